@@ -0,0 +1,213 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaAsyncBridge.h"
+#include "LuaLimits.h"
+
+// Registry key of the bridge that owns a Lua state
+static const char gBridgeKey = 0;
+
+namespace LuaUtils {;
+
+//////////////////////////////////////////////////////////////////////////////
+// Complete a parked task with an error, the C function that parked it returns nil and the message
+// returns false if the ticket is unknown
+bool	LuaAsyncBridge::fail(unsigned int ticket, const char *message)
+{
+	if (!mL)
+		return false;
+	lua_pushnil(mL.get());
+	lua_pushstring(mL.get(), message);
+	return doComplete(ticket, 2);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Resume all the tasks that were completed (or that yielded) since the last poll
+// returns the number of tasks that are still alive
+size_t	LuaAsyncBridge::poll()
+{
+	// Tasks that get ready while resuming wait for the next poll
+	std::vector<lua_State*> ready;
+	ready.swap(mReady);
+	for (size_t i = 0; i < ready.size(); ++i)
+	{
+		TaskMap::iterator it = mTasks.find(ready[i]);
+		if (it == mTasks.end())
+			continue;
+		lua_State *thread = it->first;
+		int args = it->second.args;
+		it->second.args = 0;
+		it->second.ready = false;
+		if (it->second.pending != -1)
+		{
+			// Results of a ticket completed before the task yielded
+			lua_rawgeti(thread, LUA_REGISTRYINDEX, it->second.pending);
+			int results = lua_gettop(thread);
+			for (int n = 1; n <= args; ++n)
+				lua_rawgeti(thread, results, n);
+			lua_remove(thread, results);
+			detail::_LuaUnref(mL.get(), it->second.pending);
+			it->second.pending = -1;
+		}
+		// Each resume gets its own budget
+		detail::_LuaLimitScope limits(thread);
+		int numResults;
+		int res = detail::_LuaResume(thread, mL.get(), args, &numResults);
+		if (res == LUA_YIELD)
+		{
+			lua_pop(thread, numResults);
+			// Parked tasks wait for their ticket (unless it was already completed),
+			// the others just gave back control
+			it = mTasks.find(thread);
+			if (it != mTasks.end() && it->second.ticket == 0 && !it->second.ready)
+			{
+				it->second.ready = true;
+				mReady.push_back(thread);
+			}
+			continue;
+		}
+		if (res != 0)
+		{
+			const char *error = lua_tostring(thread, -1);
+			detail::_LuaLogError(detail::_LuaGetErrorCode(thread, res), "Error in LuaAsyncBridge::poll() - %s\n", error ? error : "?");
+		}
+		removeTask(thread);
+	}
+	return mTasks.size();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Remove all tasks, parked tasks are abandoned and their tickets become invalid
+void	LuaAsyncBridge::clear()
+{
+	if (!mL)
+		return;
+	for (TaskMap::iterator it = mTasks.begin(); it != mTasks.end(); ++it)
+	{
+		detail::_LuaUnref(mL.get(), it->second.ref);
+		detail::_LuaUnref(mL.get(), it->second.pending);
+	}
+	mTasks.clear();
+	mTickets.clear();
+	mReady.clear();
+	if (detail::_LuaGetRegistryPtr(mL.get(), &gBridgeKey) == this)
+		detail::_LuaSetRegistryPtr(mL.get(), &gBridgeKey, 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// To be called from a Lua C function: park the calling task, and return the ticket
+// that must be given to complete() or fail() once the operation is done.
+unsigned int	LuaAsyncBridge::park(lua_State *L)
+{
+	LuaAsyncBridge *bridge = (LuaAsyncBridge*)detail::_LuaGetRegistryPtr(L, &gBridgeKey);
+	TaskMap::iterator it;
+	if (!bridge || (it = bridge->mTasks.find(L)) == bridge->mTasks.end())
+	{
+		luaL_error(L, "asynchronous function called outside of an async task");
+		return 0;
+	}
+	// Skip 0, it means not parked
+	if (++bridge->mNextTicket == 0)
+		++bridge->mNextTicket;
+	it->second.ticket = bridge->mNextTicket;
+	bridge->mTickets[bridge->mNextTicket] = L;
+	return bridge->mNextTicket;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+bool	LuaAsyncBridge::prepareSpawn(const detail::_LuaFunctionBase &func)
+{
+	if (!func.isInit())
+		return false;
+	if (mL && mL.get() != func.mL.get())
+	{
+		detail::_LuaLogError("Error in LuaAsyncBridge::spawn() - %s - function belongs to another Lua state\n", func.getName().c_str());
+		return false;
+	}
+	// Register again after clear()
+	void *owner = detail::_LuaGetRegistryPtr(func.mL.get(), &gBridgeKey);
+	if (owner && owner != this)
+	{
+		detail::_LuaLogError("Error in LuaAsyncBridge::spawn() - %s - the Lua state already has a bridge\n", func.getName().c_str());
+		return false;
+	}
+	if (!mL)
+		mL = func.mL;
+	if (!owner)
+		detail::_LuaSetRegistryPtr(mL.get(), &gBridgeKey, this);
+	func.push();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Create the task, the function and its args are at the top of the stack
+bool	LuaAsyncBridge::doSpawn(int args, const std::string &name)
+{
+	lua_State *L = mL.get();
+	lua_State *thread = lua_newthread(L);
+	Task task;
+	task.ref = detail::_LuaRef(L, name);
+	task.args = args;
+	task.ticket = 0;
+	task.ready = true;
+	task.pending = -1;
+	lua_xmove(L, thread, args + 1);
+	mTasks[thread] = task;
+	mReady.push_back(thread);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Move the results from the top of the stack to the parked task
+bool	LuaAsyncBridge::doComplete(unsigned int ticket, int results)
+{
+	if (!mL)
+		return false;
+	TicketMap::iterator it = mTickets.find(ticket);
+	if (it == mTickets.end())
+	{
+		lua_pop(mL.get(), results);
+		return false;
+	}
+	lua_State *thread = it->second;
+	mTickets.erase(it);
+	Task &task = mTasks[thread];
+	task.ticket = 0;
+	task.args = results;
+	task.ready = true;
+	if (lua_status(thread) == LUA_YIELD)
+	{
+		lua_xmove(mL.get(), thread, results);
+	}
+	else
+	{
+		// The task is still in the C function that parked it, and a yield only keeps the values it
+		// yields (on LuaJIT), so the results wait in a table until the resume
+		lua_State *L = mL.get();
+		lua_createtable(L, results, 0);
+		lua_insert(L, -results - 1);
+		for (int n = results; n >= 1; --n)
+			lua_rawseti(L, -n - 1, n);
+		task.pending = detail::_LuaRef(L, "LuaAsyncBridge");
+	}
+	mReady.push_back(thread);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Remove a task and release its thread
+void	LuaAsyncBridge::removeTask(lua_State *thread)
+{
+	TaskMap::iterator it = mTasks.find(thread);
+	if (it == mTasks.end())
+		return;
+	if (it->second.ticket)
+		mTickets.erase(it->second.ticket);
+	detail::_LuaUnref(mL.get(), it->second.ref);
+	detail::_LuaUnref(mL.get(), it->second.pending);
+	mTasks.erase(it);
+}
+
+} // LuaUtils
@@ -0,0 +1,172 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUAASYNCBRIDGE_H
+#define LUAASYNCBRIDGE_H
+
+#include "LuaBase.h"
+#include "LuaFunction.h"
+#include <map>
+#include <vector>
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Lets Lua scripts wait on asynchronous C++ operations without blocking the Lua state
+//
+// Script functions are spawned as tasks, each one running in its own coroutine.
+// A Lua C function that starts an asynchronous operation parks the calling task and yields:
+//
+//		int luaHttpGet(lua_State *L)
+//		{
+//			LuaStateCFunc state(L);
+//			std::string url;
+//			state.checkArg(1, url);
+//			startHttpGet(url, LuaAsyncBridge::park(L));	// keep the ticket
+//			return LuaAsyncBridge::yield(L);
+//		}
+//
+// When the operation is done, the event loop calls complete(ticket, results...) or fail(ticket, message),
+// and the next poll() resumes the task, with the results returned by the C function call in Lua.
+// A script can also call coroutine.yield() directly to give back control until the next poll().
+//
+// There can be only one bridge per Lua state, and it is not thread safe: operations finishing on
+// other threads must hand their results back to the thread that runs the event loop.
+class LuaAsyncBridge : public detail::_LuaBase
+{
+public:
+	//////////////////////////////////////////////////////////////////////////////
+	LuaAsyncBridge() : mNextTicket(0) { }
+	//////////////////////////////////////////////////////////////////////////////
+	~LuaAsyncBridge()
+	{
+		clear();
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Spawn a task that runs the given function, it starts at the next poll()
+	// All the functions must belong to the same Lua state
+	// returns success flag
+	bool	spawn(const detail::_LuaFunctionBase &func)
+	{
+		if (!prepareSpawn(func))
+			return false;
+		return doSpawn(0, func.getName());
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1>
+	bool	spawn(const detail::_LuaFunctionBase &func, const T1 &p1)
+	{
+		if (!prepareSpawn(func))
+			return false;
+		luaPushValue(p1);
+		return doSpawn(1, func.getName());
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1, typename T2>
+	bool	spawn(const detail::_LuaFunctionBase &func, const T1 &p1, const T2 &p2)
+	{
+		if (!prepareSpawn(func))
+			return false;
+		luaPushValue(p1);
+		luaPushValue(p2);
+		return doSpawn(2, func.getName());
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Complete a parked task, the values become the results of the C function that parked it
+	// returns false if the ticket is unknown
+	bool	complete(unsigned int ticket)
+	{
+		return doComplete(ticket, 0);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1>
+	bool	complete(unsigned int ticket, const T1 &p1)
+	{
+		if (!mL)
+			return false;
+		luaPushValue(p1);
+		return doComplete(ticket, 1);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1, typename T2>
+	bool	complete(unsigned int ticket, const T1 &p1, const T2 &p2)
+	{
+		if (!mL)
+			return false;
+		luaPushValue(p1);
+		luaPushValue(p2);
+		return doComplete(ticket, 2);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Complete a parked task with an error, the C function that parked it returns nil and the message
+	// returns false if the ticket is unknown
+	bool	fail(unsigned int ticket, const char *message);
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Resume all the tasks that were completed (or that yielded) since the last poll
+	// returns the number of tasks that are still alive
+	size_t	poll();
+	//////////////////////////////////////////////////////////////////////////////
+	// Remove all tasks, parked tasks are abandoned and their tickets become invalid
+	void	clear();
+	//////////////////////////////////////////////////////////////////////////////
+	size_t	getNumTasks() const { return mTasks.size(); }
+	//////////////////////////////////////////////////////////////////////////////
+	size_t	getNumParked() const { return mTickets.size(); }
+
+	//////////////////////////////////////////////////////////////////////////////
+	// To be called from a Lua C function: park the calling task, and return the ticket
+	// that must be given to complete() or fail() once the operation is done.
+	// The C function must then return LuaAsyncBridge::yield(L)
+	// (it is fine to complete the ticket before that, the task will resume at the next poll)
+	// WARNING: if the C function wasn't called by a task spawned by a bridge, this raises a Lua error
+	static unsigned int	park(lua_State *L);
+	//////////////////////////////////////////////////////////////////////////////
+	// To be returned by a Lua C function after calling park()
+	static int	yield(lua_State *L)
+	{
+		return lua_yield(L, 0);
+	}
+
+private:
+	// Non copyable
+	LuaAsyncBridge(const LuaAsyncBridge &other);
+	LuaAsyncBridge &operator=(const LuaAsyncBridge &other);
+
+	//////////////////////////////////////////////////////////////////////////////
+	bool	prepareSpawn(const detail::_LuaFunctionBase &func);
+	//////////////////////////////////////////////////////////////////////////////
+	// Create the task, the function and its args are at the top of the stack
+	bool	doSpawn(int args, const std::string &name);
+	//////////////////////////////////////////////////////////////////////////////
+	// Move the results from the top of the stack to the parked task
+	bool	doComplete(unsigned int ticket, int results);
+	//////////////////////////////////////////////////////////////////////////////
+	// Remove a task and release its thread
+	void	removeTask(lua_State *thread);
+
+	//////////////////////////////////////////////////////////////////////////////
+	struct Task
+	{
+		int				ref;		// registry reference keeping the thread alive
+		int				args;		// number of values waiting on the thread stack for the next resume
+		unsigned int	ticket;		// ticket if parked, 0 otherwise
+		bool			ready;		// waiting in the ready list for the next poll
+		int				pending;	// registry reference of the results given before the task yielded, or -1
+	};
+	typedef std::map<lua_State*, Task>			TaskMap;
+	typedef std::map<unsigned int, lua_State*>	TicketMap;
+
+	TaskMap						mTasks;
+	TicketMap					mTickets;
+	std::vector<lua_State*>		mReady;
+	unsigned int				mNextTicket;
+};
+
+} // LuaUtils
+
+#endif //LUAASYNCBRIDGE_H
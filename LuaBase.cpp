@@ -6,13 +6,25 @@
 #include "LuaBase.h"
 #include "LuaTable.h"
 #include "LuaFunction.h"
+#include "LuaLimits.h"
+#include "LuaSharedStore.h"
+#include "LuaErrorSink.h"
+#include "LuaBuffer.h"
+#include "LuaTracer.h"
+
+#ifdef LUAUTILS_LEAK_CHECK
+#include <map>
+#endif
 
 #ifdef WIN32
 #include <windows.h>
+#else
+#include <time.h>
 #endif
 
 // Static error flag (I don't like exceptions)
 static bool	gLuaError = false;
+static LuaUtils::LuaErrorCode gLuaErrorCode = LuaUtils::LuaErrorNone;
 
 // User supplied error callback function
 static errorCB gErrorCBFunc = 0;
@@ -25,6 +37,10 @@ void LuaSetErrorCB(errorCB cbfunc)
 {
 	gErrorCBFunc = cbfunc;
 }
+errorCB LuaGetErrorCB()
+{
+	return gErrorCBFunc;
+}
 
 ////////////////////////////////////////////////////////////////////////////////////
 // Get and clear the error flag that can be set internally by some LuaUtils functions
@@ -35,118 +51,435 @@ bool LuaGetErrorFlag()
 	return res;
 }
 
+////////////////////////////////////////////////////////////////////////////////////
+// Get and clear the code of the last error logged, or LuaErrorNone
+LuaErrorCode LuaGetErrorCode()
+{
+	LuaErrorCode res = gLuaErrorCode;
+	gLuaErrorCode = LuaErrorNone;
+	return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Protected call with lua_pcall, errors are logged
+bool LuaCallProtected::call(lua_State *L, int args, int results, const std::string &name)
+{
+	detail::_LuaLimitScope limits(L);
+	int status = lua_pcall(L, args, results, 0);
+	if (status)
+	{
+		const char *error = lua_tostring(L, -1);
+		detail::_LuaLogError(detail::_LuaGetErrorCode(L, status), "Error in LuaFunction::call() - %s - %s\n", name.c_str(), error ? error : "?");
+		lua_pop(L, 1);
+		// Keep the stack balanced for the caller
+		for (int i = 0; i < results; ++i)
+			lua_pushnil(L);
+		return false;
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Error handler adding a stack traceback to the error message, using debug.traceback
+static int tracebackHandler(lua_State *L)
+{
+	lua_getglobal(L, "debug");
+	if (!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		return 1;
+	}
+	lua_getfield(L, -1, "traceback");
+	if (!lua_isfunction(L, -1))
+	{
+		lua_pop(L, 2);
+		return 1;
+	}
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 2);
+	lua_call(L, 2, 1);
+	return 1;
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Protected call with a stack traceback added to the logged error messages
+bool LuaCallTraceback::call(lua_State *L, int args, int results, const std::string &name)
+{
+	// Put the error handler below the function
+	int handler = lua_gettop(L) - args;
+	lua_pushcfunction(L, tracebackHandler);
+	lua_insert(L, handler);
+	bool ret = true;
+	detail::_LuaLimitScope limits(L);
+	int status = lua_pcall(L, args, results, handler);
+	if (status)
+	{
+		const char *error = lua_tostring(L, -1);
+		detail::_LuaLogError(detail::_LuaGetErrorCode(L, status), "Error in LuaFunction::call() - %s - %s\n", name.c_str(), error ? error : "?");
+		lua_pop(L, 1);
+		for (int i = 0; i < results; ++i)
+			lua_pushnil(L);
+		ret = false;
+	}
+	lua_remove(L, handler);
+	return ret;
+}
+
 namespace detail {;
 
 ////////////////////////////////////////////////////////////////////////////////////
-void _LuaLogError(const char *format, ...)
+static void logError(LuaErrorCode code, const char *format, va_list args)
 {
 	// Set the error flag
 	gLuaError = true;
+	gLuaErrorCode = code;
+	// Leave the formatting to the sink's drain thread when it's running
+	if (_LuaSinkError(format, args))
+		return;
 	// Dump the error string
 	char buf[512];
+	vsnprintf(buf, 512, format, args);
+	_LuaOutputError(buf);
+}
+void _LuaLogError(const char *format, ...)
+{
 	va_list args;
 	va_start(args, format);
-	vsnprintf(buf, 512, format, args);
+	logError(LuaErrorGeneric, format, args);
 	va_end(args);
+}
+void _LuaLogError(LuaErrorCode code, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	logError(code, format, args);
+	va_end(args);
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Give a formatted error message to the error callback (and the debugger output on Windows)
+void _LuaOutputError(const char *msg)
+{
 #ifdef WIN32
-	OutputDebugString(buf);
+	OutputDebugString(msg);
 #endif
 	// Call user supplied function
 	if (gErrorCBFunc)
-		gErrorCBFunc(buf);
+		gErrorCBFunc(msg);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Monotonic time in microseconds, from an unspecified starting point
+unsigned long long _LuaGetTimeUS()
+{
+#ifdef WIN32
+	static LARGE_INTEGER freq;
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	LARGE_INTEGER count;
+	QueryPerformanceCounter(&count);
+	return (unsigned long long)(count.QuadPart / freq.QuadPart) * 1000000ULL
+		+ (unsigned long long)(count.QuadPart % freq.QuadPart) * 1000000ULL / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ULL + (unsigned long long)ts.tv_nsec / 1000ULL;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Store a pointer in the registry of a Lua state, the address of key is used as the registry key
+// (storing a null pointer removes it)
+void _LuaSetRegistryPtr(lua_State *L, const void *key, void *p)
+{
+	lua_pushlightuserdata(L, (void*)key);
+	if (p)
+		lua_pushlightuserdata(L, p);
+	else
+		lua_pushnil(L);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Get a pointer stored with _LuaSetRegistryPtr, or null
+void *_LuaGetRegistryPtr(lua_State *L, const void *key)
+{
+	lua_pushlightuserdata(L, (void*)key);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	void *p = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return p;
 }
 
+////////////////////////////////////////////////////////////////////////////////////
+// Insert the searcher function at the top of the stack into the package searchers, right after the
+// preload one, so that it runs before the file searchers. It gets popped.
+// returns false if the package library isn't loaded
+bool _LuaAddSearcher(lua_State *L)
+{
+	int searcher = lua_gettop(L);
+	lua_getglobal(L, "package");
+	if (lua_istable(L, -1))
+		lua_getfield(L, -1, _LuaSearchersField());
+	else
+		lua_pushnil(L);
+	if (!lua_istable(L, -1))
+	{
+		lua_settop(L, searcher - 1);
+		return false;
+	}
+	int list = lua_gettop(L);
+	int size = (int)_LuaRawLen(L, list);
+	int pos = size ? 2 : 1;
+	for (int i = size; i >= pos; --i)
+	{
+		lua_rawgeti(L, list, i);
+		lua_rawseti(L, list, i + 1);
+	}
+	lua_pushvalue(L, searcher);
+	lua_rawseti(L, list, pos);
+	lua_settop(L, searcher - 1);
+	return true;
+}
+
+#ifdef LUAUTILS_LEAK_CHECK
+////////////////////////////////////////////////////////////////////////////////////
+// Names of the live references of a state, kept in a userdata of its registry (freed with the state)
+typedef std::map<int, std::string> RefNames;
+static const char gRefNamesKey = 0;
+static int refNamesGC(lua_State *L)
+{
+	RefNames **names = (RefNames**)lua_touserdata(L, 1);
+	delete *names;
+	*names = 0;
+	return 0;
+}
+static RefNames *getRefNames(lua_State *L, bool create)
+{
+	lua_pushlightuserdata(L, (void*)&gRefNamesKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	RefNames **names = (RefNames**)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (names || !create)
+		return names ? *names : 0;
+	lua_pushlightuserdata(L, (void*)&gRefNamesKey);
+	names = (RefNames**)lua_newuserdata(L, sizeof(RefNames*));
+	*names = new RefNames;
+	lua_newtable(L);
+	lua_pushcfunction(L, refNamesGC);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+	return *names;
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Create and release the registry references of the handles
+int _LuaRef(lua_State *L, const std::string &name)
+{
+	int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	RefNames *names = ref >= 0 ? getRefNames(L, true) : 0;
+	if (names)
+		(*names)[ref] = name;
+	return ref;
+}
+void _LuaUnref(lua_State *L, int ref)
+{
+	if (ref < 0)
+		return;
+	RefNames *names = getRefNames(L, false);
+	if (names)
+		names->erase(ref);
+	luaL_unref(L, LUA_REGISTRYINDEX, ref);
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Number of live references of a state
+size_t _LuaGetNumRefs(lua_State *L)
+{
+	RefNames *names = getRefNames(L, false);
+	return names ? names->size() : 0;
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Log the live references of a state with the names of their handles, returns their number
+size_t _LuaReportRefs(lua_State *L)
+{
+	RefNames *names = getRefNames(L, false);
+	if (!names)
+		return 0;
+	for (RefNames::const_iterator it = names->begin(); it != names->end(); ++it)
+		_LuaLogError("Live reference %d - %s\n", it->first, it->second.c_str());
+	return names->size();
+}
+#else
+size_t _LuaGetNumRefs(lua_State *L)		{ return 0; }
+size_t _LuaReportRefs(lua_State *L)		{ return 0; }
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////////
 // luaPushValue overloads
 //
-void _LuaBase::luaPushValue(const std::string &s) const			{ lua_pushstring(mL.get(), s.c_str()); }
+void _LuaBase::luaPushValue(const std::string &s) const			{ lua_pushlstring(mL.get(), s.data(), s.size()); }
 void _LuaBase::luaPushValue(int n) const						{ lua_pushinteger(mL.get(), (lua_Integer)n); }
 void _LuaBase::luaPushValue(unsigned char n) const				{ lua_pushinteger(mL.get(), (lua_Integer)n); }
 void _LuaBase::luaPushValue(double n)	const					{ lua_pushnumber(mL.get(), n); }
 void _LuaBase::luaPushValue(float n) const						{ lua_pushnumber(mL.get(), (double)n); }
 void _LuaBase::luaPushValue(bool b) const						{ lua_pushboolean(mL.get(), b); }
 void _LuaBase::luaPushValue(const char *s) const				{ lua_pushstring(mL.get(), s); }
-void _LuaBase::luaPushValue(lua_CFunction f) const				{ lua_pushcfunction(mL.get(), f); }
-void _LuaBase::luaPushValue(const LuaTable &t) const			{ t.push(); }
-void _LuaBase::luaPushValue(const _LuaFunctionBase &f) const	{ f.push(); }
+void _LuaBase::luaPushValue(const LuaStringView &s) const		{ lua_pushlstring(mL.get(), s.data, s.size); }
+#ifdef LUAUTILS_STRING_VIEW
+void _LuaBase::luaPushValue(std::string_view s) const			{ lua_pushlstring(mL.get(), s.data(), s.size()); }
+#endif
+void _LuaBase::luaPushValue(lua_CFunction f) const
+{
+#ifdef LUAUTILS_TRACE
+	_LuaPushTracedCFunction(mL.get(), f);
+#else
+	lua_pushcfunction(mL.get(), f);
+#endif
+}
+void _LuaBase::luaPushValue(const LuaTable &t) const			{ if (!t.push()) lua_pushnil(mL.get()); }
+void _LuaBase::luaPushValue(const _LuaFunctionBase &f) const	{ if (!f.push()) lua_pushnil(mL.get()); }
+void _LuaBase::luaPushValue(const LuaSharedStore &s) const		{ if (!s.push(mL.get())) lua_pushnil(mL.get()); }
 
 ////////////////////////////////////////////////////////////////////////////////////
-// luaPopValue overloads
+// luaGetValue overloads
 //
-bool _LuaBase::luaPopValue(int &res) const
+bool _LuaBase::luaGetValue(int idx, int &res) const
 {
-	bool ret = false;
-	if (lua_isnumber(mL.get(), -1))
+	if (!lua_isnumber(mL.get(), idx))
+		return false;
+	res = (int)detail::_LuaToInteger(mL.get(), idx);
+	return true;
+}
+bool _LuaBase::luaGetValue(int idx, unsigned char &res) const
+{
+	if (!lua_isnumber(mL.get(), idx))
+		return false;
+	res = (unsigned char)detail::_LuaToInteger(mL.get(), idx);
+	return true;
+}
+bool _LuaBase::luaGetValue(int idx, double &res) const
+{
+	if (!lua_isnumber(mL.get(), idx))
+		return false;
+	res = lua_tonumber(mL.get(), idx);
+	return true;
+}
+bool _LuaBase::luaGetValue(int idx, float &res) const
+{
+	if (!lua_isnumber(mL.get(), idx))
+		return false;
+	res = (float)lua_tonumber(mL.get(), idx);
+	return true;
+}
+bool _LuaBase::luaGetValue(int idx, bool &res) const
+{
+	if (!lua_isboolean(mL.get(), idx))
+		return false;
+	res = lua_toboolean(mL.get(), idx) ? true : false;
+	return true;
+}
+bool _LuaBase::luaGetValue(int idx, std::string &res) const
+{
+	size_t len;
+	if (lua_type(mL.get(), idx) == LUA_TSTRING)
 	{
-		res = (int)lua_tointeger(mL.get(), -1);
-		ret = true;
+		const char *s = lua_tolstring(mL.get(), idx, &len);
+		res.assign(s, len);
+		return true;
 	}
+	if (!lua_isnumber(mL.get(), idx))
+		return false;
+	// lua_tolstring turns a number into a string in place, so convert a copy
+	lua_pushvalue(mL.get(), idx);
+	const char *s = lua_tolstring(mL.get(), -1, &len);
+	res.assign(s, len);
 	lua_pop(mL.get(), 1);
-	return ret;
+	return true;
 }
-bool _LuaBase::luaPopValue(unsigned char &res) const
+bool _LuaBase::luaGetValue(int idx, LuaStringView &res) const
 {
-	bool ret = false;
-	if (lua_isnumber(mL.get(), -1))
+	// A number would be converted to a new string that nothing references
+	if (lua_type(mL.get(), idx) == LUA_TSTRING)
 	{
-		res = (unsigned char)lua_tointeger(mL.get(), -1);
-		ret = true;
+		res.data = lua_tolstring(mL.get(), idx, &res.size);
+		return true;
 	}
+	return detail::_LuaToBuffer(mL.get(), idx, res);
+}
+#ifdef LUAUTILS_STRING_VIEW
+bool _LuaBase::luaGetValue(int idx, std::string_view &res) const
+{
+	LuaStringView view;
+	if (!luaGetValue(idx, view))
+		return false;
+	res = view;
+	return true;
+}
+#endif
+bool _LuaBase::luaGetValue(int idx, lua_CFunction &res) const
+{
+	if (!lua_iscfunction(mL.get(), idx))
+		return false;
+	res = lua_tocfunction(mL.get(), idx);
+#ifdef LUAUTILS_TRACE
+	res = _LuaUntraceCFunction(mL.get(), idx, res);
+#endif
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// luaPopValue overloads
+//
+bool _LuaBase::luaPopValue(int &res) const
+{
+	bool ret = luaGetValue(-1, res);
+	lua_pop(mL.get(), 1);
+	return ret;
+}
+bool _LuaBase::luaPopValue(unsigned char &res) const
+{
+	bool ret = luaGetValue(-1, res);
 	lua_pop(mL.get(), 1);
 	return ret;
 }
 bool _LuaBase::luaPopValue(double &res) const
 {
-	bool ret = false;
-	if (lua_isnumber(mL.get(), -1))
-	{
-		res = lua_tonumber(mL.get(), -1);
-		ret = true;
-	}
+	bool ret = luaGetValue(-1, res);
 	lua_pop(mL.get(), 1);
 	return ret;
 }
 bool _LuaBase::luaPopValue(float &res) const
 {
-	bool ret = false;
-	if (lua_isnumber(mL.get(), -1))
-	{
-		res = (float)lua_tonumber(mL.get(), -1);
-		ret = true;
-	}
+	bool ret = luaGetValue(-1, res);
 	lua_pop(mL.get(), 1);
 	return ret;
 }
 bool _LuaBase::luaPopValue(bool &res) const
 {
-	bool ret = false;
-	if (lua_isboolean(mL.get(), -1))
-	{
-		res = lua_toboolean(mL.get(), -1) ? true : false;
-		ret = true;
-	}
+	bool ret = luaGetValue(-1, res);
 	lua_pop(mL.get(), 1);
 	return ret;
 }
 bool _LuaBase::luaPopValue(std::string &res) const
 {
-	bool ret = false;
-	if (lua_isstring(mL.get(), -1))
-	{
-		res = lua_tostring(mL.get(), -1);
-		ret = true;
-	}
+	bool ret = luaGetValue(-1, res);
 	lua_pop(mL.get(), 1);
 	return ret;
 }
+bool _LuaBase::luaPopValue(LuaStringView &res) const
+{
+	bool ret = luaGetValue(-1, res);
+	lua_pop(mL.get(), 1);
+	return ret;
+}
+#ifdef LUAUTILS_STRING_VIEW
+bool _LuaBase::luaPopValue(std::string_view &res) const
+{
+	bool ret = luaGetValue(-1, res);
+	lua_pop(mL.get(), 1);
+	return ret;
+}
+#endif
 bool _LuaBase::luaPopValue(lua_CFunction &res) const
 {
-	bool ret = false;
-	if (lua_iscfunction(mL.get(), -1))
-	{
-		res = lua_tocfunction(mL.get(), -1);
-		ret = true;
-	}
+	bool ret = luaGetValue(-1, res);
 	lua_pop(mL.get(), 1);
 	return ret;
 }
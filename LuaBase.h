@@ -6,9 +6,16 @@
 #ifndef LUABASE_H
 #define LUABASE_H
 
-#include <lua/lua.hpp>
+#include "LuaCompat.h"
+#include <cstring>
 #include <string>
 
+// std::string_view is supported when building as C++17
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define LUAUTILS_STRING_VIEW
+#include <string_view>
+#endif
+
 #ifdef _MSC_VER
 #include <memory>
 // Shared pointer for the lua_State
@@ -19,6 +26,16 @@ typedef std::shared_ptr<lua_State> luaStatePtr;
 typedef std::tr1::shared_ptr<lua_State> luaStatePtr;
 #endif
 
+// Leak checks, define LUAUTILS_LEAK_CHECK in debug builds to:
+// - check that the public calls of LuaState, LuaTable and LuaFunction leave the Lua stack as they found it
+//   (a call that doesn't is logged with the LuaErrorStackLeak code and the name of the handle)
+// - track the registry references held by the handles of each state, see LuaState::reportRefs
+#ifdef LUAUTILS_LEAK_CHECK
+#define LUAUTILS_STACK_CHECK(L, name)	LuaUtils::detail::_LuaStackCheck _luaStackCheck(L, __FUNCTION__, name)
+#else
+#define LUAUTILS_STACK_CHECK(L, name)
+#endif
+
 // Error func typedef
 typedef void (*errorCB)(const char *msg);
 
@@ -31,24 +48,141 @@ class LuaState;
 class LuaStateCFunc;
 class LuaTable;
 class LuaTableCFunc;
-template <typename Ret>
+struct LuaCallProtected;
+template <typename Ret, typename CallPolicy = LuaCallProtected>
 class LuaFunction;
+class LuaCoroutine;
+class LuaScheduler;
+class LuaAsyncBridge;
+class LuaReloadManager;
+class LuaSharedStore;
+class LuaEventBus;
+class LuaWeakTable;
+template <typename Ret, typename CallPolicy>
+class LuaMemoFunction;
 
 // Set error callback function that will be called when Lua errors occur
 void LuaSetErrorCB(errorCB cbfunc);
+errorCB LuaGetErrorCB();
 
 // Get and clear the error flag that can be set internally by some LuaUtils functions with detail::_LuaLogError
 bool LuaGetErrorFlag();
 
+// Error codes, see LuaGetErrorCode
+enum LuaErrorCode
+{
+	LuaErrorNone,
+	LuaErrorGeneric,			// LuaUtils error without a more specific code
+	LuaErrorRuntime,			// Lua runtime error
+	LuaErrorSyntax,				// Lua compile error
+	LuaErrorMemory,				// The allocator failed
+	LuaErrorFile,				// A script file couldn't be opened or read
+	LuaErrorInstructionLimit,	// The call ran more instructions than allowed, see LuaLimits
+	LuaErrorTimeLimit,			// The call ran longer than allowed, see LuaLimits
+	LuaErrorMemoryLimit,		// The state used more memory than allowed, see LuaLimits
+	LuaErrorAborted,			// The call was aborted with LuaState::requestAbort
+	LuaErrorStackLeak			// A call left values on the stack or removed some, see LUAUTILS_LEAK_CHECK
+};
+
+// Get and clear the code of the last error logged, or LuaErrorNone
+LuaErrorCode LuaGetErrorCode();
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Non owning view of a string, it can hold embedded zeros
+// Pushing a view copies the characters into Lua, but getting one from Lua doesn't copy anything:
+// the view points to the string owned by Lua, and is only valid while that string is referenced from Lua
+// (the table field or global it was read from, or the current Lua C function argument).
+// Don't keep views of values that aren't referenced anywhere else, like function results.
+// Only actual strings can be read as views, numbers aren't converted.
+// The content of a buffer (see LuaBuffer.h) can be read as a view too, until the buffer is modified.
+struct LuaStringView
+{
+	LuaStringView() : data(""), size(0) { }
+	LuaStringView(const char *s) : data(s), size(strlen(s)) { }
+	LuaStringView(const char *s, size_t len) : data(s), size(len) { }
+	LuaStringView(const std::string &s) : data(s.data()), size(s.size()) { }
+#ifdef LUAUTILS_STRING_VIEW
+	LuaStringView(std::string_view s) : data(s.data()), size(s.size()) { }
+	operator std::string_view() const { return std::string_view(data, size); }
+#endif
+
+	std::string str() const { return std::string(data, size); }
+	bool operator==(const LuaStringView &other) const { return size == other.size && memcmp(data, other.data, size) == 0; }
+	bool operator!=(const LuaStringView &other) const { return !(*this == other); }
+
+	const char	*data;
+	size_t		size;
+};
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 namespace detail {;
 
 // Forward declarations
 class _LuaBase;
 class _LuaFunctionBase;
+class _LuaWeakRef;
 
 // Log error and set the error flag
 void _LuaLogError(const char *format, ...);
+// Log error and set the error flag and code
+void _LuaLogError(LuaErrorCode code, const char *format, ...);
+// Give a formatted error message to the error callback (and the debugger output on Windows)
+void _LuaOutputError(const char *msg);
+
+// Monotonic time in microseconds, from an unspecified starting point
+unsigned long long _LuaGetTimeUS();
+
+// Store a pointer in the registry of a Lua state, the address of key is used as the registry key
+// (storing a null pointer removes it)
+void _LuaSetRegistryPtr(lua_State *L, const void *key, void *p);
+// Get a pointer stored with _LuaSetRegistryPtr, or null
+void *_LuaGetRegistryPtr(lua_State *L, const void *key);
+
+// Insert the searcher function at the top of the stack into the package searchers, right after the
+// preload one, so that it runs before the file searchers. It gets popped.
+// returns false if the package library isn't loaded
+bool _LuaAddSearcher(lua_State *L);
+
+// Create and release the registry references of the handles
+// With LUAUTILS_LEAK_CHECK, the live references of each state are tracked with the name of their handle
+#ifdef LUAUTILS_LEAK_CHECK
+int _LuaRef(lua_State *L, const std::string &name);
+void _LuaUnref(lua_State *L, int ref);
+#else
+inline int _LuaRef(lua_State *L, const std::string &)	{ return luaL_ref(L, LUA_REGISTRYINDEX); }
+inline void _LuaUnref(lua_State *L, int ref)			{ luaL_unref(L, LUA_REGISTRYINDEX, ref); }
+#endif
+// Number of live references of a state (always 0 without LUAUTILS_LEAK_CHECK)
+size_t _LuaGetNumRefs(lua_State *L);
+// Log the live references of a state with the names of their handles, returns their number
+size_t _LuaReportRefs(lua_State *L);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Checks that the stack of a state has the same size at the end of the scope as at the start,
+// used by LUAUTILS_STACK_CHECK (a null state isn't checked)
+class _LuaStackCheck
+{
+public:
+	_LuaStackCheck(lua_State *L, const char *func, const std::string &name)
+	:	mL(L)
+	,	mTop(L ? lua_gettop(L) : 0)
+	,	mFunc(func)
+	,	mName(name)
+	{
+	}
+	~_LuaStackCheck()
+	{
+		if (mL && lua_gettop(mL) != mTop)
+			_LuaLogError(LuaErrorStackLeak, "Error in %s() - %s - the stack changed by %d\n", mFunc, mName.c_str(), lua_gettop(mL) - mTop);
+	}
+
+private:
+	lua_State	*mL;
+	int			mTop;
+	const char	*mFunc;
+	// Copied, since the call can rename the handle
+	std::string	mName;
+};
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Internal base class with helper functions
@@ -67,8 +201,26 @@ protected:
 	void luaPushValue(bool b) const;
 	void luaPushValue(const std::string &s) const;
 	void luaPushValue(const char *s) const;
+	void luaPushValue(const LuaStringView &s) const;
+#ifdef LUAUTILS_STRING_VIEW
+	void luaPushValue(std::string_view s) const;
+#endif
 	void luaPushValue(const LuaTable &t) const;
 	void luaPushValue(const _LuaFunctionBase &f) const;
+	void luaPushValue(const LuaSharedStore &s) const;
+
+	// Helper get functions, read the value at a stack index without popping it
+	bool luaGetValue(int idx, lua_CFunction &res) const;
+	bool luaGetValue(int idx, int &res) const;
+	bool luaGetValue(int idx, unsigned char &res) const;
+	bool luaGetValue(int idx, double &res) const;
+	bool luaGetValue(int idx, float &res) const;
+	bool luaGetValue(int idx, bool &res) const;
+	bool luaGetValue(int idx, std::string &res) const;
+	bool luaGetValue(int idx, LuaStringView &res) const;
+#ifdef LUAUTILS_STRING_VIEW
+	bool luaGetValue(int idx, std::string_view &res) const;
+#endif
 
 	// Helper pop functions
 	bool luaPopValue(lua_CFunction &res) const;
@@ -78,6 +230,10 @@ protected:
 	bool luaPopValue(float &res) const;
 	bool luaPopValue(bool &res) const;
 	bool luaPopValue(std::string &res) const;
+	bool luaPopValue(LuaStringView &res) const;
+#ifdef LUAUTILS_STRING_VIEW
+	bool luaPopValue(std::string_view &res) const;
+#endif
 	bool luaPopValue(LuaTable &res) const;
 	bool luaPopValue(_LuaFunctionBase &res) const;
 
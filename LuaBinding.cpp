@@ -0,0 +1,328 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaBinding.h"
+
+// Key of the bindings table in the metatable of a table with bound values
+static const char gBindingsKey = 0;
+
+using LuaUtils::detail::_LuaBoundValue;
+
+//////////////////////////////////////////////////////////////////////////////
+// Push the current value of a bound value
+static void pushBoundValue(lua_State *L, const _LuaBoundValue *bound)
+{
+	switch (bound->type)
+	{
+	case _LuaBoundValue::Int:			lua_pushinteger(L, (lua_Integer)*(int*)bound->ptr); break;
+	case _LuaBoundValue::UnsignedChar:	lua_pushinteger(L, (lua_Integer)*(unsigned char*)bound->ptr); break;
+	case _LuaBoundValue::Float:			lua_pushnumber(L, (lua_Number)*(float*)bound->ptr); break;
+	case _LuaBoundValue::Double:		lua_pushnumber(L, (lua_Number)*(double*)bound->ptr); break;
+	case _LuaBoundValue::Bool:			lua_pushboolean(L, *(bool*)bound->ptr); break;
+	case _LuaBoundValue::String:
+		{
+			const std::string *s = (const std::string*)bound->ptr;
+			lua_pushlstring(L, s->data(), s->size());
+		}
+		break;
+	case _LuaBoundValue::Accessor:
+		lua_pushcfunction(L, bound->getter);
+		lua_call(L, 0, 1);
+		break;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Write the value at valueIdx to a bound value, raises a Lua error if it can't be done
+// (setValue sets the fields in protected mode, see _LuaSetField)
+static void setBoundValue(lua_State *L, const _LuaBoundValue *bound, int valueIdx, const char *key)
+{
+	if (bound->readOnly || (bound->type == _LuaBoundValue::Accessor && !bound->setter))
+	{
+		luaL_error(L, "bound value '%s' is read only", key);
+		return;
+	}
+	switch (bound->type)
+	{
+	case _LuaBoundValue::Int:
+	case _LuaBoundValue::UnsignedChar:
+	case _LuaBoundValue::Float:
+	case _LuaBoundValue::Double:
+		if (!lua_isnumber(L, valueIdx))
+			luaL_error(L, "bound value '%s' expects a number, got %s", key, luaL_typename(L, valueIdx));
+		break;
+	case _LuaBoundValue::Bool:
+		if (!lua_isboolean(L, valueIdx))
+			luaL_error(L, "bound value '%s' expects a boolean, got %s", key, luaL_typename(L, valueIdx));
+		break;
+	case _LuaBoundValue::String:
+		if (!lua_isstring(L, valueIdx))
+			luaL_error(L, "bound value '%s' expects a string, got %s", key, luaL_typename(L, valueIdx));
+		break;
+	default:
+		break;
+	}
+	switch (bound->type)
+	{
+	case _LuaBoundValue::Int:			*(int*)bound->ptr = (int)LuaUtils::detail::_LuaToInteger(L, valueIdx); break;
+	case _LuaBoundValue::UnsignedChar:	*(unsigned char*)bound->ptr = (unsigned char)LuaUtils::detail::_LuaToInteger(L, valueIdx); break;
+	case _LuaBoundValue::Float:			*(float*)bound->ptr = (float)lua_tonumber(L, valueIdx); break;
+	case _LuaBoundValue::Double:		*(double*)bound->ptr = (double)lua_tonumber(L, valueIdx); break;
+	case _LuaBoundValue::Bool:			*(bool*)bound->ptr = lua_toboolean(L, valueIdx) ? true : false; break;
+	case _LuaBoundValue::String:
+		{
+			size_t len;
+			const char *s = lua_tolstring(L, valueIdx, &len);
+			((std::string*)bound->ptr)->assign(s, len);
+		}
+		break;
+	case _LuaBoundValue::Accessor:
+		lua_pushcfunction(L, bound->setter);
+		lua_pushvalue(L, valueIdx);
+		lua_call(L, 1, 0);
+		break;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// __index metamethod of tables with bound values
+// upvalue 1 is the bindings table, upvalue 2 the previous __index (or nil)
+static int bindingIndex(lua_State *L)
+{
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(1));
+	const _LuaBoundValue *bound = (const _LuaBoundValue*)lua_touserdata(L, -1);
+	if (bound)
+	{
+		pushBoundValue(L, bound);
+		return 1;
+	}
+	lua_pop(L, 1);
+	switch (lua_type(L, lua_upvalueindex(2)))
+	{
+	case LUA_TNIL:
+		// The raw lookup already failed
+		lua_pushnil(L);
+		break;
+	case LUA_TFUNCTION:
+		lua_pushvalue(L, lua_upvalueindex(2));
+		lua_pushvalue(L, 1);
+		lua_pushvalue(L, 2);
+		lua_call(L, 2, 1);
+		break;
+	default:
+		lua_pushvalue(L, 2);
+		lua_gettable(L, lua_upvalueindex(2));
+		break;
+	}
+	return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// __newindex metamethod of tables with bound values
+// upvalue 1 is the bindings table, upvalue 2 the previous __newindex (or nil)
+static int bindingNewIndex(lua_State *L)
+{
+	lua_pushvalue(L, 2);
+	lua_rawget(L, lua_upvalueindex(1));
+	const _LuaBoundValue *bound = (const _LuaBoundValue*)lua_touserdata(L, -1);
+	if (bound)
+	{
+		setBoundValue(L, bound, 3, lua_tostring(L, 2));
+		return 0;
+	}
+	lua_pop(L, 1);
+	switch (lua_type(L, lua_upvalueindex(2)))
+	{
+	case LUA_TNIL:
+		lua_rawset(L, 1);
+		break;
+	case LUA_TFUNCTION:
+		lua_pushvalue(L, lua_upvalueindex(2));
+		lua_insert(L, 1);
+		lua_call(L, 3, 0);
+		break;
+	default:
+		lua_settable(L, lua_upvalueindex(2));
+		break;
+	}
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Push the bindings table of the table at tableIdx
+// If it doesn't have one and create is true, give the table a new metatable (copied from the
+// previous one if any) with the binding metamethods, otherwise push nothing and return false
+static bool pushBindings(lua_State *L, int tableIdx, bool create)
+{
+	if (lua_getmetatable(L, tableIdx))
+	{
+		lua_pushlightuserdata(L, (void*)&gBindingsKey);
+		lua_rawget(L, -2);
+		if (lua_istable(L, -1))
+		{
+			lua_remove(L, -2);
+			return true;
+		}
+		lua_pop(L, 1);
+	}
+	else
+		lua_pushnil(L);
+	if (!create)
+	{
+		lua_pop(L, 1);
+		return false;
+	}
+
+	// Copy the previous metatable, since it may be shared with other tables
+	int oldMeta = lua_gettop(L);
+	lua_newtable(L);
+	int meta = oldMeta + 1;
+	if (lua_istable(L, oldMeta))
+	{
+		lua_pushnil(L);
+		while (lua_next(L, oldMeta))
+		{
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, meta);
+		}
+	}
+	lua_newtable(L);
+	int bindings = meta + 1;
+	lua_pushlightuserdata(L, (void*)&gBindingsKey);
+	lua_pushvalue(L, bindings);
+	lua_rawset(L, meta);
+
+	// Metamethods, falling back to the previous ones
+	lua_pushvalue(L, bindings);
+	if (lua_istable(L, oldMeta))
+		lua_getfield(L, oldMeta, "__index");
+	else
+		lua_pushnil(L);
+	lua_pushcclosure(L, bindingIndex, 2);
+	lua_setfield(L, meta, "__index");
+	lua_pushvalue(L, bindings);
+	if (lua_istable(L, oldMeta))
+		lua_getfield(L, oldMeta, "__newindex");
+	else
+		lua_pushnil(L);
+	lua_pushcclosure(L, bindingNewIndex, 2);
+	lua_setfield(L, meta, "__newindex");
+
+	lua_pushvalue(L, meta);
+	lua_setmetatable(L, tableIdx);
+	// Only leave the bindings table
+	lua_replace(L, oldMeta);
+	lua_pop(L, 1);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// t[k] = v, for _LuaSetField
+static int setFieldProtected(lua_State *L)
+{
+	lua_settable(L, 1);
+	return 0;
+}
+
+namespace LuaUtils {;
+namespace detail {;
+
+////////////////////////////////////////////////////////////////////////////////////
+// Make the description of a bound variable
+static _LuaBoundValue makeBoundValue(_LuaBoundValue::Type type, void *ptr, bool readOnly)
+{
+	_LuaBoundValue res;
+	res.type = type;
+	res.ptr = ptr;
+	res.readOnly = readOnly;
+	res.getter = 0;
+	res.setter = 0;
+	return res;
+}
+_LuaBoundValue _LuaMakeBoundValue(int *ptr, bool readOnly)				{ return makeBoundValue(_LuaBoundValue::Int, ptr, readOnly); }
+_LuaBoundValue _LuaMakeBoundValue(unsigned char *ptr, bool readOnly)	{ return makeBoundValue(_LuaBoundValue::UnsignedChar, ptr, readOnly); }
+_LuaBoundValue _LuaMakeBoundValue(float *ptr, bool readOnly)			{ return makeBoundValue(_LuaBoundValue::Float, ptr, readOnly); }
+_LuaBoundValue _LuaMakeBoundValue(double *ptr, bool readOnly)			{ return makeBoundValue(_LuaBoundValue::Double, ptr, readOnly); }
+_LuaBoundValue _LuaMakeBoundValue(bool *ptr, bool readOnly)				{ return makeBoundValue(_LuaBoundValue::Bool, ptr, readOnly); }
+_LuaBoundValue _LuaMakeBoundValue(std::string *ptr, bool readOnly)		{ return makeBoundValue(_LuaBoundValue::String, ptr, readOnly); }
+////////////////////////////////////////////////////////////////////////////////////
+// Make the description of a bound accessor (a null setter makes it read only)
+_LuaBoundValue _LuaMakeBoundAccessor(lua_CFunction getter, lua_CFunction setter)
+{
+	_LuaBoundValue res = makeBoundValue(_LuaBoundValue::Accessor, 0, setter == 0);
+	res.getter = getter;
+	res.setter = setter;
+	return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Bind t.key to the given value, the table is at the top of the stack (it doesn't get popped)
+void _LuaBindValue(lua_State *L, const char *key, const _LuaBoundValue &value)
+{
+	int table = lua_gettop(L);
+	pushBindings(L, table, true);
+	_LuaBoundValue *bound = (_LuaBoundValue*)lua_newuserdata(L, sizeof(_LuaBoundValue));
+	*bound = value;
+	lua_setfield(L, -2, key);
+	lua_pop(L, 1);
+	// Remove the raw field, so that the metamethods get called
+	lua_pushstring(L, key);
+	lua_pushnil(L);
+	lua_rawset(L, table);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Remove the binding of t.key, the table is at the top of the stack
+// The last value is copied to the table field
+void _LuaUnbindValue(lua_State *L, const char *key)
+{
+	int table = lua_gettop(L);
+	if (!pushBindings(L, table, false))
+		return;
+	lua_getfield(L, -1, key);
+	const _LuaBoundValue *bound = (const _LuaBoundValue*)lua_touserdata(L, -1);
+	if (bound)
+	{
+		lua_pushstring(L, key);
+		pushBoundValue(L, bound);
+		lua_rawset(L, table);
+		lua_pushnil(L);
+		lua_setfield(L, table + 1, key);
+	}
+	lua_settop(L, table);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Set t.key to the value at the top of the stack and pop it, the table is below it
+// The metamethods of a table with a metatable run in protected mode, returns false on error
+bool _LuaSetField(lua_State *L, const char *key, const char *func)
+{
+	int value = lua_gettop(L);
+	int table = value - 1;
+	// Without a metatable, nothing but the allocator can fail
+	if (!lua_getmetatable(L, table))
+	{
+		lua_setfield(L, table, key);
+		return true;
+	}
+	lua_pop(L, 1);
+	lua_pushcfunction(L, setFieldProtected);
+	lua_pushvalue(L, table);
+	lua_pushstring(L, key);
+	lua_pushvalue(L, value);
+	bool res = lua_pcall(L, 3, 0, 0) == 0;
+	if (!res)
+	{
+		const char *error = lua_tostring(L, -1);
+		_LuaLogError(LuaErrorRuntime, "Error in %s() - %s - %s\n", func, key, error ? error : "?");
+	}
+	lua_settop(L, table);
+	return res;
+}
+
+} // detail
+} // LuaUtils
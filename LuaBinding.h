@@ -0,0 +1,61 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUABINDING_H
+#define LUABINDING_H
+
+#include "LuaBase.h"
+
+namespace LuaUtils {;
+namespace detail {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Description of a table field that is backed by C++ memory, see LuaState::bindValue and LuaTable::bindValue
+struct _LuaBoundValue
+{
+	enum Type
+	{
+		Int,
+		UnsignedChar,
+		Float,
+		Double,
+		Bool,
+		String,
+		Accessor
+	};
+	Type			type;
+	void			*ptr;
+	bool			readOnly;
+	// Accessor functions: the getter returns the value, the setter receives it as its first argument
+	lua_CFunction	getter;
+	lua_CFunction	setter;
+};
+
+// Make the description of a bound variable (only these types are supported)
+_LuaBoundValue _LuaMakeBoundValue(int *ptr, bool readOnly);
+_LuaBoundValue _LuaMakeBoundValue(unsigned char *ptr, bool readOnly);
+_LuaBoundValue _LuaMakeBoundValue(float *ptr, bool readOnly);
+_LuaBoundValue _LuaMakeBoundValue(double *ptr, bool readOnly);
+_LuaBoundValue _LuaMakeBoundValue(bool *ptr, bool readOnly);
+_LuaBoundValue _LuaMakeBoundValue(std::string *ptr, bool readOnly);
+// Make the description of a bound accessor (a null setter makes it read only)
+_LuaBoundValue _LuaMakeBoundAccessor(lua_CFunction getter, lua_CFunction setter);
+
+// Bind t.key to the given value, the table is at the top of the stack (it doesn't get popped)
+// The table gets its own metatable, with __index and __newindex metamethods that read and write
+// the C++ memory, and fall back to the previous ones (if any) for the keys that aren't bound
+void _LuaBindValue(lua_State *L, const char *key, const _LuaBoundValue &value);
+// Remove the binding of t.key, the table is at the top of the stack
+// The last value is copied to the table field
+void _LuaUnbindValue(lua_State *L, const char *key);
+// Set t.key to the value at the top of the stack and pop it, the table is below it (it doesn't get popped)
+// The metamethods of a table with a metatable run in protected mode: a bound value that rejects the value
+// is logged as an error of func (LuaState::setValue, LuaTable::setValue) and returns false
+bool _LuaSetField(lua_State *L, const char *key, const char *func);
+
+} // detail
+} // LuaUtils
+
+#endif //LUABINDING_H
@@ -0,0 +1,381 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaBuffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace LuaUtils {;
+
+//////////////////////////////////////////////////////////////////////////////
+// Userdata of a buffer
+struct Buffer
+{
+	char	*data;
+	size_t	size;
+	size_t	capacity;
+};
+
+// Registry key of the metatable of the buffers
+static const char gBufferKey = 0;
+
+// Size of a formatted item of appendf: the widest %f with a width and a precision of 99
+static const size_t MaxItem = 512;
+
+//////////////////////////////////////////////////////////////////////////////
+// Get the buffer at the given index, or null
+static Buffer *toBuffer(lua_State *L, int idx)
+{
+	void *p = lua_touserdata(L, idx);
+	if (!p || !lua_getmetatable(L, idx))
+		return 0;
+	lua_pushlightuserdata(L, (void*)&gBufferKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	bool isBuffer = lua_rawequal(L, -1, -2) != 0;
+	lua_pop(L, 2);
+	return isBuffer ? (Buffer*)p : 0;
+}
+//////////////////////////////////////////////////////////////////////////////
+// Get the buffer at the given argument, or raise an error
+static Buffer *checkBuffer(lua_State *L, int arg)
+{
+	Buffer *b = toBuffer(L, arg);
+	if (!b)
+		detail::_LuaTypeError(L, arg, "buffer");
+	return b;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Make room for size more bytes, the capacity doubles
+static void reserve(lua_State *L, Buffer *b, size_t size)
+{
+	if (size <= b->capacity - b->size)
+		return;
+	if (size > (size_t)-1 / 2 - b->size)
+		luaL_error(L, "buffer too large");
+	size_t capacity = b->capacity ? b->capacity * 2 : 64;
+	if (capacity < b->size + size)
+		capacity = b->size + size;
+	char *data = (char*)realloc(b->data, capacity);
+	if (!data)
+		luaL_error(L, "not enough memory for the buffer");
+	b->data = data;
+	b->capacity = capacity;
+}
+//////////////////////////////////////////////////////////////////////////////
+// Append bytes with spaces before them (or after them if left is set), they can come from the buffer itself
+static void appendPadded(lua_State *L, Buffer *b, const char *s, size_t len, size_t padding, bool left)
+{
+	if (!len && !padding)
+		return;
+	bool own = b->data && s >= b->data && s < b->data + b->size;
+	size_t offset = own ? s - b->data : 0;
+	reserve(L, b, len + padding);
+	if (own)
+		s = b->data + offset;
+	char *dst = b->data + b->size;
+	memset(left ? dst + len : dst, ' ', padding);
+	memcpy(left ? dst : dst + padding, s, len);
+	b->size += len + padding;
+}
+//////////////////////////////////////////////////////////////////////////////
+// Append bytes, they can come from the buffer itself
+static void appendBytes(lua_State *L, Buffer *b, const char *s, size_t len)
+{
+	appendPadded(L, b, s, len, 0, false);
+}
+//////////////////////////////////////////////////////////////////////////////
+// Format the number at the given index like tostring does, returns its length
+static size_t formatNumber(lua_State *L, int idx, char *buf)
+{
+#if LUA_VERSION_NUM >= 503
+	if (lua_isinteger(L, idx))
+		return (size_t)_snprintf(buf, MaxItem, LUA_INTEGER_FMT, (LUAI_UACINT)lua_tointeger(L, idx));
+	int len = _snprintf(buf, MaxItem, LUA_NUMBER_FMT, (double)lua_tonumber(L, idx));
+	// Floats that look like integers get a .0
+	if (buf[strspn(buf, "-0123456789")] == 0)
+	{
+		strcpy(buf + len, ".0");
+		len += 2;
+	}
+	return (size_t)len;
+#else
+	return (size_t)_snprintf(buf, MaxItem, LUA_NUMBER_FMT, (double)lua_tonumber(L, idx));
+#endif
+}
+//////////////////////////////////////////////////////////////////////////////
+// Get the bytes of a string, number or buffer argument, numbers are formatted into buf
+static const char *checkBytes(lua_State *L, int arg, char *buf, size_t &len)
+{
+	switch (lua_type(L, arg))
+	{
+	case LUA_TSTRING:
+		return lua_tolstring(L, arg, &len);
+	case LUA_TNUMBER:
+		len = formatNumber(L, arg, buf);
+		return buf;
+	default:
+		{
+			Buffer *b = toBuffer(L, arg);
+			if (!b)
+				luaL_argerror(L, arg, "string, number or buffer expected");
+			len = b->size;
+			return b->data;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// buffer.new([capacity])
+static int bufferNew(lua_State *L)
+{
+	lua_Integer capacity = luaL_optinteger(L, 1, 0);
+	luaL_argcheck(L, capacity >= 0, 1, "negative capacity");
+	Buffer *b = (Buffer*)lua_newuserdata(L, sizeof(Buffer));
+	b->data = 0;
+	b->size = 0;
+	b->capacity = 0;
+	lua_pushlightuserdata(L, (void*)&gBufferKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	lua_setmetatable(L, -2);
+	reserve(L, b, (size_t)capacity);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// b:append(...), returns b
+static int bufferAppend(lua_State *L)
+{
+	Buffer *b = checkBuffer(L, 1);
+	int numArgs = lua_gettop(L);
+	char buf[MaxItem];
+	for (int arg = 2; arg <= numArgs; ++arg)
+	{
+		size_t len;
+		const char *s = checkBytes(L, arg, buf, len);
+		appendBytes(L, b, s, len);
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// b:appendf(format, ...), returns b
+// Formats each item with _snprintf, except %s whose bytes are copied as they are
+static int bufferAppendf(lua_State *L)
+{
+	Buffer *b = checkBuffer(L, 1);
+	size_t formatLen;
+	const char *format = luaL_checklstring(L, 2, &formatLen);
+	const char *end = format + formatLen;
+	int arg = 2;
+	char item[MaxItem];
+	while (format < end)
+	{
+		const char *percent = (const char*)memchr(format, '%', end - format);
+		if (!percent)
+		{
+			appendBytes(L, b, format, end - format);
+			break;
+		}
+		appendBytes(L, b, format, percent - format);
+		format = percent + 1;
+		if (format < end && *format == '%')
+		{
+			appendBytes(L, b, "%", 1);
+			++format;
+			continue;
+		}
+		// Flags, then width and precision of 2 digits at most, like string.format
+		char spec[16] = "%";
+		size_t specLen = 1;
+		bool left = false;
+		int width = 0;
+		int precision = -1;
+		while (format < end && strchr("-+ #0", *format) && specLen < 6)
+		{
+			left = left || *format == '-';
+			spec[specLen++] = *format++;
+		}
+		for (int i = 0; i < 2 && format < end && *format >= '0' && *format <= '9'; ++i)
+		{
+			width = width * 10 + (*format - '0');
+			spec[specLen++] = *format++;
+		}
+		if (format < end && *format == '.')
+		{
+			precision = 0;
+			spec[specLen++] = *format++;
+			for (int i = 0; i < 2 && format < end && *format >= '0' && *format <= '9'; ++i)
+			{
+				precision = precision * 10 + (*format - '0');
+				spec[specLen++] = *format++;
+			}
+		}
+		if (format >= end)
+			return luaL_error(L, "invalid conversion '%s' to 'appendf'", spec);
+		char conversion = *format++;
+		++arg;
+		int len = 0;
+		switch (conversion)
+		{
+		case 'c':
+			spec[specLen++] = 'c';
+			spec[specLen] = 0;
+			len = _snprintf(item, MaxItem, spec, (int)luaL_checkinteger(L, arg));
+			break;
+		case 'd': case 'i':
+			spec[specLen++] = 'l';
+			spec[specLen++] = 'l';
+			spec[specLen++] = conversion;
+			spec[specLen] = 0;
+			len = _snprintf(item, MaxItem, spec, (long long)luaL_checkinteger(L, arg));
+			break;
+		case 'u': case 'o': case 'x': case 'X':
+			spec[specLen++] = 'l';
+			spec[specLen++] = 'l';
+			spec[specLen++] = conversion;
+			spec[specLen] = 0;
+			len = _snprintf(item, MaxItem, spec, (unsigned long long)luaL_checkinteger(L, arg));
+			break;
+		case 'e': case 'E': case 'f': case 'g': case 'G':
+			spec[specLen++] = conversion;
+			spec[specLen] = 0;
+			len = _snprintf(item, MaxItem, spec, (double)luaL_checknumber(L, arg));
+			break;
+		case 's':
+			{
+				size_t size;
+				const char *s = checkBytes(L, arg, item, size);
+				if (precision >= 0 && size > (size_t)precision)
+					size = (size_t)precision;
+				appendPadded(L, b, s, size, (size_t)width > size ? (size_t)width - size : 0, left);
+				continue;
+			}
+		default:
+			spec[specLen++] = conversion;
+			spec[specLen] = 0;
+			return luaL_error(L, "invalid conversion '%s' to 'appendf'", spec);
+		}
+		if (len < 0)
+			return luaL_error(L, "invalid conversion '%s' to 'appendf'", spec);
+		appendBytes(L, b, item, (size_t)len);
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// b:tostring(), also the __tostring metamethod
+static int bufferToString(lua_State *L)
+{
+	Buffer *b = checkBuffer(L, 1);
+	lua_pushlstring(L, b->data ? b->data : "", b->size);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// b:clear(), returns b
+static int bufferClear(lua_State *L)
+{
+	Buffer *b = checkBuffer(L, 1);
+	b->size = 0;
+	lua_settop(L, 1);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// b:reserve(size), makes room for size more bytes, returns b
+static int bufferReserve(lua_State *L)
+{
+	Buffer *b = checkBuffer(L, 1);
+	lua_Integer size = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, size >= 0, 2, "negative size");
+	reserve(L, b, (size_t)size);
+	lua_settop(L, 1);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// __len metamethod of the buffers
+static int bufferLen(lua_State *L)
+{
+	Buffer *b = checkBuffer(L, 1);
+	lua_pushinteger(L, (lua_Integer)b->size);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// __gc metamethod of the buffers
+static int bufferGC(lua_State *L)
+{
+	Buffer *b = toBuffer(L, 1);
+	if (!b)
+		return 0;
+	free(b->data);
+	b->data = 0;
+	b->size = 0;
+	b->capacity = 0;
+	return 0;
+}
+
+static const luaL_Reg gBufferMethods[] =
+{
+	{ "append", bufferAppend },
+	{ "appendf", bufferAppendf },
+	{ "tostring", bufferToString },
+	{ "clear", bufferClear },
+	{ "reserve", bufferReserve },
+	{ 0, 0 }
+};
+
+namespace detail {;
+
+////////////////////////////////////////////////////////////////////////////////////
+// Get a view of the content of the buffer at the given index
+// returns false if it isn't a buffer
+bool _LuaToBuffer(lua_State *L, int idx, LuaStringView &view)
+{
+	Buffer *b = toBuffer(L, idx);
+	if (!b)
+		return false;
+	view.data = b->data ? b->data : "";
+	view.size = b->size;
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Set the buffer library as the global "buffer"
+void _LuaOpenBufferLib(lua_State *L)
+{
+	lua_pushlightuserdata(L, (void*)&gBufferKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	bool created = lua_istable(L, -1);
+	lua_pop(L, 1);
+	if (!created)
+	{
+		lua_pushlightuserdata(L, (void*)&gBufferKey);
+		lua_newtable(L);
+		int meta = lua_gettop(L);
+		lua_newtable(L);
+		for (const luaL_Reg *method = gBufferMethods; method->name; ++method)
+		{
+			lua_pushcfunction(L, method->func);
+			lua_setfield(L, -2, method->name);
+		}
+		lua_setfield(L, meta, "__index");
+		lua_pushcfunction(L, bufferLen);
+		lua_setfield(L, meta, "__len");
+		lua_pushcfunction(L, bufferToString);
+		lua_setfield(L, meta, "__tostring");
+		lua_pushcfunction(L, bufferGC);
+		lua_setfield(L, meta, "__gc");
+		// The metamethods stay out of reach of the scripts, they could call them with any value
+		lua_pushliteral(L, "buffer");
+		lua_setfield(L, meta, "__metatable");
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+
+	lua_newtable(L);
+	lua_pushcfunction(L, bufferNew);
+	lua_setfield(L, -2, "new");
+	lua_setglobal(L, "buffer");
+}
+
+} // detail
+} // LuaUtils
@@ -0,0 +1,42 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUABUFFER_H
+#define LUABUFFER_H
+
+#include "LuaBase.h"
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Buffer library for the scripts, see LuaState::openBufferLib
+//
+// A buffer is a userdata that builds a string in growable C++ memory, so building a long text doesn't
+// create the intermediate strings of .. or the pieces of table.concat:
+//
+//		local b = buffer.new()			-- or buffer.new(capacity)
+//		b:append('<li>', name, '</li>')	-- strings, numbers and other buffers
+//		b:appendf('%s: %5.2f\n', key, value)
+//		SendResponse(b)
+//
+// - #b is the size in bytes, b:clear() empties it but keeps the memory, b:reserve(size) grows it
+// - b:tostring() (and tostring(b)) makes a Lua string of the content
+// - appendf supports the conversions of string.format except %q, %s takes strings, numbers and buffers
+// A C function reads the content without a copy by getting its argument as a LuaStringView (see
+// LuaStateCFunc::getArg), the view is valid until the buffer is modified or collected.
+// The memory isn't allocated by Lua, so it doesn't count in LuaState::getMemUsage or the limits.
+
+namespace detail {;
+
+// Get a view of the content of the buffer at the given index
+// returns false if it isn't a buffer
+bool _LuaToBuffer(lua_State *L, int idx, LuaStringView &view);
+// Set the buffer library as the global "buffer"
+void _LuaOpenBufferLib(lua_State *L);
+
+} // detail
+} // LuaUtils
+
+#endif //LUABUFFER_H
@@ -0,0 +1,575 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaCSV.h"
+#include "LuaLimits.h"
+#include <stdarg.h>
+#include <stdlib.h>
+#include <limits.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace LuaUtils {;
+
+// Registry key of the metatable of the mapped files
+static const char gMappingKey = 0;
+
+// Longest field that gets converted to a number
+static const size_t MaxNumber = 64;
+
+//////////////////////////////////////////////////////////////////////////////
+// A mapped file, kept in a userdata so that it gets unmapped when collected if an error skips the unmap
+// It also owns the scratch buffer of the parser, for the same reason
+struct Mapping
+{
+	const char	*data;
+	size_t		size;
+	bool		mapped;
+	char		*scratch;
+	size_t		scratchSize;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+static void unmap(Mapping *m)
+{
+	if (m->mapped)
+	{
+#ifdef WIN32
+		UnmapViewOfFile(m->data);
+#else
+		munmap((void*)m->data, m->size);
+#endif
+		m->mapped = false;
+	}
+	m->data = "";
+	m->size = 0;
+	free(m->scratch);
+	m->scratch = 0;
+	m->scratchSize = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+static int mappingGC(lua_State *L)
+{
+	unmap((Mapping*)lua_touserdata(L, 1));
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Push a userdata for a mapped file, nothing is mapped yet
+static Mapping *pushMapping(lua_State *L)
+{
+	Mapping *m = (Mapping*)lua_newuserdata(L, sizeof(Mapping));
+	m->data = "";
+	m->size = 0;
+	m->mapped = false;
+	m->scratch = 0;
+	m->scratchSize = 0;
+	lua_pushlightuserdata(L, (void*)&gMappingKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushcfunction(L, mappingGC);
+		lua_setfield(L, -2, "__gc");
+		lua_pushlightuserdata(L, (void*)&gMappingKey);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+	lua_setmetatable(L, -2);
+	return m;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Map a file for reading, an empty file maps to an empty string
+// returns false if it can't be opened or mapped
+static bool map(Mapping *m, const char *fileName)
+{
+#ifdef WIN32
+	HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, 0);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	bool ok = GetFileSizeEx(file, &size) != 0;
+	if (ok && size.QuadPart > 0)
+	{
+		// The view keeps the mapping open
+		HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+		void *view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : 0;
+		if (mapping)
+			CloseHandle(mapping);
+		ok = view != 0;
+		if (ok)
+		{
+			m->data = (const char*)view;
+			m->size = (size_t)size.QuadPart;
+			m->mapped = true;
+		}
+	}
+	CloseHandle(file);
+	return ok;
+#else
+	int fd = open(fileName, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	bool ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+	if (ok && st.st_size > 0)
+	{
+		void *view = mmap(0, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		ok = view != MAP_FAILED;
+		if (ok)
+		{
+			madvise(view, (size_t)st.st_size, MADV_SEQUENTIAL);
+			m->data = (const char*)view;
+			m->size = (size_t)st.st_size;
+			m->mapped = true;
+		}
+	}
+	close(fd);
+	return ok;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Reads the fields of a mapped CSV text one by one
+// It only holds pointers, since the Lua calls made between the reads can raise memory errors
+class CSVParser
+{
+public:
+	// A field, pointing to the text, or to the scratch buffer of the mapping if it had "" to unescape
+	struct Field
+	{
+		const char	*data;
+		size_t		size;
+		bool		quoted;
+	};
+
+	//////////////////////////////////////////////////////////////////////////////
+	CSVParser(Mapping *m, char separator)
+	:	mMapping(m)
+	,	mPos(m->data)
+	,	mEnd(m->data + m->size)
+	,	mSeparator(separator)
+	,	mLine(1)
+	,	mError("")
+	{
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Skip the blank lines before the next record, or only the ones that end the text
+	// (with a single column, a blank line is a record with an empty field)
+	// returns false at the end of the text
+	bool	nextRecord(bool skipBlank)
+	{
+		const char *pos = mPos;
+		int lines = 0;
+		while (pos < mEnd && (*pos == '\n' || *pos == '\r'))
+		{
+			if (*pos == '\n')
+				lines++;
+			pos++;
+		}
+		if (skipBlank || pos == mEnd)
+		{
+			mPos = pos;
+			mLine += lines;
+		}
+		return mPos < mEnd;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Read the next field of the record, last is set if it ends the record
+	// returns false on a syntax error, see getError
+	bool	readField(Field &field, bool &last)
+	{
+		if (mPos < mEnd && *mPos == '"')
+		{
+			const char *start = ++mPos;
+			bool escaped = false;
+			for (;;)
+			{
+				const char *quote = (const char*)memchr(mPos, '"', mEnd - mPos);
+				if (!quote)
+				{
+					mError = "unterminated quoted field";
+					return false;
+				}
+				for (; mPos < quote; ++mPos)
+					mLine += *mPos == '\n';
+				mPos = quote + 1;
+				if (mPos == mEnd || *mPos != '"')
+					break;
+				escaped = true;
+				mPos++;
+			}
+			field.quoted = true;
+			field.data = start;
+			field.size = mPos - 1 - start;
+			if (escaped)
+			{
+				if (field.size > mMapping->scratchSize)
+				{
+					char *scratch = (char*)realloc(mMapping->scratch, field.size);
+					if (!scratch)
+					{
+						mError = "not enough memory";
+						return false;
+					}
+					mMapping->scratch = scratch;
+					mMapping->scratchSize = field.size;
+				}
+				char *dest = mMapping->scratch;
+				for (const char *p = start; p < mPos - 1; ++p)
+				{
+					*dest++ = *p;
+					p += *p == '"';
+				}
+				field.data = mMapping->scratch;
+				field.size = dest - mMapping->scratch;
+			}
+		}
+		else
+		{
+			const char *start = mPos;
+			while (mPos < mEnd && *mPos != mSeparator && *mPos != '\n')
+				mPos++;
+			field.quoted = false;
+			field.data = start;
+			field.size = mPos - start;
+			// \r\n line ends
+			if ((mPos == mEnd || *mPos == '\n') && field.size && start[field.size - 1] == '\r')
+				field.size--;
+		}
+
+		last = true;
+		if (mPos == mEnd)
+			return true;
+		if (*mPos == mSeparator)
+		{
+			mPos++;
+			last = false;
+			return true;
+		}
+		if (*mPos == '\r' && (mPos + 1 == mEnd || mPos[1] == '\n'))
+		{
+			if (++mPos == mEnd)
+				return true;
+		}
+		if (*mPos == '\n')
+		{
+			mPos++;
+			mLine++;
+			return true;
+		}
+		mError = "unexpected character after a quoted field";
+		return false;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Number of fields of the next record, without reading it
+	int		countFields() const
+	{
+		CSVParser probe(*this);
+		Field field;
+		bool last = false;
+		int count = 0;
+		while (!last && probe.readField(field, last))
+			count++;
+		return count;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	int			getLine() const		{ return mLine; }
+	const char	*getError() const	{ return mError; }
+
+private:
+	Mapping		*mMapping;
+	const char	*mPos;
+	const char	*mEnd;
+	char		mSeparator;
+	int			mLine;
+	const char	*mError;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Push a field, as a number if it reads as one
+static void pushField(lua_State *L, const CSVParser::Field &field, bool numbers)
+{
+	const char *s = field.data;
+	size_t size = field.size;
+	if (numbers && !field.quoted && size && size < MaxNumber)
+	{
+		size_t digits = (s[0] == '-' || s[0] == '+') ? 1 : 0;
+		size_t first = digits;
+		while (digits < size && s[digits] >= '0' && s[digits] <= '9')
+			digits++;
+		// Integers that fit, without going through strtod
+		const size_t maxDigits = sizeof(lua_Integer) >= 8 ? 18 : 9;
+		if (digits == size && size > first && size - first <= maxDigits)
+		{
+			lua_Integer n = 0;
+			for (size_t i = first; i < size; ++i)
+				n = n * 10 + (s[i] - '0');
+			lua_pushinteger(L, s[0] == '-' ? -n : n);
+			return;
+		}
+		// Anything else that strtod reads entirely, but not inf or nan
+		if (first < size && ((s[first] >= '0' && s[first] <= '9') || s[first] == '.'))
+		{
+			char buf[MaxNumber];
+			memcpy(buf, s, size);
+			buf[size] = 0;
+			char *end;
+			double n = strtod(buf, &end);
+			if (end == buf + size)
+			{
+				lua_pushnumber(L, (lua_Number)n);
+				return;
+			}
+		}
+	}
+	lua_pushlstring(L, s, size);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Upper bound of the number of records, to presize the arrays
+static int countLines(const char *data, size_t size)
+{
+	size_t count = 1;
+	const char *end = data + size;
+	while ((data = (const char*)memchr(data, '\n', end - data)) != 0)
+	{
+		count++;
+		data++;
+	}
+	return count > INT_MAX ? INT_MAX : (int)count;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Drop what loadCSV pushed and push nil and the error message
+static int csvError(lua_State *L, int base, Mapping *m, const char *format, ...)
+{
+	unmap(m);
+	lua_settop(L, base);
+	lua_pushnil(L);
+	va_list args;
+	va_start(args, format);
+	lua_pushvfstring(L, format, args);
+	va_end(args);
+	return 2;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Push the table built from a CSV file, or nil and an error message
+// Only memory errors are raised, code is set for the others
+// returns the number of values pushed
+static int loadCSV(lua_State *L, const char *fileName, const LuaCSVOptions &options, LuaErrorCode &code)
+{
+	code = LuaErrorGeneric;
+	int base = lua_gettop(L);
+	Mapping *m = pushMapping(L);
+	if (options.separator == '"' || options.separator == '\n' || options.separator == '\r')
+		return csvError(L, base, m, "invalid separator");
+	if (!map(m, fileName))
+	{
+		code = LuaErrorFile;
+		return csvError(L, base, m, "couldn't read the file");
+	}
+	CSVParser parser(m, options.separator);
+	CSVParser::Field field;
+	bool last = false;
+	int numRows = countLines(m->data, m->size);
+
+	// Column names, kept on the stack
+	int names = lua_gettop(L) + 1;
+	int numCols = 0;
+	if (parser.nextRecord(true))
+	{
+		if (options.header)
+		{
+			for (last = false; !last; ++numCols)
+			{
+				if (!parser.readField(field, last))
+					return csvError(L, base, m, "line %d: %s", parser.getLine(), parser.getError());
+				if (!lua_checkstack(L, 8))
+					return csvError(L, base, m, "too many columns");
+				lua_pushlstring(L, field.data, field.size);
+			}
+		}
+		else
+		{
+			numCols = parser.countFields();
+		}
+	}
+
+	// The column arrays or the array of rows
+	int columns = lua_gettop(L) + 1;
+	int rows = columns;
+	if (options.layout == LuaCSVColumns)
+	{
+		if (!lua_checkstack(L, numCols + 8))
+			return csvError(L, base, m, "too many columns");
+		for (int col = 0; col < numCols; ++col)
+			lua_createtable(L, numRows, 0);
+	}
+	else
+	{
+		lua_createtable(L, numRows, 0);
+	}
+
+	for (int row = 1; parser.nextRecord(numCols > 1); ++row)
+	{
+		int line = parser.getLine();
+		if (options.layout == LuaCSVRows)
+			lua_createtable(L, options.header ? 0 : numCols, options.header ? numCols : 0);
+		int col = 0;
+		for (last = false; !last; ++col)
+		{
+			if (!parser.readField(field, last))
+				return csvError(L, base, m, "line %d: %s", parser.getLine(), parser.getError());
+			if (col == numCols)
+				return csvError(L, base, m, "line %d: more than %d fields", line, numCols);
+			pushField(L, field, options.numbers);
+			if (options.layout == LuaCSVColumns)
+			{
+				lua_rawseti(L, columns + col, row);
+			}
+			else if (options.header)
+			{
+				lua_pushvalue(L, names + col);
+				lua_insert(L, -2);
+				lua_rawset(L, -3);
+			}
+			else
+			{
+				lua_rawseti(L, -2, col + 1);
+			}
+		}
+		if (col != numCols)
+			return csvError(L, base, m, "line %d: %d fields instead of %d", line, col, numCols);
+		if (options.layout == LuaCSVRows)
+			lua_rawseti(L, rows, row);
+	}
+
+	if (options.layout == LuaCSVColumns)
+	{
+		lua_createtable(L, options.header ? 0 : numCols, options.header ? numCols : 0);
+		for (int col = 0; col < numCols; ++col)
+		{
+			if (options.header)
+				lua_pushvalue(L, names + col);
+			lua_pushvalue(L, columns + col);
+			if (options.header)
+				lua_rawset(L, -3);
+			else
+				lua_rawseti(L, -2, col + 1);
+		}
+	}
+	unmap(m);
+	// Keep the result only
+	lua_replace(L, base + 1);
+	lua_settop(L, base + 1);
+	return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Arguments of protectedLoadCSV
+struct CSVLoad
+{
+	const char			*fileName;
+	const LuaCSVOptions	*options;
+	LuaErrorCode		code;
+};
+static int protectedLoadCSV(lua_State *L)
+{
+	CSVLoad *load = (CSVLoad*)lua_touserdata(L, 1);
+	lua_pop(L, 1);
+	return loadCSV(L, load->fileName, *load->options, load->code);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// csv.load(fileName [, options]), returns the table, or nil and an error message
+static int csvLoad(lua_State *L)
+{
+	const char *fileName = luaL_checkstring(L, 1);
+	LuaCSVOptions options;
+	if (!lua_isnoneornil(L, 2))
+	{
+		luaL_checktype(L, 2, LUA_TTABLE);
+		lua_getfield(L, 2, "layout");
+		if (!lua_isnil(L, -1))
+		{
+			const char *layout = lua_tostring(L, -1);
+			if (layout && !strcmp(layout, "rows"))
+				options.layout = LuaCSVRows;
+			else if (layout && !strcmp(layout, "columns"))
+				options.layout = LuaCSVColumns;
+			else
+				return luaL_argerror(L, 2, "layout must be 'rows' or 'columns'");
+		}
+		lua_getfield(L, 2, "separator");
+		if (!lua_isnil(L, -1))
+		{
+			size_t len = 0;
+			const char *separator = lua_tolstring(L, -1, &len);
+			if (!separator || len != 1)
+				return luaL_argerror(L, 2, "separator must be a single character");
+			options.separator = separator[0];
+		}
+		lua_getfield(L, 2, "header");
+		if (!lua_isnil(L, -1))
+			options.header = lua_toboolean(L, -1) != 0;
+		lua_getfield(L, 2, "numbers");
+		if (!lua_isnil(L, -1))
+			options.numbers = lua_toboolean(L, -1) != 0;
+		lua_settop(L, 2);
+	}
+	LuaErrorCode code;
+	return loadCSV(L, fileName, options, code);
+}
+
+namespace detail {;
+
+////////////////////////////////////////////////////////////////////////////////////
+// Push the table built from a CSV file, returns false (and pushes nothing) on error, which gets logged
+bool _LuaLoadCSV(lua_State *L, const char *fileName, const LuaCSVOptions &options)
+{
+	int top = lua_gettop(L);
+	CSVLoad load;
+	load.fileName = fileName;
+	load.options = &options;
+	load.code = LuaErrorGeneric;
+	lua_pushcfunction(L, protectedLoadCSV);
+	lua_pushlightuserdata(L, &load);
+	int status = lua_pcall(L, 1, LUA_MULTRET, 0);
+	if (!status && lua_istable(L, -1))
+		return true;
+	LuaErrorCode code = status ? _LuaGetErrorCode(L, status) : load.code;
+	const char *error = lua_tostring(L, -1);
+	_LuaLogError(code, "Error in LuaState::loadCSV() - %s - %s\n", fileName, error ? error : "unknown error");
+	lua_settop(L, top);
+	return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Set the csv library as the global "csv"
+void _LuaOpenCSVLib(lua_State *L)
+{
+	lua_newtable(L);
+	lua_pushcfunction(L, csvLoad);
+	lua_setfield(L, -2, "load");
+	lua_setglobal(L, "csv");
+}
+
+} // detail
+} // LuaUtils
@@ -0,0 +1,68 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUACSV_H
+#define LUACSV_H
+
+#include "LuaBase.h"
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Layout of the table built from a CSV file
+enum LuaCSVLayout
+{
+	LuaCSVColumns,		// { name = { value1, value2, ... }, ... }, one array per column
+	LuaCSVRows			// { { name = value1, ... }, { name = value2, ... }, ... }, one table per row
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// How to read a CSV file, see LuaState::loadCSV
+//
+// The file is memory mapped and parsed in C++, with the quoting rules of RFC 4180: fields can be
+// quoted with ", a quoted field can hold separators, line breaks and "" for a quote.
+// Lines end with \n or \r\n, blank lines are skipped (except with a single column, where they are empty
+// fields, and only the blank lines at the end are skipped), and every line must have as many fields as the
+// first one. Empty fields are empty strings, so the column arrays have no holes.
+// The columns layout is the compact one: a few presized arrays instead of a table per row.
+struct LuaCSVOptions
+{
+	LuaCSVOptions()
+	:	layout(LuaCSVColumns)
+	,	separator(',')
+	,	header(true)
+	,	numbers(true)
+	{
+	}
+
+	LuaCSVLayout	layout;
+	char			separator;
+	// The first line holds the names of the columns, otherwise they are numbered from 1
+	// (the rows are then arrays, and the columns an array of arrays)
+	bool			header;
+	// The unquoted fields that read as numbers become numbers, the others stay strings
+	bool			numbers;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The scripts get the same loader from the csv library, see LuaState::openCSVLib
+//
+//		local prices = csv.load('prices.csv')						-- prices.item[i], prices.price[i]
+//		local rules = csv.load('rules.tsv', { layout = 'rows', separator = '\t' })	-- rules[i].name
+//
+// The options table has the fields of LuaCSVOptions: layout ('columns' or 'rows'), separator, header
+// and numbers. Like io.open, it returns nil and an error message if the file can't be loaded.
+
+namespace detail {;
+
+// Push the table built from a CSV file, returns false (and pushes nothing) on error, which gets logged
+bool _LuaLoadCSV(lua_State *L, const char *fileName, const LuaCSVOptions &options);
+// Set the csv library as the global "csv"
+void _LuaOpenCSVLib(lua_State *L);
+
+} // detail
+} // LuaUtils
+
+#endif //LUACSV_H
@@ -0,0 +1,167 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUACOMPAT_H
+#define LUACOMPAT_H
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Lua version compatibility layer
+// LuaUtils builds against Lua 5.1, LuaJIT (which has the 5.1 API) and Lua 5.4, selected at build time:
+//
+//		(nothing)				Lua 5.1, from <lua/lua.hpp>
+//		LUAUTILS_LUAJIT			LuaJIT 2.x, from <luajit-2.1/lua.hpp>
+//		LUAUTILS_LUA54			Lua 5.4, from <lua5.4/lua.hpp>
+//		LUAUTILS_LUA_HEADER		any other location, ex: -DLUAUTILS_LUA_HEADER="<lua.hpp>"
+//
+// The code then only uses the helpers below for the parts of the API that changed between versions.
+#if defined(LUAUTILS_LUA_HEADER)
+#include LUAUTILS_LUA_HEADER
+#elif defined(LUAUTILS_LUAJIT)
+#include <luajit-2.1/lua.hpp>
+#elif defined(LUAUTILS_LUA54)
+#include <lua5.4/lua.hpp>
+#else
+#include <lua/lua.hpp>
+#endif
+
+#if LUA_VERSION_NUM < 501 || LUA_VERSION_NUM > 504
+#error "LuaUtils needs Lua 5.1 to 5.4, or LuaJIT"
+#endif
+
+namespace LuaUtils {;
+namespace detail {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Length of the table or string at idx, without metamethods
+inline size_t _LuaRawLen(lua_State *L, int idx)
+{
+#if LUA_VERSION_NUM == 501
+	return lua_objlen(L, idx);
+#else
+	return (size_t)lua_rawlen(L, idx);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Push the table of globals
+inline void _LuaPushGlobals(lua_State *L)
+{
+#if LUA_VERSION_NUM == 501
+	lua_pushvalue(L, LUA_GLOBALSINDEX);
+#else
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Convert the number at idx to an integer, truncating it if needed
+// (from 5.3 on, lua_tointeger returns 0 for numbers with a fractional part)
+inline lua_Integer _LuaToInteger(lua_State *L, int idx)
+{
+#if LUA_VERSION_NUM >= 503
+	int isInteger = 0;
+	lua_Integer n = lua_tointegerx(L, idx, &isInteger);
+	return isInteger ? n : (lua_Integer)lua_tonumber(L, idx);
+#else
+	return lua_tointeger(L, idx);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Raise a "bad argument, expected type" error (luaL_typerror was removed in 5.2)
+inline int _LuaTypeError(lua_State *L, int narg, const char *tname)
+{
+#if LUA_VERSION_NUM == 501
+	return luaL_typerror(L, narg, tname);
+#else
+	const char *msg = lua_pushfstring(L, "%s expected, got %s", tname, luaL_typename(L, narg));
+	return luaL_argerror(L, narg, msg);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Resume the coroutine L (from is the thread resuming it), numResults receives the number of values
+// it yielded or returned, they are at the top of its stack (lua_resume returns the number of results from 5.4 on)
+inline int _LuaResume(lua_State *L, lua_State *from, int nargs, int *numResults)
+{
+#if LUA_VERSION_NUM == 501
+	(void)from;
+	int res = lua_resume(L, nargs);
+	*numResults = lua_gettop(L);
+	return res;
+#elif LUA_VERSION_NUM <= 503
+	int res = lua_resume(L, from, nargs);
+	*numResults = lua_gettop(L);
+	return res;
+#else
+	return lua_resume(L, from, nargs, numResults);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Call the C function func(ud) in protected mode (lua_cpcall was removed in 5.2)
+// Returns 0 on success, or an error code with the error message on the stack
+inline int _LuaCPCall(lua_State *L, lua_CFunction func, void *ud)
+{
+#if LUA_VERSION_NUM == 501
+	return lua_cpcall(L, func, ud);
+#else
+	lua_pushcfunction(L, func);
+	lua_pushlightuserdata(L, ud);
+	return lua_pcall(L, 1, 0, 0);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Dump the function at the top of the stack as a binary chunk
+// (stripping the debug information is only supported from 5.3 on)
+inline int _LuaDump(lua_State *L, lua_Writer writer, void *data, bool strip)
+{
+#if LUA_VERSION_NUM >= 503
+	return lua_dump(L, writer, data, strip ? 1 : 0);
+#else
+	(void)strip;
+	return lua_dump(L, writer, data);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Name of the list of module searchers in the package table (package.loaders was renamed in 5.2)
+inline const char *_LuaSearchersField()
+{
+#if LUA_VERSION_NUM == 501
+	return "loaders";
+#else
+	return "searchers";
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Identity of the upvalue n of the Lua function at idx, the same for all the closures sharing it
+// (null on Lua 5.1, which can't tell, LuaJIT has it)
+inline void *_LuaUpvalueId(lua_State *L, int idx, int n)
+{
+#if LUA_VERSION_NUM >= 502 || defined(LUAJIT_VERSION)
+	return lua_upvalueid(L, idx, n);
+#else
+	(void)L; (void)idx; (void)n;
+	return 0;
+#endif
+}
+// Make the upvalue n1 of the Lua function at idx1 refer to the upvalue n2 of the one at idx2
+// (does nothing on Lua 5.1, where _LuaUpvalueId is always null)
+inline void _LuaUpvalueJoin(lua_State *L, int idx1, int n1, int idx2, int n2)
+{
+#if LUA_VERSION_NUM >= 502 || defined(LUAJIT_VERSION)
+	lua_upvaluejoin(L, idx1, n1, idx2, n2);
+#else
+	(void)L; (void)idx1; (void)n1; (void)idx2; (void)n2;
+#endif
+}
+
+} // detail
+} // LuaUtils
+
+#endif //LUACOMPAT_H
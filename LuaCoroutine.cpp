@@ -0,0 +1,202 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaCoroutine.h"
+#include "LuaLimits.h"
+
+namespace LuaUtils {;
+
+//////////////////////////////////////////////////////////////////////////////
+LuaCoroutine::LuaCoroutine()
+:	mRef(-1)
+,	mThread(0)
+,	mStatus(NotStarted)
+,	mNumResults(0)
+{
+}
+//////////////////////////////////////////////////////////////////////////////
+LuaCoroutine::LuaCoroutine(const LuaCoroutine &other)
+:	mRef(-1)
+,	mThread(0)
+,	mStatus(NotStarted)
+,	mNumResults(0)
+{
+	*this = other;
+}
+//////////////////////////////////////////////////////////////////////////////
+LuaCoroutine &LuaCoroutine::operator=(const LuaCoroutine &other)
+{
+	if (this == &other)
+		return *this;
+	unref();
+	mL = other.mL;
+	// copy the registry reference
+	if (mL && other.mRef != -1)
+	{
+		lua_rawgeti(mL.get(), LUA_REGISTRYINDEX, other.mRef);
+		mRef = detail::_LuaRef(mL.get(), other.mName);
+		mThread = other.mThread;
+		mStatus = other.mStatus;
+		mNumResults = other.mNumResults;
+		mName = other.mName;
+	}
+	return *this;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Create a new coroutine that will run the given function
+// returns success flag
+bool	LuaCoroutine::init(const detail::_LuaFunctionBase &func)
+{
+	unref();
+	if (!func.isInit())
+		return false;
+	mL = func.mL;
+	// The registry reference keeps the thread from being collected
+	mThread = lua_newthread(mL.get());
+	mRef = detail::_LuaRef(mL.get(), func.getName());
+	// Move the function to the new thread
+	func.push();
+	lua_xmove(mL.get(), mThread, 1);
+	mStatus = NotStarted;
+	mNumResults = 0;
+	mName = func.getName();
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Returns the number of values yielded or returned by the last resume
+int		LuaCoroutine::getNumResults() const
+{
+	if (mStatus == Suspended || mStatus == Finished)
+		return mNumResults;
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+void	LuaCoroutine::unref()
+{
+	// Delete the reference from registry
+	if (mL)
+		detail::_LuaUnref(mL.get(), mRef);
+	mRef = -1;
+	mThread = 0;
+	mStatus = NotStarted;
+	mNumResults = 0;
+	mName.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Clear the results of the last resume, returns false if the coroutine can't be resumed
+bool	LuaCoroutine::prepareResume()
+{
+	if (!isInit() || !isResumable())
+	{
+		detail::_LuaLogError("Error in LuaCoroutine::resume() - %s - coroutine is not resumable\n", mName.c_str());
+		return false;
+	}
+	// The values yielded last time are still on the thread stack
+	if (mStatus == Suspended)
+		lua_pop(mThread, mNumResults);
+	mNumResults = 0;
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Move the args from the parent stack to the thread and resume it
+bool	LuaCoroutine::doResume(int args)
+{
+	lua_xmove(mL.get(), mThread, args);
+	detail::_LuaLimitScope limits(mThread);
+	int res = detail::_LuaResume(mThread, mL.get(), args, &mNumResults);
+	if (res == LUA_YIELD)
+		mStatus = Suspended;
+	else if (res == 0)
+		mStatus = Finished;
+	else
+	{
+		mStatus = Failed;
+		const char *error = lua_tostring(mThread, -1);
+		detail::_LuaLogError(detail::_LuaGetErrorCode(mThread, res), "Error in LuaCoroutine::resume() - %s - %s\n", mName.c_str(), error ? error : "?");
+		lua_settop(mThread, 0);
+		mNumResults = 0;
+		return false;
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Add a task that will run the given function, starting at the next tick
+// All the functions must belong to the same Lua state
+// returns success flag
+bool	LuaScheduler::add(const detail::_LuaFunctionBase &func)
+{
+	if (!func.isInit())
+		return false;
+	if (!mL)
+		mL = func.mL;
+	else if (mL.get() != func.mL.get())
+	{
+		detail::_LuaLogError("Error in LuaScheduler::add() - %s - function belongs to another Lua state\n", func.getName().c_str());
+		return false;
+	}
+	Task task;
+	task.thread = lua_newthread(mL.get());
+	task.ref = detail::_LuaRef(mL.get(), func.getName());
+	func.push();
+	lua_xmove(mL.get(), task.thread, 1);
+	mTasks.push_back(task);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Remove all tasks
+void	LuaScheduler::clear()
+{
+	for (size_t i = 0; i < mTasks.size(); ++i)
+		detail::_LuaUnref(mL.get(), mTasks[i].ref);
+	mTasks.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Resume all tasks, the argument is at the top of the parent stack and gets popped
+size_t	LuaScheduler::doTick(bool hasArg)
+{
+	lua_State *L = mL.get();
+	int args = hasArg ? 1 : 0;
+	size_t alive = 0;
+	for (size_t i = 0; i < mTasks.size(); ++i)
+	{
+		Task task = mTasks[i];
+		if (hasArg)
+		{
+			lua_pushvalue(L, -1);
+			lua_xmove(L, task.thread, 1);
+		}
+		// Each resume gets its own budget
+		detail::_LuaLimitScope limits(task.thread);
+		int numResults;
+		int res = detail::_LuaResume(task.thread, L, args, &numResults);
+		if (res == LUA_YIELD)
+		{
+			// The yielded values are ignored
+			lua_pop(task.thread, numResults);
+			// Still alive, compact the task list in place so the order is kept
+			mTasks[alive++] = task;
+			continue;
+		}
+		if (res != 0)
+		{
+			const char *error = lua_tostring(task.thread, -1);
+			detail::_LuaLogError(detail::_LuaGetErrorCode(task.thread, res), "Error in LuaScheduler::tick() - %s\n", error ? error : "?");
+		}
+		detail::_LuaUnref(L, task.ref);
+	}
+	mTasks.resize(alive);
+	lua_pop(L, 1);
+	return alive;
+}
+
+} // LuaUtils
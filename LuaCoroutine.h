@@ -0,0 +1,220 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUACOROUTINE_H
+#define LUACOROUTINE_H
+
+#include "LuaBase.h"
+#include "LuaFunction.h"
+#include <vector>
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Lua coroutine wrapper class
+// The coroutine runs in a Lua thread created with lua_newthread, so it shares the globals of the state
+// that owns the function it was created from. Arguments and results go through the parent state's stack.
+class LuaCoroutine : public detail::_LuaBase
+{
+public:
+	//////////////////////////////////////////////////////////////////////////////
+	enum Status
+	{
+		NotStarted,		// created but never resumed
+		Suspended,		// yielded, can be resumed again
+		Finished,		// the function returned
+		Failed			// the function raised an error
+	};
+
+	//////////////////////////////////////////////////////////////////////////////
+	LuaCoroutine();
+	//////////////////////////////////////////////////////////////////////////////
+	~LuaCoroutine()
+	{
+		unref();
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Copies refer to the same Lua thread
+	LuaCoroutine(const LuaCoroutine &other);
+	//////////////////////////////////////////////////////////////////////////////
+	LuaCoroutine &operator=(const LuaCoroutine &other);
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Create a new coroutine that will run the given function
+	// returns success flag
+	bool	init(const detail::_LuaFunctionBase &func);
+	//////////////////////////////////////////////////////////////////////////////
+	bool	isInit() const { return (mRef != -1); }
+	//////////////////////////////////////////////////////////////////////////////
+	Status	getStatus() const { return mStatus; }
+	//////////////////////////////////////////////////////////////////////////////
+	// Returns true if the coroutine can be resumed
+	bool	isResumable() const { return mStatus == NotStarted || mStatus == Suspended; }
+	//////////////////////////////////////////////////////////////////////////////
+	const std::string &getName() const { return mName; }
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Resume the coroutine, the arguments are passed to the function the first time,
+	// and are returned by coroutine.yield() the following times
+	// returns false if the coroutine couldn't be resumed or raised an error
+	bool	resume()
+	{
+		if (!prepareResume())
+			return false;
+		return doResume(0);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1>
+	bool	resume(const T1 &p1)
+	{
+		if (!prepareResume())
+			return false;
+		luaPushValue(p1);
+		return doResume(1);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1, typename T2>
+	bool	resume(const T1 &p1, const T2 &p2)
+	{
+		if (!prepareResume())
+			return false;
+		luaPushValue(p1);
+		luaPushValue(p2);
+		return doResume(2);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1, typename T2, typename T3>
+	bool	resume(const T1 &p1, const T2 &p2, const T3 &p3)
+	{
+		if (!prepareResume())
+			return false;
+		luaPushValue(p1);
+		luaPushValue(p2);
+		luaPushValue(p3);
+		return doResume(3);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1, typename T2, typename T3, typename T4>
+	bool	resume(const T1 &p1, const T2 &p2, const T3 &p3, const T4 &p4)
+	{
+		if (!prepareResume())
+			return false;
+		luaPushValue(p1);
+		luaPushValue(p2);
+		luaPushValue(p3);
+		luaPushValue(p4);
+		return doResume(4);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Returns the number of values yielded or returned by the last resume
+	int		getNumResults() const;
+	//////////////////////////////////////////////////////////////////////////////
+	// Get a value yielded or returned by the last resume (the first one is at index 1)
+	// returns success flag
+	template <typename T>
+	bool	getResult(int i, T &res) const
+	{
+		if (i <= 0 || i > getNumResults())
+			return false;
+		lua_pushvalue(mThread, lua_gettop(mThread) - mNumResults + i);
+		lua_xmove(mThread, mL.get(), 1);
+		return luaPopValue(res);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	friend class LuaUtils::LuaScheduler;
+
+private:
+
+	//////////////////////////////////////////////////////////////////////////////
+	void	unref();
+	//////////////////////////////////////////////////////////////////////////////
+	// Clear the results of the last resume, returns false if the coroutine can't be resumed
+	bool	prepareResume();
+	//////////////////////////////////////////////////////////////////////////////
+	// Move the args from the parent stack to the thread and resume it
+	bool	doResume(int args);
+
+	//////////////////////////////////////////////////////////////////////////////
+	int			mRef;
+	lua_State	*mThread;
+	Status		mStatus;
+	// Number of values at the top of the thread stack, yielded or returned by the last resume
+	int			mNumResults;
+	std::string	mName;
+};
+
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Simple cooperative scheduler for lots of lightweight script tasks
+// Each task is a Lua thread and a registry reference, nothing else is kept on the C++ side.
+// Every tick resumes each task once, tasks that return or raise an error are removed.
+class LuaScheduler : public detail::_LuaBase
+{
+public:
+	//////////////////////////////////////////////////////////////////////////////
+	LuaScheduler() { }
+	//////////////////////////////////////////////////////////////////////////////
+	~LuaScheduler()
+	{
+		clear();
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Add a task that will run the given function, starting at the next tick
+	// All the functions must belong to the same Lua state
+	// returns success flag
+	bool	add(const detail::_LuaFunctionBase &func);
+	//////////////////////////////////////////////////////////////////////////////
+	// Remove all tasks
+	void	clear();
+	//////////////////////////////////////////////////////////////////////////////
+	// Returns the number of tasks that are still alive
+	size_t	getNumTasks() const { return mTasks.size(); }
+	//////////////////////////////////////////////////////////////////////////////
+	void	reserve(size_t numTasks) { mTasks.reserve(numTasks); }
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Resume every task once, returns the number of tasks that are still alive
+	size_t	tick()
+	{
+		if (mTasks.empty())
+			return 0;
+		lua_pushnil(mL.get());
+		return doTick(false);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Resume every task once, passing them the same argument (a frame time for instance)
+	template <typename T>
+	size_t	tick(const T &arg)
+	{
+		if (mTasks.empty())
+			return 0;
+		luaPushValue(arg);
+		return doTick(true);
+	}
+
+private:
+	// Non copyable
+	LuaScheduler(const LuaScheduler &other);
+	LuaScheduler &operator=(const LuaScheduler &other);
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Resume all tasks, the argument is at the top of the parent stack and gets popped
+	size_t	doTick(bool hasArg);
+
+	//////////////////////////////////////////////////////////////////////////////
+	struct Task
+	{
+		lua_State	*thread;
+		int			ref;
+	};
+	std::vector<Task>	mTasks;
+};
+
+} // LuaUtils
+
+#endif //LUACOROUTINE_H
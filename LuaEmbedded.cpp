@@ -0,0 +1,115 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaEmbedded.h"
+#include <map>
+
+namespace LuaUtils {;
+
+//////////////////////////////////////////////////////////////////////////////
+// Embedded chunks by name
+// (created on first use, since the registration happens during static initialization)
+typedef std::map<std::string, LuaEmbeddedChunk> EmbeddedChunks;
+static EmbeddedChunks &getEmbeddedChunks()
+{
+	static EmbeddedChunks chunks;
+	return chunks;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Searcher of embedded modules, gets the module name and returns its loader, or a message if not found
+static int embeddedSearcher(lua_State *L)
+{
+	// No std::string here, a Lua error would skip its destructor
+	const char *module = luaL_checkstring(L, 1);
+	char name[256];
+	size_t len = strlen(module);
+	if (len + sizeof("/init.lua") > sizeof(name))
+	{
+		lua_pushfstring(L, "\n\tno embedded chunk for '%s'", module);
+		return 1;
+	}
+	for (size_t i = 0; i <= len; ++i)
+		name[i] = module[i] == '.' ? '/' : module[i];
+	strcpy(name + len, ".lua");
+	const LuaEmbeddedChunk *chunk = LuaFindEmbedded(name);
+	if (!chunk)
+	{
+		strcpy(name + len, "/init.lua");
+		chunk = LuaFindEmbedded(name);
+	}
+	if (!chunk)
+	{
+		name[len] = 0;
+		lua_pushfstring(L, "\n\tno embedded chunk '%s.lua'", name);
+		return 1;
+	}
+	if (detail::_LuaLoadEmbedded(L, *chunk) != 0)
+		return luaL_error(L, "error loading embedded module '%s':\n\t%s", module, lua_tostring(L, -1));
+	// From 5.2 on, the second value is given to the loader
+	lua_pushstring(L, chunk->name);
+	return 2;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Register embedded chunks, their memory must stay valid until the program exits
+// (the code generated by luaembed calls this at static initialization)
+void LuaRegisterEmbedded(const LuaEmbeddedChunk *chunks, size_t count)
+{
+	EmbeddedChunks &embedded = getEmbeddedChunks();
+	for (size_t i = 0; i < count; ++i)
+		embedded[chunks[i].name] = chunks[i];
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Unregister embedded chunks, the names registered since by other chunks are kept
+void LuaUnregisterEmbedded(const LuaEmbeddedChunk *chunks, size_t count)
+{
+	EmbeddedChunks &embedded = getEmbeddedChunks();
+	for (size_t i = 0; i < count; ++i)
+	{
+		EmbeddedChunks::iterator it = embedded.find(chunks[i].name);
+		if (it != embedded.end() && it->second.data == chunks[i].data)
+			embedded.erase(it);
+	}
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Find an embedded chunk by name, or null
+const LuaEmbeddedChunk *LuaFindEmbedded(const char *name)
+{
+	const EmbeddedChunks &embedded = getEmbeddedChunks();
+	if (embedded.empty())
+		return 0;
+	EmbeddedChunks::const_iterator it = embedded.find(name);
+	return it != embedded.end() ? &it->second : 0;
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Number of embedded chunks
+size_t LuaGetNumEmbedded()
+{
+	return getEmbeddedChunks().size();
+}
+
+namespace detail {;
+
+////////////////////////////////////////////////////////////////////////////////////
+// Load an embedded chunk and push it as a function (or push the error message)
+// returns the status of the load (0 on success)
+int _LuaLoadEmbedded(lua_State *L, const LuaEmbeddedChunk &chunk)
+{
+	// Named like a file, for the error messages and tracebacks
+	std::string chunkName = std::string("@") + chunk.name;
+	return luaL_loadbuffer(L, (const char*)chunk.data, chunk.size, chunkName.c_str());
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Add the searcher of embedded modules to a state, see LuaEmbeddedChunk
+// returns false if the package library isn't loaded
+bool _LuaAddEmbeddedSearcher(lua_State *L)
+{
+	lua_pushcfunction(L, embeddedSearcher);
+	return _LuaAddSearcher(L);
+}
+
+} // detail
+} // LuaUtils
@@ -0,0 +1,84 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUAEMBEDDED_H
+#define LUAEMBEDDED_H
+
+#include "LuaBase.h"
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Script chunk embedded into the executable
+//
+// tools/luaembed.cpp compiles script files to bytecode at build time, and writes a C++ source file
+// that registers them when the program starts:
+//
+//		luaembed -r scripts/ -o EmbeddedScripts.cpp scripts/main.lua scripts/ai/brain.lua
+//
+// The chunks are named after their path without the root ("main.lua", "ai/brain.lua").
+// LuaState::loadFile runs the embedded chunk with that name instead of reading the file, and the
+// states get a searcher that resolves require("ai.brain") to "ai/brain.lua" (or "ai/brain/init.lua")
+// before the file searchers, so startup needs no file access and no compilation.
+//
+// Bytecode only loads in the Lua version luaembed was built with (LuaJIT has its own format).
+// Link the generated file into the executable itself, the linker can drop it from a static library
+// since nothing references it.
+struct LuaEmbeddedChunk
+{
+	const char			*name;
+	const unsigned char	*data;
+	size_t				size;
+};
+
+// Register embedded chunks, their memory must stay valid until the program exits
+// (the code generated by luaembed calls this at static initialization)
+void LuaRegisterEmbedded(const LuaEmbeddedChunk *chunks, size_t count);
+// Unregister embedded chunks, the names registered since by other chunks are kept
+void LuaUnregisterEmbedded(const LuaEmbeddedChunk *chunks, size_t count);
+// Find an embedded chunk by name, or null
+const LuaEmbeddedChunk *LuaFindEmbedded(const char *name);
+// Number of embedded chunks
+size_t LuaGetNumEmbedded();
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Registers embedded chunks for its lifetime, for the static registration in the generated code
+// (or for chunks built at runtime, in a scope)
+class LuaEmbeddedRegistrar
+{
+public:
+	LuaEmbeddedRegistrar(const LuaEmbeddedChunk *chunks, size_t count)
+	:	mChunks(chunks)
+	,	mCount(count)
+	{
+		LuaRegisterEmbedded(chunks, count);
+	}
+	~LuaEmbeddedRegistrar()
+	{
+		LuaUnregisterEmbedded(mChunks, mCount);
+	}
+
+private:
+	// Non copyable
+	LuaEmbeddedRegistrar(const LuaEmbeddedRegistrar &other);
+	LuaEmbeddedRegistrar &operator=(const LuaEmbeddedRegistrar &other);
+
+	const LuaEmbeddedChunk	*mChunks;
+	size_t					mCount;
+};
+
+namespace detail {;
+
+// Load an embedded chunk and push it as a function (or push the error message)
+// returns the status of the load (0 on success)
+int _LuaLoadEmbedded(lua_State *L, const LuaEmbeddedChunk &chunk);
+// Add the searcher of embedded modules to a state, see LuaEmbeddedChunk
+// returns false if the package library isn't loaded
+bool _LuaAddEmbeddedSearcher(lua_State *L);
+
+} // detail
+} // LuaUtils
+
+#endif //LUAEMBEDDED_H
@@ -0,0 +1,490 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaErrorSink.h"
+#include "LuaThreads.h"
+#include <stdio.h>
+#include <string.h>
+
+namespace LuaUtils {;
+
+// Format arguments kept per message
+static const int MaxArgs = 8;
+// Characters of the string arguments (or of the message formatted right away) kept per message
+static const size_t MaxText = 448;
+
+enum ArgType { ArgInt, ArgUInt, ArgDouble, ArgString, ArgPointer };
+enum ArgLength { LengthNone, LengthShort, LengthLong, LengthLongLong, LengthSize, LengthLongDouble };
+
+//////////////////////////////////////////////////////////////////////////////
+// A format argument, copied with its largest type
+struct SinkArg
+{
+	ArgType	type;
+	union
+	{
+		long long			integer;
+		unsigned long long	uinteger;
+		double				number;
+		const void			*pointer;
+		// Offset of the string in the text of the slot
+		size_t				offset;
+	};
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// A message of the ring, its sequence number tells whether it's free or written
+// (bounded queue from Dmitry Vyukov, with a single consumer)
+struct SinkSlot
+{
+	volatile long	sequence;
+	// Null if the message was formatted right away in text
+	const char		*format;
+	int				numArgs;
+	SinkArg			args[MaxArgs];
+	char			text[MaxText];
+};
+
+// The ring, written by any thread
+static SinkSlot *gSlots = 0;
+static long gMask = 0;
+static volatile long gEnqueuePos = 0;
+static volatile long gRunning = 0;
+static volatile long gDropped = 0;
+// Rate limit, errors counted in the current second
+static long gMaxPerSecond = 0;
+static volatile long gWindow = 0;
+static volatile long gWindowCount = 0;
+
+// Read by one thread at a time, under gDrainMutex
+static detail::_LuaMutex gDrainMutex;
+static long gDequeuePos = 0;
+static long gReportedDropped = 0;
+// Last message delivered, and how many times it was repeated since
+static std::string gLastMessage;
+static long gRepeats = 0;
+
+static detail::_LuaThread gDrainThread;
+
+//////////////////////////////////////////////////////////////////////////////
+// Parse the conversion specification after a '%': flags, width and precision end at lengthStart,
+// followed by the length modifier and the conversion character
+// returns the end of the specification, or null if it isn't supported
+static const char *parseSpec(const char *p, const char *&lengthStart, int &length, char &conv)
+{
+	while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0')
+		++p;
+	while (*p >= '0' && *p <= '9')
+		++p;
+	if (*p == '.')
+	{
+		++p;
+		while (*p >= '0' && *p <= '9')
+			++p;
+	}
+	lengthStart = p;
+	length = LengthNone;
+	if (*p == 'h')
+	{
+		length = LengthShort;
+		p += p[1] == 'h' ? 2 : 1;
+	}
+	else if (*p == 'l')
+	{
+		length = p[1] == 'l' ? LengthLongLong : LengthLong;
+		p += p[1] == 'l' ? 2 : 1;
+	}
+	else if (*p == 'j' || *p == 'q')
+	{
+		length = LengthLongLong;
+		++p;
+	}
+	else if (*p == 'z' || *p == 't')
+	{
+		length = LengthSize;
+		++p;
+	}
+	else if (*p == 'L')
+	{
+		length = LengthLongDouble;
+		++p;
+	}
+	conv = *p;
+	// No '*' width or precision, long doubles, wide characters or %n
+	if (!conv || !strchr("diuoxXcfFeEgGaAsp", conv) || length == LengthLongDouble)
+		return 0;
+	if ((conv == 'c' || conv == 's' || conv == 'p') && length != LengthNone)
+		return 0;
+	return p + 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Check that the arguments of a format can be copied
+static bool checkFormat(const char *format)
+{
+	int numArgs = 0;
+	for (const char *p = format; *p; )
+	{
+		if (*p++ != '%')
+			continue;
+		if (*p == '%')
+		{
+			++p;
+			continue;
+		}
+		const char *lengthStart;
+		int length;
+		char conv;
+		p = parseSpec(p, lengthStart, length, conv);
+		if (!p || ++numArgs > MaxArgs)
+			return false;
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Copy the arguments of a message into its slot, strings are truncated to fit in the slot text
+static void captureArgs(SinkSlot &slot, const char *format, va_list args)
+{
+	// The last character is an empty string for the ones that don't fit at all
+	slot.text[MaxText - 1] = 0;
+	size_t used = 0;
+	int arg = 0;
+	for (const char *p = format; *p; )
+	{
+		if (*p++ != '%')
+			continue;
+		if (*p == '%')
+		{
+			++p;
+			continue;
+		}
+		const char *lengthStart;
+		int length;
+		char conv;
+		p = parseSpec(p, lengthStart, length, conv);
+		SinkArg &a = slot.args[arg++];
+		switch (conv)
+		{
+		case 'd': case 'i': case 'c':
+			a.type = ArgInt;
+			if (length == LengthLong)
+				a.integer = va_arg(args, long);
+			else if (length == LengthLongLong)
+				a.integer = va_arg(args, long long);
+			else if (length == LengthSize)
+				a.integer = va_arg(args, ptrdiff_t);
+			else
+				a.integer = va_arg(args, int);
+			break;
+		case 'u': case 'o': case 'x': case 'X':
+			a.type = ArgUInt;
+			if (length == LengthLong)
+				a.uinteger = va_arg(args, unsigned long);
+			else if (length == LengthLongLong)
+				a.uinteger = va_arg(args, unsigned long long);
+			else if (length == LengthSize)
+				a.uinteger = va_arg(args, size_t);
+			else
+				a.uinteger = va_arg(args, unsigned int);
+			break;
+		case 's':
+		{
+			a.type = ArgString;
+			const char *s = va_arg(args, const char*);
+			if (!s)
+				s = "(null)";
+			size_t available = MaxText - 1 - used;
+			if (!available)
+			{
+				a.offset = MaxText - 1;
+				break;
+			}
+			size_t size = strlen(s);
+			if (size > available - 1)
+				size = available - 1;
+			memcpy(slot.text + used, s, size);
+			slot.text[used + size] = 0;
+			a.offset = used;
+			used += size + 1;
+			break;
+		}
+		case 'p':
+			a.type = ArgPointer;
+			a.pointer = va_arg(args, void*);
+			break;
+		default:
+			a.type = ArgDouble;
+			a.number = va_arg(args, double);
+			break;
+		}
+	}
+	slot.numArgs = arg;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+static void appendFormat(std::string &msg, const char *format, ...)
+{
+	char buf[512];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buf, 512, format, args);
+	va_end(args);
+	msg += buf;
+}
+//////////////////////////////////////////////////////////////////////////////
+// Format the message of a slot
+static void formatSlot(const SinkSlot &slot, std::string &msg)
+{
+	if (!slot.format)
+	{
+		msg = slot.text;
+		return;
+	}
+	msg.clear();
+	int arg = 0;
+	for (const char *p = slot.format; *p; )
+	{
+		if (*p != '%')
+		{
+			msg += *p++;
+			continue;
+		}
+		if (p[1] == '%')
+		{
+			msg += '%';
+			p += 2;
+			continue;
+		}
+		const char *lengthStart;
+		int length;
+		char conv;
+		const char *end = parseSpec(p + 1, lengthStart, length, conv);
+		// Same flags, width and precision, with the type of the copied argument
+		std::string spec(p, lengthStart);
+		const SinkArg &a = slot.args[arg++];
+		switch (a.type)
+		{
+		case ArgInt:
+			if (conv == 'c')
+				appendFormat(msg, (spec + conv).c_str(), (int)a.integer);
+			else
+				appendFormat(msg, (spec + "ll" + conv).c_str(), a.integer);
+			break;
+		case ArgUInt:
+			appendFormat(msg, (spec + "ll" + conv).c_str(), a.uinteger);
+			break;
+		case ArgDouble:
+			appendFormat(msg, (spec + conv).c_str(), a.number);
+			break;
+		case ArgString:
+			appendFormat(msg, (spec + conv).c_str(), slot.text + a.offset);
+			break;
+		case ArgPointer:
+			appendFormat(msg, (spec + conv).c_str(), a.pointer);
+			break;
+		}
+		p = end;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Deliver the number of repeats of the last message
+static void flushRepeats()
+{
+	if (!gRepeats)
+		return;
+	char buf[64];
+	sprintf(buf, "Previous error repeated %ld more times\n", gRepeats);
+	gRepeats = 0;
+	detail::_LuaOutputError(buf);
+}
+//////////////////////////////////////////////////////////////////////////////
+// Deliver a message, the repeats of the last one are only counted
+static void deliver(const std::string &msg)
+{
+	if (msg == gLastMessage)
+	{
+		gRepeats++;
+		return;
+	}
+	flushRepeats();
+	gLastMessage = msg;
+	detail::_LuaOutputError(msg.c_str());
+}
+//////////////////////////////////////////////////////////////////////////////
+// Deliver the queued messages, with gDrainMutex locked
+// returns the number of messages read from the ring
+static size_t drain()
+{
+	size_t count = 0;
+	std::string msg;
+	for (;;)
+	{
+		SinkSlot &slot = gSlots[gDequeuePos & gMask];
+		if ((long)((unsigned long)detail::_LuaAtomicLoad(&slot.sequence) - (unsigned long)(gDequeuePos + 1)) < 0)
+			break;
+		formatSlot(slot, msg);
+		// Free the slot for the next round of the ring
+		detail::_LuaAtomicStore(&slot.sequence, gDequeuePos + gMask + 1);
+		gDequeuePos++;
+		deliver(msg);
+		count++;
+	}
+	flushRepeats();
+	long dropped = detail::_LuaAtomicLoad(&gDropped);
+	if (dropped != gReportedDropped)
+	{
+		char buf[64];
+		sprintf(buf, "%ld errors dropped by the error sink\n", dropped - gReportedDropped);
+		gReportedDropped = dropped;
+		detail::_LuaOutputError(buf);
+	}
+	return count;
+}
+//////////////////////////////////////////////////////////////////////////////
+// The drain thread, delivers the messages until the sink is stopped
+static void drainThread(void *)
+{
+	while (detail::_LuaAtomicLoad(&gRunning))
+	{
+		size_t count;
+		{
+			detail::_LuaLock lock(gDrainMutex);
+			count = drain();
+		}
+		if (!count)
+			detail::_LuaSleepMS(2);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Start the sink, with a ring of capacity messages (rounded up to a power of 2) and a rate limit (0 for none)
+// returns success flag
+bool LuaStartErrorSink(size_t capacity, unsigned maxPerSecond)
+{
+	if (gRunning)
+		return false;
+	size_t size = 2;
+	while (size < capacity)
+		size *= 2;
+	gSlots = new SinkSlot[size];
+	for (size_t i = 0; i < size; ++i)
+		gSlots[i].sequence = (long)i;
+	gMask = (long)size - 1;
+	gEnqueuePos = 0;
+	gDequeuePos = 0;
+	gDropped = 0;
+	gReportedDropped = 0;
+	gMaxPerSecond = (long)maxPerSecond;
+	gWindow = 0;
+	gWindowCount = 0;
+	gLastMessage.clear();
+	gRepeats = 0;
+	detail::_LuaAtomicStore(&gRunning, 1);
+	if (!gDrainThread.start(drainThread, 0))
+	{
+		detail::_LuaAtomicStore(&gRunning, 0);
+		delete[] gSlots;
+		gSlots = 0;
+		detail::_LuaLogError("Error in LuaStartErrorSink() - couldn't start the drain thread\n");
+		return false;
+	}
+	return true;
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Deliver the queued messages and stop the sink, the errors are delivered synchronously again
+void LuaStopErrorSink()
+{
+	if (!gRunning)
+		return;
+	detail::_LuaAtomicStore(&gRunning, 0);
+	gDrainThread.join();
+	detail::_LuaLock lock(gDrainMutex);
+	drain();
+	delete[] gSlots;
+	gSlots = 0;
+	gLastMessage.clear();
+}
+bool LuaIsErrorSinkRunning()
+{
+	return detail::_LuaAtomicLoad(&gRunning) != 0;
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Deliver the queued messages on the calling thread
+void LuaFlushErrorSink()
+{
+	detail::_LuaLock lock(gDrainMutex);
+	if (gSlots)
+		drain();
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Number of errors dropped by the rate limit or because the ring was full, since the sink was started
+size_t LuaGetNumDroppedErrors()
+{
+	return (size_t)detail::_LuaAtomicLoad(&gDropped);
+}
+
+namespace detail {;
+
+////////////////////////////////////////////////////////////////////////////////////
+// Queue an error in the sink, the format must be a string literal (it's only read when the message is delivered)
+// returns false if the sink isn't running
+bool _LuaSinkError(const char *format, va_list args)
+{
+	if (!_LuaAtomicLoad(&gRunning))
+		return false;
+	if (gMaxPerSecond)
+	{
+		long second = (long)(_LuaGetTimeUS() / 1000000ULL);
+		long window = _LuaAtomicLoad(&gWindow);
+		if (window != second && _LuaAtomicCAS(&gWindow, window, second) == window)
+			_LuaAtomicStore(&gWindowCount, 0);
+		if (_LuaAtomicAdd(&gWindowCount, 1) >= gMaxPerSecond)
+		{
+			_LuaAtomicAdd(&gDropped, 1);
+			return true;
+		}
+	}
+	// Claim a slot
+	SinkSlot *slot;
+	long pos = _LuaAtomicLoad(&gEnqueuePos);
+	for (;;)
+	{
+		slot = &gSlots[pos & gMask];
+		long diff = (long)((unsigned long)_LuaAtomicLoad(&slot->sequence) - (unsigned long)pos);
+		if (!diff)
+		{
+			long prev = _LuaAtomicCAS(&gEnqueuePos, pos, pos + 1);
+			if (prev == pos)
+				break;
+			pos = prev;
+		}
+		else if (diff < 0)
+		{
+			// The ring is full
+			_LuaAtomicAdd(&gDropped, 1);
+			return true;
+		}
+		else
+			pos = _LuaAtomicLoad(&gEnqueuePos);
+	}
+	if (checkFormat(format))
+	{
+		slot->format = format;
+		captureArgs(*slot, format, args);
+	}
+	else
+	{
+		slot->format = 0;
+		vsnprintf(slot->text, MaxText, format, args);
+	}
+	// Publish it
+	_LuaAtomicStore(&slot->sequence, pos + 1);
+	return true;
+}
+
+} // detail
+} // LuaUtils
@@ -0,0 +1,54 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUAERRORSINK_H
+#define LUAERRORSINK_H
+
+#include "LuaBase.h"
+#include <stdarg.h>
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Asynchronous delivery of the errors logged by LuaUtils (opt-in)
+//
+// Without the sink, every error is formatted and given to the error callback (see LuaSetErrorCB) by the
+// thread that hit it, so a script failing in a loop slows down every call that fails. Once the sink is
+// started, logging an error only copies the format arguments into a lock-free ring shared by all the
+// threads, and a drain thread formats the messages and calls the error callback:
+//
+//		LuaStartErrorSink();
+//		...
+//		LuaStopErrorSink();		// delivers the last messages
+//
+// - Rate limiting: past maxPerSecond errors in a second, the errors are dropped (and counted)
+// - Coalescing: an error repeating the previous message is only counted, and a single
+//   "Previous error repeated N times" message is delivered for the series
+// - When the ring is full, the errors are dropped (and counted)
+// The error flag and code (see LuaGetErrorFlag and LuaGetErrorCode) are still set immediately.
+// The error callback is called on the drain thread, or on the thread calling LuaFlushErrorSink.
+// Start and stop the sink while no other thread uses LuaUtils.
+
+// Start the sink, with a ring of capacity messages (rounded up to a power of 2) and a rate limit (0 for none)
+// returns success flag
+bool LuaStartErrorSink(size_t capacity = 1024, unsigned maxPerSecond = 1000);
+// Deliver the queued messages and stop the sink, the errors are delivered synchronously again
+void LuaStopErrorSink();
+bool LuaIsErrorSinkRunning();
+// Deliver the queued messages on the calling thread
+void LuaFlushErrorSink();
+// Number of errors dropped by the rate limit or because the ring was full, since the sink was started
+size_t LuaGetNumDroppedErrors();
+
+namespace detail {;
+
+// Queue an error in the sink, the format must be a string literal (it's only read when the message is delivered)
+// returns false if the sink isn't running
+bool _LuaSinkError(const char *format, va_list args);
+
+} // detail
+} // LuaUtils
+
+#endif //LUAERRORSINK_H
@@ -0,0 +1,257 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaEventBus.h"
+#include "LuaLimits.h"
+
+namespace LuaUtils {;
+
+//////////////////////////////////////////////////////////////////////////////
+LuaEventBus::LuaEventBus(size_t capacity)
+:	mRing(capacity ? capacity : 1)
+,	mHead(0)
+,	mCount(0)
+,	mHandlersRef(-1)
+,	mFlushCount(0)
+,	mDispatched(0)
+,	mFlushing(false)
+{
+}
+//////////////////////////////////////////////////////////////////////////////
+LuaEventBus::~LuaEventBus()
+{
+	clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Call handler for each event of the given type, after the handlers already subscribed to it
+// returns success flag
+bool	LuaEventBus::subscribe(int type, const detail::_LuaFunctionBase &handler)
+{
+	if (!handler.isInit())
+		return false;
+	if (!mL)
+		mL = handler.mL;
+	else if (mL.get() != handler.mL.get())
+	{
+		detail::_LuaLogError("Error in LuaEventBus::subscribe() - %s - function belongs to another Lua state\n", handler.getName().c_str());
+		return false;
+	}
+	LUAUTILS_STACK_CHECK(mL.get(), handler.getName());
+	lua_State *L = mL.get();
+	if (mHandlersRef == -1)
+	{
+		lua_newtable(L);
+		mHandlersRef = detail::_LuaRef(L, "LuaEventBus");
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, mHandlersRef);
+	lua_rawgeti(L, -1, type);
+	if (!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -3, type);
+	}
+	handler.push();
+	lua_rawseti(L, -2, (int)detail::_LuaRawLen(L, -2) + 1);
+	lua_pop(L, 2);
+	return true;
+}
+//////////////////////////////////////////////////////////////////////////////
+// Remove a handler of an event type
+void	LuaEventBus::unsubscribe(int type, const detail::_LuaFunctionBase &handler)
+{
+	if (mHandlersRef == -1 || !handler.isInit() || mL.get() != handler.mL.get())
+		return;
+	LUAUTILS_STACK_CHECK(mL.get(), handler.getName());
+	lua_State *L = mL.get();
+	lua_rawgeti(L, LUA_REGISTRYINDEX, mHandlersRef);
+	int handlers = lua_gettop(L);
+	lua_rawgeti(L, handlers, type);
+	if (lua_istable(L, -1))
+	{
+		// Make a new list, since the old one may be iterated by a flush
+		int list = handlers + 1;
+		handler.push();
+		int removed = list + 1;
+		int size = (int)detail::_LuaRawLen(L, list);
+		lua_createtable(L, size, 0);
+		int newList = removed + 1;
+		int newSize = 0;
+		for (int i = 1; i <= size; ++i)
+		{
+			lua_rawgeti(L, list, i);
+			if (lua_rawequal(L, -1, removed))
+				lua_pop(L, 1);
+			else
+				lua_rawseti(L, newList, ++newSize);
+		}
+		if (newSize)
+			lua_rawseti(L, handlers, type);
+		else
+		{
+			lua_pushnil(L);
+			lua_rawseti(L, handlers, type);
+		}
+	}
+	lua_settop(L, handlers - 1);
+}
+//////////////////////////////////////////////////////////////////////////////
+// Remove all the handlers and the queued events
+void	LuaEventBus::clear()
+{
+	if (mL)
+		detail::_LuaUnref(mL.get(), mHandlersRef);
+	mHandlersRef = -1;
+	mHead = 0;
+	mCount = 0;
+	mStrings.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Dispatch the queued events (the ones posted by the handlers wait for the next flush)
+// returns the number of events dispatched
+size_t	LuaEventBus::flush()
+{
+	if (!mCount || mFlushing)
+		return 0;
+	if (mHandlersRef == -1)
+	{
+		// Nobody listens
+		size_t count = mCount;
+		mHead = 0;
+		mCount = 0;
+		mStrings.clear();
+		return count;
+	}
+	LUAUTILS_STACK_CHECK(mL.get(), "LuaEventBus");
+	lua_State *L = mL.get();
+	int top = lua_gettop(L);
+	mFlushing = true;
+	mFlushCount = mCount;
+	mDispatched = 0;
+	detail::_LuaLimitScope limits(L);
+	// (a handler can clear the bus)
+	while (mDispatched < mFlushCount && mCount && mHandlersRef != -1)
+	{
+		int status = detail::_LuaCPCall(L, dispatch, this);
+		if (!status)
+			break;
+		// Go on with the next event, unless a limit stopped the call
+		LuaErrorCode code = detail::_LuaGetErrorCode(L, status);
+		const char *error = lua_tostring(L, -1);
+		detail::_LuaLogError(code, "Error in LuaEventBus::flush() - %s\n", error ? error : "?");
+		lua_settop(L, top);
+		if (code != LuaErrorRuntime)
+			break;
+	}
+	mFlushing = false;
+	if (!mCount)
+		mHead = 0;
+	compactStrings();
+	return mDispatched;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Keep only the strings of the queued events
+// (handlers that post on each flush would otherwise grow the buffer forever)
+void	LuaEventBus::compactStrings()
+{
+	mCompacted.clear();
+	for (size_t i = 0; i < mCount; ++i)
+	{
+		Event &event = mRing[(mHead + i) % mRing.size()];
+		for (int arg = 0; arg < event.numArgs; ++arg)
+		{
+			if (event.args[arg].type != ArgString)
+				continue;
+			size_t offset = mCompacted.size();
+			mCompacted.append(mStrings, event.args[arg].string.offset, event.args[arg].string.size);
+			event.args[arg].string.offset = offset;
+		}
+	}
+	mStrings.swap(mCompacted);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Protected part of flush, the bus is the light user data argument
+int		LuaEventBus::dispatch(lua_State *L)
+{
+	LuaEventBus *bus = (LuaEventBus*)lua_touserdata(L, 1);
+	lua_rawgeti(L, LUA_REGISTRYINDEX, bus->mHandlersRef);
+	int handlers = lua_gettop(L);
+	while (bus->mDispatched < bus->mFlushCount && bus->mCount)
+	{
+		// Take it off the ring first, so that an error doesn't dispatch it again,
+		// and copy it, since the handlers can post new events in its place
+		Event event = bus->mRing[bus->mHead];
+		bus->mHead = (bus->mHead + 1) % bus->mRing.size();
+		bus->mCount--;
+		bus->mDispatched++;
+		lua_rawgeti(L, handlers, event.type);
+		if (!lua_istable(L, -1))
+		{
+			lua_pop(L, 1);
+			continue;
+		}
+		int list = lua_gettop(L);
+		int size = (int)detail::_LuaRawLen(L, list);
+		// Pushed once for all the handlers, a handler can clear the bus and its strings
+		for (int arg = 0; arg < event.numArgs; ++arg)
+			bus->pushArg(event.args[arg]);
+		for (int i = 1; i <= size && bus->mHandlersRef != -1; ++i)
+		{
+			lua_rawgeti(L, list, i);
+			for (int arg = 1; arg <= event.numArgs; ++arg)
+				lua_pushvalue(L, list + arg);
+			lua_call(L, event.numArgs, 0);
+		}
+		lua_settop(L, list - 1);
+	}
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Get a new event at the end of the ring, or null if it's full
+LuaEventBus::Event	*LuaEventBus::newEvent(int type, int numArgs)
+{
+	if (mCount == mRing.size())
+		return 0;
+	Event *event = &mRing[(mHead + mCount) % mRing.size()];
+	mCount++;
+	event->type = type;
+	event->numArgs = numArgs;
+	return event;
+}
+//////////////////////////////////////////////////////////////////////////////
+void	LuaEventBus::setArg(Arg &arg, const LuaStringView &value)
+{
+	arg.type = ArgString;
+	arg.string.offset = mStrings.size();
+	arg.string.size = value.size;
+	mStrings.append(value.data, value.size);
+}
+//////////////////////////////////////////////////////////////////////////////
+void	LuaEventBus::pushArg(const Arg &arg) const
+{
+	switch (arg.type)
+	{
+	case ArgInt:
+		lua_pushinteger(mL.get(), (lua_Integer)arg.integer);
+		break;
+	case ArgNumber:
+		lua_pushnumber(mL.get(), arg.number);
+		break;
+	case ArgBool:
+		lua_pushboolean(mL.get(), arg.boolean);
+		break;
+	case ArgString:
+		lua_pushlstring(mL.get(), mStrings.data() + arg.string.offset, arg.string.size);
+		break;
+	}
+}
+
+} // LuaUtils
@@ -0,0 +1,187 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUAEVENTBUS_H
+#define LUAEVENTBUS_H
+
+#include "LuaBase.h"
+#include "LuaFunction.h"
+#include <vector>
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Queue of events from C++ to Lua handler functions, dispatched in batches
+//
+// Handlers subscribe to an event type (any int), and C++ posts events with up to 4 arguments
+// (numbers, bools or strings) into a ring allocated once. flush() then calls the handlers of all
+// the queued events inside a single protected call, with plain lua_calls in between, so thousands of
+// events cost one protected call instead of one each:
+//
+//		bus.subscribe(EventDamage, onDamage);
+//		bus.post(EventDamage, amount, "fire");
+//		...
+//		bus.flush();
+//
+// Handlers get the arguments of the event. An error in a handler is logged, the other handlers of that
+// event are skipped and the flush goes on with the next event (a limit error, see LuaLimits, stops it).
+// All the handlers must belong to the same Lua state.
+class LuaEventBus : public detail::_LuaBase
+{
+public:
+	//////////////////////////////////////////////////////////////////////////////
+	// The ring holds up to capacity events between two flushes
+	LuaEventBus(size_t capacity = 1024);
+	//////////////////////////////////////////////////////////////////////////////
+	~LuaEventBus();
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Call handler for each event of the given type, after the handlers already subscribed to it
+	// returns success flag
+	bool	subscribe(int type, const detail::_LuaFunctionBase &handler);
+	//////////////////////////////////////////////////////////////////////////////
+	// Remove a handler of an event type
+	void	unsubscribe(int type, const detail::_LuaFunctionBase &handler);
+	//////////////////////////////////////////////////////////////////////////////
+	// Remove all the handlers and the queued events
+	void	clear();
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Queue an event with its arguments: integers (int, long, long long, size_t... signed or not),
+	// float, double, bool, const char *, std::string or LuaStringView
+	// returns false if the ring is full
+	bool	post(int type)
+	{
+		return newEvent(type, 0) != 0;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1>
+	bool	post(int type, const T1 &p1)
+	{
+		Event *event = newEvent(type, 1);
+		if (!event)
+			return false;
+		setArg(event->args[0], p1);
+		return true;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1, typename T2>
+	bool	post(int type, const T1 &p1, const T2 &p2)
+	{
+		Event *event = newEvent(type, 2);
+		if (!event)
+			return false;
+		setArg(event->args[0], p1);
+		setArg(event->args[1], p2);
+		return true;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1, typename T2, typename T3>
+	bool	post(int type, const T1 &p1, const T2 &p2, const T3 &p3)
+	{
+		Event *event = newEvent(type, 3);
+		if (!event)
+			return false;
+		setArg(event->args[0], p1);
+		setArg(event->args[1], p2);
+		setArg(event->args[2], p3);
+		return true;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1, typename T2, typename T3, typename T4>
+	bool	post(int type, const T1 &p1, const T2 &p2, const T3 &p3, const T4 &p4)
+	{
+		Event *event = newEvent(type, 4);
+		if (!event)
+			return false;
+		setArg(event->args[0], p1);
+		setArg(event->args[1], p2);
+		setArg(event->args[2], p3);
+		setArg(event->args[3], p4);
+		return true;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Dispatch the queued events (the ones posted by the handlers wait for the next flush)
+	// returns the number of events dispatched
+	size_t	flush();
+	//////////////////////////////////////////////////////////////////////////////
+	size_t	getNumQueued() const { return mCount; }
+	//////////////////////////////////////////////////////////////////////////////
+	size_t	getCapacity() const { return mRing.size(); }
+	//////////////////////////////////////////////////////////////////////////////
+	// Bytes held for the string arguments of the queued events
+	size_t	getStringSize() const { return mStrings.size(); }
+
+private:
+	// Non copyable
+	LuaEventBus(const LuaEventBus &other);
+	LuaEventBus &operator=(const LuaEventBus &other);
+
+	//////////////////////////////////////////////////////////////////////////////
+	enum ArgType { ArgInt, ArgNumber, ArgBool, ArgString };
+	struct Arg
+	{
+		ArgType	type;
+		union
+		{
+			long long	integer;
+			double		number;
+			bool	boolean;
+			// Offset and size in the string buffer
+			struct { size_t offset, size; } string;
+		};
+	};
+	struct Event
+	{
+		int		type;
+		int		numArgs;
+		Arg		args[4];
+	};
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Get a new event at the end of the ring, or null if it's full
+	Event	*newEvent(int type, int numArgs);
+	//////////////////////////////////////////////////////////////////////////////
+	void	setArg(Arg &arg, int value)						{ arg.type = ArgInt; arg.integer = value; }
+	void	setArg(Arg &arg, unsigned int value)			{ arg.type = ArgInt; arg.integer = value; }
+	void	setArg(Arg &arg, long value)					{ arg.type = ArgInt; arg.integer = value; }
+	void	setArg(Arg &arg, unsigned long value)			{ arg.type = ArgInt; arg.integer = (long long)value; }
+	void	setArg(Arg &arg, long long value)				{ arg.type = ArgInt; arg.integer = value; }
+	void	setArg(Arg &arg, unsigned long long value)		{ arg.type = ArgInt; arg.integer = (long long)value; }
+	void	setArg(Arg &arg, float value)					{ arg.type = ArgNumber; arg.number = value; }
+	void	setArg(Arg &arg, double value)					{ arg.type = ArgNumber; arg.number = value; }
+	void	setArg(Arg &arg, bool value)					{ arg.type = ArgBool; arg.boolean = value; }
+	void	setArg(Arg &arg, const char *value)				{ setArg(arg, LuaStringView(value)); }
+	void	setArg(Arg &arg, const std::string &value)		{ setArg(arg, LuaStringView(value)); }
+	void	setArg(Arg &arg, const LuaStringView &value);
+	//////////////////////////////////////////////////////////////////////////////
+	void	pushArg(const Arg &arg) const;
+	//////////////////////////////////////////////////////////////////////////////
+	// Protected part of flush, the bus is the light user data argument
+	static int	dispatch(lua_State *L);
+	//////////////////////////////////////////////////////////////////////////////
+	// Keep only the strings of the queued events
+	void	compactStrings();
+
+	//////////////////////////////////////////////////////////////////////////////
+	std::vector<Event>	mRing;
+	size_t				mHead;
+	size_t				mCount;
+	// Characters of the string arguments of the queued events, compacted after each flush
+	std::string			mStrings;
+	// Spare buffer of the compaction, kept to reuse its memory
+	std::string			mCompacted;
+	// Handler lists by event type
+	int					mHandlersRef;
+	// Number of events to dispatch in the current flush, and how many were
+	size_t				mFlushCount;
+	size_t				mDispatched;
+	bool				mFlushing;
+};
+
+} // LuaUtils
+
+#endif //LUAEVENTBUS_H
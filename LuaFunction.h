@@ -7,11 +7,55 @@
 #define LUAFUNCTION_H
 
 #include "LuaBase.h"
+#include "LuaTracer.h"
 
 namespace LuaUtils {;
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Call policies, given as the second template parameter of LuaFunction
+// They call the function with args arguments (already pushed on top of it),
+// and leave exactly results values on the stack (nils if the call failed)
+// returns false if the call failed
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Protected call with lua_pcall, errors are logged (this is the default)
+struct LuaCallProtected
+{
+	static bool call(lua_State *L, int args, int results, const std::string &name);
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Protected call with a stack traceback added to the logged error messages
+// (slower, since the error handler is pushed for each call)
+struct LuaCallTraceback
+{
+	static bool call(lua_State *L, int args, int results, const std::string &name);
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Unprotected call with lua_call, no setjmp and no error handling for each call
+// Errors jump to the enclosing protected frame, so this must only be used from Lua C functions,
+// or from a batch of calls run with LuaState::runProtected
+// WARNING: if there's no enclosing protected frame, an error will terminate your program
+struct LuaCallUnprotected
+{
+	static bool call(lua_State *L, int args, int results, const std::string &name)
+	{
+		lua_call(L, args, results);
+		return true;
+	}
+};
+
 namespace detail {;
 
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// The stack of the calls made with a call policy is checked by LUAUTILS_STACK_CHECK
+// (not for unprotected calls: an error leaves the stack as is, and LuaJIT unwinds through the check)
+template <typename CallPolicy>
+struct _LuaCheckCallStack { enum { value = 1 }; };
+template <>
+struct _LuaCheckCallStack<LuaCallUnprotected> { enum { value = 0 }; };
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Internal LuaFunction base wrapper class
 class _LuaFunctionBase : public _LuaBase
@@ -20,7 +64,7 @@ public:
 	//////////////////////////////////////////////////////////////////////////////
 	bool isInit() const
 	{
-		return (mRef != -1);
+		return (mRef != -1 || mStackIdx != 0);
 	}
 	//////////////////////////////////////////////////////////////////////////////
 	const std::string &getName() const
@@ -32,12 +76,20 @@ public:
 	friend class LuaUtils::LuaState;
 	friend class LuaUtils::LuaStateCFunc;
 	friend class LuaUtils::LuaTable;
+	friend class LuaUtils::LuaCoroutine;
+	friend class LuaUtils::LuaScheduler;
+	friend class LuaUtils::LuaAsyncBridge;
+	friend class LuaUtils::LuaEventBus;
 	friend class LuaUtils::detail::_LuaBase;
+	friend class LuaUtils::detail::_LuaWeakRef;
+	template <typename Ret, typename CallPolicy>
+	friend class LuaUtils::LuaMemoFunction;
 
 protected:
 	//////////////////////////////////////////////////////////////////////////////
 	_LuaFunctionBase()
 	:	mRef(-1)
+	,	mStackIdx(0)
 	{
 	}
 	//////////////////////////////////////////////////////////////////////////////
@@ -47,13 +99,14 @@ protected:
 	}
 	//////////////////////////////////////////////////////////////////////////////
 	_LuaFunctionBase(const _LuaFunctionBase &other)
+	:	mRef(-1)
+	,	mStackIdx(0)
 	{
 		mL = other.mL;
-		// copy the registry reference
-		if (mL && other.mRef != -1)
+		// copy the registry reference (a stack index gets one, so the copy can outlive the C function)
+		if (mL && other.push())
 		{
-			lua_rawgeti(mL.get(), LUA_REGISTRYINDEX, other.mRef);
-			mRef = luaL_ref(mL.get(), LUA_REGISTRYINDEX);
+			mRef = _LuaRef(mL.get(), other.mName);
 			mName = other.mName;
 		}
 	}
@@ -62,11 +115,10 @@ protected:
 	{
 		unref();
 		mL = other.mL;
-		// copy the registry reference
-		if (mL && other.mRef != -1)
+		// copy the registry reference (a stack index gets one, so the copy can outlive the C function)
+		if (mL && other.push())
 		{
-			lua_rawgeti(mL.get(), LUA_REGISTRYINDEX, other.mRef);
-			mRef = luaL_ref(mL.get(), LUA_REGISTRYINDEX);
+			mRef = _LuaRef(mL.get(), other.mName);
 			mName = other.mName;
 		}
 		return *this;
@@ -75,8 +127,9 @@ protected:
 	void	unref()
 	{
 		// Delete the reference from registry
-		luaL_unref(mL.get(), LUA_REGISTRYINDEX, mRef);
+		_LuaUnref(mL.get(), mRef);
 		mRef = -1;
+		mStackIdx = 0;
 		mName.clear();
 	}
 	//////////////////////////////////////////////////////////////////////////////
@@ -87,21 +140,23 @@ protected:
 			lua_rawgeti(mL.get(), LUA_REGISTRYINDEX, mRef);
 			return true;
 		}
+		if (mStackIdx)
+		{
+			lua_pushvalue(mL.get(), mStackIdx);
+			return true;
+		}
 		return false;
 	}
 
 	//////////////////////////////////////////////////////////////////////////////
-	// Call the function
+	// Call the function with the given call policy
 	// This assumes that the function and its args have already been pushed
-	void	call(int args = 0, int results = 0)
+	template <typename CallPolicy>
+	bool	call(int args = 0, int results = 0)
 	{
-		// this removes function and arguments from stack after calling the function, returns 1 on error
-		if (lua_pcall(mL.get(), args, results, 0))
-		{
-			std::string error;
-			luaPopValue(error);
-			detail::_LuaLogError("Error in LuaFunction::call() - %s - %s\n", mName.c_str(), error.c_str());
-		}
+		LUAUTILS_TRACE_SCOPE(mName.c_str(), "call");
+		// this removes function and arguments from stack after calling the function
+		return CallPolicy::call(mL.get(), args, results, mName);
 	}
 
 	//////////////////////////////////////////////////////////////////////////////
@@ -112,7 +167,17 @@ protected:
 		mL = vm;
 		lua_pushvalue(mL.get(), arg);
 		// Store it in registry for later use
-		mRef = luaL_ref(mL.get(), LUA_REGISTRYINDEX);
+		mRef = _LuaRef(mL.get(), name);
+		mName = name;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Refer to the value at an absolute stack index, without a registry reference, see LuaStateCFunc::getStackArg
+	void	initFromStackIndex(luaStatePtr vm, const std::string &name, int idx)
+	{
+		unref();
+		mL = vm;
+		mStackIdx = idx;
 		mName = name;
 	}
 
@@ -129,13 +194,15 @@ protected:
 			return false;
 		}
 		// Store it in registry for later use
-		mRef = luaL_ref(mL.get(), LUA_REGISTRYINDEX);
+		mRef = _LuaRef(mL.get(), name);
 		mName = name;
 		return true;
 	}
 
 	//////////////////////////////////////////////////////////////////////////////
 	int			mRef;
+	// Absolute stack index of the function when it has no registry reference, 0 for none
+	int			mStackIdx;
 	std::string	mName;
 };
 
@@ -143,7 +210,8 @@ protected:
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 // The LuaFunction wrapper class with one return value
-template <typename Ret>
+// The call policy (LuaCallProtected by default) decides how the function gets called
+template <typename Ret, typename CallPolicy>
 class LuaFunction : public detail::_LuaFunctionBase
 {
 public:
@@ -155,10 +223,11 @@ public:
 	//////////////////////////////////////////////////////////////////////////////
 	Ret operator()()
 	{
-		Ret res;
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mName);
+		Ret res = Ret();
 		if (push())
 		{
-			call(0, 1);
+			call<CallPolicy>(0, 1);
 			luaPopValue(res);
 		}
 		return res;
@@ -167,11 +236,12 @@ public:
 	template <typename T1>
 	Ret operator()(const T1 &p1)
 	{
-		Ret res;
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mName);
+		Ret res = Ret();
 		if (push())
 		{
 			luaPushValue(p1);
-			call(1, 1);
+			call<CallPolicy>(1, 1);
 			luaPopValue(res);
 		}
 		return res;
@@ -180,12 +250,13 @@ public:
 	template <typename T1, typename T2>
 	Ret operator()(const T1 &p1, const T2 &p2)
 	{
-		Ret res;
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mName);
+		Ret res = Ret();
 		if (push())
 		{
 			luaPushValue(p1);
 			luaPushValue(p2);
-			call(2, 1);
+			call<CallPolicy>(2, 1);
 			luaPopValue(res);
 		}
 		return res;
@@ -194,13 +265,14 @@ public:
 	template <typename T1, typename T2, typename T3>
 	Ret operator()(const T1 &p1, const T2 &p2, const T3 &p3)
 	{
-		Ret res;
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mName);
+		Ret res = Ret();
 		if (push())
 		{
 			luaPushValue(p1);
 			luaPushValue(p2);
 			luaPushValue(p3);
-			call(3, 1);
+			call<CallPolicy>(3, 1);
 			luaPopValue(res);
 		}
 		return res;
@@ -209,14 +281,15 @@ public:
 	template <typename T1, typename T2, typename T3, typename T4>
 	Ret operator()(const T1 &p1, const T2 &p2, const T3 &p3, const T4 &p4)
 	{
-		Ret res;
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mName);
+		Ret res = Ret();
 		if (push())
 		{
 			luaPushValue(p1);
 			luaPushValue(p2);
 			luaPushValue(p3);
 			luaPushValue(p4);
-			call(3, 1);
+			call<CallPolicy>(4, 1);
 			luaPopValue(res);
 		}
 		return res;
@@ -225,8 +298,8 @@ public:
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Template instantiation of LuaFunction for void return type
-template <>
-class LuaFunction<void> : public detail::_LuaFunctionBase
+template <typename CallPolicy>
+class LuaFunction<void, CallPolicy> : public detail::_LuaFunctionBase
 {
 public:
 	//////////////////////////////////////////////////////////////////////////////
@@ -237,53 +310,58 @@ public:
 	//////////////////////////////////////////////////////////////////////////////
 	void operator()()
 	{
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mName);
 		if (push())
-			call(0);
+			call<CallPolicy>(0);
 	}
 	//////////////////////////////////////////////////////////////////////////////
 	template <typename T1>
 	void operator()(const T1 &p1)
 	{
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mName);
 		if (push())
 		{
 			luaPushValue(p1);
-			call(1);
+			call<CallPolicy>(1);
 		}
 	}
 	//////////////////////////////////////////////////////////////////////////////
 	template <typename T1, typename T2>
 	void operator()(const T1 &p1, const T2 &p2)
 	{
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mName);
 		if (push())
 		{
 			luaPushValue(p1);
 			luaPushValue(p2);
-			call(2);
+			call<CallPolicy>(2);
 		}
 	}
 	//////////////////////////////////////////////////////////////////////////////
 	template <typename T1, typename T2, typename T3>
 	void operator()(const T1 &p1, const T2 &p2, const T3 &p3)
 	{
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mName);
 		if (push())
 		{
 			luaPushValue(p1);
 			luaPushValue(p2);
 			luaPushValue(p3);
-			call(3);
+			call<CallPolicy>(3);
 		}
 	}
 	//////////////////////////////////////////////////////////////////////////////
 	template <typename T1, typename T2, typename T3, typename T4>
 	void operator()(const T1 &p1, const T2 &p2, const T3 &p3, const T4 &p4)
 	{
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mName);
 		if (push())
 		{
 			luaPushValue(p1);
 			luaPushValue(p2);
 			luaPushValue(p3);
 			luaPushValue(p4);
-			call(3);
+			call<CallPolicy>(4);
 		}
 	}
 };
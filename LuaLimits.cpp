@@ -0,0 +1,200 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaLimits.h"
+#include "LuaThreads.h"
+
+// Maximum number of instructions between two checks of the limits
+static const int gCheckInterval = 1000;
+
+namespace LuaUtils {;
+namespace detail {;
+
+//////////////////////////////////////////////////////////////////////////////
+// Limits of a Lua state, and what the current call used so far
+// It is the user data of the allocator of the state, which wraps the previous allocator
+struct _LuaLimitState
+{
+	LuaLimits			limits;
+	lua_Alloc			alloc;
+	void				*allocUD;
+	// Bytes used by the state
+	size_t				memory;
+	// Nesting level of the limit scopes, the limits are only enforced inside of them
+	int					depth;
+	unsigned long		instructions;
+	int					hookCount;
+	// Time after which the call is aborted, 0 for none
+	unsigned long long	deadline;
+	// Set by requestAbort, possibly from another thread
+	volatile long		abortRequested;
+	// Limit that made the current call fail
+	LuaErrorCode		reason;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Allocator of the states with limits
+static void *limitAlloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	_LuaLimitState *state = (_LuaLimitState*)ud;
+	// From Lua 5.2 on, osize is the type of the object when ptr is null
+	size_t oldSize = ptr ? osize : 0;
+	if (nsize > oldSize && state->depth && state->limits.maxMemory
+		&& state->memory + (nsize - oldSize) > state->limits.maxMemory)
+	{
+		state->reason = LuaErrorMemoryLimit;
+		return 0;
+	}
+	void *res = state->alloc(state->allocUD, ptr, osize, nsize);
+	if (res || nsize == 0)
+		state->memory = state->memory - oldSize + nsize;
+	return res;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Get the limits of a state, or null if it has none
+static _LuaLimitState *getLimitState(lua_State *L)
+{
+	void *ud;
+	if (lua_getallocf(L, &ud) != limitAlloc)
+		return 0;
+	return (_LuaLimitState*)ud;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Count hook checking the limits
+static void limitHook(lua_State *L, lua_Debug *ar)
+{
+	_LuaLimitState *state = getLimitState(L);
+	// Coroutines keep the hook of the thread that created them, even outside of limited calls
+	if (!state || !state->depth)
+		return;
+	state->instructions += state->hookCount;
+	if (_LuaAtomicLoad(&state->abortRequested))
+	{
+		state->reason = LuaErrorAborted;
+		luaL_error(L, "call aborted");
+	}
+	else if (state->limits.maxInstructions && state->instructions >= state->limits.maxInstructions)
+	{
+		state->reason = LuaErrorInstructionLimit;
+		luaL_error(L, "instruction limit exceeded");
+	}
+	else if (state->deadline && _LuaGetTimeUS() >= state->deadline)
+	{
+		state->reason = LuaErrorTimeLimit;
+		luaL_error(L, "time limit exceeded (%d ms)", (int)state->limits.maxTimeMS);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Set the limits of a state, returns success flag
+bool _LuaSetLimits(lua_State *L, const LuaLimits &limits)
+{
+	_LuaLimitState *state = getLimitState(L);
+	if (!state)
+	{
+		state = new _LuaLimitState;
+		state->alloc = lua_getallocf(L, &state->allocUD);
+		state->memory = (size_t)lua_gc(L, LUA_GCCOUNT, 0) * 1024 + (size_t)lua_gc(L, LUA_GCCOUNTB, 0);
+		state->depth = 0;
+		state->instructions = 0;
+		state->hookCount = gCheckInterval;
+		state->deadline = 0;
+		_LuaAtomicStore(&state->abortRequested, 0);
+		state->reason = LuaErrorNone;
+		lua_setallocf(L, limitAlloc, state);
+#ifdef LUAJIT_VERSION
+		// Compiled code doesn't call hooks
+		luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_OFF);
+#endif
+	}
+	state->limits = limits;
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Get the limits of a state (no limits if they were never set)
+LuaLimits _LuaGetLimits(lua_State *L)
+{
+	_LuaLimitState *state = getLimitState(L);
+	return state ? state->limits : LuaLimits();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Abort the limited call running in the state, returns false if the state has no limits
+// This can be called from another thread
+bool _LuaRequestAbort(lua_State *L)
+{
+	_LuaLimitState *state = getLimitState(L);
+	if (!state)
+		return false;
+	_LuaAtomicStore(&state->abortRequested, 1);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Get the error code of a failed call or resume, given its status (LUA_ERRRUN, LUA_ERRMEM...)
+LuaErrorCode _LuaGetErrorCode(lua_State *L, int status)
+{
+	_LuaLimitState *state = getLimitState(L);
+	if (state && state->reason != LuaErrorNone)
+		return state->reason;
+	switch (status)
+	{
+	case LUA_ERRSYNTAX:	return LuaErrorSyntax;
+	case LUA_ERRMEM:	return LuaErrorMemory;
+	case LUA_ERRFILE:	return LuaErrorFile;
+	default:			return LuaErrorRuntime;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Close function of the lua_State shared pointers, also frees the limits
+void _LuaCloseState(lua_State *L)
+{
+	// The allocator is still used by lua_close
+	_LuaLimitState *state = getLimitState(L);
+	lua_close(L);
+	delete state;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+_LuaLimitScope::_LuaLimitScope(lua_State *L)
+:	mL(L)
+,	mState(getLimitState(L))
+,	mHook(0)
+,	mHookMask(0)
+,	mHookCount(0)
+{
+	if (!mState || mState->depth++)
+		return;
+	const LuaLimits &limits = mState->limits;
+	mState->instructions = 0;
+	_LuaAtomicStore(&mState->abortRequested, 0);
+	mState->reason = LuaErrorNone;
+	mState->deadline = limits.maxTimeMS ? _LuaGetTimeUS() + (unsigned long long)limits.maxTimeMS * 1000ULL : 0;
+	mState->hookCount = limits.maxInstructions && limits.maxInstructions < (unsigned long)gCheckInterval ?
+		(int)limits.maxInstructions : gCheckInterval;
+	// Keep the hook that was there, ex: a debugger
+	mHook = lua_gethook(L);
+	mHookMask = lua_gethookmask(L);
+	mHookCount = lua_gethookcount(L);
+	lua_sethook(L, limitHook, LUA_MASKCOUNT, mState->hookCount);
+}
+//////////////////////////////////////////////////////////////////////////////
+_LuaLimitScope::~_LuaLimitScope()
+{
+	if (!mState || --mState->depth)
+		return;
+	lua_sethook(mL, mHook, mHookMask, mHookCount);
+	// Collect the garbage of the failed call now, otherwise the next calls would be over budget too
+	if (mState->reason == LuaErrorMemoryLimit)
+		lua_gc(mL, LUA_GCCOLLECT, 0);
+	mState->reason = LuaErrorNone;
+}
+
+} // detail
+} // LuaUtils
@@ -0,0 +1,86 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUALIMITS_H
+#define LUALIMITS_H
+
+#include "LuaBase.h"
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Budgets for the calls into a Lua state, see LuaState::setLimits (0 means no limit)
+//
+// They apply to each protected call made from C++: LuaFunction calls (with the LuaCallProtected and
+// LuaCallTraceback policies), LuaState::loadFile, loadString and runProtected, and to each resume of a
+// LuaCoroutine, LuaScheduler task or LuaAsyncBridge task. Nested calls made from Lua C functions share
+// the budget of the outer call.
+// A call that goes over budget is aborted with a Lua error, which is logged with its own LuaErrorCode
+// (LuaErrorInstructionLimit, LuaErrorTimeLimit or LuaErrorMemoryLimit), and the state stays usable.
+//
+// Instructions and time are checked from a count hook, so time spent inside a single C function isn't
+// interrupted. On LuaJIT, setting limits turns off the JIT compiler, since compiled code doesn't call hooks.
+struct LuaLimits
+{
+	LuaLimits()
+	:	maxInstructions(0)
+	,	maxTimeMS(0)
+	,	maxMemory(0)
+	{
+	}
+
+	// Maximum number of VM instructions per call (checked every 1000 instructions at most)
+	unsigned long	maxInstructions;
+	// Maximum wall clock time per call, in milliseconds
+	unsigned int	maxTimeMS;
+	// Maximum memory used by the whole state while a call is running, in bytes
+	// (outside of calls the state can still grow, so that LuaUtils functions never fail because of it)
+	size_t			maxMemory;
+};
+
+namespace detail {;
+
+struct _LuaLimitState;
+
+// Set the limits of a state, returns success flag
+bool _LuaSetLimits(lua_State *L, const LuaLimits &limits);
+// Get the limits of a state (no limits if they were never set)
+LuaLimits _LuaGetLimits(lua_State *L);
+// Abort the limited call running in the state, returns false if the state has no limits
+// This can be called from another thread
+bool _LuaRequestAbort(lua_State *L);
+
+// Get the error code of a failed call or resume, given its status (LUA_ERRRUN, LUA_ERRMEM...)
+LuaErrorCode _LuaGetErrorCode(lua_State *L, int status);
+
+// Close function of the lua_State shared pointers, also frees the limits
+void _LuaCloseState(lua_State *L);
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Enforces the limits of a state (if it has any) during its lifetime
+// Only the outermost scope of a state resets the budget, the error code must be read before it ends.
+class _LuaLimitScope
+{
+public:
+	_LuaLimitScope(lua_State *L);
+	~_LuaLimitScope();
+
+private:
+	// Non copyable
+	_LuaLimitScope(const _LuaLimitScope &other);
+	_LuaLimitScope &operator=(const _LuaLimitScope &other);
+
+	lua_State		*mL;
+	_LuaLimitState	*mState;
+	// Hook that was set before the scope
+	lua_Hook		mHook;
+	int				mHookMask;
+	int				mHookCount;
+};
+
+} // detail
+} // LuaUtils
+
+#endif //LUALIMITS_H
@@ -0,0 +1,73 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaMemoFunction.h"
+
+namespace LuaUtils {;
+
+//////////////////////////////////////////////////////////////////////////////
+// Append a value to a key, tagged with its type so that 1, "1" and true differ
+static void appendBytes(std::string &bytes, char type, const void *data, size_t size)
+{
+	bytes += type;
+	bytes.append((const char*)data, size);
+}
+
+namespace detail {;
+
+////////////////////////////////////////////////////////////////////////////////////
+// Build the key of the count values from stack index first
+// returns false if one of them isn't a nil, boolean, number or string
+bool _LuaMakeMemoKey(lua_State *L, int first, int count, _LuaMemoKey &key)
+{
+	key.bytes.clear();
+	for (int idx = first; idx < first + count; ++idx)
+	{
+		switch (lua_type(L, idx))
+		{
+		case LUA_TNIL:
+			key.bytes += 'n';
+			break;
+		case LUA_TBOOLEAN:
+			key.bytes += lua_toboolean(L, idx) ? 't' : 'f';
+			break;
+		case LUA_TNUMBER:
+		{
+#if LUA_VERSION_NUM >= 503
+			// Integers and floats are different values for the function (math.type, string.format)
+			if (lua_isinteger(L, idx))
+			{
+				lua_Integer n = lua_tointeger(L, idx);
+				appendBytes(key.bytes, 'i', &n, sizeof(n));
+				break;
+			}
+#endif
+			lua_Number n = lua_tonumber(L, idx);
+			appendBytes(key.bytes, 'd', &n, sizeof(n));
+			break;
+		}
+		case LUA_TSTRING:
+		{
+			// The size first, so that ("ab", "c") and ("a", "bc") differ
+			size_t size;
+			const char *s = lua_tolstring(L, idx, &size);
+			appendBytes(key.bytes, 's', &size, sizeof(size));
+			key.bytes.append(s, size);
+			break;
+		}
+		default:
+			return false;
+		}
+	}
+	// FNV-1a
+	size_t hash = 2166136261u;
+	for (size_t i = 0; i < key.bytes.size(); ++i)
+		hash = (hash ^ (unsigned char)key.bytes[i]) * 16777619u;
+	key.hash = hash;
+	return true;
+}
+
+} // detail
+} // LuaUtils
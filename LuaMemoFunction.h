@@ -0,0 +1,357 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUAMEMOFUNCTION_H
+#define LUAMEMOFUNCTION_H
+
+#include "LuaFunction.h"
+#include <list>
+#include <map>
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Statistics of a LuaMemoFunction
+struct LuaMemoStats
+{
+	LuaMemoStats()
+	:	hits(0)
+	,	misses(0)
+	,	evictions(0)
+	,	uncached(0)
+	{
+	}
+
+	// Calls answered from the cache, without calling the function
+	size_t	hits;
+	// Calls that ran the function, and cached the result if the call succeeded
+	size_t	misses;
+	// Results dropped to make room for new ones
+	size_t	evictions;
+	// Calls that ran the function because an argument can't be a key (see LuaMemoFunction)
+	size_t	uncached;
+};
+
+namespace detail {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Key of the results of a LuaMemoFunction: the bytes of the argument values, and their hash
+struct _LuaMemoKey
+{
+	size_t		hash;
+	std::string	bytes;
+
+	bool operator<(const _LuaMemoKey &other) const
+	{
+		if (hash != other.hash)
+			return hash < other.hash;
+		return bytes < other.bytes;
+	}
+};
+
+// Build the key of the count values from stack index first
+// returns false if one of them isn't a nil, boolean, number or string
+bool _LuaMakeMemoKey(lua_State *L, int first, int count, _LuaMemoKey &key);
+
+} // detail
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// A LuaFunction that remembers its results, for the pure functions called with the same arguments
+// again and again (price lookups, rule evaluation...)
+//
+//		LuaFunction<float> getPrice;
+//		state.getValue("GetPrice", getPrice);
+//		LuaMemoFunction<float> price(getPrice, 1024);	// keeps the last 1024 results
+//		float p = price("sword", 3);			// calls GetPrice once, then answers from the cache
+//		...
+//		price.invalidate();						// the price tables were reloaded
+//
+// The arguments are pushed like for a LuaFunction call, then their values make the key of the cache:
+// a hit pops them and returns the result without calling the function. The cache keeps the most
+// recently used results, up to its capacity.
+// - Only nil, boolean, number and string arguments make keys, a call with another argument (a table,
+//   a function...) always runs the function, since its content can change without the cache knowing
+// - The results of failed calls aren't cached
+// - Cached results are shared: a LuaTable result is the same table on each hit
+// - The function must be pure: the cache can't see the globals or upvalues it reads, so invalidate it
+//   when they change
+// Copies start with an empty cache.
+template <typename Ret, typename CallPolicy = LuaCallProtected>
+class LuaMemoFunction : public detail::_LuaBase
+{
+public:
+	//////////////////////////////////////////////////////////////////////////////
+	LuaMemoFunction(size_t capacity = 256)
+	:	mCapacity(capacity)
+	{
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	LuaMemoFunction(const LuaFunction<Ret, CallPolicy> &func, size_t capacity = 256)
+	:	mCapacity(capacity)
+	{
+		setFunction(func);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	LuaMemoFunction(const LuaMemoFunction &other)
+	:	mCapacity(other.mCapacity)
+	{
+		setFunction(other.mFunc);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	LuaMemoFunction &operator=(const LuaMemoFunction &other)
+	{
+		if (this != &other)
+		{
+			mCapacity = other.mCapacity;
+			setFunction(other.mFunc);
+		}
+		return *this;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Set the function, which drops the cached results
+	void	setFunction(const LuaFunction<Ret, CallPolicy> &func)
+	{
+		mFunc = func;
+		mL = mFunc.mL;
+		invalidate();
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	const LuaFunction<Ret, CallPolicy>	&getFunction() const { return mFunc; }
+	//////////////////////////////////////////////////////////////////////////////
+	bool	isInit() const { return mFunc.isInit(); }
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Drop all the cached results
+	void	invalidate()
+	{
+		mResults.clear();
+		mKeys.clear();
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Drop the result cached for these arguments
+	// returns false if there was none
+	template <typename T1>
+	bool	invalidate(const T1 &p1)
+	{
+		LUAUTILS_STACK_CHECK(mL.get(), mFunc.mName);
+		if (!mL)
+			return false;
+		luaPushValue(p1);
+		return invalidateArgs(1);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1, typename T2>
+	bool	invalidate(const T1 &p1, const T2 &p2)
+	{
+		LUAUTILS_STACK_CHECK(mL.get(), mFunc.mName);
+		if (!mL)
+			return false;
+		luaPushValue(p1);
+		luaPushValue(p2);
+		return invalidateArgs(2);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1, typename T2, typename T3>
+	bool	invalidate(const T1 &p1, const T2 &p2, const T3 &p3)
+	{
+		LUAUTILS_STACK_CHECK(mL.get(), mFunc.mName);
+		if (!mL)
+			return false;
+		luaPushValue(p1);
+		luaPushValue(p2);
+		luaPushValue(p3);
+		return invalidateArgs(3);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1, typename T2, typename T3, typename T4>
+	bool	invalidate(const T1 &p1, const T2 &p2, const T3 &p3, const T4 &p4)
+	{
+		LUAUTILS_STACK_CHECK(mL.get(), mFunc.mName);
+		if (!mL)
+			return false;
+		luaPushValue(p1);
+		luaPushValue(p2);
+		luaPushValue(p3);
+		luaPushValue(p4);
+		return invalidateArgs(4);
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Maximum number of cached results, the least recently used ones are dropped first
+	// 0 turns the cache off
+	void	setCapacity(size_t capacity)
+	{
+		mCapacity = capacity;
+		while (mResults.size() > mCapacity)
+			evict();
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	size_t	getCapacity() const	{ return mCapacity; }
+	//////////////////////////////////////////////////////////////////////////////
+	// Number of cached results
+	size_t	getSize() const		{ return mResults.size(); }
+
+	//////////////////////////////////////////////////////////////////////////////
+	const LuaMemoStats	&getStats() const	{ return mStats; }
+	void				resetStats()		{ mStats = LuaMemoStats(); }
+
+	//////////////////////////////////////////////////////////////////////////////
+	Ret operator()()
+	{
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mFunc.mName);
+		Ret res = Ret();
+		if (mFunc.push())
+			callArgs(0, res);
+		return res;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1>
+	Ret operator()(const T1 &p1)
+	{
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mFunc.mName);
+		Ret res = Ret();
+		if (mFunc.push())
+		{
+			luaPushValue(p1);
+			callArgs(1, res);
+		}
+		return res;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1, typename T2>
+	Ret operator()(const T1 &p1, const T2 &p2)
+	{
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mFunc.mName);
+		Ret res = Ret();
+		if (mFunc.push())
+		{
+			luaPushValue(p1);
+			luaPushValue(p2);
+			callArgs(2, res);
+		}
+		return res;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1, typename T2, typename T3>
+	Ret operator()(const T1 &p1, const T2 &p2, const T3 &p3)
+	{
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mFunc.mName);
+		Ret res = Ret();
+		if (mFunc.push())
+		{
+			luaPushValue(p1);
+			luaPushValue(p2);
+			luaPushValue(p3);
+			callArgs(3, res);
+		}
+		return res;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	template <typename T1, typename T2, typename T3, typename T4>
+	Ret operator()(const T1 &p1, const T2 &p2, const T3 &p3, const T4 &p4)
+	{
+		LUAUTILS_STACK_CHECK(detail::_LuaCheckCallStack<CallPolicy>::value ? mL.get() : 0, mFunc.mName);
+		Ret res = Ret();
+		if (mFunc.push())
+		{
+			luaPushValue(p1);
+			luaPushValue(p2);
+			luaPushValue(p3);
+			luaPushValue(p4);
+			callArgs(4, res);
+		}
+		return res;
+	}
+
+private:
+	typedef std::list<std::pair<detail::_LuaMemoKey, Ret> >	Results;
+	typedef std::map<detail::_LuaMemoKey, typename Results::iterator>	Keys;
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Answer from the cache or call the function, which is pushed below its args arguments
+	// The key is local: the function can call back into this LuaMemoFunction (ex: recursion
+	// through a C function), which changes the cache while the outer call runs
+	void	callArgs(int args, Ret &res)
+	{
+		lua_State *L = mL.get();
+		detail::_LuaMemoKey key;
+		bool cached = mCapacity && detail::_LuaMakeMemoKey(L, lua_gettop(L) - args + 1, args, key);
+		if (cached)
+		{
+			typename Keys::iterator it = mKeys.find(key);
+			if (it != mKeys.end())
+			{
+				// Most recently used first
+				mResults.splice(mResults.begin(), mResults, it->second);
+				res = it->second->second;
+				lua_pop(L, args + 1);
+				mStats.hits++;
+				return;
+			}
+			mStats.misses++;
+		}
+		else
+		{
+			mStats.uncached++;
+		}
+		bool ok = mFunc.template call<CallPolicy>(args, 1);
+		ok = luaPopValue(res) && ok;
+		if (!ok || !cached || !mCapacity)
+			return;
+		// A nested call may have cached the same arguments
+		typename Keys::iterator it = mKeys.find(key);
+		if (it != mKeys.end())
+		{
+			mResults.splice(mResults.begin(), mResults, it->second);
+			it->second->second = res;
+			return;
+		}
+		if (mResults.size() >= mCapacity)
+			evict();
+		mResults.push_front(std::make_pair(key, res));
+		mKeys.insert(std::make_pair(key, mResults.begin()));
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Drop the result of the args arguments on top of the stack, and pop them
+	bool	invalidateArgs(int args)
+	{
+		lua_State *L = mL.get();
+		detail::_LuaMemoKey key;
+		bool found = false;
+		if (detail::_LuaMakeMemoKey(L, lua_gettop(L) - args + 1, args, key))
+		{
+			typename Keys::iterator it = mKeys.find(key);
+			if (it != mKeys.end())
+			{
+				mResults.erase(it->second);
+				mKeys.erase(it);
+				found = true;
+			}
+		}
+		lua_pop(L, args);
+		return found;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Drop the least recently used result
+	void	evict()
+	{
+		mKeys.erase(mResults.back().first);
+		mResults.pop_back();
+		mStats.evictions++;
+	}
+
+	LuaFunction<Ret, CallPolicy>	mFunc;
+	size_t							mCapacity;
+	Results							mResults;
+	Keys							mKeys;
+	LuaMemoStats					mStats;
+};
+
+} // LuaUtils
+
+#endif //LUAMEMOFUNCTION_H
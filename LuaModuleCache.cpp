@@ -0,0 +1,178 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaModuleCache.h"
+#include "LuaThreads.h"
+#include <cstdio>
+#include <map>
+
+namespace LuaUtils {;
+
+#ifdef _MSC_VER
+typedef std::shared_ptr<const std::string> ModuleCodePtr;
+#else
+typedef std::tr1::shared_ptr<const std::string> ModuleCodePtr;
+#endif
+
+//////////////////////////////////////////////////////////////////////////////
+// A compiled module, the code is shared so that clearing the cache doesn't free it while it's being loaded
+struct CachedModule
+{
+	std::string		fileName;
+	ModuleCodePtr	code;
+};
+typedef std::map<std::string, CachedModule> CachedModules;
+
+// The cache, by module name and package.path
+static CachedModules gCachedModules;
+static detail::_LuaMutex gCacheMutex;
+static bool gCacheEnabled = false;
+
+//////////////////////////////////////////////////////////////////////////////
+// lua_dump writer appending to a string
+static int writeChunk(lua_State *L, const void *p, size_t size, void *ud)
+{
+	((std::string*)ud)->append((const char*)p, size);
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Find the file of a module along a search path (like package.searchpath, which Lua 5.1 doesn't have)
+static bool findModuleFile(const std::string &path, const std::string &name, std::string &fileName)
+{
+	std::string modulePath = name;
+	for (size_t i = 0; i < modulePath.size(); ++i)
+	{
+		if (modulePath[i] == '.')
+			modulePath[i] = '/';
+	}
+	size_t start = 0;
+	while (start < path.size())
+	{
+		size_t end = path.find(';', start);
+		if (end == std::string::npos)
+			end = path.size();
+		fileName = path.substr(start, end - start);
+		for (size_t pos = fileName.find('?'); pos != std::string::npos; pos = fileName.find('?', pos + modulePath.size()))
+			fileName.replace(pos, 1, modulePath);
+		FILE *file = fileName.empty() ? 0 : fopen(fileName.c_str(), "rb");
+		if (file)
+		{
+			fclose(file);
+			return true;
+		}
+		start = end + 1;
+	}
+	return false;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Load the module named at index 1 from the cache (or from its file, caching it), push its loader and file name
+// Returns the number of values pushed, or -1 with the error message pushed
+// (no Lua errors in here, they would skip the destructors)
+static int loadModule(lua_State *L)
+{
+	std::string name = lua_tostring(L, 1);
+	std::string path;
+	lua_getglobal(L, "package");
+	if (lua_istable(L, -1))
+	{
+		lua_getfield(L, -1, "path");
+		if (lua_isstring(L, -1))
+			path = lua_tostring(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	std::string key = name + '\n' + path;
+	CachedModule module;
+	{
+		detail::_LuaLock lock(gCacheMutex);
+		CachedModules::const_iterator it = gCachedModules.find(key);
+		if (it != gCachedModules.end())
+			module = it->second;
+	}
+	int status;
+	if (module.code)
+	{
+		std::string chunkName = '@' + module.fileName;
+		status = luaL_loadbuffer(L, module.code->data(), module.code->size(), chunkName.c_str());
+	}
+	else
+	{
+		// Let the file searchers report it
+		if (!findModuleFile(path, name, module.fileName))
+			return 0;
+		status = luaL_loadfile(L, module.fileName.c_str());
+		if (!status)
+		{
+			std::string *code = new std::string;
+			module.code = ModuleCodePtr(code);
+			detail::_LuaDump(L, writeChunk, code, false);
+			detail::_LuaLock lock(gCacheMutex);
+			// Another state may have cached it in the meantime, either one is fine
+			gCachedModules.insert(std::make_pair(key, module));
+		}
+	}
+	if (status)
+	{
+		lua_pushfstring(L, "error loading module '%s' from file '%s':\n\t%s", name.c_str(), module.fileName.c_str(), lua_tostring(L, -1));
+		lua_remove(L, -2);
+		return -1;
+	}
+	// From 5.2 on, the second value is given to the loader
+	lua_pushstring(L, module.fileName.c_str());
+	return 2;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Searcher of the module cache, gets the module name and returns its loader
+static int cacheSearcher(lua_State *L)
+{
+	luaL_checkstring(L, 1);
+	int res = loadModule(L);
+	if (res < 0)
+		return lua_error(L);
+	return res;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Enable or disable the cache for the states created from now on
+void LuaEnableModuleCache(bool enable)
+{
+	gCacheEnabled = enable;
+}
+bool LuaIsModuleCacheEnabled()
+{
+	return gCacheEnabled;
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Forget the cached modules, they are read again on their next require()
+void LuaClearModuleCache()
+{
+	detail::_LuaLock lock(gCacheMutex);
+	gCachedModules.clear();
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Number of cached modules
+size_t LuaGetNumCachedModules()
+{
+	detail::_LuaLock lock(gCacheMutex);
+	return gCachedModules.size();
+}
+
+namespace detail {;
+
+////////////////////////////////////////////////////////////////////////////////////
+// Add the searcher of the module cache to a state
+// returns false if the package library isn't loaded
+bool _LuaAddModuleCacheSearcher(lua_State *L)
+{
+	lua_pushcfunction(L, cacheSearcher);
+	return _LuaAddSearcher(L);
+}
+
+} // detail
+} // LuaUtils
@@ -0,0 +1,41 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUAMODULECACHE_H
+#define LUAMODULECACHE_H
+
+#include "LuaBase.h"
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Process-wide cache of compiled modules, shared by all the Lua states (opt-in)
+//
+// Once enabled, the states created with the libraries get a searcher that runs before the file searchers:
+// the first require() of a module finds its file along package.path, compiles it and keeps its bytecode,
+// the next ones (from any state, on any thread) load that bytecode without touching the filesystem.
+// N states then cost one file read and one compile per module.
+//
+// Modules are cached by name and package.path, and are never reloaded: clear the cache when module
+// files change. Each state still runs the module once, only the loading is shared.
+
+// Enable or disable the cache for the states created from now on
+void LuaEnableModuleCache(bool enable);
+bool LuaIsModuleCacheEnabled();
+// Forget the cached modules, they are read again on their next require()
+void LuaClearModuleCache();
+// Number of cached modules
+size_t LuaGetNumCachedModules();
+
+namespace detail {;
+
+// Add the searcher of the module cache to a state
+// returns false if the package library isn't loaded
+bool _LuaAddModuleCacheSearcher(lua_State *L);
+
+} // detail
+} // LuaUtils
+
+#endif //LUAMODULECACHE_H
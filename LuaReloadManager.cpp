@@ -0,0 +1,301 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaReloadManager.h"
+#include "LuaState.h"
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+// Registry key of the reload manager attached to a Lua state
+static const char gReloadManagerKey = 0;
+
+// Get the modification time of a file, or 0 if it doesn't exist
+static time_t getModTime(const char *fileName)
+{
+	struct stat st;
+	if (stat(fileName, &st) != 0)
+		return 0;
+	return st.st_mtime;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Merge the fields of the table at newIdx into the table at oldIdx (absolute indices)
+// Nested tables that exist in both are merged instead of replaced
+// visited is the absolute index of a table of the new tables already merged, to handle cycles
+static void mergeTables(lua_State *L, int oldIdx, int newIdx, int visited)
+{
+	if (!lua_checkstack(L, 6))
+		return;
+	lua_pushvalue(L, newIdx);
+	lua_rawget(L, visited);
+	bool seen = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+	if (seen)
+		return;
+	lua_pushvalue(L, newIdx);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, visited);
+
+	lua_pushnil(L);
+	while (lua_next(L, newIdx))
+	{
+		// key at top - 1, value at top
+		int top = lua_gettop(L);
+		if (lua_istable(L, top))
+		{
+			lua_pushvalue(L, top - 1);
+			lua_rawget(L, oldIdx);
+			if (lua_istable(L, -1) && !lua_rawequal(L, -1, top))
+			{
+				// Keep the old nested table
+				mergeTables(L, top + 1, top, visited);
+				lua_pop(L, 2);
+				continue;
+			}
+			lua_pop(L, 1);
+		}
+		lua_pushvalue(L, top - 1);
+		lua_pushvalue(L, top);
+		lua_rawset(L, oldIdx);
+		lua_pop(L, 1);
+	}
+}
+
+namespace LuaUtils {;
+
+//////////////////////////////////////////////////////////////////////////////
+LuaReloadManager::LuaReloadManager()
+:	mNotify(-1)
+{
+}
+//////////////////////////////////////////////////////////////////////////////
+LuaReloadManager::~LuaReloadManager()
+{
+	detach();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Start tracking the files loaded in the given state (one manager per state)
+// returns success flag
+bool	LuaReloadManager::attach(const LuaState &state)
+{
+	detach();
+	void *owner = detail::_LuaGetRegistryPtr(state.mL.get(), &gReloadManagerKey);
+	if (owner)
+	{
+		detail::_LuaLogError("Error in LuaReloadManager::attach() - the Lua state already has a reload manager\n");
+		return false;
+	}
+	mL = state.mL;
+	detail::_LuaSetRegistryPtr(mL.get(), &gReloadManagerKey, this);
+#ifdef __linux__
+	mNotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+	return true;
+}
+//////////////////////////////////////////////////////////////////////////////
+// Stop tracking files, and forget the tracked ones
+void	LuaReloadManager::detach()
+{
+	if (mL && detail::_LuaGetRegistryPtr(mL.get(), &gReloadManagerKey) == this)
+		detail::_LuaSetRegistryPtr(mL.get(), &gReloadManagerKey, 0);
+	mL = luaStatePtr();
+#ifdef __linux__
+	if (mNotify != -1)
+		close(mNotify);
+#endif
+	mNotify = -1;
+	mWatches.clear();
+	mFiles.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Track a file that was run without LuaState::loadFile
+void	LuaReloadManager::track(const char *fileName)
+{
+	for (size_t i = 0; i < mFiles.size(); ++i)
+	{
+		if (mFiles[i].path == fileName)
+		{
+			mFiles[i].modTime = getModTime(fileName);
+			mFiles[i].changed = false;
+			return;
+		}
+	}
+	File file;
+	file.path = fileName;
+	size_t slash = file.path.find_last_of("/\\");
+	file.dir = slash == std::string::npos ? "." : file.path.substr(0, slash);
+	file.name = slash == std::string::npos ? file.path : file.path.substr(slash + 1);
+	file.modTime = getModTime(fileName);
+	file.changed = false;
+	mFiles.push_back(file);
+#ifdef __linux__
+	// Watch the directory rather than the file, since editors often replace files by renaming
+	if (mNotify != -1)
+	{
+		for (std::map<int, std::string>::iterator it = mWatches.begin(); it != mWatches.end(); ++it)
+			if (it->second == file.dir)
+				return;
+		// Not IN_CREATE, a new file is still empty: the write that follows ends with IN_CLOSE_WRITE
+		int wd = inotify_add_watch(mNotify, file.dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (wd != -1)
+			mWatches[wd] = file.dir;
+	}
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Reload the files that changed
+// returns the number of files that were reloaded
+int		LuaReloadManager::update()
+{
+	if (!mL)
+		return 0;
+	checkChanges();
+	int count = 0;
+	for (size_t i = 0; i < mFiles.size(); ++i)
+	{
+		if (!mFiles[i].changed)
+			continue;
+		mFiles[i].changed = false;
+		reloadFile(mFiles[i]);
+		count++;
+	}
+	return count;
+}
+//////////////////////////////////////////////////////////////////////////////
+// Reload a tracked file now, whether it changed or not
+// returns success flag
+bool	LuaReloadManager::reload(const char *fileName)
+{
+	if (!mL)
+		return false;
+	for (size_t i = 0; i < mFiles.size(); ++i)
+		if (mFiles[i].path == fileName)
+			return reloadFile(mFiles[i]);
+	return false;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Called by LuaState::loadFile
+void	LuaReloadManager::onFileLoaded(lua_State *L, const char *fileName)
+{
+	LuaReloadManager *manager = (LuaReloadManager*)detail::_LuaGetRegistryPtr(L, &gReloadManagerKey);
+	if (manager)
+		manager->track(fileName);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Flag the files that changed since the last update
+void	LuaReloadManager::checkChanges()
+{
+#ifdef __linux__
+	if (mNotify != -1)
+	{
+		char buf[4096];
+		ssize_t len;
+		while ((len = read(mNotify, buf, sizeof(buf))) > 0)
+		{
+			for (char *p = buf; p < buf + len; )
+			{
+				struct inotify_event *event = (struct inotify_event*)p;
+				p += sizeof(struct inotify_event) + event->len;
+				std::map<int, std::string>::iterator it = mWatches.find(event->wd);
+				if (!event->len || it == mWatches.end())
+					continue;
+				for (size_t i = 0; i < mFiles.size(); ++i)
+				{
+					if (mFiles[i].name == event->name && mFiles[i].dir == it->second)
+						mFiles[i].changed = true;
+				}
+			}
+		}
+		for (size_t i = 0; i < mFiles.size(); ++i)
+			if (mFiles[i].changed)
+				mFiles[i].modTime = getModTime(mFiles[i].path.c_str());
+		return;
+	}
+#endif
+	for (size_t i = 0; i < mFiles.size(); ++i)
+	{
+		time_t modTime = getModTime(mFiles[i].path.c_str());
+		if (modTime && modTime != mFiles[i].modTime)
+		{
+			mFiles[i].modTime = modTime;
+			mFiles[i].changed = true;
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Run the file again, preserving global tables
+bool	LuaReloadManager::reloadFile(File &file)
+{
+	lua_State *L = mL.get();
+	int top = lua_gettop(L);
+	lua_checkstack(L, 8);
+	// Remember the global tables
+	detail::_LuaPushGlobals(L);
+	int globals = top + 1;
+	lua_newtable(L);
+	int oldTables = top + 2;
+	lua_pushnil(L);
+	while (lua_next(L, globals))
+	{
+		if (lua_istable(L, -1))
+		{
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, oldTables);
+		}
+		else
+			lua_pop(L, 1);
+	}
+
+	// Run the new chunk, a compile error leaves everything as it was
+	bool ret = true;
+	if (luaL_loadfile(L, file.path.c_str()))
+	{
+		detail::_LuaLogError("Error in LuaReloadManager::update() - %s\n", lua_tostring(L, -1));
+		lua_settop(L, top);
+		return false;
+	}
+	if (lua_pcall(L, 0, 0, 0))
+	{
+		// The chunk may have run partially, still put the old tables back
+		detail::_LuaLogError("Error in LuaReloadManager::update() - %s\n", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		ret = false;
+	}
+
+	// Merge the tables that were replaced into the old ones, and put the old ones back
+	lua_newtable(L);
+	int visited = top + 3;
+	lua_pushnil(L);
+	while (lua_next(L, oldTables))
+	{
+		// key at -2, old table at -1
+		int oldIdx = lua_gettop(L);
+		lua_pushvalue(L, oldIdx - 1);
+		lua_rawget(L, globals);
+		if (lua_istable(L, -1) && !lua_rawequal(L, -1, oldIdx))
+		{
+			mergeTables(L, oldIdx, oldIdx + 1, visited);
+			lua_pushvalue(L, oldIdx - 1);
+			lua_pushvalue(L, oldIdx);
+			lua_rawset(L, globals);
+		}
+		lua_pop(L, 2);
+	}
+	lua_settop(L, top);
+	return ret;
+}
+
+} // LuaUtils
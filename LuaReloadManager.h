@@ -0,0 +1,93 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUARELOADMANAGER_H
+#define LUARELOADMANAGER_H
+
+#include "LuaBase.h"
+#include <ctime>
+#include <map>
+#include <vector>
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Opt-in hot reload of script files in a live Lua state
+//
+// Once attached to a state, every file run with LuaState::loadFile is tracked.
+// update() re-runs the files that changed since they were loaded, in the order they were first loaded.
+// Tables are preserved: when a reloaded chunk replaces a global table with a new one, the new fields
+// are merged into the old table (recursively for nested tables) and the old table is put back,
+// so warm data and existing LuaTable handles stay valid.
+// Existing LuaFunction handles keep working, but they still call the old version of the function,
+// get them again from their table after a reload to pick up the new code.
+//
+// On Linux the script directories are watched with inotify, elsewhere update() compares file times.
+class LuaReloadManager : public detail::_LuaBase
+{
+public:
+	//////////////////////////////////////////////////////////////////////////////
+	LuaReloadManager();
+	//////////////////////////////////////////////////////////////////////////////
+	~LuaReloadManager();
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Start tracking the files loaded in the given state (one manager per state)
+	// returns success flag
+	bool	attach(const LuaState &state);
+	//////////////////////////////////////////////////////////////////////////////
+	// Stop tracking files, and forget the tracked ones
+	void	detach();
+	//////////////////////////////////////////////////////////////////////////////
+	// Track a file that was run without LuaState::loadFile
+	void	track(const char *fileName);
+	//////////////////////////////////////////////////////////////////////////////
+	size_t	getNumFiles() const { return mFiles.size(); }
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Reload the files that changed
+	// returns the number of files that were reloaded
+	int		update();
+	//////////////////////////////////////////////////////////////////////////////
+	// Reload a tracked file now, whether it changed or not
+	// returns success flag
+	bool	reload(const char *fileName);
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Called by LuaState::loadFile
+	static void	onFileLoaded(lua_State *L, const char *fileName);
+
+private:
+	// Non copyable
+	LuaReloadManager(const LuaReloadManager &other);
+	LuaReloadManager &operator=(const LuaReloadManager &other);
+
+	//////////////////////////////////////////////////////////////////////////////
+	struct File
+	{
+		std::string	path;
+		std::string	dir;
+		std::string	name;
+		time_t		modTime;
+		bool		changed;
+	};
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Flag the files that changed since the last update
+	void	checkChanges();
+	//////////////////////////////////////////////////////////////////////////////
+	// Run the file again, preserving global tables
+	bool	reloadFile(File &file);
+
+	//////////////////////////////////////////////////////////////////////////////
+	std::vector<File>	mFiles;
+	// inotify descriptor and watched directories
+	int							mNotify;
+	std::map<int, std::string>	mWatches;
+};
+
+} // LuaUtils
+
+#endif //LUARELOADMANAGER_H
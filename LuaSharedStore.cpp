@@ -0,0 +1,526 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaSharedStore.h"
+#include "LuaTable.h"
+#include <map>
+#include <new>
+
+using LuaUtils::detail::_LuaSharedValue;
+using LuaUtils::detail::_LuaSharedEntry;
+using LuaUtils::detail::_LuaSharedTable;
+using LuaUtils::detail::_LuaSharedData;
+using LuaUtils::detail::_LuaSharedDataPtr;
+
+// Keys of the proxy cache and of the data anchor in the proxy metatables
+static const char gCacheKey = 0;
+static const char gAnchorKey = 0;
+
+//////////////////////////////////////////////////////////////////////////////
+// Proxy userdata of a table of the store
+struct Proxy
+{
+	const _LuaSharedData	*data;
+	unsigned int			table;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// FNV-1a hash
+static unsigned int hashBytes(const void *p, size_t len)
+{
+	const unsigned char *bytes = (const unsigned char*)p;
+	unsigned int hash = 2166136261u;
+	for (size_t i = 0; i < len; ++i)
+		hash = (hash ^ bytes[i]) * 16777619u;
+	return hash;
+}
+static unsigned int hashNumber(lua_Number n)
+{
+	// -0 == 0
+	if (n == 0)
+		n = 0;
+	return hashBytes(&n, sizeof(n));
+}
+static unsigned int hashKey(const _LuaSharedData &data, const _LuaSharedValue &key)
+{
+	if (key.type == LUA_TNUMBER)
+		return hashNumber(key.number);
+	return hashBytes(data.strings.data() + key.string.offset, key.string.size);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Build state
+struct Builder
+{
+	lua_State								*L;
+	_LuaSharedData							*data;
+	std::map<const void*, unsigned int>		tables;
+	std::map<std::string, unsigned int>		strings;
+};
+
+static bool addTable(Builder &b, int idx, unsigned int &res);
+
+//////////////////////////////////////////////////////////////////////////////
+// Convert the value at idx (absolute index), returns false if its type can't be stored
+static bool convertValue(Builder &b, int idx, _LuaSharedValue &res)
+{
+	res.type = lua_type(b.L, idx);
+	res.integer = 0;
+	switch (res.type)
+	{
+	case LUA_TBOOLEAN:
+		res.boolean = lua_toboolean(b.L, idx);
+		return true;
+	case LUA_TNUMBER:
+		res.number = lua_tonumber(b.L, idx);
+#if LUA_VERSION_NUM >= 503
+		res.integer = lua_isinteger(b.L, idx);
+#endif
+		return true;
+	case LUA_TSTRING:
+		{
+			size_t len;
+			const char *s = lua_tolstring(b.L, idx, &len);
+			// The strings are pooled, once each
+			std::string str(s, len);
+			std::map<std::string, unsigned int>::iterator it = b.strings.find(str);
+			if (it == b.strings.end())
+			{
+				it = b.strings.insert(std::make_pair(str, (unsigned int)b.data->strings.size())).first;
+				b.data->strings.append(s, len);
+			}
+			res.string.offset = it->second;
+			res.string.size = (unsigned int)len;
+		}
+		return true;
+	case LUA_TTABLE:
+		return addTable(b, idx, res.table);
+	default:
+		return false;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Add the table at idx (absolute index) and its nested tables, res receives its index
+// returns false if the tables are nested too deep
+static bool addTable(Builder &b, int idx, unsigned int &res)
+{
+	lua_State *L = b.L;
+	const void *ptr = lua_topointer(L, idx);
+	std::map<const void*, unsigned int>::iterator it = b.tables.find(ptr);
+	if (it != b.tables.end())
+	{
+		res = it->second;
+		return true;
+	}
+	if (!lua_checkstack(L, 4))
+		return false;
+	res = (unsigned int)b.data->tables.size();
+	b.data->tables.push_back(_LuaSharedTable());
+	b.tables[ptr] = res;
+
+	// The nested tables get added while converting, so the ranges of this one are only added at the end
+	bool ret = true;
+	size_t arraySize = LuaUtils::detail::_LuaRawLen(L, idx);
+	std::vector<_LuaSharedValue> array(arraySize);
+	for (size_t i = 0; i < arraySize && ret; ++i)
+	{
+		lua_rawgeti(L, idx, (int)i + 1);
+		if (!convertValue(b, lua_gettop(L), array[i]))
+		{
+			ret = ret && array[i].type != LUA_TTABLE;
+			array[i].type = LUA_TNIL;
+		}
+		lua_pop(L, 1);
+	}
+	std::vector<_LuaSharedEntry> hash;
+	lua_pushnil(L);
+	while (ret && lua_next(L, idx))
+	{
+		int top = lua_gettop(L);
+		int keyType = lua_type(L, top - 1);
+		bool keep = keyType == LUA_TSTRING || keyType == LUA_TNUMBER;
+		if (keyType == LUA_TNUMBER)
+		{
+			// Skip the array part
+			lua_Number n = lua_tonumber(L, top - 1);
+			keep = !(n >= 1 && n <= (lua_Number)arraySize && n == (lua_Number)(size_t)n);
+		}
+		_LuaSharedEntry entry;
+		if (keep && convertValue(b, top - 1, entry.key))
+		{
+			if (convertValue(b, top, entry.value))
+				hash.push_back(entry);
+			else if (entry.value.type == LUA_TTABLE)
+				ret = false;
+		}
+		lua_pop(L, 1);
+	}
+	if (!ret)
+	{
+		lua_settop(L, idx);
+		return false;
+	}
+
+	_LuaSharedData &data = *b.data;
+	_LuaSharedTable table;
+	table.arrayStart = (unsigned int)data.arrays.size();
+	table.arraySize = (unsigned int)arraySize;
+	data.arrays.insert(data.arrays.end(), array.begin(), array.end());
+	// At most half full, so that the probing stays short
+	table.hashStart = (unsigned int)data.entries.size();
+	table.hashCapacity = 0;
+	if (!hash.empty())
+	{
+		table.hashCapacity = 1;
+		while (table.hashCapacity < hash.size() * 2)
+			table.hashCapacity *= 2;
+	}
+	_LuaSharedEntry empty;
+	memset(&empty, 0, sizeof(empty));
+	empty.key.type = LUA_TNIL;
+	empty.value.type = LUA_TNIL;
+	data.entries.resize(data.entries.size() + table.hashCapacity, empty);
+	for (size_t i = 0; i < hash.size(); ++i)
+	{
+		unsigned int mask = table.hashCapacity - 1;
+		unsigned int slot = hashKey(data, hash[i].key) & mask;
+		while (data.entries[table.hashStart + slot].key.type != LUA_TNIL)
+			slot = (slot + 1) & mask;
+		data.entries[table.hashStart + slot] = hash[i];
+	}
+	data.tables[res] = table;
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Find the hash slot of the key at keyIdx, or -1
+static int findSlot(const _LuaSharedData &data, const _LuaSharedTable &table, lua_State *L, int keyIdx)
+{
+	if (!table.hashCapacity)
+		return -1;
+	int type = lua_type(L, keyIdx);
+	lua_Number n = 0;
+	const char *s = 0;
+	size_t len = 0;
+	unsigned int hash;
+	if (type == LUA_TNUMBER)
+	{
+		n = lua_tonumber(L, keyIdx);
+		hash = hashNumber(n);
+	}
+	else if (type == LUA_TSTRING)
+	{
+		s = lua_tolstring(L, keyIdx, &len);
+		hash = hashBytes(s, len);
+	}
+	else
+		return -1;
+	unsigned int mask = table.hashCapacity - 1;
+	for (unsigned int slot = hash & mask; ; slot = (slot + 1) & mask)
+	{
+		const _LuaSharedValue &key = data.entries[table.hashStart + slot].key;
+		if (key.type == LUA_TNIL)
+			return -1;
+		if (key.type != type)
+			continue;
+		if (type == LUA_TNUMBER ? key.number == n
+			: key.string.size == len && memcmp(data.strings.data() + key.string.offset, s, len) == 0)
+			return (int)slot;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Get the array index (0 based) of the key at keyIdx, or -1
+static int findArrayIndex(const _LuaSharedTable &table, lua_State *L, int keyIdx)
+{
+	if (lua_type(L, keyIdx) != LUA_TNUMBER)
+		return -1;
+	lua_Number n = lua_tonumber(L, keyIdx);
+	if (n >= 1 && n <= (lua_Number)table.arraySize && n == (lua_Number)(unsigned int)n)
+		return (int)n - 1;
+	return -1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Push the proxy of a table, using the proxy cache and metatable at the given indices
+static void pushProxy(lua_State *L, const _LuaSharedData *data, unsigned int table, int cache, int meta)
+{
+	lua_rawgeti(L, cache, (int)table);
+	if (!lua_isnil(L, -1))
+		return;
+	lua_pop(L, 1);
+	Proxy *proxy = (Proxy*)lua_newuserdata(L, sizeof(Proxy));
+	proxy->data = data;
+	proxy->table = table;
+	lua_pushvalue(L, meta);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, cache, (int)table);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Push a value of the store, from a metamethod (upvalue 1 is the proxy cache, upvalue 2 the metatable)
+static void pushValue(lua_State *L, const _LuaSharedData *data, const _LuaSharedValue &value)
+{
+	switch (value.type)
+	{
+	case LUA_TBOOLEAN:	lua_pushboolean(L, value.boolean); break;
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+		if (value.integer)
+		{
+			lua_pushinteger(L, (lua_Integer)value.number);
+			break;
+		}
+#endif
+		lua_pushnumber(L, value.number);
+		break;
+	case LUA_TSTRING:	lua_pushlstring(L, data->strings.data() + value.string.offset, value.string.size); break;
+	case LUA_TTABLE:	pushProxy(L, data, value.table, lua_upvalueindex(1), lua_upvalueindex(2)); break;
+	default:			lua_pushnil(L); break;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Check that argument 1 of a metamethod is a proxy of its store (upvalue 2 is the metatable)
+// The metamethods can be called with any value, ex: getmetatable(proxy).__len({}) before Lua 5.2
+static const Proxy *checkProxy(lua_State *L)
+{
+	const Proxy *proxy = (const Proxy*)lua_touserdata(L, 1);
+	bool ok = false;
+	if (proxy && lua_getmetatable(L, 1))
+	{
+		ok = lua_rawequal(L, -1, lua_upvalueindex(2)) != 0;
+		lua_pop(L, 1);
+	}
+	if (!ok)
+		luaL_argerror(L, 1, "shared store table expected");
+	return proxy;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// __index metamethod of the proxies
+static int proxyIndex(lua_State *L)
+{
+	const Proxy *proxy = checkProxy(L);
+	const _LuaSharedData *data = proxy->data;
+	const _LuaSharedTable &table = data->tables[proxy->table];
+	int i = findArrayIndex(table, L, 2);
+	if (i != -1)
+	{
+		pushValue(L, data, data->arrays[table.arrayStart + i]);
+		return 1;
+	}
+	int slot = findSlot(*data, table, L, 2);
+	if (slot == -1)
+		lua_pushnil(L);
+	else
+		pushValue(L, data, data->entries[table.hashStart + slot].value);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// __newindex metamethod of the proxies
+static int proxyNewIndex(lua_State *L)
+{
+	return luaL_error(L, "shared store is read only");
+}
+//////////////////////////////////////////////////////////////////////////////
+// __len metamethod of the proxies
+static int proxyLen(lua_State *L)
+{
+	const Proxy *proxy = checkProxy(L);
+	lua_pushinteger(L, (lua_Integer)proxy->data->tables[proxy->table].arraySize);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// next() for the proxies: the array part, then the hash slots in order
+static int proxyNext(lua_State *L)
+{
+	const Proxy *proxy = checkProxy(L);
+	const _LuaSharedData *data = proxy->data;
+	const _LuaSharedTable &table = data->tables[proxy->table];
+	lua_settop(L, 2);
+	unsigned int pos = 0;
+	if (!lua_isnil(L, 2))
+	{
+		int i = findArrayIndex(table, L, 2);
+		int slot = i == -1 ? findSlot(*data, table, L, 2) : -1;
+		if (i == -1 && slot == -1)
+			return luaL_error(L, "invalid key to 'next'");
+		pos = i != -1 ? (unsigned int)i + 1 : table.arraySize + (unsigned int)slot + 1;
+	}
+	for (; pos < table.arraySize; ++pos)
+	{
+		const _LuaSharedValue &value = data->arrays[table.arrayStart + pos];
+		if (value.type != LUA_TNIL)
+		{
+			lua_pushinteger(L, (lua_Integer)pos + 1);
+			pushValue(L, data, value);
+			return 2;
+		}
+	}
+	for (unsigned int slot = pos - table.arraySize; slot < table.hashCapacity; ++slot)
+	{
+		const _LuaSharedEntry &entry = data->entries[table.hashStart + slot];
+		if (entry.key.type != LUA_TNIL)
+		{
+			pushValue(L, data, entry.key);
+			pushValue(L, data, entry.value);
+			return 2;
+		}
+	}
+	lua_pushnil(L);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// __pairs metamethod of the proxies (upvalue 3 is proxyNext)
+static int proxyPairs(lua_State *L)
+{
+	checkProxy(L);
+	lua_pushvalue(L, lua_upvalueindex(3));
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// __gc metamethod of the anchor userdata, that keeps the data alive for a state
+static int anchorGC(lua_State *L)
+{
+	_LuaSharedDataPtr *anchor = (_LuaSharedDataPtr*)lua_touserdata(L, 1);
+	anchor->~_LuaSharedDataPtr();
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Push the proxy metatable of the data in this state, creating it if needed
+// The metamethods get the proxy cache and the metatable as upvalues
+// Scripts only see a table with __pairs as the metatable (for pairs() before Lua 5.2)
+static void pushMetatable(lua_State *L, const _LuaSharedDataPtr &data)
+{
+	lua_pushlightuserdata(L, (void*)data.get());
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (lua_istable(L, -1))
+		return;
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	int meta = lua_gettop(L);
+	// The proxies are cached by table index as long as they're used
+	lua_newtable(L);
+	int cache = meta + 1;
+	lua_newtable(L);
+	lua_pushliteral(L, "v");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, cache);
+	lua_pushlightuserdata(L, (void*)&gCacheKey);
+	lua_pushvalue(L, cache);
+	lua_rawset(L, meta);
+
+	_LuaSharedDataPtr *anchor = (_LuaSharedDataPtr*)lua_newuserdata(L, sizeof(_LuaSharedDataPtr));
+	new (anchor) _LuaSharedDataPtr(data);
+	lua_newtable(L);
+	lua_pushcfunction(L, anchorGC);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+	lua_pushlightuserdata(L, (void*)&gAnchorKey);
+	lua_insert(L, -2);
+	lua_rawset(L, meta);
+
+	lua_pushvalue(L, cache);
+	lua_pushvalue(L, meta);
+	lua_pushcclosure(L, proxyIndex, 2);
+	lua_setfield(L, meta, "__index");
+	lua_pushcfunction(L, proxyNewIndex);
+	lua_setfield(L, meta, "__newindex");
+	lua_pushvalue(L, cache);
+	lua_pushvalue(L, meta);
+	lua_pushcclosure(L, proxyLen, 2);
+	lua_setfield(L, meta, "__len");
+	lua_pushvalue(L, cache);
+	lua_pushvalue(L, meta);
+	lua_pushvalue(L, cache);
+	lua_pushvalue(L, meta);
+	lua_pushcclosure(L, proxyNext, 2);
+	lua_pushcclosure(L, proxyPairs, 3);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, meta, "__pairs");
+	lua_createtable(L, 0, 1);
+	lua_insert(L, -2);
+	lua_setfield(L, -2, "__pairs");
+	lua_setfield(L, meta, "__metatable");
+	lua_pop(L, 1);
+
+	lua_pushlightuserdata(L, (void*)data.get());
+	lua_pushvalue(L, meta);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+namespace LuaUtils {;
+
+//////////////////////////////////////////////////////////////////////////////
+// Build the store from the content of a table (and its nested tables)
+// It replaces the previous content, the states that have it keep the old one.
+// returns success flag
+bool	LuaSharedStore::build(const LuaTable &table)
+{
+	if (!table.push())
+		return false;
+	lua_State *L = table.mL.get();
+	int top = lua_gettop(L);
+	_LuaSharedData *data = new _LuaSharedData;
+	Builder builder;
+	builder.L = L;
+	builder.data = data;
+	unsigned int root;
+	bool ret = addTable(builder, top, root);
+	lua_settop(L, top - 1);
+	if (!ret)
+	{
+		delete data;
+		detail::_LuaLogError("Error in LuaSharedStore::build() - %s - tables are nested too deep\n", table.getName().c_str());
+		return false;
+	}
+	mData = _LuaSharedDataPtr(data);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Number of tables in the store
+size_t	LuaSharedStore::getNumTables() const
+{
+	return mData ? mData->tables.size() : 0;
+}
+//////////////////////////////////////////////////////////////////////////////
+// Return the number of bytes used by the store
+size_t	LuaSharedStore::getMemUsage() const
+{
+	if (!mData)
+		return 0;
+	return sizeof(_LuaSharedData)
+		+ mData->tables.capacity() * sizeof(_LuaSharedTable)
+		+ mData->arrays.capacity() * sizeof(_LuaSharedValue)
+		+ mData->entries.capacity() * sizeof(_LuaSharedEntry)
+		+ mData->strings.capacity();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Push the proxy of the root table, returns false if the store isn't built
+bool	LuaSharedStore::push(lua_State *L) const
+{
+	if (!mData)
+		return false;
+	pushMetatable(L, mData);
+	int meta = lua_gettop(L);
+	lua_pushlightuserdata(L, (void*)&gCacheKey);
+	lua_rawget(L, meta);
+	pushProxy(L, mData.get(), 0, meta + 1, meta);
+	lua_replace(L, meta);
+	lua_settop(L, meta);
+	return true;
+}
+
+} // LuaUtils
@@ -0,0 +1,115 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUASHAREDSTORE_H
+#define LUASHAREDSTORE_H
+
+#include "LuaBase.h"
+#include <vector>
+
+namespace LuaUtils {;
+
+namespace detail {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Flat representation of a tree of tables
+struct _LuaSharedValue
+{
+	// LUA_TNIL, LUA_TBOOLEAN, LUA_TNUMBER, LUA_TSTRING or LUA_TTABLE
+	int				type;
+	// The number was a Lua integer (Lua 5.3 and up)
+	int				integer;
+	union
+	{
+		lua_Number		number;
+		int				boolean;
+		// Offset and size in the string pool
+		struct { unsigned int offset, size; } string;
+		// Index in the table list
+		unsigned int	table;
+	};
+};
+struct _LuaSharedEntry
+{
+	_LuaSharedValue	key;
+	_LuaSharedValue	value;
+};
+struct _LuaSharedTable
+{
+	// Values at [1, arraySize] in the array list
+	unsigned int	arrayStart;
+	unsigned int	arraySize;
+	// Open addressing hash of the other fields in the entry list, the capacity is a power of 2 (or 0)
+	unsigned int	hashStart;
+	unsigned int	hashCapacity;
+};
+struct _LuaSharedData
+{
+	std::vector<_LuaSharedTable>	tables;
+	std::vector<_LuaSharedValue>	arrays;
+	std::vector<_LuaSharedEntry>	entries;
+	std::string						strings;
+};
+
+#ifdef _MSC_VER
+typedef std::shared_ptr<const _LuaSharedData> _LuaSharedDataPtr;
+#else
+typedef std::tr1::shared_ptr<const _LuaSharedData> _LuaSharedDataPtr;
+#endif
+
+} // detail
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Read-only tree of tables built once in C++, that can be read by any number of Lua states
+//
+// The data is stored once in flat arrays (no Lua objects), and each state sees it as a userdata proxy
+// with __index and __len metamethods (and __pairs, used by pairs() from Lua 5.2 on),
+// so it can be pushed like any other value:
+//
+//		LuaSharedStore store;
+//		store.build(referenceTable);
+//		state1.setValue("Reference", store);
+//		state2.setValue("Reference", store);
+//
+// Scripts can't reach the metamethods: getmetatable gives a table with only __pairs (to iterate on Lua 5.1).
+// Nothing is ever written after the build, so states running on different threads read it without locking.
+// Only booleans, numbers, strings and tables are kept, with string or number keys, metatables are ignored.
+// Strings are copied into the reading state when they're read, so keep the long ones for the rare lookups.
+// A state keeps the data alive until it is closed.
+class LuaSharedStore
+{
+public:
+	//////////////////////////////////////////////////////////////////////////////
+	LuaSharedStore() { }
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Build the store from the content of a table (and its nested tables)
+	// It replaces the previous content, the states that have it keep the old one.
+	// returns success flag
+	bool	build(const LuaTable &table);
+	//////////////////////////////////////////////////////////////////////////////
+	bool	isInit() const { return mData ? true : false; }
+	//////////////////////////////////////////////////////////////////////////////
+	// Number of tables in the store
+	size_t	getNumTables() const;
+	//////////////////////////////////////////////////////////////////////////////
+	// Return the number of bytes used by the store
+	size_t	getMemUsage() const;
+
+	//////////////////////////////////////////////////////////////////////////////
+	friend class LuaUtils::detail::_LuaBase;
+
+private:
+	//////////////////////////////////////////////////////////////////////////////
+	// Push the proxy of the root table, returns false if the store isn't built
+	bool	push(lua_State *L) const;
+
+	//////////////////////////////////////////////////////////////////////////////
+	detail::_LuaSharedDataPtr	mData;
+};
+
+} // LuaUtils
+
+#endif //LUASHAREDSTORE_H
@@ -0,0 +1,991 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaSnapshot.h"
+#include "LuaTable.h"
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+namespace LuaUtils {;
+
+// File header, the last byte is the version of the format
+static const char gMagic[8] = { 'L', 'u', 'a', 'S', 'n', 'a', 'p', 1 };
+// Checks that numbers are stored the same way
+static const double gNumberCheck = 370.5;
+
+// Values
+enum { TagEnd, TagNil, TagFalse, TagTrue, TagInteger, TagNumber, TagString, TagRef, TagTable, TagLibraryTable, TagFunction };
+// Objects taken from the state the snapshot is restored into, by their path from the globals
+enum { PathEnd, PathValue, PathTable };
+// Keys of the paths
+enum { KeyString = 's', KeyNumber = 'n' };
+// Upvalues, a value or the upvalue of a closure written before
+enum { UpvalueValue, UpvalueJoin };
+
+static const size_t gBufferSize = 64 * 1024;
+
+//////////////////////////////////////////////////////////////////////////////
+// Buffered writes to the snapshot file
+class SnapshotWriter
+{
+public:
+	SnapshotWriter(FILE *file) : mFile(file), mFailed(false) { mBuffer.reserve(gBufferSize); }
+
+	void write(const void *data, size_t size)
+	{
+		mBuffer.append((const char*)data, size);
+		if (mBuffer.size() >= gBufferSize)
+			flush();
+	}
+	void writeByte(int b)
+	{
+		mBuffer += (char)b;
+		if (mBuffer.size() >= gBufferSize)
+			flush();
+	}
+	// Sizes and ids, 7 bits per byte
+	void writeSize(unsigned long long n)
+	{
+		unsigned char buf[10];
+		int len = 0;
+		do
+		{
+			buf[len] = (unsigned char)(n & 0x7f);
+			n >>= 7;
+			if (n)
+				buf[len] |= 0x80;
+			len++;
+		} while (n);
+		write(buf, len);
+	}
+	void writeNumber(double n)						{ write(&n, sizeof(n)); }
+	void writeString(const char *s, size_t size)	{ writeSize(size); write(s, size); }
+
+	// returns false if a write failed
+	bool flush()
+	{
+		if (!mBuffer.empty() && fwrite(mBuffer.data(), 1, mBuffer.size(), mFile) != mBuffer.size())
+			mFailed = true;
+		mBuffer.clear();
+		return !mFailed;
+	}
+
+private:
+	FILE		*mFile;
+	std::string	mBuffer;
+	bool		mFailed;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Buffered reads from the snapshot file
+class SnapshotReader
+{
+public:
+	SnapshotReader(FILE *file) : mFile(file), mBuffer(gBufferSize), mPos(0), mSize(0) { }
+
+	// Get the next size bytes, valid until the next read, or null at the end of the file
+	const char *read(size_t size)
+	{
+		if (mSize - mPos < size)
+		{
+			size_t rest = mSize - mPos;
+			if (size > mBuffer.size())
+				mBuffer.resize(size);
+			memmove(&mBuffer[0], &mBuffer[mPos], rest);
+			mSize = rest + fread(&mBuffer[rest], 1, mBuffer.size() - rest, mFile);
+			mPos = 0;
+			if (mSize < size)
+				return 0;
+		}
+		const char *p = &mBuffer[mPos];
+		mPos += size;
+		return p;
+	}
+	// returns -1 at the end of the file
+	int readByte()
+	{
+		const char *p = read(1);
+		return p ? (unsigned char)*p : -1;
+	}
+	bool readSize(unsigned long long &n)
+	{
+		n = 0;
+		for (int shift = 0; shift < 64; shift += 7)
+		{
+			int b = readByte();
+			if (b < 0)
+				return false;
+			n |= (unsigned long long)(b & 0x7f) << shift;
+			if (!(b & 0x80))
+				return true;
+		}
+		return false;
+	}
+	bool readNumber(double &n)
+	{
+		const char *p = read(sizeof(n));
+		if (p)
+			memcpy(&n, p, sizeof(n));
+		return p != 0;
+	}
+
+private:
+	FILE				*mFile;
+	std::vector<char>	mBuffer;
+	size_t				mPos;
+	size_t				mSize;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// lua_dump writer appending to a string
+static int writeChunk(lua_State *L, const void *p, size_t size, void *ud)
+{
+	((std::string*)ud)->append((const char*)p, size);
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Append the key at idx to the key of a path (only strings and numbers)
+// (numbers are read with lua_tonumber, lua_tostring would change the key of a traversal)
+static void appendPathKey(lua_State *L, int idx, std::string &pathKey)
+{
+	if (lua_type(L, idx) == LUA_TSTRING)
+	{
+		size_t len;
+		const char *s = lua_tolstring(L, idx, &len);
+		pathKey += (char)KeyString;
+		pathKey.append(s, len);
+	}
+	else
+	{
+		char buf[32];
+		sprintf(buf, "%c%.17g", KeyNumber, (double)lua_tonumber(L, idx));
+		pathKey += buf;
+	}
+	pathKey += '\0';
+}
+//////////////////////////////////////////////////////////////////////////////
+// Describe a key for the error messages
+static std::string describeKey(lua_State *L, int idx)
+{
+	char buf[64];
+	switch (lua_type(L, idx))
+	{
+	case LUA_TSTRING:
+		return std::string(".") + lua_tostring(L, idx);
+	case LUA_TNUMBER:
+		sprintf(buf, "[%.14g]", (double)lua_tonumber(L, idx));
+		return buf;
+	default:
+		return std::string("[") + luaL_typename(L, idx) + "]";
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Writes the globals of a state
+class SnapshotSaver
+{
+public:
+	SnapshotSaver(lua_State *L, SnapshotWriter &writer) : mL(L), mWriter(writer), mIds(0), mNextId(0), mGlobals(0), mLibraryGlobals(0) { }
+
+	// returns success flag, see getError
+	// Run it in protected mode (see saveProtected): the state can raise a memory error, so the saver
+	// keeps its strings and containers in members rather than in locals the error would jump over.
+	bool save()
+	{
+		lua_newtable(mL);
+		mIds = lua_gettop(mL);
+		if (!getLibraryPaths())
+			return false;
+		detail::_LuaPushGlobals(mL);
+		int globals = mGlobals = lua_gettop(mL);
+		mPath.clear();
+		addPathObject(globals, mPath, PathTable);
+		for (int pass = PassLibraries; pass < NumPasses; ++pass)
+			findPathObjects(globals, mPath, pass);
+		mWriter.writeByte(PathEnd);
+		return writeValue(globals);
+	}
+	const std::string &getError() const { return mError; }
+	void setError(const std::string &error) { mError = error; mErrorPath.clear(); }
+	// Where the value that couldn't be saved was found, from the globals
+	const std::string &getErrorPath() const { return mErrorPath; }
+
+private:
+	//////////////////////////////////////////////////////////////////////////////
+	// Paths of the library tables and of their C functions and userdata, the ones of a new state
+	bool getLibraryPaths()
+	{
+		lua_State *L = luaL_newstate();
+		if (!L)
+		{
+			mError = "not enough memory";
+			return false;
+		}
+		mPathKey.clear();
+		int status = detail::_LuaCPCall(L, findLibraryPathsProtected, this);
+		lua_close(L);
+		if (status)
+		{
+			mError = "not enough memory";
+			return false;
+		}
+		return true;
+	}
+	static int findLibraryPathsProtected(lua_State *L)
+	{
+		SnapshotSaver *saver = (SnapshotSaver*)lua_touserdata(L, 1);
+		luaL_openlibs(L);
+		detail::_LuaPushGlobals(L);
+		saver->mLibraryGlobals = lua_gettop(L);
+		saver->findLibraryPaths(L, saver->mLibraryGlobals);
+		return 0;
+	}
+	// The key of the path of the table is in mPathKey
+	void findLibraryPaths(lua_State *L, int table)
+	{
+		size_t tableKeySize = mPathKey.size();
+		lua_pushnil(L);
+		while (lua_next(L, table))
+		{
+			int keyType = lua_type(L, -2);
+			if (keyType == LUA_TSTRING || keyType == LUA_TNUMBER)
+			{
+				mPathKey.resize(tableKeySize);
+				appendPathKey(L, -2, mPathKey);
+				int depth = (int)std::count(mPathKey.begin(), mPathKey.end(), '\0');
+				switch (lua_type(L, -1))
+				{
+				case LUA_TTABLE:
+					if (depth < 3 && !lua_rawequal(L, -1, mLibraryGlobals))
+					{
+						mLibraryTables.insert(mPathKey);
+						findLibraryPaths(L, lua_gettop(L));
+					}
+					break;
+				case LUA_TFUNCTION:
+				case LUA_TUSERDATA:
+					mLibraryValues.insert(mPathKey);
+					break;
+				}
+			}
+			lua_pop(L, 1);
+		}
+		mPathKey.resize(tableKeySize);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Find the objects that are taken from the state the snapshot is restored into, by their path:
+	// the library tables, and the C functions, userdata and coroutines up to 2 levels from the globals
+	// (3 in the library tables). An object found at several paths takes the one in the libraries first,
+	// then a global, so that it's found in the restored state even if the scripts keep it elsewhere too.
+	enum { PassLibraries, PassGlobals, PassAll, NumPasses };
+	void findPathObjects(int table, std::vector<int> &path, int pass)
+	{
+		if (!lua_checkstack(mL, 5))
+			return;
+		if (detail::_LuaPushObservedBacking(mL, table))
+		{
+			findPathObjects(lua_gettop(mL), path, pass);
+			lua_pop(mL, 1);
+			return;
+		}
+		lua_pushnil(mL);
+		while (lua_next(mL, table))
+		{
+			int key = lua_gettop(mL) - 1;
+			int value = key + 1;
+			int keyType = lua_type(mL, key);
+			if (keyType == LUA_TSTRING || keyType == LUA_TNUMBER)
+			{
+				path.push_back(key);
+				std::string &pathKey = mPathKey;
+				pathKey.clear();
+				for (size_t i = 0; i < path.size(); ++i)
+					appendPathKey(mL, path[i], pathKey);
+				int type = lua_type(mL, value);
+				if (type == LUA_TTABLE)
+				{
+					bool library = mLibraryTables.count(pathKey) != 0;
+					if (library)
+						addPathObject(value, path, PathTable);
+					if (!lua_rawequal(mL, value, mGlobals) && pass != PassGlobals && (path.size() < 2 || (path.size() < 3 && library)))
+						findPathObjects(value, path, pass);
+				}
+				else if ((type == LUA_TFUNCTION && lua_iscfunction(mL, value)) || type == LUA_TUSERDATA
+					|| type == LUA_TLIGHTUSERDATA || type == LUA_TTHREAD)
+				{
+					if (pass == PassAll || (pass == PassGlobals && path.size() == 1)
+						|| mLibraryValues.count(pathKey))
+						addPathObject(value, path, PathValue);
+				}
+				path.pop_back();
+			}
+			lua_pop(mL, 1);
+		}
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Write the path of an object, unless it already has one
+	// The library tables get a negative id until their fields are written
+	void addPathObject(int value, const std::vector<int> &path, int kind)
+	{
+		lua_pushvalue(mL, value);
+		lua_rawget(mL, mIds);
+		bool known = !lua_isnil(mL, -1);
+		lua_pop(mL, 1);
+		if (known)
+			return;
+		int id = ++mNextId;
+		lua_pushvalue(mL, value);
+		lua_pushinteger(mL, kind == PathTable ? -id : id);
+		lua_rawset(mL, mIds);
+		mWriter.writeByte(kind);
+		mWriter.writeSize(path.size());
+		for (size_t i = 0; i < path.size(); ++i)
+		{
+			if (lua_type(mL, path[i]) == LUA_TSTRING)
+			{
+				size_t len;
+				const char *s = lua_tolstring(mL, path[i], &len);
+				mWriter.writeByte(KeyString);
+				mWriter.writeString(s, len);
+			}
+			else
+			{
+				mWriter.writeByte(KeyNumber);
+				mWriter.writeNumber((double)lua_tonumber(mL, path[i]));
+			}
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Give the next id to the object at idx
+	int newId(int idx)
+	{
+		lua_pushvalue(mL, idx);
+		lua_pushinteger(mL, ++mNextId);
+		lua_rawset(mL, mIds);
+		return mNextId;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Write the value at idx (a positive index), objects are only written the first time
+	bool writeValue(int idx)
+	{
+		int type = lua_type(mL, idx);
+		switch (type)
+		{
+		case LUA_TNIL:
+			mWriter.writeByte(TagNil);
+			return true;
+		case LUA_TBOOLEAN:
+			mWriter.writeByte(lua_toboolean(mL, idx) ? TagTrue : TagFalse);
+			return true;
+		case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+			if (lua_isinteger(mL, idx))
+			{
+				lua_Integer n = lua_tointeger(mL, idx);
+				mWriter.writeByte(TagInteger);
+				mWriter.write(&n, sizeof(n));
+				return true;
+			}
+#endif
+			mWriter.writeByte(TagNumber);
+			mWriter.writeNumber((double)lua_tonumber(mL, idx));
+			return true;
+		}
+
+		if (!lua_checkstack(mL, 8))
+		{
+			mError = "the tables are nested too deeply";
+			return false;
+		}
+		lua_pushvalue(mL, idx);
+		lua_rawget(mL, mIds);
+		int id = (int)lua_tointeger(mL, -1);
+		lua_pop(mL, 1);
+		if (id > 0)
+		{
+			mWriter.writeByte(TagRef);
+			mWriter.writeSize(id);
+			return true;
+		}
+		if (id < 0)
+		{
+			// Library table, its fields go into the one of the restored state
+			lua_pushvalue(mL, idx);
+			lua_pushinteger(mL, -id);
+			lua_rawset(mL, mIds);
+			mWriter.writeByte(TagLibraryTable);
+			mWriter.writeSize(-id);
+			return writeFields(idx);
+		}
+
+		switch (type)
+		{
+		case LUA_TSTRING:
+		{
+			newId(idx);
+			size_t len;
+			const char *s = lua_tolstring(mL, idx, &len);
+			mWriter.writeByte(TagString);
+			mWriter.writeString(s, len);
+			return true;
+		}
+		case LUA_TTABLE:
+		{
+			newId(idx);
+			mWriter.writeByte(TagTable);
+			// An observed table is saved as its backing table, with its fields and previous metatable
+			int fields = idx;
+			if (detail::_LuaPushObservedBacking(mL, idx))
+				fields = lua_gettop(mL);
+			bool ok = true;
+			if (lua_getmetatable(mL, fields))
+			{
+				ok = writeValue(lua_gettop(mL));
+				lua_pop(mL, 1);
+				if (!ok)
+					mErrorPath.insert(0, "(metatable)");
+			}
+			else
+				mWriter.writeByte(TagNil);
+			ok = ok && writeFields(fields);
+			if (fields != idx)
+				lua_remove(mL, fields);
+			return ok;
+		}
+		case LUA_TFUNCTION:
+			if (!lua_iscfunction(mL, idx))
+				return writeFunction(idx);
+			break;
+		}
+		mError = std::string("a ") + (type == LUA_TFUNCTION ? "C function" : lua_typename(mL, type))
+			+ " isn't at a path that can be restored (2 levels from the globals at most)";
+		return false;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Write the fields of the table at idx
+	bool writeFields(int idx)
+	{
+		lua_pushnil(mL);
+		while (lua_next(mL, idx))
+		{
+			int key = lua_gettop(mL) - 1;
+			if (!writeValue(key) || !writeValue(key + 1))
+			{
+				mErrorPath.insert(0, describeKey(mL, key));
+				lua_pop(mL, 2);
+				return false;
+			}
+			lua_pop(mL, 1);
+		}
+		mWriter.writeByte(TagEnd);
+		return true;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Write the Lua function at idx: its bytecode and its upvalues
+	bool writeFunction(int idx)
+	{
+		int id = newId(idx);
+		mWriter.writeByte(TagFunction);
+		mCode.clear();
+		lua_pushvalue(mL, idx);
+		int res = detail::_LuaDump(mL, writeChunk, &mCode, false);
+		lua_pop(mL, 1);
+		if (res)
+		{
+			mError = "a function couldn't be dumped";
+			return false;
+		}
+		mWriter.writeString(mCode.data(), mCode.size());
+
+		int numUpvalues = 0;
+		while (lua_getupvalue(mL, idx, numUpvalues + 1))
+		{
+			lua_pop(mL, 1);
+			numUpvalues++;
+		}
+		mWriter.writeSize(numUpvalues);
+		for (int n = 1; n <= numUpvalues; ++n)
+		{
+			// Upvalues shared with a closure written before are joined to its upvalue
+			void *upvalueId = detail::_LuaUpvalueId(mL, idx, n);
+			if (upvalueId)
+			{
+				std::map<void*, std::pair<int, int> >::const_iterator it = mUpvalues.find(upvalueId);
+				if (it != mUpvalues.end())
+				{
+					mWriter.writeByte(UpvalueJoin);
+					mWriter.writeSize(it->second.first);
+					mWriter.writeSize(it->second.second);
+					continue;
+				}
+				mUpvalues[upvalueId] = std::make_pair(id, n);
+			}
+			mWriter.writeByte(UpvalueValue);
+			// (the name belongs to the function, which stays on the stack)
+			const char *name = lua_getupvalue(mL, idx, n);
+			bool ok = writeValue(lua_gettop(mL));
+			lua_pop(mL, 1);
+			if (!ok)
+			{
+				mErrorPath.insert(0, std::string("(upvalue ") + (name && *name ? name : "?") + ")");
+				return false;
+			}
+		}
+#if LUA_VERSION_NUM == 501
+		lua_getfenv(mL, idx);
+		bool ok = writeValue(lua_gettop(mL));
+		lua_pop(mL, 1);
+		if (!ok)
+		{
+			mErrorPath.insert(0, "(environment)");
+			return false;
+		}
+#endif
+		return true;
+	}
+
+	lua_State			*mL;
+	SnapshotWriter		&mWriter;
+	// Stack index of the table of the ids of the objects written
+	int					mIds;
+	int					mNextId;
+	// Stack index of the globals
+	int					mGlobals;
+	// Stack index of the globals of the state of getLibraryPaths
+	int					mLibraryGlobals;
+	// Path being explored, current path key, and the bytecode being written
+	std::vector<int>	mPath;
+	std::string			mPathKey;
+	std::string			mCode;
+	// Keys of the paths of the library tables and values, see appendPathKey
+	std::set<std::string>	mLibraryTables;
+	std::set<std::string>	mLibraryValues;
+	// Upvalues written, with the id of the closure and the index of the upvalue
+	std::map<void*, std::pair<int, int> >	mUpvalues;
+	std::string			mError;
+	std::string			mErrorPath;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Reads the globals of a state
+class SnapshotRestorer
+{
+public:
+	SnapshotRestorer(lua_State *L, SnapshotReader &reader) : mL(L), mReader(reader), mObjects(0), mNextId(0) { }
+
+	// returns false if the snapshot couldn't be read, see getError
+	// Run it in protected mode (see restoreProtected), like SnapshotSaver::save
+	bool restore()
+	{
+		lua_newtable(mL);
+		mObjects = lua_gettop(mL);
+		detail::_LuaPushGlobals(mL);
+		int globals = lua_gettop(mL);
+		for (;;)
+		{
+			int kind = mReader.readByte();
+			if (kind == PathEnd)
+				break;
+			if ((kind != PathValue && kind != PathTable) || !readPathObject(globals, kind))
+				return fail();
+		}
+		int tag = mReader.readByte();
+		if (tag != TagLibraryTable || !readValue(tag))
+			return fail();
+		return true;
+	}
+	const std::string &getError() const { return mError; }
+	void setError(const std::string &error) { mError = error; }
+	// Paths of the objects missing from the restored state, they were restored as nil
+	const std::string &getMissing() const { return mMissing; }
+
+private:
+	//////////////////////////////////////////////////////////////////////////////
+	bool fail()
+	{
+		if (mError.empty())
+			mError = "the file is truncated or corrupted";
+		return false;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Get an object from the globals of the state by its path
+	bool readPathObject(int globals, int kind)
+	{
+		unsigned long long numKeys;
+		if (!mReader.readSize(numKeys) || numKeys > 3)
+			return false;
+		std::string &name = mName;
+		name.clear();
+		lua_pushvalue(mL, globals);
+		for (unsigned long long i = 0; i < numKeys; ++i)
+		{
+			int keyType = mReader.readByte();
+			if (keyType == KeyString)
+			{
+				unsigned long long len;
+				const char *s = mReader.readSize(len) ? mReader.read((size_t)len) : 0;
+				if (!s)
+					return false;
+				lua_pushlstring(mL, s, (size_t)len);
+			}
+			else if (keyType == KeyNumber)
+			{
+				double n;
+				if (!mReader.readNumber(n))
+					return false;
+				lua_pushnumber(mL, n);
+			}
+			else
+				return false;
+			name += describeKey(mL, -1);
+			if (lua_istable(mL, -2))
+				lua_rawget(mL, -2);
+			else
+			{
+				lua_pop(mL, 1);
+				lua_pushnil(mL);
+			}
+			lua_remove(mL, -2);
+		}
+		if (kind == PathTable && !lua_istable(mL, -1))
+		{
+			lua_pop(mL, 1);
+			lua_newtable(mL);
+		}
+		else if (kind == PathValue && lua_isnil(mL, -1))
+			mMissing += (mMissing.empty() ? "" : ", ") + name.substr(name[0] == '.' ? 1 : 0);
+		lua_rawseti(mL, mObjects, ++mNextId);
+		return true;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Keep the object at the top of the stack with the next id
+	int newId()
+	{
+		lua_pushvalue(mL, -1);
+		lua_rawseti(mL, mObjects, ++mNextId);
+		return mNextId;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Get an object read before
+	bool pushObject(int type)
+	{
+		unsigned long long id;
+		if (!mReader.readSize(id) || !id || id > (unsigned long long)mNextId)
+			return false;
+		lua_rawgeti(mL, mObjects, (int)id);
+		return type == LUA_TNONE || lua_type(mL, -1) == type;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Push the value starting with tag
+	bool readValue(int tag)
+	{
+		if (!lua_checkstack(mL, 8))
+		{
+			mError = "the tables are nested too deeply";
+			return false;
+		}
+		switch (tag)
+		{
+		case TagNil:
+			lua_pushnil(mL);
+			return true;
+		case TagFalse:
+		case TagTrue:
+			lua_pushboolean(mL, tag == TagTrue);
+			return true;
+#if LUA_VERSION_NUM >= 503
+		case TagInteger:
+		{
+			lua_Integer n;
+			const char *p = mReader.read(sizeof(n));
+			if (!p)
+				return false;
+			memcpy(&n, p, sizeof(n));
+			lua_pushinteger(mL, n);
+			return true;
+		}
+#endif
+		case TagNumber:
+		{
+			double n;
+			if (!mReader.readNumber(n))
+				return false;
+			lua_pushnumber(mL, (lua_Number)n);
+			return true;
+		}
+		case TagString:
+		{
+			unsigned long long len;
+			const char *s = mReader.readSize(len) ? mReader.read((size_t)len) : 0;
+			if (!s)
+				return false;
+			lua_pushlstring(mL, s, (size_t)len);
+			newId();
+			return true;
+		}
+		case TagRef:
+			return pushObject(LUA_TNONE);
+		case TagTable:
+		{
+			lua_newtable(mL);
+			int table = lua_gettop(mL);
+			newId();
+			if (!readValue(mReader.readByte()))
+				return false;
+			if (lua_istable(mL, -1))
+				lua_setmetatable(mL, table);
+			else
+				lua_pop(mL, 1);
+			return readFields(table);
+		}
+		case TagLibraryTable:
+			return pushObject(LUA_TTABLE) && readFields(lua_gettop(mL));
+		case TagFunction:
+			return readFunction();
+		}
+		return false;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Read the fields of the table at idx
+	bool readFields(int idx)
+	{
+		for (;;)
+		{
+			int tag = mReader.readByte();
+			if (tag == TagEnd)
+				return true;
+			if (!readValue(tag))
+				return false;
+			if (lua_isnil(mL, -1) || !readValue(mReader.readByte()))
+				return false;
+			lua_rawset(mL, idx);
+		}
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Read a Lua function and set its upvalues
+	bool readFunction()
+	{
+		unsigned long long len;
+		const char *code = mReader.readSize(len) ? mReader.read((size_t)len) : 0;
+		if (!code)
+			return false;
+		if (luaL_loadbuffer(mL, code, (size_t)len, "=snapshot"))
+		{
+			mError = std::string("a function couldn't be loaded: ") + lua_tostring(mL, -1);
+			return false;
+		}
+		int func = lua_gettop(mL);
+		newId();
+		unsigned long long numUpvalues;
+		if (!mReader.readSize(numUpvalues))
+			return false;
+		for (int n = 1; n <= (int)numUpvalues; ++n)
+		{
+			int kind = mReader.readByte();
+			if (kind == UpvalueValue)
+			{
+				if (!readValue(mReader.readByte()))
+					return false;
+				if (!lua_setupvalue(mL, func, n))
+					lua_pop(mL, 1);
+			}
+			else if (kind == UpvalueJoin)
+			{
+				unsigned long long upvalue;
+				if (!pushObject(LUA_TFUNCTION) || !mReader.readSize(upvalue))
+					return false;
+				detail::_LuaUpvalueJoin(mL, func, n, lua_gettop(mL), (int)upvalue);
+				lua_pop(mL, 1);
+			}
+			else
+				return false;
+		}
+#if LUA_VERSION_NUM == 501
+		if (!readValue(mReader.readByte()))
+			return false;
+		if (lua_istable(mL, -1))
+			lua_setfenv(mL, func);
+		else
+			lua_pop(mL, 1);
+#endif
+		return true;
+	}
+
+	lua_State		*mL;
+	SnapshotReader	&mReader;
+	// Stack index of the objects read, by id
+	int				mObjects;
+	int				mNextId;
+	// Path of the object read by readPathObject
+	std::string		mName;
+	std::string		mError;
+	std::string		mMissing;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Write the header, it only matches the same Lua version and number formats
+static void writeHeader(SnapshotWriter &writer)
+{
+	writer.write(gMagic, sizeof(gMagic));
+	writer.writeSize(LUA_VERSION_NUM);
+#ifdef LUAJIT_VERSION
+	writer.writeByte(1);
+#else
+	writer.writeByte(0);
+#endif
+	writer.writeByte(sizeof(lua_Number));
+	writer.writeByte(sizeof(lua_Integer));
+	writer.writeNumber(gNumberCheck);
+}
+static bool readHeader(SnapshotReader &reader)
+{
+	const char *magic = reader.read(sizeof(gMagic));
+	if (!magic || memcmp(magic, gMagic, sizeof(gMagic)))
+		return false;
+	unsigned long long version;
+	double check;
+#ifdef LUAJIT_VERSION
+	int jit = 1;
+#else
+	int jit = 0;
+#endif
+	return reader.readSize(version) && version == LUA_VERSION_NUM
+		&& reader.readByte() == jit
+		&& reader.readByte() == sizeof(lua_Number)
+		&& reader.readByte() == sizeof(lua_Integer)
+		&& reader.readNumber(check) && check == gNumberCheck;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Protected call of SnapshotSaver::save, so that a memory error doesn't reach the panic function
+struct SaveCall
+{
+	SnapshotSaver	*saver;
+	bool			saved;
+};
+static int saveProtected(lua_State *L)
+{
+	SaveCall *call = (SaveCall*)lua_touserdata(L, 1);
+	call->saved = call->saver->save();
+	return 0;
+}
+// Protected call of SnapshotRestorer::restore, a corrupted file can also make it raise an error (a NaN key)
+struct RestoreCall
+{
+	SnapshotRestorer	*restorer;
+	bool				restored;
+};
+static int restoreProtected(lua_State *L)
+{
+	RestoreCall *call = (RestoreCall*)lua_touserdata(L, 1);
+	call->restored = call->restorer->restore();
+	return 0;
+}
+
+namespace detail {;
+
+////////////////////////////////////////////////////////////////////////////////////
+// Save the globals of a state to a file, returns success flag
+bool _LuaSaveSnapshot(lua_State *L, const char *fileName)
+{
+	// Written next to it first, so that a failed save doesn't lose the previous snapshot
+	std::string tempName = std::string(fileName) + ".tmp";
+	FILE *file = fopen(tempName.c_str(), "wb");
+	if (!file)
+	{
+		_LuaLogError(LuaErrorFile, "Error in LuaState::saveSnapshot() - %s - couldn't open the file\n", fileName);
+		return false;
+	}
+	int top = lua_gettop(L);
+	SnapshotWriter writer(file);
+	SnapshotSaver saver(L, writer);
+	writeHeader(writer);
+	SaveCall call = { &saver, false };
+	int status = _LuaCPCall(L, saveProtected, &call);
+	if (status)
+	{
+		const char *error = lua_tostring(L, -1);
+		saver.setError(error ? error : "?");
+	}
+	bool saved = !status && call.saved;
+	lua_settop(L, top);
+	bool written = writer.flush();
+	if (fclose(file))
+		written = false;
+	if (saved && written)
+	{
+#ifdef WIN32
+		// rename doesn't replace files on Windows
+		remove(fileName);
+#endif
+		written = rename(tempName.c_str(), fileName) == 0;
+	}
+	if (!saved || !written)
+		remove(tempName.c_str());
+	if (!saved)
+	{
+		const std::string &path = saver.getErrorPath();
+		_LuaLogError("Error in LuaState::saveSnapshot() - %s - %s%s%s\n", fileName, saver.getError().c_str(),
+			path.empty() ? "" : ", at ", path.c_str() + (path.empty() || path[0] != '.' ? 0 : 1));
+		return false;
+	}
+	if (!written)
+	{
+		_LuaLogError(LuaErrorFile, "Error in LuaState::saveSnapshot() - %s - couldn't write the file\n", fileName);
+		return false;
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Restore the globals of a state from a file, returns success flag
+bool _LuaRestoreSnapshot(lua_State *L, const char *fileName)
+{
+	FILE *file = fopen(fileName, "rb");
+	if (!file)
+	{
+		_LuaLogError(LuaErrorFile, "Error in LuaState::restoreSnapshot() - %s - couldn't open the file\n", fileName);
+		return false;
+	}
+	SnapshotReader reader(file);
+	if (!readHeader(reader))
+	{
+		fclose(file);
+		_LuaLogError("Error in LuaState::restoreSnapshot() - %s - not a snapshot of this Lua version\n", fileName);
+		return false;
+	}
+	int top = lua_gettop(L);
+	SnapshotRestorer restorer(L, reader);
+	RestoreCall call = { &restorer, false };
+	int status = _LuaCPCall(L, restoreProtected, &call);
+	if (status)
+	{
+		const char *error = lua_tostring(L, -1);
+		restorer.setError(error ? error : "?");
+	}
+	bool restored = !status && call.restored;
+	lua_settop(L, top);
+	fclose(file);
+	if (!restored)
+	{
+		_LuaLogError("Error in LuaState::restoreSnapshot() - %s - %s\n", fileName, restorer.getError().c_str());
+		return false;
+	}
+	if (!restorer.getMissing().empty())
+	{
+		_LuaLogError("Error in LuaState::restoreSnapshot() - %s - missing from this state: %s\n", fileName, restorer.getMissing().c_str());
+		return false;
+	}
+	return true;
+}
+
+} // detail
+} // LuaUtils
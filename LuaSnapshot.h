@@ -0,0 +1,40 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUASNAPSHOT_H
+#define LUASNAPSHOT_H
+
+#include "LuaBase.h"
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Snapshots of the globals of a Lua state, see LuaState::saveSnapshot and restoreSnapshot
+//
+// A snapshot holds everything reachable from the globals: tables (with their metatables, cycles and
+// shared references), strings, numbers, booleans and Lua functions (bytecode from lua_dump, with their
+// upvalues). Restoring it into a new state is then much faster than running the scripts that built it.
+//
+// What the snapshot can't hold is taken from the state it's restored into, by its path from the globals:
+// - the library tables (string, package, package.loaded...) aren't replaced, the saved fields are set
+//   into the tables of the state (so the modules in package.loaded are restored too)
+// - C functions, userdata and coroutines are looked up at the path where they were found when saving
+//   (up to 2 levels from the globals, 3 inside the library tables), so register the same C functions
+//   before restoring. Saving fails if one is found anywhere else, ex: a C function in a deeper table.
+// The metatable of the globals isn't saved (see LuaState::bindValue), and neither is the environment of
+// the main chunks. Lua 5.1 can't tell shared upvalues apart, so closures sharing one get their own copy.
+// Snapshots only load with the Lua version that saved them.
+
+namespace detail {;
+
+// Save the globals of a state to a file, returns success flag
+bool _LuaSaveSnapshot(lua_State *L, const char *fileName);
+// Restore the globals of a state from a file, returns success flag
+bool _LuaRestoreSnapshot(lua_State *L, const char *fileName);
+
+} // detail
+} // LuaUtils
+
+#endif //LUASNAPSHOT_H
@@ -5,6 +5,13 @@
 
 #include "LuaState.h"
 #include "LuaTable.h"
+#include "LuaReloadManager.h"
+#include "LuaEmbedded.h"
+#include "LuaModuleCache.h"
+#include "LuaSnapshot.h"
+#include "LuaVector.h"
+#include "LuaBuffer.h"
+#include <stdio.h>
 
 // Custom Allocator
 static lua_Alloc gLuaAlloc = 0;
@@ -38,13 +45,20 @@ LuaState::LuaState(bool loadlibs)
 :	mGCEnabled(true)
 {
 	// Create new lua state and keep a shared pointer to it
-	// We give the lua_close as a destroy function so that it gets properly closed by Lua
+	// We give a destroy function that calls lua_close so that it gets properly closed by Lua
 	lua_State *state = gLuaAlloc ? lua_newstate(gLuaAlloc, 0) : luaL_newstate();
-	mL = luaStatePtr(state, lua_close);
+	mL = luaStatePtr(state, detail::_LuaCloseState);
 
 	// Load Lua libraries
 	if (loadlibs)
+	{
 		luaL_openlibs(mL.get());
+		// Each one is inserted first, the embedded modules come before the cached ones
+		if (LuaIsModuleCacheEnabled())
+			detail::_LuaAddModuleCacheSearcher(mL.get());
+		if (LuaGetNumEmbedded())
+			detail::_LuaAddEmbeddedSearcher(mL.get());
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////
@@ -86,35 +100,287 @@ void	LuaState::enableGarbageCollector()
 // If amount is 0, collect all garbage, otherwise, collect some garbage
 void	LuaState::collectGarbage(int amount) const
 {
+	LUAUTILS_TRACE_SCOPE("collectGarbage", "gc");
+	detail::_LuaTelemetry *telemetry = detail::_LuaGetTelemetry(mL.get());
+	unsigned long long start = telemetry ? detail::_LuaGetTimeUS() : 0;
+	size_t memory = telemetry ? getMemUsage() : 0;
 	lua_gc(mL.get(), amount == 0 ? LUA_GCCOLLECT : LUA_GCSTEP, amount);
 	if (!mGCEnabled)
 		lua_gc(mL.get(), LUA_GCSTOP, 0);
+	if (telemetry)
+		detail::_LuaRecordGC(telemetry, amount == 0, start, memory, getMemUsage());
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Record the collections made with collectGarbage (duration, memory before and after, time since the
+// previous one), keeping the last numSamples of them, see LuaGCSample. 0 turns the telemetry off.
+// Enabling it again starts over.
+void	LuaState::enableTelemetry(size_t numSamples) const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), "LuaState");
+	detail::_LuaEnableTelemetry(mL.get(), numSamples);
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Get the recorded collections, oldest first
+// returns false if the telemetry isn't enabled
+bool	LuaState::getGCSamples(std::vector<LuaGCSample> &samples) const
+{
+	samples.clear();
+	const detail::_LuaTelemetry *telemetry = detail::_LuaGetTelemetry(mL.get());
+	if (!telemetry)
+		return false;
+	detail::_LuaGetGCSamples(telemetry, samples);
+	return true;
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Export the telemetry in the Prometheus text format, each metric labeled with state="stateName":
+// collection durations and intervals as summaries (quantiles of the recorded collections, totals
+// since the telemetry was enabled), bytes freed and memory used
+// returns false if the telemetry isn't enabled
+bool	LuaState::exportTelemetry(std::string &text, const char *stateName) const
+{
+	text.clear();
+	const detail::_LuaTelemetry *telemetry = detail::_LuaGetTelemetry(mL.get());
+	if (!telemetry)
+		return false;
+	detail::_LuaExportTelemetry(telemetry, getMemUsage(), stateName, text);
+	return true;
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Same, written to a file (ex: for the textfile collector of the node exporter)
+// The export goes to a temporary file that replaces the file, so readers never see a partial one
+// returns success flag
+bool	LuaState::exportTelemetryFile(const char *fileName, const char *stateName) const
+{
+	std::string text;
+	if (!exportTelemetry(text, stateName))
+	{
+		detail::_LuaLogError("Error in LuaState::exportTelemetryFile() - %s - the telemetry isn't enabled\n", fileName);
+		return false;
+	}
+	std::string tempName = std::string(fileName) + ".tmp";
+	FILE *file = fopen(tempName.c_str(), "wb");
+	bool written = file && fwrite(text.data(), 1, text.size(), file) == text.size();
+	if (file && fclose(file))
+		written = false;
+	if (written)
+	{
+#ifdef WIN32
+		// rename doesn't replace files on Windows
+		remove(fileName);
+#endif
+		written = rename(tempName.c_str(), fileName) == 0;
+	}
+	if (!written)
+	{
+		remove(tempName.c_str());
+		detail::_LuaLogError(LuaErrorFile, "Error in LuaState::exportTelemetryFile() - %s - couldn't write the file\n", fileName);
+		return false;
+	}
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Set the instruction, time and memory budgets of the calls into this state, see LuaLimits
+// If this state was created from an existing lua_State, the limits are never freed
+void	LuaState::setLimits(const LuaLimits &limits) const
+{
+	detail::_LuaSetLimits(mL.get(), limits);
+}
+////////////////////////////////////////////////////////////////////////////////////
+LuaLimits	LuaState::getLimits() const
+{
+	return detail::_LuaGetLimits(mL.get());
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Abort the call running in this state, it fails with LuaErrorAborted
+// This only works once limits were set (even with no limit), and can be called from another thread (ex: a watchdog)
+// returns success flag
+bool	LuaState::requestAbort() const
+{
+	return detail::_LuaRequestAbort(mL.get());
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Number of registry references held by the handles of this state (LuaTable, LuaFunction, LuaCoroutine...)
+// They are only tracked when built with LUAUTILS_LEAK_CHECK, otherwise this returns 0
+size_t	LuaState::getNumRefs() const
+{
+	return detail::_LuaGetNumRefs(mL.get());
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Log each live reference with the name of its handle, ex: at shutdown, once all handles should be gone
+// returns the number of references (0 without LUAUTILS_LEAK_CHECK)
+size_t	LuaState::reportRefs() const
+{
+	return detail::_LuaReportRefs(mL.get());
 }
 
 ////////////////////////////////////////////////////////////////////////////////////
 // Run file
+// If a chunk with that name was embedded (see LuaEmbeddedChunk), it runs instead and the file isn't read
+// If a LuaReloadManager is attached to this state, the file gets tracked for hot reload
 // returns true on success
 bool	LuaState::loadFile(const char *fileName) const
 {
-	if (luaL_dofile(mL.get(), fileName))
+	LUAUTILS_STACK_CHECK(mL.get(), fileName);
+	LUAUTILS_TRACE_SCOPE(fileName, "load");
+	const LuaEmbeddedChunk *embedded = LuaFindEmbedded(fileName);
+	// Track it even if it fails, so that it gets loaded once fixed
+	if (!embedded)
+		LuaReloadManager::onFileLoaded(mL.get(), fileName);
+	int top = lua_gettop(mL.get());
+	detail::_LuaLimitScope limits(mL.get());
+	int status = embedded ? detail::_LuaLoadEmbedded(mL.get(), *embedded) : luaL_loadfile(mL.get(), fileName);
+	if (!status)
+		status = lua_pcall(mL.get(), 0, LUA_MULTRET, 0);
+	if (status)
 	{
+		LuaErrorCode code = detail::_LuaGetErrorCode(mL.get(), status);
 		std::string error;
 		luaPopValue(error);
-		detail::_LuaLogError("Error in LuaState::loadFile() - %s\n", error.c_str());
+		detail::_LuaLogError(code, "Error in LuaState::loadFile() - %s\n", error.c_str());
 		return false;
 	}
+	// Drop the values returned by the chunk
+	lua_settop(mL.get(), top);
 	return true;
 }
+////////////////////////////////////////////////////////////////////////////////////
+// Let require() find the embedded modules (see LuaEmbeddedChunk) before the module files
+// The states created with the libraries already have it if chunks were embedded
+// returns false if the package library isn't loaded
+bool	LuaState::addEmbeddedSearcher() const
+{
+	return detail::_LuaAddEmbeddedSearcher(mL.get());
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Let require() use the process-wide module cache (see LuaEnableModuleCache) before the module files
+// The states created with the libraries already have it if the cache is enabled
+// returns false if the package library isn't loaded
+bool	LuaState::addModuleCacheSearcher() const
+{
+	return detail::_LuaAddModuleCacheSearcher(mL.get());
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Set the vector library as the global "vector", for element-wise math on arrays of numbers
+// with C++ kernels, see LuaVector.h
+void	LuaState::openVectorLib() const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), "LuaState");
+	detail::_LuaOpenVectorLib(mL.get());
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Set the buffer library as the global "buffer", to build strings in C++ memory
+// without the intermediate strings of concatenation, see LuaBuffer.h
+void	LuaState::openBufferLib() const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), "LuaState");
+	detail::_LuaOpenBufferLib(mL.get());
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Set the csv library as the global "csv", to load CSV files from the scripts, see LuaCSV.h
+void	LuaState::openCSVLib() const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), "LuaState");
+	detail::_LuaOpenCSVLib(mL.get());
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Load a CSV file into a table, parsed in C++ from the memory mapped file, see LuaCSVOptions
+// returns success flag
+bool	LuaState::loadCSV(const char *fileName, LuaTable &res, const LuaCSVOptions &options) const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), fileName);
+	if (!detail::_LuaLoadCSV(mL.get(), fileName, options))
+		return false;
+	return res.init(mL, fileName, false);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////
 // Run string
 // returns true on success
 bool	LuaState::loadString(const char *str) const
 {
-	if (luaL_dostring(mL.get(), str))
+	LUAUTILS_STACK_CHECK(mL.get(), "LuaState");
+	LUAUTILS_TRACE_SCOPE("loadString", "load");
+	int top = lua_gettop(mL.get());
+	detail::_LuaLimitScope limits(mL.get());
+	int status = luaL_loadstring(mL.get(), str);
+	if (!status)
+		status = lua_pcall(mL.get(), 0, LUA_MULTRET, 0);
+	if (status)
+	{
+		LuaErrorCode code = detail::_LuaGetErrorCode(mL.get(), status);
+		std::string error;
+		luaPopValue(error);
+		detail::_LuaLogError(code, "Error in LuaState::loadString() - %s\n", error.c_str());
+		return false;
+	}
+	// Drop the values returned by the chunk
+	lua_settop(mL.get(), top);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Save the globals of this state to a file: the tables, strings, numbers and Lua functions
+// (with their upvalues) reachable from them, see LuaSnapshot.h for what can be saved
+// The previous file is only replaced once the snapshot is written
+// returns success flag
+bool	LuaState::saveSnapshot(const char *fileName) const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), fileName);
+	return detail::_LuaSaveSnapshot(mL.get(), fileName);
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Restore the globals saved with saveSnapshot, into a new state created with the same libraries
+// and the same C functions. Only restore your own snapshots, they contain bytecode.
+// If it fails, the globals may be partly restored
+// returns success flag
+bool	LuaState::restoreSnapshot(const char *fileName) const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), fileName);
+	return detail::_LuaRestoreSnapshot(mL.get(), fileName);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Function and user data given to runProtected
+struct ProtectedBatch
+{
+	void	(*func)(void *userData);
+	void	*userData;
+};
+static int runProtectedBatch(lua_State *L)
+{
+	ProtectedBatch *batch = (ProtectedBatch*)lua_touserdata(L, 1);
+	batch->func(batch->userData);
+	return 0;
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Run func(userData) inside a single protected frame, so that it can make a batch of
+// LuaFunction<Ret, LuaCallUnprotected> calls without paying for a protected call each time.
+// The first error aborts the whole batch and gets logged.
+// returns true on success
+bool	LuaState::runProtected(void (*func)(void *userData), void *userData) const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), "LuaState");
+	ProtectedBatch batch;
+	batch.func = func;
+	batch.userData = userData;
+	int top = lua_gettop(mL.get());
+	detail::_LuaLimitScope limits(mL.get());
+	int status = detail::_LuaCPCall(mL.get(), runProtectedBatch, &batch);
+	if (status)
 	{
+		LuaErrorCode code = detail::_LuaGetErrorCode(mL.get(), status);
 		std::string error;
 		luaPopValue(error);
-		detail::_LuaLogError("Error in LuaState::loadString() - %s\n", error.c_str());
+		detail::_LuaLogError(code, "Error in LuaState::runProtected() - %s\n", error.c_str());
+		// The batch may have been aborted with values on the stack
+		lua_settop(mL.get(), top);
 		return false;
 	}
 	return true;
@@ -125,16 +391,38 @@ bool	LuaState::loadString(const char *str) const
 // returns success flag
 bool	LuaState::getValue(const char *globalName, LuaTable &res) const
 {
+	LUAUTILS_STACK_CHECK(mL.get(), globalName);
 	lua_getglobal(mL.get(), globalName);
 	return res.init(mL, globalName, false);
 }
 
+////////////////////////////////////////////////////////////////////////////////////
+// Bind a global to accessor Lua C functions, the getter returns the value,
+// the setter gets the new value as its first argument (no setter means it's read only)
+void	LuaState::bindAccessor(const char *globalName, lua_CFunction getter, lua_CFunction setter) const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), globalName);
+	detail::_LuaPushGlobals(mL.get());
+	detail::_LuaBindValue(mL.get(), globalName, detail::_LuaMakeBoundAccessor(getter, setter));
+	lua_pop(mL.get(), 1);
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Remove the binding of a global, it keeps its last value as a normal global
+void	LuaState::unbindValue(const char *globalName) const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), globalName);
+	detail::_LuaPushGlobals(mL.get());
+	detail::_LuaUnbindValue(mL.get(), globalName);
+	lua_pop(mL.get(), 1);
+}
+
 ////////////////////////////////////////////////////////////////////////////////////
 // Create a new table
 // If globalName isn't empty, then set the table as a global,
 // otherwise it will be an anonymous table
 void	LuaState::newTable(const char *globalName, LuaTable &table) const
 {
+	LUAUTILS_STACK_CHECK(mL.get(), globalName);
 	if (strlen(globalName))
 	{
 		table.init(mL, globalName, true);
@@ -181,6 +469,7 @@ int		LuaStateCFunc::getNumArgs() const
 // returns success flag
 bool	LuaStateCFunc::getArg(int argument, LuaTable &res) const
 {
+	LUAUTILS_STACK_CHECK(mL.get(), "LuaStateCFunc");
 	if (argument <= 0 || getNumArgs() < argument)
 		return false;
 	lua_pushvalue(mL.get(), argument);
@@ -188,10 +477,37 @@ bool	LuaStateCFunc::getArg(int argument, LuaTable &res) const
 }
 bool	LuaStateCFunc::getArg(int argument, detail::_LuaFunctionBase &res) const
 {
+	LUAUTILS_STACK_CHECK(mL.get(), "LuaStateCFunc");
 	if (argument <= 0 || getNumArgs() < argument)
 		return false;
 	lua_pushvalue(mL.get(), argument);
 	return res.initFromStack(mL, "<anon>");
 }
 
+////////////////////////////////////////////////////////////////////////////////////
+// Get a table or function argument without creating a registry reference: the handle reads
+// the argument at its stack index, so it's only valid until the C function returns.
+// A copy of the handle gets a registry reference, so copy it to keep the table or function.
+// returns false if the argument isn't a table (or a function)
+bool	LuaStateCFunc::getStackArg(int argument, LuaTable &res) const
+{
+	if (argument <= 0 || getNumArgs() < argument || !lua_istable(mL.get(), argument))
+	{
+		res.unref();
+		return false;
+	}
+	res.initFromStackIndex(mL, "<anon>", argument);
+	return true;
+}
+bool	LuaStateCFunc::getStackArg(int argument, detail::_LuaFunctionBase &res) const
+{
+	if (argument <= 0 || getNumArgs() < argument || !lua_isfunction(mL.get(), argument))
+	{
+		res.unref();
+		return false;
+	}
+	res.initFromStackIndex(mL, "<anon>", argument);
+	return true;
+}
+
 } // LuaUtils
@@ -8,6 +8,10 @@
 
 #include "LuaBase.h"
 #include "LuaFunction.h"
+#include "LuaBinding.h"
+#include "LuaLimits.h"
+#include "LuaTelemetry.h"
+#include "LuaCSV.h"
 #include <string.h>
 
 namespace LuaUtils {;
@@ -40,28 +44,120 @@ public:
 	////////////////////////////////////////////////////////////////////////////////////
 	// If amount is 0, collect all garbage, otherwise, collect some garbage
 	void	collectGarbage(int amount = 0) const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Record the collections made with collectGarbage (duration, memory before and after, time since the
+	// previous one), keeping the last numSamples of them, see LuaGCSample. 0 turns the telemetry off.
+	// Enabling it again starts over.
+	void	enableTelemetry(size_t numSamples = 256) const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Get the recorded collections, oldest first
+	// returns false if the telemetry isn't enabled
+	bool	getGCSamples(std::vector<LuaGCSample> &samples) const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Export the telemetry in the Prometheus text format, each metric labeled with state="stateName":
+	// collection durations and intervals as summaries (quantiles of the recorded collections, totals
+	// since the telemetry was enabled), bytes freed and memory used
+	// returns false if the telemetry isn't enabled
+	bool	exportTelemetry(std::string &text, const char *stateName) const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Same, written to a file (ex: for the textfile collector of the node exporter)
+	// The export goes to a temporary file that replaces the file, so readers never see a partial one
+	// returns success flag
+	bool	exportTelemetryFile(const char *fileName, const char *stateName) const;
+
+	////////////////////////////////////////////////////////////////////////////////////
+	// Set the instruction, time and memory budgets of the calls into this state, see LuaLimits
+	// If this state was created from an existing lua_State, the limits are never freed
+	void		setLimits(const LuaLimits &limits) const;
+	////////////////////////////////////////////////////////////////////////////////////
+	LuaLimits	getLimits() const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Abort the call running in this state, it fails with LuaErrorAborted
+	// This only works once limits were set (even with no limit), and can be called from another thread (ex: a watchdog)
+	// returns success flag
+	bool		requestAbort() const;
+
+	////////////////////////////////////////////////////////////////////////////////////
+	// Number of registry references held by the handles of this state (LuaTable, LuaFunction, LuaCoroutine...)
+	// They are only tracked when built with LUAUTILS_LEAK_CHECK, otherwise this returns 0
+	size_t	getNumRefs() const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Log each live reference with the name of its handle, ex: at shutdown, once all handles should be gone
+	// returns the number of references (0 without LUAUTILS_LEAK_CHECK)
+	size_t	reportRefs() const;
 
 	////////////////////////////////////////////////////////////////////////////////////
 	// Run file
+	// If a chunk with that name was embedded (see LuaEmbeddedChunk), it runs instead and the file isn't read
+	// If a LuaReloadManager is attached to this state, the file gets tracked for hot reload
 	// returns true on success
 	bool	loadFile(const char *fileName) const;
 	////////////////////////////////////////////////////////////////////////////////////
+	// Let require() find the embedded modules (see LuaEmbeddedChunk) before the module files
+	// The states created with the libraries already have it if chunks were embedded
+	// returns false if the package library isn't loaded
+	bool	addEmbeddedSearcher() const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Let require() use the process-wide module cache (see LuaEnableModuleCache) before the module files
+	// The states created with the libraries already have it if the cache is enabled
+	// returns false if the package library isn't loaded
+	bool	addModuleCacheSearcher() const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Set the vector library as the global "vector", for element-wise math on arrays of numbers
+	// with C++ kernels, see LuaVector.h
+	void	openVectorLib() const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Set the buffer library as the global "buffer", to build strings in C++ memory
+	// without the intermediate strings of concatenation, see LuaBuffer.h
+	void	openBufferLib() const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Set the csv library as the global "csv", to load CSV files from the scripts, see LuaCSV.h
+	void	openCSVLib() const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Load a CSV file into a table, parsed in C++ from the memory mapped file, see LuaCSVOptions
+	// returns success flag
+	bool	loadCSV(const char *fileName, LuaTable &res, const LuaCSVOptions &options = LuaCSVOptions()) const;
+	////////////////////////////////////////////////////////////////////////////////////
 	// Run string
 	// returns true on success
 	bool	loadString(const char *str) const;
 
+	////////////////////////////////////////////////////////////////////////////////////
+	// Save the globals of this state to a file: the tables, strings, numbers and Lua functions
+	// (with their upvalues) reachable from them, see LuaSnapshot.h for what can be saved
+	// The previous file is only replaced once the snapshot is written
+	// returns success flag
+	bool	saveSnapshot(const char *fileName) const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Restore the globals saved with saveSnapshot, into a new state created with the same libraries
+	// and the same C functions. Only restore your own snapshots, they contain bytecode.
+	// If it fails, the globals may be partly restored
+	// returns success flag
+	bool	restoreSnapshot(const char *fileName) const;
+
+	////////////////////////////////////////////////////////////////////////////////////
+	// Run func(userData) inside a single protected frame, so that it can make a batch of
+	// LuaFunction<Ret, LuaCallUnprotected> calls without paying for a protected call each time.
+	// The first error aborts the whole batch and gets logged.
+	// WARNING: an error jumps straight back here, skipping the destructors of the objects created
+	// in between, unless Lua is compiled as C++, so keep the batch simple
+	// returns true on success
+	bool	runProtected(void (*func)(void *userData), void *userData) const;
+
 	////////////////////////////////////////////////////////////////////////////////////
 	// Get a global value of any C-Lua convertible type (bool, int, float double, string, lua_CFunction, LuaTable, LuaFunction)
 	// returns success flag
 	template <typename T>
 	bool	getValue(const char *globalName, T &res) const
 	{
+		LUAUTILS_STACK_CHECK(mL.get(), globalName);
 		lua_getglobal(mL.get(), globalName);
 		return luaPopValue(res);
 	}
-	template <typename Ret>
-	bool	getValue(const char *globalName, LuaFunction<Ret> &res) const
+	template <typename Ret, typename CallPolicy>
+	bool	getValue(const char *globalName, LuaFunction<Ret, CallPolicy> &res) const
 	{
+		LUAUTILS_STACK_CHECK(mL.get(), globalName);
 		lua_getglobal(mL.get(), globalName);
 		return res.initFromStack(mL, globalName);
 	}
@@ -72,16 +168,45 @@ public:
 	template <typename T>
 	void	setValue(const char *globalName, const T &value) const
 	{
+		LUAUTILS_STACK_CHECK(mL.get(), globalName);
+		detail::_LuaPushGlobals(mL.get());
 		luaPushValue(value);
-		lua_setglobal(mL.get(), globalName);
+		detail::_LuaSetField(mL.get(), globalName, "LuaState::setValue");
+		lua_pop(mL.get(), 1);
 	}
 
+	////////////////////////////////////////////////////////////////////////////////////
+	// Bind a global to a C++ variable (bool, int, unsigned char, float, double or string)
+	// Lua always reads the current value of the variable, and writes from Lua or setValue go to the variable
+	// (a value with the wrong type, or a write to a read only binding, raises a Lua error in Lua,
+	// and is logged as an error by setValue).
+	// The variable must outlive the binding.
+	template <typename T>
+	void	bindValue(const char *globalName, T *var, bool readOnly = false) const
+	{
+		LUAUTILS_STACK_CHECK(mL.get(), globalName);
+		detail::_LuaPushGlobals(mL.get());
+		detail::_LuaBindValue(mL.get(), globalName, detail::_LuaMakeBoundValue(var, readOnly));
+		lua_pop(mL.get(), 1);
+	}
+	////////////////////////////////////////////////////////////////////////////////////
+	// Bind a global to accessor Lua C functions, the getter returns the value,
+	// the setter gets the new value as its first argument (no setter means it's read only)
+	void	bindAccessor(const char *globalName, lua_CFunction getter, lua_CFunction setter = 0) const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Remove the binding of a global, it keeps its last value as a normal global
+	void	unbindValue(const char *globalName) const;
+
 	////////////////////////////////////////////////////////////////////////////////////
 	// Create a new table
 	// If globalName isn't empty, then set the table as a global,
 	// otherwise it will be an anonymous table
 	void	newTable(const char *globalName, LuaTable &table) const;
 
+	//////////////////////////////////////////////////////////////////////////////
+	friend class LuaUtils::LuaTable;
+	friend class LuaUtils::LuaReloadManager;
+
 private:
 
 	// Garbage collector enabled flag
@@ -121,7 +246,7 @@ public:
 	void	checkArg(int argument, T &res) const
 	{
 		if (!getArg(argument, res))
-			luaL_typerror(mL.get(), argument, typeid(T).name());
+			detail::_LuaTypeError(mL.get(), argument, typeid(T).name());
 	}
 	////////////////////////////////////////////////////////////////////////////////////
 	// Get the top index of the stack
@@ -131,17 +256,26 @@ public:
 	////////////////////////////////////////////////////////////////////////////////////
 	// Get a value from given argument, if possible (no error will be thrown if it isn't)
 	// This is used to get optional arguments from Lua C functions
+	// The values are read in place, tables and functions get a registry reference (see getStackArg)
 	// returns success flag
 	template <typename T>
 	bool	getArg(int argument, T &res) const
 	{
+		LUAUTILS_STACK_CHECK(mL.get(), "LuaStateCFunc");
 		if (argument <= 0 || getNumArgs() < argument)
 			return false;
-		lua_pushvalue(mL.get(), argument);
-		return luaPopValue(res);
+		return luaGetValue(argument, res);
 	}
 	bool	getArg(int argument, LuaTable &res) const;
 	bool	getArg(int argument, detail::_LuaFunctionBase &res) const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Get a table or function argument without creating a registry reference: the handle reads
+	// the argument at its stack index, so it's only valid until the C function returns.
+	// A copy of the handle gets a registry reference, so copy it to keep the table or function.
+	// WARNING: don't use the handle after the C function returned, or after removing the argument from the stack
+	// returns false if the argument isn't a table (or a function)
+	bool	getStackArg(int argument, LuaTable &res) const;
+	bool	getStackArg(int argument, detail::_LuaFunctionBase &res) const;
 
 	////////////////////////////////////////////////////////////////////////////////////
 	// Set a value at given stackIndex
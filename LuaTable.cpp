@@ -4,18 +4,186 @@
 // Version 1.1
 
 #include "LuaTable.h"
+#include "LuaState.h"
 
 namespace LuaUtils {;
 
+// Results of copyValue
+enum { COPY_FAILED = -1, COPY_SKIPPED = 0, COPY_DONE = 1 };
+
+static int copyValue(lua_State *from, lua_State *to, int srcIdx, int visited);
+
+// Key of the observer in the metatable of observed tables
+static const char gObserverKey = 0;
+// Fields of the observer
+enum { OBSERVER_BACKING = 1, OBSERVER_DIRTY = 2 };
+
+//////////////////////////////////////////////////////////////////////////////
+// Deep copy the table at srcIdx (absolute index in from) and push the copy onto to.
+// visited is the absolute index (in to) of a table mapping source tables to their copies,
+// so shared references and cycles map to a single copy.
+// Works even if from and to are the same state, since only absolute indices are used.
+// On failure, the stacks are left as is, the caller restores them.
+static bool copyTable(lua_State *from, lua_State *to, int srcIdx, int visited)
+{
+	if (!lua_checkstack(from, 4) || !lua_checkstack(to, 4))
+		return false;
+	// Already copied?
+	void *key = (void*)lua_topointer(from, srcIdx);
+	lua_pushlightuserdata(to, key);
+	lua_rawget(to, visited);
+	if (!lua_isnil(to, -1))
+		return true;
+	lua_pop(to, 1);
+	// Observed tables are empty, their fields are in the backing table
+	bool observed = detail::_LuaPushObservedBacking(from, srcIdx);
+	if (observed)
+		srcIdx = lua_gettop(from);
+	// Count the entries so that the copy can be presized
+	int narr = (int)detail::_LuaRawLen(from, srcIdx);
+	int nrec = 0;
+	lua_pushnil(from);
+	while (lua_next(from, srcIdx))
+	{
+		nrec++;
+		lua_pop(from, 1);
+	}
+	nrec = nrec > narr ? nrec - narr : 0;
+	lua_createtable(to, narr, nrec);
+	int dstIdx = lua_gettop(to);
+	lua_pushlightuserdata(to, key);
+	lua_pushvalue(to, dstIdx);
+	lua_rawset(to, visited);
+	// Copy the entries
+	lua_pushnil(from);
+	while (lua_next(from, srcIdx))
+	{
+		int keyIdx = lua_gettop(from) - 1;
+		int res = copyValue(from, to, keyIdx, visited);
+		if (res == COPY_DONE)
+		{
+			res = copyValue(from, to, keyIdx + 1, visited);
+			if (res == COPY_DONE)
+				lua_rawset(to, dstIdx);
+			else
+				lua_pop(to, 1);
+		}
+		if (res == COPY_FAILED)
+			return false;
+		lua_pop(from, 1);
+	}
+	// (the copy is above it if both states are the same)
+	if (observed)
+		lua_remove(from, srcIdx);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Copy the value at srcIdx (absolute index in from) and push it onto to.
+// Nothing is pushed if the value can't cross states.
+static int copyValue(lua_State *from, lua_State *to, int srcIdx, int visited)
+{
+	switch (lua_type(from, srcIdx))
+	{
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+		// Keep the integer subtype (math.type, %d, tostring)
+		if (lua_isinteger(from, srcIdx))
+		{
+			lua_pushinteger(to, lua_tointeger(from, srcIdx));
+			return COPY_DONE;
+		}
+#endif
+		lua_pushnumber(to, lua_tonumber(from, srcIdx));
+		return COPY_DONE;
+	case LUA_TBOOLEAN:
+		lua_pushboolean(to, lua_toboolean(from, srcIdx));
+		return COPY_DONE;
+	case LUA_TSTRING:
+		{
+			size_t len;
+			const char *str = lua_tolstring(from, srcIdx, &len);
+			lua_pushlstring(to, str, len);
+		}
+		return COPY_DONE;
+	case LUA_TTABLE:
+		return copyTable(from, to, srcIdx, visited) ? COPY_DONE : COPY_FAILED;
+	default:
+		return COPY_SKIPPED;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Push the observer of the table at tableIdx, if it's observed
+// Otherwise push nothing and return false
+static bool pushObserver(lua_State *L, int tableIdx)
+{
+	if (!lua_getmetatable(L, tableIdx))
+		return false;
+	lua_pushlightuserdata(L, (void*)&gObserverKey);
+	lua_rawget(L, -2);
+	if (lua_istable(L, -1))
+	{
+		lua_remove(L, -2);
+		return true;
+	}
+	lua_pop(L, 2);
+	return false;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// __newindex of observed tables, the observer is the upvalue
+// Write to the backing table and mark the key as dirty
+static int observedNewIndex(lua_State *L)
+{
+	lua_settop(L, 3);
+	lua_rawgeti(L, lua_upvalueindex(1), OBSERVER_BACKING);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 3);
+	lua_settable(L, 4);
+	lua_rawgeti(L, lua_upvalueindex(1), OBSERVER_DIRTY);
+	lua_pushvalue(L, 2);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, -3);
+	return 0;
+}
+//////////////////////////////////////////////////////////////////////////////
+// __len of observed tables, the backing table is the upvalue
+static int observedLen(lua_State *L)
+{
+	lua_pushinteger(L, (lua_Integer)detail::_LuaRawLen(L, lua_upvalueindex(1)));
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// Iterator returned by __pairs
+static int observedNext(lua_State *L)
+{
+	lua_settop(L, 2);
+	if (lua_next(L, 1))
+		return 2;
+	lua_pushnil(L);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// __pairs of observed tables, the backing table is the upvalue
+static int observedPairs(lua_State *L)
+{
+	lua_pushcfunction(L, observedNext);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_pushnil(L);
+	return 3;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 LuaTable::LuaTable(const LuaTable &other)
+:	mRef(-1)
+,	mStackIdx(0)
 {
 	mL = other.mL;
-	// copy the registry reference
-	if (mL && other.mRef != -1)
+	// copy the registry reference (a stack index gets one, so the copy can outlive the C function)
+	if (mL && other.push())
 	{
-		lua_rawgeti(mL.get(), LUA_REGISTRYINDEX, other.mRef);
-		mRef = luaL_ref(mL.get(), LUA_REGISTRYINDEX);
+		mRef = detail::_LuaRef(mL.get(), other.mName);
 		mName = other.mName;
 	}
 }
@@ -24,11 +192,10 @@ LuaTable &LuaTable::operator=(const LuaTable &other)
 {
 	unref();
 	mL = other.mL;
-	// copy the registry reference
-	if (mL && other.mRef != -1)
+	// copy the registry reference (a stack index gets one, so the copy can outlive the C function)
+	if (mL && other.push())
 	{
-		lua_rawgeti(mL.get(), LUA_REGISTRYINDEX, other.mRef);
-		mRef = luaL_ref(mL.get(), LUA_REGISTRYINDEX);
+		mRef = detail::_LuaRef(mL.get(), other.mName);
 		mName = other.mName;
 	}
 	return *this;
@@ -38,10 +205,17 @@ LuaTable &LuaTable::operator=(const LuaTable &other)
 // Returns the number of int-indexed elements of the table
 size_t	LuaTable::getArraySize() const
 {
+	LUAUTILS_STACK_CHECK(mL.get(), mName);
 	size_t res = 0;
 	if (push())
 	{
-		res = lua_objlen(mL.get(), -1);
+		res = detail::_LuaRawLen(mL.get(), -1);
+		// Observed tables are empty, their fields are in the backing table
+		if (!res && detail::_LuaPushObservedBacking(mL.get(), lua_gettop(mL.get())))
+		{
+			res = detail::_LuaRawLen(mL.get(), -1);
+			lua_pop(mL.get(), 1);
+		}
 		pop();
 	}
 	return res;
@@ -50,6 +224,7 @@ size_t	LuaTable::getArraySize() const
 // Get the table at t.key
 bool	LuaTable::getValue(const char *key, LuaTable &res) const
 {
+	LUAUTILS_STACK_CHECK(mL.get(), mName);
 	bool ret = false;
 	if (push())
 	{
@@ -65,10 +240,11 @@ bool	LuaTable::getValue(const char *key, LuaTable &res) const
 // Get the table at t[i]
 bool	LuaTable::getValue(int i, LuaTable &res) const
 {
+	LUAUTILS_STACK_CHECK(mL.get(), mName);
 	bool ret = false;
 	if (push())
 	{
-		lua_rawgeti(mL.get(), -1, i);
+		detail::_LuaGetIndex(mL.get(), i);
 		char newName[100];
 		_snprintf(newName, 100, "%s[%d]", mName.c_str(), i);
 		ret = res.init(mL, newName, false);
@@ -77,10 +253,169 @@ bool	LuaTable::getValue(int i, LuaTable &res) const
 	return ret;
 }
 
+////////////////////////////////////////////////////////////////////////////////////
+// Bind t.key to accessor Lua C functions, the getter returns the value,
+// the setter gets the new value as its first argument (no setter means it's read only)
+void	LuaTable::bindAccessor(const char *key, lua_CFunction getter, lua_CFunction setter) const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), mName);
+	if (push())
+	{
+		detail::_LuaBindValue(mL.get(), key, detail::_LuaMakeBoundAccessor(getter, setter));
+		pop();
+	}
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Remove the binding of t.key, it keeps its last value as a normal field
+void	LuaTable::unbindValue(const char *key) const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), mName);
+	if (push())
+	{
+		detail::_LuaUnbindValue(mL.get(), key);
+		pop();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Start recording the fields written to this table, see consumeChanges
+// The fields move to a hidden backing table, and this table stays empty with metamethods forwarding
+// to it, so that every write goes through __newindex (from Lua or from setValue).
+// References to the table stay valid, but raw access (rawget, rawset, next) sees an empty table,
+// and so do pairs and # before Lua 5.2 (from 5.2 on they use the __pairs and __len metamethods).
+// A previous metatable moves to the backing table, bindings still work.
+// returns success flag
+bool	LuaTable::observe() const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), mName);
+	if (!push())
+		return false;
+	lua_State *L = mL.get();
+	int table = lua_gettop(L);
+	if (pushObserver(L, table))
+	{
+		lua_settop(L, table);
+		pop();
+		return true;
+	}
+	if (!lua_checkstack(L, 6))
+	{
+		pop();
+		detail::_LuaLogError("Error in LuaTable::observe() - %s - stack overflow\n", mName.c_str());
+		return false;
+	}
+
+	// Move the fields to the backing table
+	lua_createtable(L, (int)detail::_LuaRawLen(L, table), 0);
+	int backing = table + 1;
+	lua_pushnil(L);
+	while (lua_next(L, table))
+	{
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, backing);
+	}
+	// (clearing existing fields is allowed during a traversal)
+	lua_pushnil(L);
+	while (lua_next(L, table))
+	{
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, table);
+	}
+	// The previous metatable keeps working from the backing table
+	if (lua_getmetatable(L, table))
+		lua_setmetatable(L, backing);
+
+	lua_createtable(L, 2, 0);
+	int observer = backing + 1;
+	lua_pushvalue(L, backing);
+	lua_rawseti(L, observer, OBSERVER_BACKING);
+	lua_newtable(L);
+	lua_rawseti(L, observer, OBSERVER_DIRTY);
+
+	lua_createtable(L, 0, 5);
+	int meta = observer + 1;
+	lua_pushlightuserdata(L, (void*)&gObserverKey);
+	lua_pushvalue(L, observer);
+	lua_rawset(L, meta);
+	lua_pushvalue(L, backing);
+	lua_setfield(L, meta, "__index");
+	lua_pushvalue(L, observer);
+	lua_pushcclosure(L, observedNewIndex, 1);
+	lua_setfield(L, meta, "__newindex");
+	lua_pushvalue(L, backing);
+	lua_pushcclosure(L, observedLen, 1);
+	lua_setfield(L, meta, "__len");
+	lua_pushvalue(L, backing);
+	lua_pushcclosure(L, observedPairs, 1);
+	lua_setfield(L, meta, "__pairs");
+	lua_setmetatable(L, table);
+
+	lua_settop(L, table);
+	pop();
+	return true;
+}
+////////////////////////////////////////////////////////////////////////////////////
+bool	LuaTable::isObserved() const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), mName);
+	bool ret = false;
+	if (push())
+	{
+		ret = pushObserver(mL.get(), lua_gettop(mL.get()));
+		if (ret)
+			lua_pop(mL.get(), 1);
+		pop();
+	}
+	return ret;
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Call func for each field of an observed table written since the last call (or since observe),
+// with its current value. A field written several times is only delivered once.
+// Writes made from the callback are delivered by the next call.
+// returns the number of changes
+int		LuaTable::consumeChanges(LuaTableChangeCB func, void *userData) const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), mName);
+	if (!push())
+		return 0;
+	lua_State *L = mL.get();
+	int table = lua_gettop(L);
+	int count = 0;
+	if (pushObserver(L, table))
+	{
+		int observer = table + 1;
+		lua_rawgeti(L, observer, OBSERVER_BACKING);
+		int backing = observer + 1;
+		lua_rawgeti(L, observer, OBSERVER_DIRTY);
+		int dirty = backing + 1;
+		// Start a new set, so that the callback can write to the table
+		lua_newtable(L);
+		lua_rawseti(L, observer, OBSERVER_DIRTY);
+		lua_pushnil(L);
+		while (lua_next(L, dirty))
+		{
+			lua_pop(L, 1);
+			int key = lua_gettop(L);
+			lua_pushvalue(L, key);
+			lua_gettable(L, backing);
+			func(LuaTableChange(mL, key, key + 1), userData);
+			lua_settop(L, key);
+			count++;
+		}
+	}
+	lua_settop(L, table);
+	pop();
+	return count;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////
 // Create a new table at t.key
 void	LuaTable::newTable(const char *key, LuaTable &res) const
 {
+	LUAUTILS_STACK_CHECK(mL.get(), mName);
 	char newName[100];
 	_snprintf(newName, 100, "%s.%s", mName.c_str(), key);
 		res.init(mL, newName, true);
@@ -90,18 +425,52 @@ void	LuaTable::newTable(const char *key, LuaTable &res) const
 // Create a new table at t[i]
 void	LuaTable::newTable(int i, LuaTable &res) const
 {
+	LUAUTILS_STACK_CHECK(mL.get(), mName);
 	char newName[100];
 	_snprintf(newName, 100, "%s[%d]", mName.c_str(), i);
 		res.init(mL, newName, true);
 		setValue(i, res);
 }
 
+////////////////////////////////////////////////////////////////////////////////////
+// Deep copy this table into another Lua state (or the same one), and store a reference to the copy in out.
+// Nested tables, strings, numbers and booleans are copied directly between the two stacks,
+// shared references and cycles are preserved. Functions, userdata, threads and metatables can't
+// cross states and are skipped.
+// returns success flag
+bool	LuaTable::copyTo(const LuaState &state, LuaTable &out) const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), mName);
+	lua_State *from = mL.get();
+	lua_State *to = state.mL.get();
+	if (!from || !to)
+		return false;
+	int fromTop = lua_gettop(from);
+	if (!push())
+		return false;
+	int srcIdx = lua_gettop(from);
+	int toTop = lua_gettop(to);
+	lua_newtable(to);
+	int visited = lua_gettop(to);
+	bool ret = copyTable(from, to, srcIdx, visited);
+	if (ret)
+		ret = out.init(state.mL, mName, false);
+	else
+		detail::_LuaLogError("Error in LuaTable::copyTo() - %s - stack overflow\n", mName.c_str());
+	// Drop the visited table and the source table
+	// (the source table is below everything we pushed if both states are the same)
+	lua_settop(to, toTop);
+	lua_settop(from, fromTop);
+	return ret;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 void	LuaTable::unref()
 {
 	// Delete the reference from registry
-	luaL_unref(mL.get(), LUA_REGISTRYINDEX, mRef);
+	detail::_LuaUnref(mL.get(), mRef);
 	mRef = -1;
+	mStackIdx = 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -112,7 +481,17 @@ void	LuaTable::initFromArgument(luaStatePtr vm, const std::string &name, int arg
 	mL = vm;
 	lua_pushvalue(mL.get(), arg);
 	// Store it in registry for later use
-	mRef = luaL_ref(mL.get(), LUA_REGISTRYINDEX);
+	mRef = detail::_LuaRef(mL.get(), name);
+	mName = name;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Refer to the value at an absolute stack index, without a registry reference, see LuaStateCFunc::getStackArg
+void	LuaTable::initFromStackIndex(luaStatePtr vm, const std::string &name, int idx)
+{
+	unref();
+	mL = vm;
+	mStackIdx = idx;
 	mName = name;
 }
 
@@ -134,7 +513,7 @@ bool	LuaTable::init(luaStatePtr vm, const std::string &name, bool create)
 		return false;
 	}
 	// Store it in registry for later use
-	mRef = luaL_ref(mL.get(), LUA_REGISTRYINDEX);
+	mRef = detail::_LuaRef(mL.get(), name);
 	mName = name;
 	return true;
 }
@@ -147,6 +526,11 @@ bool	LuaTable::push() const
 		lua_rawgeti(mL.get(), LUA_REGISTRYINDEX, mRef);
 		return true;
 	}
+	if (mStackIdx)
+	{
+		lua_pushvalue(mL.get(), mStackIdx);
+		return true;
+	}
 	return false;
 }
 //////////////////////////////////////////////////////////////////////////////
@@ -169,5 +553,50 @@ void	LuaTableCFunc::abortCurrentCFunc(const char *format, ...) const
 	luaL_error(mL.get(), buf);
 }
 
-} // LuaUtils
+namespace detail {;
+
+////////////////////////////////////////////////////////////////////////////////////
+// Push t[i] of the table at the top of the stack
+// Raw access, except for observed tables that go through their metatable
+void _LuaGetIndex(lua_State *L, int i)
+{
+	int table = lua_gettop(L);
+	lua_rawgeti(L, table, i);
+	// Observed tables are empty, only a missing field can belong to one
+	if (lua_isnil(L, -1) && pushObserver(L, table))
+	{
+		lua_pop(L, 2);
+		lua_pushinteger(L, i);
+		lua_gettable(L, table);
+	}
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Set t[i] to the value at the top of the stack and pop it, the table is below it
+// Raw access, except for observed tables that go through their metatable
+void _LuaSetIndex(lua_State *L, int i)
+{
+	int table = lua_gettop(L) - 1;
+	if (pushObserver(L, table))
+	{
+		lua_pop(L, 1);
+		lua_pushinteger(L, i);
+		lua_insert(L, -2);
+		lua_settable(L, table);
+	}
+	else
+		lua_rawseti(L, table, i);
+}
+////////////////////////////////////////////////////////////////////////////////////
+// Push the backing table of the observed table at idx, which holds its fields (see LuaTable::observe)
+// returns false (and pushes nothing) if the table isn't observed
+bool _LuaPushObservedBacking(lua_State *L, int idx)
+{
+	if (!pushObserver(L, idx))
+		return false;
+	lua_rawgeti(L, -1, OBSERVER_BACKING);
+	lua_remove(L, -2);
+	return true;
+}
 
+} // detail
+} // LuaUtils
@@ -8,9 +8,70 @@
 
 #include "LuaBase.h"
 #include "LuaFunction.h"
+#include "LuaBinding.h"
 
 namespace LuaUtils {;
 
+//////////////////////////////////////////////////////////////////////////////
+// A field written to an observed table, given to the LuaTable::consumeChanges callback
+// It is only valid during the callback.
+class LuaTableChange : public detail::_LuaBase
+{
+public:
+	//////////////////////////////////////////////////////////////////////////////
+	// Get the key of the field
+	template <typename T>
+	bool	getKey(T &res) const
+	{
+		lua_pushvalue(mL.get(), mKeyIdx);
+		return luaPopValue(res);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Get the current value of the field
+	template <typename T>
+	bool	getValue(T &res) const
+	{
+		lua_pushvalue(mL.get(), mValueIdx);
+		return luaPopValue(res);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// The field was removed (its current value is nil)
+	bool	isDeleted() const { return lua_isnil(mL.get(), mValueIdx) != 0; }
+
+	//////////////////////////////////////////////////////////////////////////////
+	friend class LuaUtils::LuaTable;
+
+private:
+	//////////////////////////////////////////////////////////////////////////////
+	LuaTableChange(luaStatePtr vm, int keyIdx, int valueIdx)
+	:	mKeyIdx(keyIdx)
+	,	mValueIdx(valueIdx)
+	{
+		mL = vm;
+	}
+
+	//////////////////////////////////////////////////////////////////////////////
+	int		mKeyIdx;
+	int		mValueIdx;
+};
+
+// Callback of LuaTable::consumeChanges
+typedef void (*LuaTableChangeCB)(const LuaTableChange &change, void *userData);
+
+namespace detail {;
+
+// Push t[i] of the table at the top of the stack
+// Raw access, except for observed tables that go through their metatable
+void _LuaGetIndex(lua_State *L, int i);
+// Set t[i] to the value at the top of the stack and pop it, the table is below it
+// Raw access, except for observed tables that go through their metatable
+void _LuaSetIndex(lua_State *L, int i);
+// Push the backing table of the observed table at idx, which holds its fields (see LuaTable::observe)
+// returns false (and pushes nothing) if the table isn't observed
+bool _LuaPushObservedBacking(lua_State *L, int idx);
+
+} // detail
+
 //////////////////////////////////////////////////////////////////////////////
 // Lua table wrapper class
 class LuaTable : public detail::_LuaBase
@@ -19,6 +80,7 @@ public:
 	//////////////////////////////////////////////////////////////////////////////
 	LuaTable()
 	:	mRef(-1)
+	,	mStackIdx(0)
 	,	mName("")
 	{
 	}
@@ -32,7 +94,7 @@ public:
 	//////////////////////////////////////////////////////////////////////////////
 	LuaTable &operator=(const LuaTable &other);	
 	//////////////////////////////////////////////////////////////////////////////
-	bool isInit() const { return (mRef != -1); }
+	bool isInit() const { return (mRef != -1 || mStackIdx != 0); }
 	//////////////////////////////////////////////////////////////////////////////
 	// Returns the number of int-indexed elements of the table
 	size_t	getArraySize() const;
@@ -41,11 +103,11 @@ public:
 	template <typename T>
 	void	setValue(const char *key, const T &value) const
 	{
+		LUAUTILS_STACK_CHECK(mL.get(), mName);
 		if (push())
 		{
-			lua_pushstring(mL.get(), key);
 			luaPushValue(value);
-			lua_settable(mL.get(), -3);
+			detail::_LuaSetField(mL.get(), key, "LuaTable::setValue");
 			pop();
 		}
 	}
@@ -54,10 +116,11 @@ public:
 	template <typename T>
 	void	setValue(int i, const T &value) const
 	{
+		LUAUTILS_STACK_CHECK(mL.get(), mName);
 		if (push())
 		{
 			luaPushValue(value);
-			lua_rawseti(mL.get(), -2, i);
+			detail::_LuaSetIndex(mL.get(), i);
 			pop();
 		}
 	}
@@ -66,6 +129,7 @@ public:
 	template <typename T>
 	bool	getValue(const char *key, T &res) const
 	{
+		LUAUTILS_STACK_CHECK(mL.get(), mName);
 		bool ret = false;
 		if (push())
 		{
@@ -80,10 +144,11 @@ public:
 	template <typename T>
 	bool	getValue(int i, T &res) const
 	{
+		LUAUTILS_STACK_CHECK(mL.get(), mName);
 		bool ret = false;
 		if (push())
 		{
-			lua_rawgeti(mL.get(), -1, i);
+			detail::_LuaGetIndex(mL.get(), i);
 			ret = luaPopValue(res);
 			pop();
 		}
@@ -94,10 +159,10 @@ public:
 	bool	getValue(const char *key, LuaTable &res) const;
 	////////////////////////////////////////////////////////////////////////////////////
 	// Get the function at t.key
-	//template <typename Ret>
-	template <typename Ret>
-	bool	getValue(const char *key, LuaFunction<Ret> &res) const
+	template <typename Ret, typename CallPolicy>
+	bool	getValue(const char *key, LuaFunction<Ret, CallPolicy> &res) const
 	{
+		LUAUTILS_STACK_CHECK(mL.get(), mName);
 		bool ret = false;
 		if (push())
 		{
@@ -115,13 +180,14 @@ public:
 	bool	getValue(int i, LuaTable &res) const;
 	////////////////////////////////////////////////////////////////////////////////////
 	// Get the function at t[i]
-	template <typename Ret>
-	bool	getValue(int i, LuaFunction<Ret> &res) const
+	template <typename Ret, typename CallPolicy>
+	bool	getValue(int i, LuaFunction<Ret, CallPolicy> &res) const
 	{
+		LUAUTILS_STACK_CHECK(mL.get(), mName);
 		bool ret = false;
 		if (push())
 		{
-			lua_rawgeti(mL.get(), -1, i);
+			detail::_LuaGetIndex(mL.get(), i);
 			char newName[100];
 			_snprintf(newName, 100, "%s[%d]", mName.c_str(), i);
 			ret = res.initFromStack(mL, newName);
@@ -130,6 +196,48 @@ public:
 		return ret;
 	}
 
+	////////////////////////////////////////////////////////////////////////////////////
+	// Bind t.key to a C++ variable (bool, int, unsigned char, float, double or string)
+	// Lua always reads the current value of the variable, and writes from Lua or setValue go to the variable
+	// (a value with the wrong type, or a write to a read only binding, raises a Lua error in Lua,
+	// and is logged as an error by setValue).
+	// The variable must outlive the binding.
+	template <typename T>
+	void	bindValue(const char *key, T *var, bool readOnly = false) const
+	{
+		LUAUTILS_STACK_CHECK(mL.get(), mName);
+		if (push())
+		{
+			detail::_LuaBindValue(mL.get(), key, detail::_LuaMakeBoundValue(var, readOnly));
+			pop();
+		}
+	}
+	////////////////////////////////////////////////////////////////////////////////////
+	// Bind t.key to accessor Lua C functions, the getter returns the value,
+	// the setter gets the new value as its first argument (no setter means it's read only)
+	void	bindAccessor(const char *key, lua_CFunction getter, lua_CFunction setter = 0) const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Remove the binding of t.key, it keeps its last value as a normal field
+	void	unbindValue(const char *key) const;
+
+	////////////////////////////////////////////////////////////////////////////////////
+	// Start recording the fields written to this table, see consumeChanges
+	// The fields move to a hidden backing table, and this table stays empty with metamethods forwarding
+	// to it, so that every write goes through __newindex (from Lua or from setValue).
+	// References to the table stay valid, but raw access (rawget, rawset, next) sees an empty table,
+	// and so do pairs and # before Lua 5.2 (from 5.2 on they use the __pairs and __len metamethods).
+	// A previous metatable moves to the backing table, bindings still work.
+	// returns success flag
+	bool	observe() const;
+	////////////////////////////////////////////////////////////////////////////////////
+	bool	isObserved() const;
+	////////////////////////////////////////////////////////////////////////////////////
+	// Call func for each field of an observed table written since the last call (or since observe),
+	// with its current value. A field written several times is only delivered once.
+	// Writes made from the callback are delivered by the next call.
+	// returns the number of changes
+	int		consumeChanges(LuaTableChangeCB func, void *userData) const;
+
 	////////////////////////////////////////////////////////////////////////////////////
 	// Create a new table at t.key
 	void	newTable(const char *key, LuaTable &res) const;
@@ -139,9 +247,19 @@ public:
 	//////////////////////////////////////////////////////////////////////////////
 	const std::string &getName() const { return mName; }
 
+	////////////////////////////////////////////////////////////////////////////////////
+	// Deep copy this table into another Lua state (or the same one), and store a reference to the copy in out.
+	// Nested tables, strings, numbers and booleans are copied directly between the two stacks,
+	// shared references and cycles are preserved. Functions, userdata, threads and metatables can't
+	// cross states and are skipped. Observed tables copy their fields, the copies aren't observed.
+	// returns success flag
+	bool	copyTo(const LuaState &state, LuaTable &out) const;
+
 	//////////////////////////////////////////////////////////////////////////////
 	friend class LuaUtils::LuaState;
 	friend class LuaUtils::LuaStateCFunc;
+	friend class LuaUtils::LuaSharedStore;
+	friend class LuaUtils::LuaWeakTable;
 	friend class LuaUtils::detail::_LuaBase;
 
 private:
@@ -152,6 +270,9 @@ private:
 	//////////////////////////////////////////////////////////////////////////////
 	// Init from stack index, without checking the type
 	void	initFromArgument(luaStatePtr vm, const std::string &name, int arg);
+	//////////////////////////////////////////////////////////////////////////////
+	// Refer to the value at an absolute stack index, without a registry reference, see LuaStateCFunc::getStackArg
+	void	initFromStackIndex(luaStatePtr vm, const std::string &name, int idx);
 
 	//////////////////////////////////////////////////////////////////////////////
 	// If the create flag is true, create a new table and store a new reference to it
@@ -166,6 +287,8 @@ private:
 
 	//////////////////////////////////////////////////////////////////////////////
 	int			mRef;
+	// Absolute stack index of the table when it has no registry reference, 0 for none
+	int			mStackIdx;
 	std::string mName;
 };
 
@@ -0,0 +1,233 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaTelemetry.h"
+#include <algorithm>
+#include <stdio.h>
+
+namespace LuaUtils {;
+namespace detail {;
+
+// Kinds of collections, index of the totals
+enum { KindStep, KindFull, NumKinds };
+static const char *gKindNames[NumKinds] = { "step", "full" };
+
+// Quantiles exported for the recent collections
+static const double gQuantiles[] = { 0.5, 0.9, 0.99, 1.0 };
+static const int gNumQuantiles = sizeof(gQuantiles) / sizeof(gQuantiles[0]);
+
+//////////////////////////////////////////////////////////////////////////////
+// Telemetry of a state, kept in a userdata of its registry (freed with the state)
+struct _LuaTelemetry
+{
+	// Rolling window of the last collections
+	std::vector<LuaGCSample>	samples;
+	size_t						next;
+	size_t						count;
+	// End of the last collection, 0 before the first one
+	unsigned long long			lastEndUS;
+	// Totals since the telemetry was enabled
+	unsigned long long			numCollections[NumKinds];
+	unsigned long long			totalDurationUS[NumKinds];
+	unsigned long long			numIntervals;
+	unsigned long long			totalIntervalUS;
+	unsigned long long			freedBytes;
+};
+
+static const char gTelemetryKey = 0;
+
+//////////////////////////////////////////////////////////////////////////////
+static int telemetryGC(lua_State *L)
+{
+	_LuaTelemetry **telemetry = (_LuaTelemetry**)lua_touserdata(L, 1);
+	delete *telemetry;
+	*telemetry = 0;
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Append a formatted line to text
+static void appendLine(std::string &text, const char *format, ...)
+{
+	char buf[512];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(buf, 512, format, args);
+	va_end(args);
+	text += buf;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Value of a quantile, with the nearest rank method (values must be sorted)
+static double getQuantile(const std::vector<double> &values, double quantile)
+{
+	size_t rank = (size_t)(quantile * values.size() + 0.999999);
+	return values[rank ? rank - 1 : 0];
+}
+//////////////////////////////////////////////////////////////////////////////
+// Append the quantile lines of a summary, NaN when the window is empty
+static void appendQuantiles(std::string &text, const char *name, const std::string &labels, std::vector<double> &values)
+{
+	std::sort(values.begin(), values.end());
+	for (int i = 0; i < gNumQuantiles; ++i)
+	{
+		if (values.empty())
+			appendLine(text, "%s{%s,quantile=\"%g\"} NaN\n", name, labels.c_str(), gQuantiles[i]);
+		else
+			appendLine(text, "%s{%s,quantile=\"%g\"} %.6f\n", name, labels.c_str(), gQuantiles[i], getQuantile(values, gQuantiles[i]));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Get the telemetry of a state, or null if it isn't enabled
+_LuaTelemetry *_LuaGetTelemetry(lua_State *L)
+{
+	_LuaTelemetry **telemetry = (_LuaTelemetry**)_LuaGetRegistryPtr(L, &gTelemetryKey);
+	return telemetry ? *telemetry : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Enable the telemetry of a state, keeping the last numSamples collections (0 disables it)
+void _LuaEnableTelemetry(lua_State *L, size_t numSamples)
+{
+	_LuaTelemetry *telemetry = _LuaGetTelemetry(L);
+	if (!numSamples)
+	{
+		// The userdata frees it once collected
+		if (telemetry)
+			_LuaSetRegistryPtr(L, &gTelemetryKey, 0);
+		return;
+	}
+	if (!telemetry)
+	{
+		lua_pushlightuserdata(L, (void*)&gTelemetryKey);
+		_LuaTelemetry **p = (_LuaTelemetry**)lua_newuserdata(L, sizeof(_LuaTelemetry*));
+		*p = telemetry = new _LuaTelemetry;
+		lua_newtable(L);
+		lua_pushcfunction(L, telemetryGC);
+		lua_setfield(L, -2, "__gc");
+		lua_setmetatable(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+	telemetry->samples.assign(numSamples, LuaGCSample());
+	telemetry->next = 0;
+	telemetry->count = 0;
+	telemetry->lastEndUS = 0;
+	for (int kind = 0; kind < NumKinds; ++kind)
+	{
+		telemetry->numCollections[kind] = 0;
+		telemetry->totalDurationUS[kind] = 0;
+	}
+	telemetry->numIntervals = 0;
+	telemetry->totalIntervalUS = 0;
+	telemetry->freedBytes = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Record a collection
+void _LuaRecordGC(_LuaTelemetry *telemetry, bool full, unsigned long long startUS, size_t memoryBefore, size_t memoryAfter)
+{
+	unsigned long long endUS = _LuaGetTimeUS();
+	LuaGCSample &sample = telemetry->samples[telemetry->next];
+	sample.timeUS = startUS;
+	sample.durationUS = endUS - startUS;
+	sample.intervalUS = telemetry->lastEndUS ? startUS - telemetry->lastEndUS : 0;
+	sample.memoryBefore = memoryBefore;
+	sample.memoryAfter = memoryAfter;
+	sample.full = full;
+	telemetry->next = (telemetry->next + 1) % telemetry->samples.size();
+	if (telemetry->count < telemetry->samples.size())
+		telemetry->count++;
+
+	int kind = full ? KindFull : KindStep;
+	telemetry->numCollections[kind]++;
+	telemetry->totalDurationUS[kind] += sample.durationUS;
+	if (telemetry->lastEndUS)
+	{
+		telemetry->numIntervals++;
+		telemetry->totalIntervalUS += sample.intervalUS;
+	}
+	if (memoryAfter < memoryBefore)
+		telemetry->freedBytes += memoryBefore - memoryAfter;
+	telemetry->lastEndUS = endUS;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Get the recorded collections, oldest first
+void _LuaGetGCSamples(const _LuaTelemetry *telemetry, std::vector<LuaGCSample> &samples)
+{
+	samples.clear();
+	size_t size = telemetry->samples.size();
+	size_t first = (telemetry->next + size - telemetry->count) % size;
+	for (size_t i = 0; i < telemetry->count; ++i)
+		samples.push_back(telemetry->samples[(first + i) % size]);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Append the telemetry in the Prometheus text format to text
+// Quantiles come from the recent collections, sums and counts are totals
+void _LuaExportTelemetry(const _LuaTelemetry *telemetry, size_t memory, const char *stateName, std::string &text)
+{
+	std::string state = "state=\"";
+	for (const char *c = stateName; *c; ++c)
+	{
+		if (*c == '\\' || *c == '"')
+			state += '\\';
+		if (*c == '\n')
+			state += "\\n";
+		else
+			state += *c;
+	}
+	state += '"';
+	std::vector<LuaGCSample> samples;
+	_LuaGetGCSamples(telemetry, samples);
+
+	text += "# HELP luautils_memory_bytes Memory used by the Lua state.\n";
+	text += "# TYPE luautils_memory_bytes gauge\n";
+	appendLine(text, "luautils_memory_bytes{%s} %llu\n", state.c_str(), (unsigned long long)memory);
+
+	text += "# HELP luautils_gc_duration_seconds Duration of the collections made with collectGarbage.\n";
+	text += "# TYPE luautils_gc_duration_seconds summary\n";
+	for (int kind = 0; kind < NumKinds; ++kind)
+	{
+		std::string labels = state + ",kind=\"" + gKindNames[kind] + '"';
+		std::vector<double> durations;
+		for (size_t i = 0; i < samples.size(); ++i)
+		{
+			if (samples[i].full == (kind == KindFull))
+				durations.push_back(samples[i].durationUS / 1e6);
+		}
+		appendQuantiles(text, "luautils_gc_duration_seconds", labels, durations);
+		appendLine(text, "luautils_gc_duration_seconds_sum{%s} %.6f\n", labels.c_str(), telemetry->totalDurationUS[kind] / 1e6);
+		appendLine(text, "luautils_gc_duration_seconds_count{%s} %llu\n", labels.c_str(), telemetry->numCollections[kind]);
+	}
+
+	text += "# HELP luautils_gc_interval_seconds Time between the end of a collection and the start of the next one.\n";
+	text += "# TYPE luautils_gc_interval_seconds summary\n";
+	std::vector<double> intervals;
+	for (size_t i = 0; i < samples.size(); ++i)
+	{
+		if (samples[i].intervalUS)
+			intervals.push_back(samples[i].intervalUS / 1e6);
+	}
+	appendQuantiles(text, "luautils_gc_interval_seconds", state, intervals);
+	appendLine(text, "luautils_gc_interval_seconds_sum{%s} %.6f\n", state.c_str(), telemetry->totalIntervalUS / 1e6);
+	appendLine(text, "luautils_gc_interval_seconds_count{%s} %llu\n", state.c_str(), telemetry->numIntervals);
+
+	text += "# HELP luautils_gc_freed_bytes_total Bytes freed by the collections made with collectGarbage.\n";
+	text += "# TYPE luautils_gc_freed_bytes_total counter\n";
+	appendLine(text, "luautils_gc_freed_bytes_total{%s} %llu\n", state.c_str(), telemetry->freedBytes);
+
+	text += "# HELP luautils_gc_last_memory_bytes Memory used by the Lua state before and after the last collection.\n";
+	text += "# TYPE luautils_gc_last_memory_bytes gauge\n";
+	if (!samples.empty())
+	{
+		appendLine(text, "luautils_gc_last_memory_bytes{%s,when=\"before\"} %llu\n", state.c_str(), (unsigned long long)samples.back().memoryBefore);
+		appendLine(text, "luautils_gc_last_memory_bytes{%s,when=\"after\"} %llu\n", state.c_str(), (unsigned long long)samples.back().memoryAfter);
+	}
+}
+
+} // detail
+} // LuaUtils
@@ -0,0 +1,50 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUATELEMETRY_H
+#define LUATELEMETRY_H
+
+#include "LuaBase.h"
+#include <vector>
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// A garbage collection made with LuaState::collectGarbage, once the telemetry of the state is enabled
+// (see LuaState::enableTelemetry). Times come from the same monotonic clock, in microseconds, so that
+// they can be lined up with the frame times of the application.
+struct LuaGCSample
+{
+	// When the collection started
+	unsigned long long	timeUS;
+	unsigned long long	durationUS;
+	// Time since the end of the previous collection, 0 for the first one
+	unsigned long long	intervalUS;
+	// Bytes used by the state
+	size_t				memoryBefore;
+	size_t				memoryAfter;
+	// Full collection, or a step
+	bool				full;
+};
+
+namespace detail {;
+
+struct _LuaTelemetry;
+
+// Get the telemetry of a state, or null if it isn't enabled
+_LuaTelemetry *_LuaGetTelemetry(lua_State *L);
+// Enable the telemetry of a state, keeping the last numSamples collections (0 disables it)
+void _LuaEnableTelemetry(lua_State *L, size_t numSamples);
+// Record a collection
+void _LuaRecordGC(_LuaTelemetry *telemetry, bool full, unsigned long long startUS, size_t memoryBefore, size_t memoryAfter);
+// Get the recorded collections, oldest first
+void _LuaGetGCSamples(const _LuaTelemetry *telemetry, std::vector<LuaGCSample> &samples);
+// Append the telemetry in the Prometheus text format to text
+void _LuaExportTelemetry(const _LuaTelemetry *telemetry, size_t memory, const char *stateName, std::string &text);
+
+} // detail
+} // LuaUtils
+
+#endif //LUATELEMETRY_H
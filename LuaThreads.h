@@ -0,0 +1,162 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUATHREADS_H
+#define LUATHREADS_H
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#endif
+
+// Storage class of the variables that each thread has its own copy of
+#ifdef _MSC_VER
+#define LUAUTILS_THREAD_LOCAL	__declspec(thread)
+#else
+#define LUAUTILS_THREAD_LOCAL	__thread
+#endif
+
+namespace LuaUtils {;
+namespace detail {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Mutex for the data shared between the Lua states of different threads
+class _LuaMutex
+{
+public:
+#ifdef WIN32
+	_LuaMutex()		{ InitializeCriticalSection(&mMutex); }
+	~_LuaMutex()	{ DeleteCriticalSection(&mMutex); }
+	void lock()		{ EnterCriticalSection(&mMutex); }
+	void unlock()	{ LeaveCriticalSection(&mMutex); }
+#else
+	_LuaMutex()		{ pthread_mutex_init(&mMutex, 0); }
+	~_LuaMutex()	{ pthread_mutex_destroy(&mMutex); }
+	void lock()		{ pthread_mutex_lock(&mMutex); }
+	void unlock()	{ pthread_mutex_unlock(&mMutex); }
+#endif
+
+private:
+	// Non copyable
+	_LuaMutex(const _LuaMutex &other);
+	_LuaMutex &operator=(const _LuaMutex &other);
+
+#ifdef WIN32
+	CRITICAL_SECTION	mMutex;
+#else
+	pthread_mutex_t		mMutex;
+#endif
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Locks a mutex during its lifetime
+class _LuaLock
+{
+public:
+	_LuaLock(_LuaMutex &mutex) : mMutex(mutex)	{ mMutex.lock(); }
+	~_LuaLock()									{ mMutex.unlock(); }
+
+private:
+	// Non copyable
+	_LuaLock(const _LuaLock &other);
+	_LuaLock &operator=(const _LuaLock &other);
+
+	_LuaMutex	&mMutex;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Thread running a function until it returns, join() it before destroying it
+class _LuaThread
+{
+public:
+	typedef void (*ThreadFunc)(void *arg);
+
+	_LuaThread() : mFunc(0), mArg(0), mStarted(false) { }
+	~_LuaThread() { }
+
+	// returns success flag
+	bool start(ThreadFunc func, void *arg)
+	{
+		if (mStarted)
+			return false;
+		mFunc = func;
+		mArg = arg;
+#ifdef WIN32
+		mThread = CreateThread(0, 0, run, this, 0, 0);
+		mStarted = mThread != 0;
+#else
+		mStarted = pthread_create(&mThread, 0, run, this) == 0;
+#endif
+		return mStarted;
+	}
+	// Wait for the function to return
+	void join()
+	{
+		if (!mStarted)
+			return;
+#ifdef WIN32
+		WaitForSingleObject(mThread, INFINITE);
+		CloseHandle(mThread);
+#else
+		pthread_join(mThread, 0);
+#endif
+		mStarted = false;
+	}
+
+private:
+	// Non copyable
+	_LuaThread(const _LuaThread &other);
+	_LuaThread &operator=(const _LuaThread &other);
+
+#ifdef WIN32
+	static DWORD WINAPI run(void *thread)	{ ((_LuaThread*)thread)->mFunc(((_LuaThread*)thread)->mArg); return 0; }
+	HANDLE		mThread;
+#else
+	static void *run(void *thread)			{ ((_LuaThread*)thread)->mFunc(((_LuaThread*)thread)->mArg); return 0; }
+	pthread_t	mThread;
+#endif
+	ThreadFunc	mFunc;
+	void		*mArg;
+	bool		mStarted;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sleep the current thread
+inline void _LuaSleepMS(unsigned ms)
+{
+#ifdef WIN32
+	Sleep(ms);
+#else
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+	nanosleep(&ts, 0);
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Atomic operations on a long, with full memory barriers
+#ifdef WIN32
+// Set *p to newValue if it is oldValue, returns the previous value
+inline long _LuaAtomicCAS(volatile long *p, long oldValue, long newValue)	{ return InterlockedCompareExchange(p, newValue, oldValue); }
+// Add value to *p, returns the previous value
+inline long _LuaAtomicAdd(volatile long *p, long value)						{ return InterlockedExchangeAdd(p, value); }
+inline long _LuaAtomicLoad(const volatile long *p)							{ long value = *p; MemoryBarrier(); return value; }
+inline void _LuaAtomicStore(volatile long *p, long value)					{ MemoryBarrier(); *p = value; MemoryBarrier(); }
+#else
+// Set *p to newValue if it is oldValue, returns the previous value
+inline long _LuaAtomicCAS(volatile long *p, long oldValue, long newValue)	{ return __sync_val_compare_and_swap(p, oldValue, newValue); }
+// Add value to *p, returns the previous value
+inline long _LuaAtomicAdd(volatile long *p, long value)						{ return __sync_fetch_and_add(p, value); }
+inline long _LuaAtomicLoad(const volatile long *p)							{ long value = *p; __sync_synchronize(); return value; }
+inline void _LuaAtomicStore(volatile long *p, long value)					{ __sync_synchronize(); *p = value; __sync_synchronize(); }
+#endif
+
+} // detail
+} // LuaUtils
+
+#endif //LUATHREADS_H
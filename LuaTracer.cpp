@@ -0,0 +1,287 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaTracer.h"
+#include "LuaThreads.h"
+#include <stdio.h>
+#include <vector>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+namespace LuaUtils {;
+
+//////////////////////////////////////////////////////////////////////////////
+// A complete event of the trace (a begin and an end)
+struct TraceEvent
+{
+	char				name[detail::_LuaTraceScope::MaxName];
+	const char			*category;
+	unsigned long long	startUS;
+	unsigned long long	durationUS;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Events of a thread, its lock is only contended while the trace is written
+// The buffers are kept until the program exits, since their thread can't be told to drop them
+struct ThreadBuffer
+{
+	detail::_LuaMutex			mutex;
+	std::vector<TraceEvent>		events;
+	size_t						numDropped;
+	int							threadId;
+};
+
+static detail::_LuaMutex gTraceMutex;
+static std::vector<ThreadBuffer*> gThreadBuffers;
+static std::string gTraceFileName;
+static size_t gMaxEvents = 0;
+static LUAUTILS_THREAD_LOCAL ThreadBuffer *tThreadBuffer = 0;
+// Key of the registry table of the traced closures, by C function
+static const char gTracedKey = 0;
+
+//////////////////////////////////////////////////////////////////////////////
+// Get the buffer of the current thread, creating it on its first event
+static ThreadBuffer *getThreadBuffer()
+{
+	if (!tThreadBuffer)
+	{
+		ThreadBuffer *buffer = new ThreadBuffer;
+		buffer->numDropped = 0;
+		detail::_LuaLock lock(gTraceMutex);
+		buffer->threadId = (int)gThreadBuffers.size() + 1;
+		gThreadBuffers.push_back(buffer);
+		tThreadBuffer = buffer;
+	}
+	return tThreadBuffer;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Write a string as a JSON string
+static void writeJSONString(FILE *file, const char *s)
+{
+	fputc('"', file);
+	for (; *s; ++s)
+	{
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\')
+			fprintf(file, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(file, "\\u%04x", c);
+		else
+			fputc(c, file);
+	}
+	fputc('"', file);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Write the events of the threads in the Chrome trace event format
+static bool writeTrace(FILE *file, const std::vector<std::vector<TraceEvent> > &events, const std::vector<int> &threadIds)
+{
+#ifdef WIN32
+	unsigned long pid = GetCurrentProcessId();
+#else
+	unsigned long pid = (unsigned long)getpid();
+#endif
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	for (size_t t = 0; t < events.size(); ++t)
+	{
+		if (events[t].empty())
+			continue;
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":%d,\"args\":{\"name\":\"LuaUtils thread %d\"}}",
+			first ? "" : ",\n", pid, threadIds[t], threadIds[t]);
+		first = false;
+		for (size_t i = 0; i < events[t].size(); ++i)
+		{
+			const TraceEvent &event = events[t][i];
+			fprintf(file, ",\n{\"name\":");
+			writeJSONString(file, event.name);
+			fprintf(file, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%lu,\"tid\":%d}",
+				event.category, event.startUS, event.durationUS, pid, threadIds[t]);
+		}
+	}
+	fprintf(file, "\n]}\n");
+	return ferror(file) == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Calls a C function wrapped by _LuaPushTracedCFunction (upvalue 1 holds it)
+static int tracedCFunction(lua_State *L)
+{
+	lua_CFunction func = *(lua_CFunction*)lua_touserdata(L, lua_upvalueindex(1));
+	if (!detail::_LuaIsTracing())
+		return func(L);
+	// Name of the function in the calling code
+	lua_Debug ar;
+	const char *name = 0;
+	if (lua_getstack(L, 0, &ar) && lua_getinfo(L, "n", &ar))
+		name = ar.name;
+	detail::_LuaTraceScope scope(name ? name : "?", "cfunc");
+	return func(L);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Start recording a trace, written to fileName by LuaStopTrace in the Chrome trace event format
+// returns false if a trace is already recorded, or if LUAUTILS_TRACE isn't defined
+bool LuaStartTrace(const char *fileName, size_t maxEventsPerThread)
+{
+#ifndef LUAUTILS_TRACE
+	detail::_LuaLogError("Error in LuaStartTrace() - %s - LUAUTILS_TRACE isn't defined\n", fileName);
+	return false;
+#else
+	detail::_LuaLock lock(gTraceMutex);
+	if (detail::_LuaIsTracing())
+	{
+		detail::_LuaLogError("Error in LuaStartTrace() - %s - a trace is already recorded\n", fileName);
+		return false;
+	}
+	gTraceFileName = fileName;
+	gMaxEvents = maxEventsPerThread;
+	for (size_t i = 0; i < gThreadBuffers.size(); ++i)
+	{
+		detail::_LuaLock bufferLock(gThreadBuffers[i]->mutex);
+		gThreadBuffers[i]->events.clear();
+		gThreadBuffers[i]->numDropped = 0;
+	}
+	detail::_LuaAtomicStore(&detail::_gLuaTracing, 1);
+	return true;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Stop recording and write the trace file
+// returns success flag
+bool LuaStopTrace()
+{
+	std::vector<std::vector<TraceEvent> > events;
+	std::vector<int> threadIds;
+	size_t numDropped = 0;
+	std::string fileName;
+	{
+		detail::_LuaLock lock(gTraceMutex);
+		if (!detail::_LuaIsTracing())
+		{
+			detail::_LuaLogError("Error in LuaStopTrace() - no trace is recorded\n");
+			return false;
+		}
+		detail::_LuaAtomicStore(&detail::_gLuaTracing, 0);
+		// The threads check the flag again under the lock of their buffer
+		events.resize(gThreadBuffers.size());
+		for (size_t i = 0; i < gThreadBuffers.size(); ++i)
+		{
+			detail::_LuaLock bufferLock(gThreadBuffers[i]->mutex);
+			events[i].swap(gThreadBuffers[i]->events);
+			threadIds.push_back(gThreadBuffers[i]->threadId);
+			numDropped += gThreadBuffers[i]->numDropped;
+		}
+		fileName = gTraceFileName;
+	}
+
+	std::string tempName = fileName + ".tmp";
+	FILE *file = fopen(tempName.c_str(), "wb");
+	bool written = file && writeTrace(file, events, threadIds);
+	if (file && fclose(file))
+		written = false;
+	if (written)
+	{
+#ifdef WIN32
+		// rename doesn't replace files on Windows
+		remove(fileName.c_str());
+#endif
+		written = rename(tempName.c_str(), fileName.c_str()) == 0;
+	}
+	if (!written)
+	{
+		remove(tempName.c_str());
+		detail::_LuaLogError(LuaErrorFile, "Error in LuaStopTrace() - %s - couldn't write the file\n", fileName.c_str());
+		return false;
+	}
+	if (numDropped)
+		detail::_LuaLogError("Error in LuaStopTrace() - %s - %lu events dropped, the thread buffers were full\n", fileName.c_str(), (unsigned long)numDropped);
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// A trace is being recorded
+bool LuaIsTracing()
+{
+	return detail::_LuaIsTracing();
+}
+
+namespace detail {;
+
+volatile long _gLuaTracing = 0;
+
+////////////////////////////////////////////////////////////////////////////////////
+// Record an event that started at startUS and ends now
+void _LuaTraceEvent(const char *name, const char *category, unsigned long long startUS)
+{
+	unsigned long long endUS = _LuaGetTimeUS();
+	ThreadBuffer *buffer = getThreadBuffer();
+	_LuaLock lock(buffer->mutex);
+	// The trace may have been stopped since the event started
+	if (!_LuaIsTracing())
+		return;
+	if (buffer->events.size() >= gMaxEvents)
+	{
+		buffer->numDropped++;
+		return;
+	}
+	buffer->events.push_back(TraceEvent());
+	TraceEvent &event = buffer->events.back();
+	strncpy(event.name, name, sizeof(event.name) - 1);
+	event.name[sizeof(event.name) - 1] = 0;
+	event.category = category;
+	event.startUS = startUS;
+	event.durationUS = endUS - startUS;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Push a C function that records its calls, see LuaStartTrace
+// The closure of a function is made once per state, so pushing it twice gives the same value
+// (rawequal, table keys). The cost left when no trace is recorded is an extra C call and a flag
+// check per call, and a table lookup per push.
+void _LuaPushTracedCFunction(lua_State *L, lua_CFunction func)
+{
+	lua_pushlightuserdata(L, (void*)&gTracedKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (lua_isnil(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushlightuserdata(L, (void*)&gTracedKey);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+	// Function pointers don't convert to lightuserdata, their bytes make the key
+	lua_pushlstring(L, (const char*)&func, sizeof(func));
+	lua_rawget(L, -2);
+	if (lua_isnil(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_CFunction *p = (lua_CFunction*)lua_newuserdata(L, sizeof(lua_CFunction));
+		*p = func;
+		lua_pushcclosure(L, tracedCFunction, 1);
+		lua_pushlstring(L, (const char*)&func, sizeof(func));
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+	lua_remove(L, -2);
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Get the C function wrapped by the value at the given index, or func if it isn't a traced one
+lua_CFunction _LuaUntraceCFunction(lua_State *L, int idx, lua_CFunction func)
+{
+	if (func != tracedCFunction || !lua_getupvalue(L, idx, 1))
+		return func;
+	func = *(lua_CFunction*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return func;
+}
+
+} // detail
+} // LuaUtils
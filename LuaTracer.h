@@ -0,0 +1,94 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUATRACER_H
+#define LUATRACER_H
+
+#include "LuaBase.h"
+
+// Tracing, define LUAUTILS_TRACE to compile it in, then record a timeline between LuaStartTrace and
+// LuaStopTrace of the LuaFunction calls, the loadFile/loadString runs, the collectGarbage calls and the
+// calls to the C functions set with setValue/pushValue. Without LUAUTILS_TRACE it costs nothing,
+// with it the cost is a flag test per call while no trace is recorded, and the C functions run through
+// a wrapper closure (an extra C call, and a table lookup when they're pushed).
+#ifdef LUAUTILS_TRACE
+#define LUAUTILS_TRACE_SCOPE(name, category)	LuaUtils::detail::_LuaTraceScope _luaTraceScope(name, category)
+#else
+#define LUAUTILS_TRACE_SCOPE(name, category)
+#endif
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Start recording a trace, written to fileName by LuaStopTrace in the Chrome trace event format
+// (open it with chrome://tracing or https://ui.perfetto.dev)
+// Each thread records its events in its own buffer, up to maxEventsPerThread, the next ones are dropped.
+// An event is recorded when its call returns: a Lua error raised through a C function skips the end of
+// the calls in between (unless Lua is compiled as C++), so they don't appear.
+// returns false if a trace is already recorded, or if LUAUTILS_TRACE isn't defined
+bool LuaStartTrace(const char *fileName, size_t maxEventsPerThread = 1 << 20);
+// Stop recording and write the trace file
+// returns success flag
+bool LuaStopTrace();
+// A trace is being recorded
+bool LuaIsTracing();
+
+namespace detail {;
+
+// Set while a trace is recorded
+extern volatile long _gLuaTracing;
+
+// Record an event that started at startUS and ends now
+void _LuaTraceEvent(const char *name, const char *category, unsigned long long startUS);
+// Push a C function that records its calls, see LuaStartTrace
+void _LuaPushTracedCFunction(lua_State *L, lua_CFunction func);
+// Get the C function wrapped by the value at the given index, or func if it isn't a traced one
+lua_CFunction _LuaUntraceCFunction(lua_State *L, int idx, lua_CFunction func);
+
+//////////////////////////////////////////////////////////////////////////////
+inline bool _LuaIsTracing()
+{
+#ifdef __GNUC__
+	return __atomic_load_n(&_gLuaTracing, __ATOMIC_RELAXED) != 0;
+#else
+	return _gLuaTracing != 0;
+#endif
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Records an event for its scope, used by LUAUTILS_TRACE_SCOPE
+// The name is copied, a handle can be renamed or released by the call it traces
+class _LuaTraceScope
+{
+public:
+	enum { MaxName = 64 };
+
+	_LuaTraceScope(const char *name, const char *category)
+	:	mCategory(category)
+	,	mStart(0)
+	{
+		if (_LuaIsTracing())
+		{
+			strncpy(mName, name, MaxName - 1);
+			mName[MaxName - 1] = 0;
+			mStart = _LuaGetTimeUS();
+		}
+	}
+	~_LuaTraceScope()
+	{
+		if (mStart)
+			_LuaTraceEvent(mName, mCategory, mStart);
+	}
+
+private:
+	char				mName[MaxName];
+	const char			*mCategory;
+	unsigned long long	mStart;
+};
+
+} // detail
+} // LuaUtils
+
+#endif //LUATRACER_H
@@ -4,6 +4,13 @@
 // Version 1.1
 
 #include "LuaUtils.h"
+#include <ctime>
+#include <cstdio>
+#include <cstring>
+#ifndef WIN32
+#include <stdlib.h>
+#include <unistd.h>
+#endif
 
 namespace LuaUtils {;
 namespace detail {;
@@ -42,8 +49,183 @@ static const char *_testString =
 " end"
 " function TestFunc3()"
 "	return TestFunc2"
+" end"
+" function TestError()"
+"	error('test error')"
+" end"
+" TaskCount = 0"
+" function TestCoroutine(a, b)"
+"	local c = coroutine.yield(a + b)"
+"	TaskCount = TaskCount + 1"
+"	return c * 2, 'done'"
+" end"
+" function TestAsync(a)"
+"	local res, err = AsyncOp(a)"
+"	AsyncResult = res or err"
+" end"
+" function TestTask(dt)"
+"	local dt2 = coroutine.yield()"
+"	TaskCount = TaskCount + dt + dt2"
 " end";
 
+// Async test function, parks the calling task and keeps the ticket
+static unsigned int _testTicket = 0;
+static int _TestAsyncOp(lua_State *L)
+{
+	_testTicket = LuaAsyncBridge::park(L);
+	return LuaAsyncBridge::yield(L);
+}
+
+// Async test function, completes its ticket before yielding (ex: a cached answer)
+static LuaAsyncBridge *_testBridge = 0;
+static int _TestAsyncNow(lua_State *L)
+{
+	_testBridge->complete(LuaAsyncBridge::park(L), "async now");
+	return LuaAsyncBridge::yield(L);
+}
+
+// Batch of unprotected calls for the call policy test
+struct _TestBatch
+{
+	LuaFunction<float, LuaCallUnprotected>	func;
+	float									sum;
+	int										count;
+};
+static void _TestRunBatch(void *userData)
+{
+	_TestBatch *batch = (_TestBatch*)userData;
+	for (int n = 0; n < batch->count; ++n)
+		batch->sum += batch->func((float)n);
+}
+
+// Bound accessor test functions
+static int _testAccessorValue = 0;
+static int _TestGetAccessor(lua_State *L)
+{
+	lua_pushinteger(L, _testAccessorValue * 2);
+	return 1;
+}
+static int _TestSetAccessor(lua_State *L)
+{
+	_testAccessorValue = (int)detail::_LuaToInteger(L, 1);
+	return 0;
+}
+
+// Limits test function, aborts the call that is running
+static int _TestAbort(lua_State *L)
+{
+	LuaStateCFunc state(L);
+	state.requestAbort();
+	return 0;
+}
+
+// Observed table test callback
+struct _TestChanges
+{
+	int		count;
+	int		health;
+	int		first;
+	bool	nameDeleted;
+};
+static void _TestOnChange(const LuaTableChange &change, void *userData)
+{
+	_TestChanges *changes = (_TestChanges*)userData;
+	std::string key;
+	int index;
+	changes->count++;
+	if (change.getKey(index))
+		change.getValue(changes->first);
+	else if (change.getKey(key) && key == "Health")
+		change.getValue(changes->health);
+	else if (key == "Name")
+		changes->nameDeleted = change.isDeleted();
+}
+
+// Embedded chunk test data, compiled by the test
+static std::string _testEmbeddedCode;
+static LuaEmbeddedChunk _testEmbeddedChunk;
+
+// Messages delivered by the error sink test
+static std::vector<std::string> _testSinkMessages;
+static void _TestSinkError(const char *msg)
+{
+	_testSinkMessages.push_back(msg);
+}
+
+// Buffer test function, reads its argument as a view
+static std::string _testBufferContent;
+static int _TestSendBuffer(lua_State *L)
+{
+	LuaStateCFunc state(L);
+	LuaStringView view;
+	state.checkArg(1, view);
+	_testBufferContent = view.str();
+	return 0;
+}
+
+#ifdef LUAUTILS_LEAK_CHECK
+// Stack leak test function, its checked scope leaves its result on the stack
+static int _TestStackLeak(lua_State *L)
+{
+	{
+		LUAUTILS_STACK_CHECK(L, "StackLeak");
+		lua_pushboolean(L, 1);
+	}
+	return 1;
+}
+#endif
+
+// Stack argument test function, reads a table, a function and a number without registry references
+// and returns f(t.x) + 2, keeping a copy of the table
+static LuaTable _testKeptTable;
+static size_t _testStackArgRefs = 0;
+static int _TestStackArgs(lua_State *L)
+{
+	LuaStateCFunc state(L);
+	LuaTable t;
+	LuaFunction<int> f;
+	int x = 0;
+	std::string n;
+	size_t numRefs = state.getNumRefs();
+	if (!state.getStackArg(1, t) || !state.getStackArg(2, f) || state.getStackArg(3, t) || !state.getStackArg(1, t))
+		return 0;
+	// The number stays a number when read as a string
+	if (!t.getValue("x", x) || !state.getArg(3, n) || n != "2" || lua_type(L, 3) != LUA_TNUMBER)
+		return 0;
+	_testStackArgRefs = state.getNumRefs() - numRefs;
+	state.pushValue(f(x) + 2);
+	_testKeptTable = t;
+	return 1;
+}
+
+// Event bus test function, posts its string argument again, like a handler that polls
+static LuaEventBus *_testRepostBus = 0;
+static int _TestRepost(lua_State *L)
+{
+	LuaStateCFunc state(L);
+	std::string payload;
+	state.checkArg(1, payload);
+	_testRepostBus->post(4, payload, (size_t)payload.size(), 1L);
+	return 0;
+}
+// Event bus test function, clears the bus from a handler
+static int _TestClearBus(lua_State *)
+{
+	_testRepostBus->clear();
+	return 0;
+}
+
+// Memoised function test, called back from the memoised Fib script function
+static LuaMemoFunction<int> *_testMemoFib = 0;
+static int _TestMemoFib(lua_State *L)
+{
+	LuaStateCFunc state(L);
+	int n = 0;
+	state.checkArg(1, n);
+	state.pushValue((*_testMemoFib)(n));
+	return 1;
+}
+
 #define TESTASSERT(EXPR) if (!(EXPR)) { errCount++; detail::_LuaLogError("LuaUtils::test() assert failed: %s", #EXPR); }
 
 // A little test function, for testing and stuff. Returns the number of errors, which should be 0.
@@ -81,6 +263,7 @@ int	_Test()
 		TESTASSERT(b == true);
 		TESTASSERT(s == "awesome string!");		
 		TESTASSERT(testFunc(42.0f) == 1764.0f);
+		TESTASSERT(testFunc(4.0f, 2, 1, 0) == 16.0f);
 		TESTASSERT(testFunc.getName() == "TestFunc");
 		TESTASSERT(table.getName() == "<anon>"); // name is <anon> since it was returned by a function, no way of knowing the original global name
 		TESTASSERT(table.getArraySize() == 2); // only array values count for the size, not string mapped values
@@ -112,9 +295,970 @@ int	_Test()
 		TESTASSERT(i == 51);
 		TESTASSERT(f == 24.2f);
 		TESTASSERT(s == "nested table string!");
+
+		// Strings keep their embedded zeros, views borrow the Lua string
+		LuaStringView view;
+		const std::string binary("bin\0ary", 7);
+		nestedTable.setValue("Binary", binary);
+		TESTASSERT(nestedTable.getValue("Binary", s));
+		TESTASSERT(s == binary);
+		TESTASSERT(nestedTable.getValue("Binary", view));
+		TESTASSERT(view == LuaStringView(binary));
+		TESTASSERT(view.str() == binary);
+		TESTASSERT(!nestedTable.getValue(1, view)); // numbers aren't strings
+		TESTASSERT(state.getValue("StringVal", view));
+		TESTASSERT(view == "awesome string!");
+#ifdef LUAUTILS_STRING_VIEW
+		std::string_view stdView;
+		nestedTable.setValue("Binary", std::string_view("a\0b", 3));
+		TESTASSERT(nestedTable.getValue("Binary", stdView));
+		TESTASSERT(stdView == std::string_view("a\0b", 3));
+#endif
+
+		// Deep copy the table into another state
+		LuaState otherState(false);
+		LuaTable copy, nestedCopy;
+		table.setValue("Self", table);
+		TESTASSERT(table.copyTo(otherState, copy));
+		TESTASSERT(copy.getArraySize() == 2);
+		TESTASSERT(copy.getValue("TableName", s));
+		TESTASSERT(s == "awesome table!");
+		TESTASSERT(!copy.getValue("TestFunc", testFunc)); // functions can't cross states
+		TESTASSERT(copy.getValue("NestedTable", nestedCopy));
+		TESTASSERT(nestedCopy.getValue(2, f));
+		TESTASSERT(f == 24.2f);
+		TESTASSERT(copy.getValue("Self", nestedCopy));
+		TESTASSERT(nestedCopy.getValue("IntResult", i));
+		TESTASSERT(i == 1764);
+#if LUA_VERSION_NUM >= 503
+		// Integers stay integers (tostring gives 3, not 3.0)
+		LuaTable intTable;
+		TESTASSERT(state.loadString("IntCopy = { n = 3, [1] = 7, f = 2.0 }"));
+		TESTASSERT(state.getValue("IntCopy", intTable));
+		TESTASSERT(intTable.copyTo(otherState, nestedCopy));
+		TESTASSERT(nestedCopy.getValue("n", s) && s == "3");
+		TESTASSERT(nestedCopy.getValue(1, s) && s == "7");
+		TESTASSERT(nestedCopy.getValue("f", s) && s == "2.0");
+#endif
+
+		// Shared store, read from two states
+		LuaSharedStore store;
+		TESTASSERT(store.build(table));
+		TESTASSERT(store.getNumTables() == 2);
+		otherState.setValue("Shared", store);
+		state.setValue("Shared", store);
+		TESTASSERT(otherState.loadString("SharedName = Shared.TableName SharedLen = #Shared.NestedTable SharedSelf = Shared.Self.Self == Shared"));
+		TESTASSERT(otherState.getValue("SharedName", s));
+		TESTASSERT(s == "awesome table!");
+		TESTASSERT(otherState.getValue("SharedLen", i));
+		TESTASSERT(i == 3);
+		TESTASSERT(otherState.getValue("SharedSelf", b));
+		TESTASSERT(b);
+		TESTASSERT(state.loadString("SharedCount = 0 for k, v in getmetatable(Shared).__pairs(Shared.NestedTable) do SharedCount = SharedCount + 1 end"));
+		TESTASSERT(state.getValue("SharedCount", i));
+		TESTASSERT(i == 4);
+		// The metamethods can't be reached with other values
+		TESTASSERT(state.loadString("SharedSafe = getmetatable(Shared).__len == nil and getmetatable(Shared).__index == nil "
+			"and not pcall(getmetatable(Shared).__pairs, {}) and not pcall(getmetatable(Shared).__pairs, io.stdout)"));
+		TESTASSERT(state.getValue("SharedSafe", b));
+		TESTASSERT(b);
+		TESTASSERT(state.loadString("SharedString = Shared.NestedTable[3]"));
+		TESTASSERT(state.getValue("SharedString", s));
+		TESTASSERT(s == "nested table string!");
+		TESTASSERT(!otherState.loadString("Shared.TableName = 'changed'"));
+		TESTASSERT(LuaGetErrorFlag());
+
+		// Observed table
+		LuaTable observed;
+		_TestChanges changes = { 0, 0, 0, false };
+		TESTASSERT(state.loadString("Observed = { Health = 10, Name = 'bob', 5 }"));
+		TESTASSERT(state.getValue("Observed", observed));
+		TESTASSERT(observed.observe());
+		TESTASSERT(observed.isObserved());
+		TESTASSERT(!table.isObserved());
+		TESTASSERT(state.loadString("Observed.Health = 5 Observed.Health = Observed.Health + 2 Observed.Name = nil Observed[1] = Observed[1] + 1"));
+		observed.setValue("Mana", 3);
+		TESTASSERT(observed.consumeChanges(_TestOnChange, &changes) == 4);
+		TESTASSERT(changes.count == 4 && changes.health == 7 && changes.first == 6 && changes.nameDeleted);
+		TESTASSERT(observed.consumeChanges(_TestOnChange, &changes) == 0);
+		TESTASSERT(observed.getValue("Mana", i));
+		TESTASSERT(i == 3);
+		TESTASSERT(observed.getValue(1, i));
+		TESTASSERT(i == 6);
+		TESTASSERT(observed.getArraySize() == 1);
+		observed.setValue(2, 8);
+		TESTASSERT(observed.consumeChanges(_TestOnChange, &changes) == 1);
+		LuaTable observedCopy;
+		TESTASSERT(observed.copyTo(otherState, observedCopy));
+		TESTASSERT(!observedCopy.isObserved() && observedCopy.getArraySize() == 2);
+		TESTASSERT(observedCopy.getValue(2, i) && i == 8);
+		TESTASSERT(observedCopy.getValue("Mana", i) && i == 3);
+		// Integer keys of the other tables are read raw
+		TESTASSERT(state.loadString("RawIndexed = setmetatable({}, { __index = function() return 1 end })"));
+		TESTASSERT(state.getValue("RawIndexed", observedCopy));
+		TESTASSERT(!observedCopy.getValue(1, i));
+
+		// Handle copies and registry references
+		LuaTable emptyTable;
+		size_t numRefs = state.getNumRefs();
+		{
+			LuaTable emptyCopy(emptyTable);
+			LuaTable tableCopy(observed);
+			LuaTable otherTableCopy(table);
+			LuaFunction<float> emptyFuncCopy(testFunc); // testFunc failed to init from the copy state
+			TESTASSERT(!emptyCopy.isInit());
+			TESTASSERT(!emptyFuncCopy.isInit());
+#ifdef LUAUTILS_LEAK_CHECK
+			TESTASSERT(state.getNumRefs() == numRefs + 2);
+#endif
+		}
+		TESTASSERT(state.getNumRefs() == numRefs);
+		TESTASSERT(state.loadString("return 1, 2, 3"));
+		TESTASSERT(LuaGetErrorCode() != LuaErrorStackLeak);
+#ifdef LUAUTILS_LEAK_CHECK
+		state.setValue("StackLeak", (lua_CFunction)_TestStackLeak);
+		TESTASSERT(state.loadString("StackLeak()"));
+		TESTASSERT(LuaGetErrorCode() == LuaErrorStackLeak);
+		TESTASSERT(LuaGetErrorFlag());
+#endif
+
+		// Weak handles don't keep the objects alive
+		{
+			LuaState weakState;
+			TESTASSERT(weakState.loadString("Cached = { hp = 7 } function CachedFunc(n) return n * 3 end"));
+			LuaTable cached, locked;
+			LuaFunction<int> cachedFunc, lockedFunc;
+			TESTASSERT(weakState.getValue("Cached", cached));
+			TESTASSERT(weakState.getValue("CachedFunc", cachedFunc));
+			size_t weakRefs = weakState.getNumRefs();
+			LuaWeakTable weak(cached), emptyWeak;
+			LuaWeakFunction<int> weakFunc = cachedFunc;
+			LuaWeakTable weakCopy(weak);
+			TESTASSERT(weakState.getNumRefs() == weakRefs);
+			cached = LuaTable();
+			cachedFunc = LuaFunction<int>();
+			weakState.collectGarbage();
+			TESTASSERT(weak.isAlive() && weakCopy.isAlive());
+			TESTASSERT(weak.lock(locked));
+			TESTASSERT(locked.getValue("hp", i) && i == 7);
+			TESTASSERT(weakFunc.lock(lockedFunc));
+			TESTASSERT(lockedFunc(2) == 6);
+			TESTASSERT(!emptyWeak.lock(locked) && !locked.isInit());
+
+			// A locked handle keeps the object alive until it's released
+			TESTASSERT(weak.lock(locked));
+			TESTASSERT(weakState.loadString("Cached = nil CachedFunc = nil"));
+			weakState.collectGarbage();
+			TESTASSERT(weak.isAlive());
+			TESTASSERT(weakFunc.isAlive());
+			locked = LuaTable();
+			lockedFunc = LuaFunction<int>();
+			weakState.collectGarbage();
+			TESTASSERT(!weak.lock(locked) && !locked.isInit());
+			TESTASSERT(!weakCopy.isAlive() && weakCopy.isInit());
+			TESTASSERT(!weakFunc.lock(lockedFunc) && !lockedFunc.isInit());
+			LuaWeakTable collectedCopy = weak;
+			TESTASSERT(collectedCopy.isInit() && !collectedCopy.isAlive());
+			weak.reset();
+			TESTASSERT(!weak.isInit());
+		}
+
+		// Stack arguments, valid during the C function, copies get a reference
+		{
+			LuaState argState;
+			argState.setValue("StackArgs", (lua_CFunction)_TestStackArgs);
+			TESTASSERT(argState.loadString("StackArgsResult = StackArgs({ x = 4 }, function(x) return x * 10 end, 2)"));
+			TESTASSERT(argState.getValue("StackArgsResult", i));
+			TESTASSERT(i == 42);
+			TESTASSERT(_testStackArgRefs == 0);
+			argState.collectGarbage();
+			TESTASSERT(_testKeptTable.getValue("x", i) && i == 4);
+			_testKeptTable = LuaTable();
+		}
+
+		// Embedded chunks, compiled with string.dump like luaembed does with lua_dump
+		TESTASSERT(state.loadString("EmbeddedCode = string.dump((loadstring or load)('EmbeddedLoads = (EmbeddedLoads or 0) + 1 return { Answer = 42 }'))"));
+		TESTASSERT(state.getValue("EmbeddedCode", _testEmbeddedCode));
+		_testEmbeddedChunk.name = "embedded/test.lua";
+		_testEmbeddedChunk.data = (const unsigned char*)_testEmbeddedCode.data();
+		_testEmbeddedChunk.size = _testEmbeddedCode.size();
+		size_t numEmbedded = LuaGetNumEmbedded();
+		{
+			// Registered for the scope only, the chunk memory belongs to the test
+			LuaEmbeddedRegistrar registrar(&_testEmbeddedChunk, 1);
+			TESTASSERT(LuaFindEmbedded("embedded/test.lua") != 0);
+			TESTASSERT(LuaFindEmbedded("embedded/other.lua") == 0);
+			LuaState embeddedState;
+			TESTASSERT(embeddedState.loadString("EmbeddedAnswer = require('embedded.test').Answer"));
+			TESTASSERT(embeddedState.getValue("EmbeddedAnswer", i));
+			TESTASSERT(i == 42);
+			TESTASSERT(embeddedState.loadFile("embedded/test.lua"));
+			TESTASSERT(embeddedState.getValue("EmbeddedLoads", i));
+			TESTASSERT(i == 2);
+			TESTASSERT(!embeddedState.loadString("require('embedded.missing')"));
+			TESTASSERT(LuaGetErrorFlag());
+		}
+		TESTASSERT(LuaFindEmbedded("embedded/test.lua") == 0);
+		TESTASSERT(LuaGetNumEmbedded() == numEmbedded);
+
+		// Event bus, the events are dispatched in one protected call and an error only drops its event
+		LuaEventBus bus(4);
+		LuaFunction<void> onDamage, onBoom;
+		TESTASSERT(state.loadString("EventSum = 0 EventNames = '' function OnDamage(amount, source) EventSum = EventSum + amount EventNames = EventNames .. source end function OnBoom() error('boom') end"));
+		TESTASSERT(state.getValue("OnDamage", onDamage));
+		TESTASSERT(state.getValue("OnBoom", onBoom));
+		TESTASSERT(bus.subscribe(1, onDamage));
+		TESTASSERT(bus.subscribe(2, onBoom));
+		TESTASSERT(bus.post(1, 5, "a"));
+		TESTASSERT(bus.post(2));
+		TESTASSERT(bus.post(1, 7.0, std::string("b")));
+		TESTASSERT(bus.post(3, true));
+		TESTASSERT(!bus.post(1, 1, "c"));
+		TESTASSERT(bus.getNumQueued() == 4);
+		TESTASSERT(bus.flush() == 4);
+		TESTASSERT(LuaGetErrorFlag());
+		TESTASSERT(bus.getNumQueued() == 0);
+		TESTASSERT(state.getValue("EventSum", i));
+		TESTASSERT(i == 12);
+		TESTASSERT(state.getValue("EventNames", s));
+		TESTASSERT(s == "ab");
+		bus.unsubscribe(1, onDamage);
+		TESTASSERT(bus.post(1, 5, "x"));
+		TESTASSERT(bus.flush() == 1);
+		TESTASSERT(state.getValue("EventSum", i));
+		TESTASSERT(i == 12);
+		// A handler posting on each flush keeps the queue busy, the strings stay bounded
+		{
+			LuaFunction<void> onRepost;
+			LuaEventBus repostBus(4);
+			_testRepostBus = &repostBus;
+			state.setValue("Repost", (lua_CFunction)_TestRepost);
+			TESTASSERT(state.loadString("RepostCount = 0 function OnRepost(payload, size, one) RepostCount = RepostCount + one Repost(payload) end"));
+			TESTASSERT(state.getValue("OnRepost", onRepost));
+			TESTASSERT(repostBus.subscribe(4, onRepost));
+			TESTASSERT(repostBus.post(4, std::string(100, 'x'), (size_t)100, 1L));
+			for (int flush = 0; flush < 1000; ++flush)
+				repostBus.flush();
+			TESTASSERT(repostBus.getNumQueued() == 1);
+			TESTASSERT(repostBus.getStringSize() == 100);
+			TESTASSERT(state.getValue("RepostCount", i));
+			TESTASSERT(i == 1000);
+			_testRepostBus = 0;
+		}
+		// A handler can clear the bus, the next handlers of its event don't run
+		{
+			LuaFunction<void> onClear, onAfterClear;
+			LuaEventBus clearBus(4);
+			_testRepostBus = &clearBus;
+			state.setValue("ClearBus", (lua_CFunction)_TestClearBus);
+			TESTASSERT(state.loadString("ClearCount = 0 function OnClear(s) ClearCount = ClearCount + #s ClearBus() end "
+				"function OnAfterClear(s) ClearCount = ClearCount + #s end"));
+			TESTASSERT(state.getValue("OnClear", onClear));
+			TESTASSERT(state.getValue("OnAfterClear", onAfterClear));
+			TESTASSERT(clearBus.subscribe(5, onClear));
+			TESTASSERT(clearBus.subscribe(5, onAfterClear));
+			TESTASSERT(clearBus.post(5, std::string(64, 'y')));
+			TESTASSERT(clearBus.post(5, "z"));
+			TESTASSERT(clearBus.flush() == 1);
+			TESTASSERT(clearBus.getNumQueued() == 0);
+			TESTASSERT(clearBus.getStringSize() == 0);
+			TESTASSERT(state.getValue("ClearCount", i));
+			TESTASSERT(i == 64);
+			_testRepostBus = 0;
+		}
+
+		// Error sink, the messages are formatted by the drain thread from copies of the arguments
+		{
+			errorCB previousCB = LuaGetErrorCB();
+			LuaSetErrorCB(_TestSinkError);
+			TESTASSERT(LuaStartErrorSink(16, 0));
+			TESTASSERT(!LuaStartErrorSink());
+			TESTASSERT(LuaIsErrorSinkRunning());
+			char name[16];
+			strcpy(name, "first");
+			detail::_LuaLogError("Sink test %s %d %.1f %5.2lf%%\n", name, -3, 1.5, 2.0);
+			strcpy(name, "second");
+			for (int n = 0; n < 3; ++n)
+				detail::_LuaLogError(LuaErrorRuntime, "Sink test repeat\n");
+			TESTASSERT(LuaGetErrorFlag());
+			TESTASSERT(LuaGetErrorCode() == LuaErrorRuntime);
+			LuaFlushErrorSink();
+			LuaStopErrorSink();
+			TESTASSERT(!LuaIsErrorSinkRunning());
+			long repeats = 0, count;
+			int repeatMessages = 0;
+			for (size_t n = 0; n < _testSinkMessages.size(); ++n)
+			{
+				if (_testSinkMessages[n] == "Sink test repeat\n")
+					repeatMessages++;
+				else if (sscanf(_testSinkMessages[n].c_str(), "Previous error repeated %ld", &count) == 1)
+					repeats += count;
+			}
+			TESTASSERT(!_testSinkMessages.empty() && _testSinkMessages[0] == "Sink test first -3 1.5  2.00%\n");
+			TESTASSERT(repeatMessages == 1 && repeats == 2);
+
+			// Rate limit (the errors may straddle two seconds)
+			_testSinkMessages.clear();
+			TESTASSERT(LuaStartErrorSink(16, 5));
+			for (int n = 0; n < 12; ++n)
+				detail::_LuaLogError("Sink test rate %d\n", n);
+			LuaStopErrorSink();
+			int rateMessages = 0;
+			for (size_t n = 0; n < _testSinkMessages.size(); ++n)
+			{
+				if (_testSinkMessages[n].compare(0, 14, "Sink test rate") == 0)
+					rateMessages++;
+			}
+			TESTASSERT(LuaGetNumDroppedErrors() >= 2);
+			TESTASSERT(rateMessages + LuaGetNumDroppedErrors() == 12);
+			LuaSetErrorCB(previousCB);
+			_testSinkMessages.clear();
+		}
+		LuaGetErrorFlag();
+
+		// GC telemetry, the last 4 collections are kept and the totals go on
+		{
+			std::vector<LuaGCSample> samples;
+			TESTASSERT(!state.getGCSamples(samples));
+			state.enableTelemetry(4);
+			state.collectGarbage();
+			for (int n = 0; n < 3; ++n)
+				state.collectGarbage(1);
+			state.collectGarbage();
+			TESTASSERT(state.getGCSamples(samples));
+			TESTASSERT(samples.size() == 4);
+			TESTASSERT(!samples.front().full && samples.back().full);
+			TESTASSERT(samples.back().memoryBefore > 0 && samples.back().memoryAfter > 0);
+			TESTASSERT(samples.back().timeUS >= samples.front().timeUS + samples.front().durationUS);
+			std::string text;
+			TESTASSERT(state.exportTelemetry(text, "test"));
+			TESTASSERT(text.find("luautils_gc_duration_seconds_count{state=\"test\",kind=\"full\"} 2\n") != std::string::npos);
+			TESTASSERT(text.find("luautils_gc_duration_seconds_count{state=\"test\",kind=\"step\"} 3\n") != std::string::npos);
+			TESTASSERT(text.find("luautils_gc_interval_seconds_count{state=\"test\"} 4\n") != std::string::npos);
+			TESTASSERT(text.find("luautils_gc_duration_seconds{state=\"test\",kind=\"full\",quantile=\"0.99\"} ") != std::string::npos);
+			const char *telemetryFile = "LuaUtilsTelemetry.prom";
+			TESTASSERT(state.exportTelemetryFile(telemetryFile, "test"));
+			std::string fileText;
+			FILE *file = fopen(telemetryFile, "rb");
+			TESTASSERT(file);
+			if (file)
+			{
+				char buf[256];
+				size_t size;
+				while ((size = fread(buf, 1, sizeof(buf), file)) > 0)
+					fileText.append(buf, size);
+				fclose(file);
+			}
+			remove(telemetryFile);
+			TESTASSERT(fileText.find("luautils_gc_freed_bytes_total{state=\"test\"} ") != std::string::npos);
+			state.enableTelemetry(0);
+			TESTASSERT(!state.getGCSamples(samples));
+			TESTASSERT(!state.exportTelemetryFile(telemetryFile, "test"));
+			TESTASSERT(LuaGetErrorFlag());
+		}
+
+		// Snapshots, restored into a new state
+		{
+			const char *snapshotFile = "LuaUtilsSnapshot.bin";
+			LuaState source;
+			source.setValue("TestCFunc", (lua_CFunction)_TestGetAccessor);
+			TESTASSERT(source.loadString(
+				"Config = { name = 'snap', list = { 1, 2.5, 'three', true }, nested = {} } "
+				"Config.nested.parent = Config Config.shared = Config.list "
+				"local count = 10 "
+				"function Inc(n) count = count + n return count end "
+				"function Get() return count end "
+				"Proxy = setmetatable({}, { __index = function(t, k) return k .. '!' end }) "
+				"Fmt = string.format Funcs = { cfunc = TestCFunc } "
+				"string.snapext = function(s) return s .. '?' end "
+				"package.loaded.snapmodule = { value = 42 } "
+				"Deep = { a = { b = { co = coroutine.create(function() end) } } } "
+				"Watched = { hp = 3, 'a' } "
+				"Inc(5)"));
+			LuaTable watched;
+			TESTASSERT(source.getValue("Watched", watched) && watched.observe());
+			TESTASSERT(!source.saveSnapshot(snapshotFile));
+			TESTASSERT(LuaGetErrorFlag());
+			TESTASSERT(source.loadString("Deep = nil"));
+			TESTASSERT(source.saveSnapshot(snapshotFile));
+
+			LuaState restored;
+			restored.setValue("TestCFunc", (lua_CFunction)_TestGetAccessor);
+			TESTASSERT(restored.restoreSnapshot(snapshotFile));
+			TESTASSERT(restored.loadString(
+				"SnapshotOK = Config.name == 'snap' and Config.list[2] == 2.5 and Config.list[3] == 'three' "
+				"and Config.nested.parent == Config and Config.shared == Config.list "
+				"and Proxy.abc == 'abc!' and Fmt == string.format and Funcs.cfunc == TestCFunc "
+				"and string.snapext('a') == 'a?' and require('snapmodule').value == 42 "
+				"and rawget(Watched, 'hp') == 3 and rawget(Watched, 1) == 'a'"));
+			TESTASSERT(restored.getValue("SnapshotOK", b));
+			TESTASSERT(b);
+			LuaFunction<int> inc, get;
+			TESTASSERT(restored.getValue("Inc", inc));
+			TESTASSERT(restored.getValue("Get", get));
+			TESTASSERT(inc(1) == 16);
+#if LUA_VERSION_NUM >= 502 || defined(LUAJIT_VERSION)
+			// Shared upvalues stay shared
+			TESTASSERT(get() == 16);
+#endif
+
+			// The C functions must be registered before restoring
+			LuaState missing;
+			TESTASSERT(!missing.restoreSnapshot(snapshotFile));
+			TESTASSERT(LuaGetErrorFlag());
+
+			// A corrupted key is reported, the error doesn't reach the panic function
+			LuaState corrupt;
+			TESTASSERT(corrupt.loadString("Corrupt = { [12345.5] = true }"));
+			TESTASSERT(corrupt.saveSnapshot(snapshotFile));
+			std::string data;
+			FILE *file = fopen(snapshotFile, "rb");
+			TESTASSERT(file);
+			char chunk[256];
+			for (size_t size; (size = fread(chunk, 1, sizeof(chunk), file)) != 0; )
+				data.append(chunk, size);
+			fclose(file);
+			double key = 12345.5;
+			volatile double zero = 0;
+			double nan = zero / zero;
+			size_t pos = data.find(std::string((const char*)&key, sizeof(key)));
+			TESTASSERT(pos != std::string::npos);
+			data.replace(pos, sizeof(nan), (const char*)&nan, sizeof(nan));
+			file = fopen(snapshotFile, "wb");
+			TESTASSERT(file && fwrite(data.data(), 1, data.size(), file) == data.size());
+			fclose(file);
+			LuaState corrupted;
+			TESTASSERT(!corrupted.restoreSnapshot(snapshotFile));
+			TESTASSERT(LuaGetErrorFlag());
+			TESTASSERT(corrupted.loadString("assert(Corrupt == nil)"));
+
+			remove(snapshotFile);
+			TESTASSERT(!missing.restoreSnapshot(snapshotFile));
+			TESTASSERT(LuaGetErrorCode() == LuaErrorFile);
+		}
+
+		// Vector kernels, with sizes that aren't a multiple of the SIMD width
+		{
+			double a[7] = { 1, 2, 3, 4, 5, 6, 7 };
+			double b[7] = { 7, 6, 5, 4, 3, 2, 1 };
+			TESTASSERT(_LuaVectorDot(a, b, 7) == 84);
+			TESTASSERT(_LuaVectorSum(a, 7) == 28);
+			TESTASSERT(_LuaVectorSum(a, 0) == 0);
+			TESTASSERT(_LuaVectorMin(b, 7) == 1 && _LuaVectorMax(b, 7) == 7);
+			TESTASSERT(_LuaVectorMin(b + 1, 3) == 4 && _LuaVectorMax(a + 4, 1) == 5);
+			_LuaVectorFma(a, b, b, 7);
+			TESTASSERT(a[0] == 50 && a[3] == 20 && a[6] == 8);
+			_LuaVectorAdd(b, b, 7);
+			_LuaVectorScale(b, 0.5, 7);
+			_LuaVectorClamp(b, 2, 5, 7);
+			TESTASSERT(b[0] == 5 && b[2] == 5 && b[3] == 4 && b[6] == 2);
+		}
+
+		// Vector library
+		{
+			LuaState vecState;
+			vecState.openVectorLib();
+			TESTASSERT(vecState.loadString(
+				"local v = vector.fromTable({ 1, 2, 3, 4, 5 }) "
+				"local w = vector.new(5, 2) "
+				"v:add(1):mul(w):fma(w, 0.5):scale(2):add(v:copy()) "
+				"local t = v:toTable() "
+				"VectorOK = #v == 5 and v[1] == 20 and t[5] == 52 and v[6] == nil and w:dot(w) == 20 "
+				"and w:sum() == 10 and v:min() == 20 and v:max() == 52 and vector.new(0):max() == nil "
+				"v[2] = -1 v:clamp(0, 20) "
+				"VectorOK = VectorOK and v[2] == 0 and v[3] == 20 and v[5] == 20 "
+				"and not pcall(v.add, v, vector.new(4)) and not pcall(function() v[6] = 1 end) "
+				"and not pcall(vector.fromTable, { 1, 'x' }) and getmetatable(v) == 'vector' "
+				"and not pcall(debug.getmetatable(v).__len, {}) and not pcall(debug.getmetatable(v).__newindex, io.stdout, 1, 5)"));
+			TESTASSERT(vecState.getValue("VectorOK", b));
+			TESTASSERT(b);
+		}
+
+		// Buffer library, read from a C function without a Lua string
+		{
+			LuaState bufState;
+			bufState.openBufferLib();
+			bufState.setValue("SendBuffer", (lua_CFunction)_TestSendBuffer);
+			TESTASSERT(bufState.loadString(
+				"local b = buffer.new(4) "
+				"b:append('<', 12, '>', 1.5):appendf('[%5s|%-3s|%.2s|%03d|%x|%.1f|%%]', 'ab', 'c', 'xyz', 7, 255, 0.25) "
+				"b:append(b) SendBuffer(b) "
+				"local big = buffer.new() for i = 1, 1000 do big:append('x') end "
+				"BufferOK = #b == 68 and #big == 1000 and tostring(big) == string.rep('x', 1000) "
+				"and #big:clear() == 0 and not pcall(b.append, b, {}) and not pcall(b.appendf, b, '%q', 'a') "
+				"and not pcall(b.appendf, b, '%d') and buffer.new():tostring() == '' and getmetatable(b) == 'buffer' "
+				"and pcall(debug.getmetatable(b).__gc, io.stdout) and pcall(debug.getmetatable(b).__gc, {}) "
+				"and not pcall(debug.getmetatable(b).__len, {})"));
+			TESTASSERT(bufState.getValue("BufferOK", b));
+			TESTASSERT(b);
+			TESTASSERT(_testBufferContent.size() == 68);
+			TESTASSERT(_testBufferContent.compare(0, 34, "<12>1.5[   ab|c  |xy|007|ff|0.2|%]") == 0);
+		}
+
+		// Trace of the calls between C++ and Lua
+		{
+			const char *traceFile = "LuaUtilsTrace.json";
+#ifdef LUAUTILS_TRACE
+			LuaState traceState;
+			lua_CFunction cfunc = 0;
+			traceState.setValue("SendBuffer", (lua_CFunction)_TestSendBuffer);
+			TESTASSERT(traceState.getValue("SendBuffer", cfunc) && cfunc == _TestSendBuffer);
+			traceState.setValue("SendBuffer2", (lua_CFunction)_TestSendBuffer);
+			TESTASSERT(traceState.loadString("SAMEFUNC = rawequal(SendBuffer, SendBuffer2)"));
+			TESTASSERT(traceState.getValue("SAMEFUNC", b) && b);
+			TESTASSERT(LuaStartTrace(traceFile));
+			TESTASSERT(LuaIsTracing());
+			TESTASSERT(!LuaStartTrace(traceFile));
+			TESTASSERT(traceState.loadString("function Traced(s) SendBuffer(s) return 1 end"));
+			LuaFunction<int> traced;
+			TESTASSERT(traceState.getValue("Traced", traced));
+			TESTASSERT(traced("\"quoted\"") == 1);
+			traceState.collectGarbage();
+			TESTASSERT(LuaStopTrace());
+			TESTASSERT(!LuaIsTracing());
+			TESTASSERT(!LuaStopTrace());
+			std::string fileText;
+			FILE *file = fopen(traceFile, "rb");
+			TESTASSERT(file);
+			if (file)
+			{
+				char buf[256];
+				size_t size;
+				while ((size = fread(buf, 1, sizeof(buf), file)) > 0)
+					fileText.append(buf, size);
+				fclose(file);
+			}
+			remove(traceFile);
+			TESTASSERT(fileText.find("{\"name\":\"loadString\",\"cat\":\"load\",\"ph\":\"X\",") != std::string::npos);
+			TESTASSERT(fileText.find("{\"name\":\"Traced\",\"cat\":\"call\",") != std::string::npos);
+			TESTASSERT(fileText.find("{\"name\":\"SendBuffer\",\"cat\":\"cfunc\",") != std::string::npos);
+			TESTASSERT(fileText.find("{\"name\":\"collectGarbage\",\"cat\":\"gc\",") != std::string::npos);
+			TESTASSERT(_testBufferContent == "\"quoted\"");
+			TESTASSERT(LuaGetErrorFlag());
+#else
+			TESTASSERT(!LuaStartTrace(traceFile));
+			TESTASSERT(LuaGetErrorFlag());
+#endif
+		}
+
+		// CSV loader, both layouts and the quoting rules
+		{
+			const char *csvFile = "LuaUtilsTest.csv";
+			FILE *file = fopen(csvFile, "wb");
+			TESTASSERT(file);
+			if (file)
+			{
+				fputs("name,price,note\r\n"
+					"apple,1.5,\"red, round\"\r\n"
+					"\n"
+					"pear,12,\"say \"\"hi\"\"\nthen\"\r\n"
+					"kiwi,-3,\"007\"\n", file);
+				fclose(file);
+			}
+			LuaState csvState;
+			LuaTable columns, rows, column, row;
+			LuaCSVOptions options;
+			TESTASSERT(csvState.loadCSV(csvFile, columns));
+			TESTASSERT(columns.getValue("price", column) && column.getArraySize() == 3);
+			TESTASSERT(column.getValue(2, i) && i == 12);
+			TESTASSERT(column.getValue(1, f) && f == 1.5f);
+			TESTASSERT(columns.getValue("note", column) && column.getValue(1, s) && s == "red, round");
+			TESTASSERT(column.getValue(2, s) && s == "say \"hi\"\nthen");
+			TESTASSERT(column.getValue(3, s) && s == "007");
+			options.layout = LuaCSVRows;
+			TESTASSERT(csvState.loadCSV(csvFile, rows, options));
+			TESTASSERT(rows.getArraySize() == 3);
+			TESTASSERT(rows.getValue(3, row) && row.getValue("price", i) && i == -3);
+			TESTASSERT(row.getValue("name", s) && s == "kiwi");
+			options.header = false;
+			TESTASSERT(csvState.loadCSV(csvFile, rows, options));
+			TESTASSERT(rows.getArraySize() == 4 && rows.getValue(1, row) && row.getValue(3, s) && s == "note");
+			TESTASSERT(!csvState.loadCSV("LuaUtilsMissing.csv", rows));
+			TESTASSERT(LuaGetErrorCode() == LuaErrorFile);
+			csvState.openCSVLib();
+			TESTASSERT(csvState.loadString(
+				"local t = csv.load('LuaUtilsTest.csv') "
+				"local r = csv.load('LuaUtilsTest.csv', { layout = 'rows', separator = ';', numbers = false }) "
+				"local missing, err = csv.load('LuaUtilsMissing.csv') "
+				"CSVOK = #t.name == 3 and t.name[3] == 'kiwi' and (math.type == nil or math.type(t.price[2]) == 'integer') "
+				"and #r == 5 and r[2]['name,price,note'] == '' and r[3]['name,price,note'] == 'pear,12,\"say \"\"hi\"\"' "
+				"and missing == nil and type(err) == 'string' and not pcall(csv.load, 'x', { separator = ';;' })"));
+			TESTASSERT(csvState.getValue("CSVOK", b));
+			TESTASSERT(b);
+			file = fopen(csvFile, "wb");
+			if (file)
+			{
+				fputs("a,b\n1,2\n3\n", file);
+				fclose(file);
+			}
+			TESTASSERT(!csvState.loadCSV(csvFile, rows));
+			TESTASSERT(LuaGetErrorFlag());
+			// A quoted last field ended by a \r at the end of the file
+			file = fopen(csvFile, "wb");
+			if (file)
+			{
+				fputs("a,b\r\n1,\"x\"\r", file);
+				fclose(file);
+			}
+			TESTASSERT(csvState.loadCSV(csvFile, columns));
+			TESTASSERT(columns.getValue("b", column) && column.getArraySize() == 1 && column.getValue(1, s) && s == "x");
+			// With a single column, a blank line is an empty field
+			file = fopen(csvFile, "wb");
+			if (file)
+			{
+				fputs("a\n1\n\n3\n\n", file);
+				fclose(file);
+			}
+			TESTASSERT(csvState.loadCSV(csvFile, columns));
+			TESTASSERT(columns.getValue("a", column) && column.getArraySize() == 3);
+			TESTASSERT(column.getValue(2, s) && s.empty() && column.getValue(3, i) && i == 3);
+			remove(csvFile);
+		}
+
+		// Memoised calls, answered from a bounded cache while the arguments repeat
+		{
+			LuaState memoState;
+			LuaFunction<int> priceFunc;
+			LuaTable memoTable;
+			TESTASSERT(memoState.loadString("MemoCalls = 0 MemoTable = { 1, 2 } "
+				"function Price(item, count) MemoCalls = MemoCalls + 1 if item == 'bad' then error('bad item') end return #item * count end"));
+			TESTASSERT(memoState.getValue("Price", priceFunc));
+			TESTASSERT(memoState.getValue("MemoTable", memoTable));
+			LuaMemoFunction<int> price(priceFunc, 2);
+			TESTASSERT(price("sword", 3) == 15);
+			TESTASSERT(price("sword", 3) == 15);
+			TESTASSERT(price("axe", 2) == 6);
+			TESTASSERT(price("sword", 3) == 15);
+			// Evicts axe, then axe evicts sword
+			TESTASSERT(price("bow", 1) == 3);
+			TESTASSERT(price("axe", 2) == 6);
+			TESTASSERT(price("bad", 1) == 0);
+			TESTASSERT(price("bad", 1) == 0);
+			TESTASSERT(LuaGetErrorFlag());
+			TESTASSERT(price(memoTable, 2) == 4);
+			TESTASSERT(price(memoTable, 2) == 4);
+			TESTASSERT(price.invalidate("bow", 1));
+			TESTASSERT(!price.invalidate("bow", 1));
+			TESTASSERT(price("axe", 2) == 6);
+			TESTASSERT(memoState.getValue("MemoCalls", i));
+			TESTASSERT(i == 8);
+			const LuaMemoStats &stats = price.getStats();
+			TESTASSERT(stats.hits == 3 && stats.misses == 6 && stats.uncached == 2 && stats.evictions == 2);
+			TESTASSERT(price.getSize() == 1);
+			LuaMemoFunction<int> priceCopy(price);
+			TESTASSERT(priceCopy.getSize() == 0 && priceCopy("axe", 2) == 6);
+			price.invalidate();
+			TESTASSERT(price.getSize() == 0);
+			price.setCapacity(0);
+			TESTASSERT(price("axe", 2) == 6 && price.getSize() == 0);
+
+			// Reentrant calls, Fib recurses through the memoised function
+			LuaFunction<int> fibFunc;
+			memoState.setValue("MemoFib", (lua_CFunction)_TestMemoFib);
+			TESTASSERT(memoState.loadString("function Fib(n) if n < 2 then return n end return MemoFib(n - 1) + MemoFib(n - 2) end"));
+			TESTASSERT(memoState.getValue("Fib", fibFunc));
+			LuaMemoFunction<int> fib(fibFunc, 64);
+			_testMemoFib = &fib;
+			TESTASSERT(fib(10) == 55);
+			TESTASSERT(fib.getSize() == 11);
+			TESTASSERT(fib(10) == 55 && fib.getStats().hits == 9);
+			fib.invalidate();
+			fib.setCapacity(3);
+			TESTASSERT(fib(20) == 6765);
+			TESTASSERT(fib.getSize() == 3);
+			_testMemoFib = 0;
+		}
+
+		// Call policies
+		LuaFunction<float, LuaCallTraceback> tracebackFunc;
+		_TestBatch batch;
+		TESTASSERT(state.getValue("TestFunc", tracebackFunc));
+		TESTASSERT(tracebackFunc(3.0f) == 9.0f);
+		TESTASSERT(tracebackFunc("not a number") == 0.0f);
+		TESTASSERT(LuaGetErrorFlag());
+		TESTASSERT(state.getValue("TestFunc", batch.func));
+		batch.sum = 0.0f;
+		batch.count = 4;
+		TESTASSERT(state.runProtected(_TestRunBatch, &batch));
+		TESTASSERT(batch.sum == 14.0f);
+		TESTASSERT(state.getValue("TestError", batch.func));
+		TESTASSERT(!state.runProtected(_TestRunBatch, &batch));
+		TESTASSERT(LuaGetErrorFlag());
+
+		// Bound values
+		int boundInt = 5;
+		std::string boundString = "bound";
+		TESTASSERT(state.loadString("BoundInt = 1"));
+		state.bindValue("BoundInt", &boundInt);
+		state.bindValue("BoundString", &boundString, true);
+		state.bindAccessor("BoundAccessor", _TestGetAccessor, _TestSetAccessor);
+		table.bindValue("BoundFloat", &f);
+		f = 2.5f;
+		TESTASSERT(state.loadString("BoundResult = BoundInt + BoundAccessor; BoundInt = 7; BoundAccessor = 3; TableVal.BoundFloat = TableVal.BoundFloat * 2"));
+		TESTASSERT(state.getValue("BoundResult", i));
+		TESTASSERT(i == 5);
+		TESTASSERT(boundInt == 7);
+		TESTASSERT(_testAccessorValue == 3);
+		TESTASSERT(f == 5.0f);
+		boundString = "changed";
+		TESTASSERT(state.getValue("BoundString", s));
+		TESTASSERT(s == "changed");
+		TESTASSERT(!state.loadString("BoundString = 'nope'"));
+		TESTASSERT(!state.loadString("BoundInt = 'nope'"));
+		TESTASSERT(LuaGetErrorFlag());
+		state.setValue("BoundInt", 8);
+		TESTASSERT(boundInt == 8);
+		// From C++ the errors are logged
+		state.setValue("BoundInt", "nope");
+		TESTASSERT(LuaGetErrorCode() == LuaErrorRuntime);
+		TESTASSERT(boundInt == 8);
+		state.setValue("BoundString", "nope");
+		TESTASSERT(LuaGetErrorFlag());
+		TESTASSERT(boundString == "changed");
+		table.setValue("BoundFloat", true);
+		TESTASSERT(LuaGetErrorFlag());
+		TESTASSERT(f == 5.0f);
+		state.unbindValue("BoundInt");
+		boundInt = 0;
+		TESTASSERT(state.getValue("BoundInt", i));
+		TESTASSERT(i == 8);
+		table.unbindValue("BoundFloat");
+
+		// Run a coroutine
+		LuaFunction<void> coFunc;
+		LuaCoroutine co;
+		TESTASSERT(state.getValue("TestCoroutine", coFunc));
+		TESTASSERT(co.init(coFunc));
+		TESTASSERT(co.resume(1, 2));
+		TESTASSERT(co.getStatus() == LuaCoroutine::Suspended);
+		TESTASSERT(co.getNumResults() == 1);
+		TESTASSERT(co.getResult(1, i));
+		TESTASSERT(i == 3);
+		TESTASSERT(co.resume(21));
+		TESTASSERT(co.getStatus() == LuaCoroutine::Finished);
+		TESTASSERT(co.getNumResults() == 2);
+		TESTASSERT(co.getResult(1, i));
+		TESTASSERT(co.getResult(2, s));
+		TESTASSERT(i == 42);
+		TESTASSERT(s == "done");
+		TESTASSERT(!co.resume());
+		LuaGetErrorFlag();
+
+		// Schedule a few tasks, they finish on the second tick
+		LuaScheduler scheduler;
+		TESTASSERT(state.getValue("TestTask", coFunc));
+		for (int n = 0; n < 100; ++n)
+			TESTASSERT(scheduler.add(coFunc));
+		TESTASSERT(scheduler.tick(1) == 100);
+		TESTASSERT(scheduler.tick(2) == 0);
+		TESTASSERT(state.getValue("TaskCount", i));
+		TESTASSERT(i == 301);
+
+		// Wait on an asynchronous operation
+		LuaAsyncBridge bridge;
+		state.setValue("AsyncOp", _TestAsyncOp);
+		TESTASSERT(state.getValue("TestAsync", coFunc));
+		TESTASSERT(bridge.spawn(coFunc, 1));
+		TESTASSERT(bridge.poll() == 1);
+		TESTASSERT(bridge.getNumParked() == 1);
+		TESTASSERT(bridge.poll() == 1);
+		TESTASSERT(bridge.complete(_testTicket, "async result"));
+		TESTASSERT(!bridge.complete(_testTicket, "async result"));
+		TESTASSERT(bridge.poll() == 0);
+		TESTASSERT(state.getValue("AsyncResult", s));
+		TESTASSERT(s == "async result");
+		TESTASSERT(bridge.spawn(coFunc, 2));
+		bridge.poll();
+		TESTASSERT(bridge.fail(_testTicket, "async error"));
+		TESTASSERT(bridge.poll() == 0);
+		TESTASSERT(state.getValue("AsyncResult", s));
+		TESTASSERT(s == "async error");
+		// Still usable after clear, and a ticket can be completed before the task yields
+		bridge.clear();
+		TESTASSERT(bridge.spawn(coFunc, 3));
+		TESTASSERT(bridge.poll() == 1);
+		TESTASSERT(bridge.complete(_testTicket, "after clear"));
+		TESTASSERT(bridge.poll() == 0);
+		TESTASSERT(state.getValue("AsyncResult", s));
+		TESTASSERT(s == "after clear");
+		_testBridge = &bridge;
+		state.setValue("AsyncOp", _TestAsyncNow);
+		TESTASSERT(bridge.spawn(coFunc, 4));
+		TESTASSERT(bridge.poll() == 1);
+		TESTASSERT(bridge.getNumParked() == 0);
+		TESTASSERT(bridge.poll() == 0);
+		TESTASSERT(state.getValue("AsyncResult", s));
+		TESTASSERT(s == "async now");
+		state.setValue("AsyncOp", _TestAsyncOp);
+		_testBridge = 0;
+
+		// Reload a script file, the global table must be preserved
+		// (in a directory of its own, the reload manager watches the whole directory)
+		LuaReloadManager reloader;
+		LuaTable reloadTable;
+		TESTASSERT(reloader.attach(state));
+#ifdef WIN32
+		std::string reloadDir = ".";
+#else
+		char reloadDirTemplate[] = "/tmp/LuaUtilsReloadXXXXXX";
+		std::string reloadDir = mkdtemp(reloadDirTemplate) ? reloadDirTemplate : ".";
+#endif
+		std::string reloadFile = reloadDir + "/LuaUtilsReloadTest.lua";
+		FILE *file = fopen(reloadFile.c_str(), "w");
+		TESTASSERT(file);
+		if (file)
+		{
+			fputs("ReloadTable = { Value = 1, Nested = { A = 1 } }", file);
+			fclose(file);
+			TESTASSERT(state.loadFile(reloadFile.c_str()));
+			TESTASSERT(reloader.getNumFiles() == 1);
+			TESTASSERT(state.getValue("ReloadTable", reloadTable));
+			reloadTable.setValue("Warm", 42);
+			file = fopen(reloadFile.c_str(), "w");
+			fputs("ReloadTable = { Value = 2, Nested = { A = 2 } }", file);
+			fclose(file);
+			TESTASSERT(reloader.reload(reloadFile.c_str()));
+			TESTASSERT(reloadTable.getValue("Value", i));
+			TESTASSERT(i == 2);
+			TESTASSERT(reloadTable.getValue("Warm", i));
+			TESTASSERT(i == 42);
+			TESTASSERT(reloadTable.getValue("Nested", nestedTable));
+			TESTASSERT(nestedTable.getValue("A", i));
+			TESTASSERT(i == 2);
+#ifdef __linux__
+			// update() sees the file rewritten (the file times could be in the same second elsewhere)
+			file = fopen(reloadFile.c_str(), "w");
+			fputs("ReloadTable = { Value = 3, Nested = { A = 3 } }", file);
+			fclose(file);
+			TESTASSERT(reloader.update() == 1);
+			TESTASSERT(reloadTable.getValue("Value", i));
+			TESTASSERT(i == 3);
+			TESTASSERT(reloadTable.getValue("Warm", i));
+			TESTASSERT(i == 42);
+			TESTASSERT(reloader.update() == 0);
+#endif
+			remove(reloadFile.c_str());
+		}
+#ifndef WIN32
+		if (reloadDir != ".")
+			rmdir(reloadDir.c_str());
+#endif
+		reloader.detach();
+
+		// Module cache, the second state loads the module without its file
+		const char *moduleFile = "LuaUtilsCachedModule.lua";
+		file = fopen(moduleFile, "w");
+		TESTASSERT(file);
+		if (file)
+		{
+			fputs("return { Value = 5 }", file);
+			fclose(file);
+			LuaEnableModuleCache(true);
+			{
+				LuaState firstState;
+				TESTASSERT(firstState.loadString("CachedValue = require('LuaUtilsCachedModule').Value"));
+				TESTASSERT(firstState.getValue("CachedValue", i));
+				TESTASSERT(i == 5);
+			}
+			TESTASSERT(LuaGetNumCachedModules() == 1);
+			remove(moduleFile);
+			{
+				LuaState secondState;
+				TESTASSERT(secondState.loadString("CachedValue = require('LuaUtilsCachedModule').Value"));
+				TESTASSERT(secondState.getValue("CachedValue", i));
+				TESTASSERT(i == 5);
+				TESTASSERT(!secondState.loadString("require('LuaUtilsMissingModule')"));
+				TESTASSERT(LuaGetErrorFlag());
+			}
+			LuaEnableModuleCache(false);
+			LuaClearModuleCache();
+			TESTASSERT(LuaGetNumCachedModules() == 0);
+		}
+
+		// Limits, the state must stay usable after a call went over budget
+		LuaState limitedState;
+		LuaLimits limits;
+		LuaFunction<void> loopFunc;
+		limits.maxInstructions = 100000;
+		limitedState.setLimits(limits);
+		TESTASSERT(limitedState.loadString("function Loop() while true do end end function Grow() local t = {} for i = 1, 10000000 do t[i] = i end end"));
+		TESTASSERT(limitedState.getValue("Loop", loopFunc));
+		loopFunc();
+		TESTASSERT(LuaGetErrorCode() == LuaErrorInstructionLimit);
+		limits.maxInstructions = 0;
+		limits.maxTimeMS = 10;
+		limitedState.setLimits(limits);
+		TESTASSERT(!limitedState.loadString("Loop()"));
+		TESTASSERT(LuaGetErrorCode() == LuaErrorTimeLimit);
+		limits.maxTimeMS = 0;
+		limits.maxMemory = limitedState.getMemUsage() + 256 * 1024;
+		limitedState.setLimits(limits);
+		TESTASSERT(!limitedState.loadString("Grow()"));
+		TESTASSERT(LuaGetErrorCode() == LuaErrorMemoryLimit);
+		limitedState.setValue("Abort", _TestAbort);
+		TESTASSERT(!limitedState.loadString("Abort() Loop()"));
+		TESTASSERT(LuaGetErrorCode() == LuaErrorAborted);
+		limits.maxMemory = 0;
+		limits.maxInstructions = 100000;
+		limitedState.setLimits(limits);
+		LuaCoroutine limitedCo;
+		TESTASSERT(limitedCo.init(loopFunc));
+		TESTASSERT(!limitedCo.resume());
+		TESTASSERT(LuaGetErrorCode() == LuaErrorInstructionLimit);
+		TESTASSERT(limitedCo.getStatus() == LuaCoroutine::Failed);
+		TESTASSERT(limitedState.loadString("LimitResult = 42"));
+		TESTASSERT(limitedState.getValue("LimitResult", i));
+		TESTASSERT(i == 42);
+		TESTASSERT(LuaGetErrorFlag());
 	}
 	return errCount;
 }
 
+////////////////////////////////////////////////////////////////////////////////////
+// Benchmark the call policies
+struct _BenchBatch
+{
+	LuaFunction<double, LuaCallUnprotected>	func;
+	int										iterations;
+	double									sum;
+};
+static void _BenchRunBatch(void *userData)
+{
+	_BenchBatch *batch = (_BenchBatch*)userData;
+	for (int n = 0; n < batch->iterations; ++n)
+		batch->sum += batch->func(n);
+}
+void _BenchmarkCallPolicies(int iterations, double results[3])
+{
+	LuaState state;
+	LuaFunction<double> protectedFunc;
+	LuaFunction<double, LuaCallTraceback> tracebackFunc;
+	_BenchBatch batch;
+	state.loadString("function BenchFunc(n) return n + 1 end");
+	state.getValue("BenchFunc", protectedFunc);
+	state.getValue("BenchFunc", tracebackFunc);
+	state.getValue("BenchFunc", batch.func);
+	batch.iterations = iterations;
+	batch.sum = 0.0;
+	double sum = 0.0;
+	
+	clock_t start = clock();
+	for (int n = 0; n < iterations; ++n)
+		sum += protectedFunc(n);
+	results[0] = (double)(clock() - start) / CLOCKS_PER_SEC;
+	
+	start = clock();
+	for (int n = 0; n < iterations; ++n)
+		sum += tracebackFunc(n);
+	results[1] = (double)(clock() - start) / CLOCKS_PER_SEC;
+	
+	start = clock();
+	state.runProtected(_BenchRunBatch, &batch);
+	results[2] = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+	for (int i = 0; i < 3; ++i)
+		results[i] = results[i] * 1e9 / iterations;
+}
+
 } // detail
 } // LuaUtils
@@ -0,0 +1,569 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaVector.h"
+
+#if defined(LUAUTILS_VECTOR_AVX2)
+#include <immintrin.h>
+#elif defined(LUAUTILS_VECTOR_SSE2)
+#include <emmintrin.h>
+#endif
+
+namespace LuaUtils {;
+namespace detail {;
+
+//////////////////////////////////////////////////////////////////////////////
+// Packs of doubles processed by one instruction, the kernels do the packs then the remaining elements
+#if defined(LUAUTILS_VECTOR_AVX2)
+#define LUAUTILS_VECTOR_PACK
+typedef __m256d Pack;
+static const size_t gPackSize = 4;
+static inline Pack packLoad(const double *p) { return _mm256_loadu_pd(p); }
+static inline void packStore(double *p, Pack a) { _mm256_storeu_pd(p, a); }
+static inline Pack packSet(double s) { return _mm256_set1_pd(s); }
+static inline Pack packAdd(Pack a, Pack b) { return _mm256_add_pd(a, b); }
+static inline Pack packMul(Pack a, Pack b) { return _mm256_mul_pd(a, b); }
+static inline Pack packMin(Pack a, Pack b) { return _mm256_min_pd(a, b); }
+static inline Pack packMax(Pack a, Pack b) { return _mm256_max_pd(a, b); }
+#ifdef __FMA__
+static inline Pack packFma(Pack a, Pack b, Pack c) { return _mm256_fmadd_pd(b, c, a); }
+#else
+static inline Pack packFma(Pack a, Pack b, Pack c) { return _mm256_add_pd(a, _mm256_mul_pd(b, c)); }
+#endif
+#elif defined(LUAUTILS_VECTOR_SSE2)
+#define LUAUTILS_VECTOR_PACK
+typedef __m128d Pack;
+static const size_t gPackSize = 2;
+static inline Pack packLoad(const double *p) { return _mm_loadu_pd(p); }
+static inline void packStore(double *p, Pack a) { _mm_storeu_pd(p, a); }
+static inline Pack packSet(double s) { return _mm_set1_pd(s); }
+static inline Pack packAdd(Pack a, Pack b) { return _mm_add_pd(a, b); }
+static inline Pack packMul(Pack a, Pack b) { return _mm_mul_pd(a, b); }
+static inline Pack packMin(Pack a, Pack b) { return _mm_min_pd(a, b); }
+static inline Pack packMax(Pack a, Pack b) { return _mm_max_pd(a, b); }
+static inline Pack packFma(Pack a, Pack b, Pack c) { return _mm_add_pd(a, _mm_mul_pd(b, c)); }
+#endif
+
+#ifdef LUAUTILS_VECTOR_PACK
+// Number of elements done with packs
+static inline size_t packEnd(size_t n) { return n - n % gPackSize; }
+// Sum of the elements of a pack
+static inline double packSum(Pack a)
+{
+	double values[gPackSize];
+	packStore(values, a);
+	double sum = 0;
+	for (size_t i = 0; i < gPackSize; ++i)
+		sum += values[i];
+	return sum;
+}
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////
+// a += b
+void _LuaVectorAdd(double *a, const double *b, size_t n)
+{
+	size_t i = 0;
+#ifdef LUAUTILS_VECTOR_PACK
+	for (size_t end = packEnd(n); i < end; i += gPackSize)
+		packStore(a + i, packAdd(packLoad(a + i), packLoad(b + i)));
+#endif
+	for (; i < n; ++i)
+		a[i] += b[i];
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// a += s
+void _LuaVectorAddScalar(double *a, double s, size_t n)
+{
+	size_t i = 0;
+#ifdef LUAUTILS_VECTOR_PACK
+	Pack p = packSet(s);
+	for (size_t end = packEnd(n); i < end; i += gPackSize)
+		packStore(a + i, packAdd(packLoad(a + i), p));
+#endif
+	for (; i < n; ++i)
+		a[i] += s;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// a *= b
+void _LuaVectorMul(double *a, const double *b, size_t n)
+{
+	size_t i = 0;
+#ifdef LUAUTILS_VECTOR_PACK
+	for (size_t end = packEnd(n); i < end; i += gPackSize)
+		packStore(a + i, packMul(packLoad(a + i), packLoad(b + i)));
+#endif
+	for (; i < n; ++i)
+		a[i] *= b[i];
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// a *= s
+void _LuaVectorScale(double *a, double s, size_t n)
+{
+	size_t i = 0;
+#ifdef LUAUTILS_VECTOR_PACK
+	Pack p = packSet(s);
+	for (size_t end = packEnd(n); i < end; i += gPackSize)
+		packStore(a + i, packMul(packLoad(a + i), p));
+#endif
+	for (; i < n; ++i)
+		a[i] *= s;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// a += b * c
+void _LuaVectorFma(double *a, const double *b, const double *c, size_t n)
+{
+	size_t i = 0;
+#ifdef LUAUTILS_VECTOR_PACK
+	for (size_t end = packEnd(n); i < end; i += gPackSize)
+		packStore(a + i, packFma(packLoad(a + i), packLoad(b + i), packLoad(c + i)));
+#endif
+	for (; i < n; ++i)
+		a[i] += b[i] * c[i];
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// a += b * s
+void _LuaVectorFmaScalar(double *a, const double *b, double s, size_t n)
+{
+	size_t i = 0;
+#ifdef LUAUTILS_VECTOR_PACK
+	Pack p = packSet(s);
+	for (size_t end = packEnd(n); i < end; i += gPackSize)
+		packStore(a + i, packFma(packLoad(a + i), packLoad(b + i), p));
+#endif
+	for (; i < n; ++i)
+		a[i] += b[i] * s;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// a = min(max(a, low), high)
+void _LuaVectorClamp(double *a, double low, double high, size_t n)
+{
+	size_t i = 0;
+#ifdef LUAUTILS_VECTOR_PACK
+	Pack pLow = packSet(low);
+	Pack pHigh = packSet(high);
+	for (size_t end = packEnd(n); i < end; i += gPackSize)
+		packStore(a + i, packMin(packMax(packLoad(a + i), pLow), pHigh));
+#endif
+	for (; i < n; ++i)
+	{
+		double x = a[i] > low ? a[i] : low;
+		a[i] = x < high ? x : high;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Sum of a * b
+double _LuaVectorDot(const double *a, const double *b, size_t n)
+{
+	size_t i = 0;
+	double sum = 0;
+#ifdef LUAUTILS_VECTOR_PACK
+	Pack p = packSet(0);
+	for (size_t end = packEnd(n); i < end; i += gPackSize)
+		p = packFma(p, packLoad(a + i), packLoad(b + i));
+	sum = packSum(p);
+#endif
+	for (; i < n; ++i)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Sum of a
+double _LuaVectorSum(const double *a, size_t n)
+{
+	size_t i = 0;
+	double sum = 0;
+#ifdef LUAUTILS_VECTOR_PACK
+	Pack p = packSet(0);
+	for (size_t end = packEnd(n); i < end; i += gPackSize)
+		p = packAdd(p, packLoad(a + i));
+	sum = packSum(p);
+#endif
+	for (; i < n; ++i)
+		sum += a[i];
+	return sum;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Smallest of a, n must not be 0
+double _LuaVectorMin(const double *a, size_t n)
+{
+	size_t i = 0;
+	double result = a[0];
+#ifdef LUAUTILS_VECTOR_PACK
+	if (n >= gPackSize)
+	{
+		Pack p = packLoad(a);
+		for (size_t end = packEnd(n); i < end; i += gPackSize)
+			p = packMin(p, packLoad(a + i));
+		double values[gPackSize];
+		packStore(values, p);
+		for (size_t j = 0; j < gPackSize; ++j)
+			result = values[j] < result ? values[j] : result;
+	}
+#endif
+	for (; i < n; ++i)
+		result = a[i] < result ? a[i] : result;
+	return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////
+// Largest of a, n must not be 0
+double _LuaVectorMax(const double *a, size_t n)
+{
+	size_t i = 0;
+	double result = a[0];
+#ifdef LUAUTILS_VECTOR_PACK
+	if (n >= gPackSize)
+	{
+		Pack p = packLoad(a);
+		for (size_t end = packEnd(n); i < end; i += gPackSize)
+			p = packMax(p, packLoad(a + i));
+		double values[gPackSize];
+		packStore(values, p);
+		for (size_t j = 0; j < gPackSize; ++j)
+			result = values[j] > result ? values[j] : result;
+	}
+#endif
+	for (; i < n; ++i)
+		result = a[i] > result ? a[i] : result;
+	return result;
+}
+
+} // detail
+
+//////////////////////////////////////////////////////////////////////////////
+// Userdata of a vector, the doubles follow the header
+struct Vector
+{
+	union
+	{
+		size_t	size;
+		double	align;
+	};
+};
+
+// Registry key of the metatable of the vectors
+static const char gVectorKey = 0;
+
+typedef void (*VectorKernel)(double *a, const double *b, size_t n);
+typedef void (*ScalarKernel)(double *a, double s, size_t n);
+
+//////////////////////////////////////////////////////////////////////////////
+static double *getData(Vector *v)
+{
+	return (double*)(v + 1);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Push a new vector, its values aren't set
+static Vector *newVector(lua_State *L, size_t size)
+{
+	if (size > ((size_t)-1 - sizeof(Vector)) / sizeof(double))
+		luaL_error(L, "vector too large");
+	Vector *v = (Vector*)lua_newuserdata(L, sizeof(Vector) + size * sizeof(double));
+	v->size = size;
+	lua_pushlightuserdata(L, (void*)&gVectorKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	lua_setmetatable(L, -2);
+	return v;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Get the vector at the given index, or null
+static Vector *toVector(lua_State *L, int idx)
+{
+	void *p = lua_touserdata(L, idx);
+	if (!p || !lua_getmetatable(L, idx))
+		return 0;
+	lua_pushlightuserdata(L, (void*)&gVectorKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	bool isVector = lua_rawequal(L, -1, -2) != 0;
+	lua_pop(L, 2);
+	return isVector ? (Vector*)p : 0;
+}
+//////////////////////////////////////////////////////////////////////////////
+// Get the vector at the given argument, or raise an error
+static Vector *checkVector(lua_State *L, int arg)
+{
+	Vector *v = toVector(L, arg);
+	if (!v)
+		detail::_LuaTypeError(L, arg, "vector");
+	return v;
+}
+//////////////////////////////////////////////////////////////////////////////
+// Get the vector at the given argument, it must have the same size as v
+static Vector *checkSameSize(lua_State *L, int arg, const Vector *v)
+{
+	Vector *w = checkVector(L, arg);
+	luaL_argcheck(L, w->size == v->size, arg, "vectors must have the same size");
+	return w;
+}
+//////////////////////////////////////////////////////////////////////////////
+// Get the 0 based index of the number key at the given index, or -1 if it isn't within the vector
+static ptrdiff_t getIndex(lua_State *L, int idx, const Vector *v)
+{
+	if (lua_type(L, idx) != LUA_TNUMBER)
+		return -1;
+	lua_Number n = lua_tonumber(L, idx);
+	if (n >= 1 && n <= (lua_Number)v->size && n == (lua_Number)(size_t)n)
+		return (ptrdiff_t)n - 1;
+	return -1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// vector.new(size [, value])
+static int vectorNew(lua_State *L)
+{
+	lua_Integer size = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, size >= 0, 1, "negative size");
+	double value = (double)luaL_optnumber(L, 2, 0);
+	Vector *v = newVector(L, (size_t)size);
+	double *data = getData(v);
+	for (size_t i = 0; i < v->size; ++i)
+		data[i] = value;
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// vector.fromTable(t), from the array part of a table of numbers
+static int vectorFromTable(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	size_t size = detail::_LuaRawLen(L, 1);
+	Vector *v = newVector(L, size);
+	double *data = getData(v);
+	for (size_t i = 0; i < size; ++i)
+	{
+		lua_rawgeti(L, 1, (int)i + 1);
+		if (lua_type(L, -1) != LUA_TNUMBER)
+			return luaL_error(L, "vector.fromTable: element %d isn't a number", (int)i + 1);
+		data[i] = (double)lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// v:toTable()
+static int vectorToTable(lua_State *L)
+{
+	Vector *v = checkVector(L, 1);
+	const double *data = getData(v);
+	lua_createtable(L, (int)v->size, 0);
+	for (size_t i = 0; i < v->size; ++i)
+	{
+		lua_pushnumber(L, (lua_Number)data[i]);
+		lua_rawseti(L, -2, (int)i + 1);
+	}
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// v:copy()
+static int vectorCopy(lua_State *L)
+{
+	Vector *v = checkVector(L, 1);
+	Vector *copy = newVector(L, v->size);
+	memcpy(getData(copy), getData(v), v->size * sizeof(double));
+	return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Apply a kernel to v with a vector or number argument, returns v
+static int applyKernel(lua_State *L, VectorKernel kernel, ScalarKernel scalarKernel)
+{
+	Vector *v = checkVector(L, 1);
+	if (lua_type(L, 2) == LUA_TNUMBER)
+		scalarKernel(getData(v), (double)lua_tonumber(L, 2), v->size);
+	else
+		kernel(getData(v), getData(checkSameSize(L, 2, v)), v->size);
+	lua_settop(L, 1);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// v:add(x)
+static int vectorAdd(lua_State *L)
+{
+	return applyKernel(L, detail::_LuaVectorAdd, detail::_LuaVectorAddScalar);
+}
+//////////////////////////////////////////////////////////////////////////////
+// v:mul(x)
+static int vectorMul(lua_State *L)
+{
+	return applyKernel(L, detail::_LuaVectorMul, detail::_LuaVectorScale);
+}
+//////////////////////////////////////////////////////////////////////////////
+// v:scale(s)
+static int vectorScale(lua_State *L)
+{
+	Vector *v = checkVector(L, 1);
+	detail::_LuaVectorScale(getData(v), (double)luaL_checknumber(L, 2), v->size);
+	lua_settop(L, 1);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// v:fma(a, x), v += a * x
+static int vectorFma(lua_State *L)
+{
+	Vector *v = checkVector(L, 1);
+	Vector *a = checkSameSize(L, 2, v);
+	if (lua_type(L, 3) == LUA_TNUMBER)
+		detail::_LuaVectorFmaScalar(getData(v), getData(a), (double)lua_tonumber(L, 3), v->size);
+	else
+		detail::_LuaVectorFma(getData(v), getData(a), getData(checkSameSize(L, 3, v)), v->size);
+	lua_settop(L, 1);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// v:clamp(min, max)
+static int vectorClamp(lua_State *L)
+{
+	Vector *v = checkVector(L, 1);
+	double low = (double)luaL_checknumber(L, 2);
+	double high = (double)luaL_checknumber(L, 3);
+	luaL_argcheck(L, low <= high, 3, "max is less than min");
+	detail::_LuaVectorClamp(getData(v), low, high, v->size);
+	lua_settop(L, 1);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// v:dot(w)
+static int vectorDot(lua_State *L)
+{
+	Vector *v = checkVector(L, 1);
+	Vector *w = checkSameSize(L, 2, v);
+	lua_pushnumber(L, (lua_Number)detail::_LuaVectorDot(getData(v), getData(w), v->size));
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// v:sum()
+static int vectorSum(lua_State *L)
+{
+	Vector *v = checkVector(L, 1);
+	lua_pushnumber(L, (lua_Number)detail::_LuaVectorSum(getData(v), v->size));
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// v:min(), nil for an empty vector
+static int vectorMin(lua_State *L)
+{
+	Vector *v = checkVector(L, 1);
+	if (v->size)
+		lua_pushnumber(L, (lua_Number)detail::_LuaVectorMin(getData(v), v->size));
+	else
+		lua_pushnil(L);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// v:max(), nil for an empty vector
+static int vectorMax(lua_State *L)
+{
+	Vector *v = checkVector(L, 1);
+	if (v->size)
+		lua_pushnumber(L, (lua_Number)detail::_LuaVectorMax(getData(v), v->size));
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// __index metamethod of the vectors, the elements then the methods (upvalue 1)
+static int vectorIndex(lua_State *L)
+{
+	Vector *v = checkVector(L, 1);
+	ptrdiff_t i = getIndex(L, 2, v);
+	if (i != -1)
+		lua_pushnumber(L, (lua_Number)getData(v)[i]);
+	else if (lua_type(L, 2) == LUA_TSTRING)
+		lua_rawget(L, lua_upvalueindex(1));
+	else
+		lua_pushnil(L);
+	return 1;
+}
+//////////////////////////////////////////////////////////////////////////////
+// __newindex metamethod of the vectors
+static int vectorNewIndex(lua_State *L)
+{
+	Vector *v = checkVector(L, 1);
+	ptrdiff_t i = getIndex(L, 2, v);
+	if (i == -1)
+		return luaL_error(L, "vector index out of range");
+	getData(v)[i] = (double)luaL_checknumber(L, 3);
+	return 0;
+}
+//////////////////////////////////////////////////////////////////////////////
+// __len metamethod of the vectors
+static int vectorLen(lua_State *L)
+{
+	Vector *v = checkVector(L, 1);
+	lua_pushinteger(L, (lua_Integer)v->size);
+	return 1;
+}
+
+static const luaL_Reg gVectorMethods[] =
+{
+	{ "toTable", vectorToTable },
+	{ "copy", vectorCopy },
+	{ "add", vectorAdd },
+	{ "mul", vectorMul },
+	{ "scale", vectorScale },
+	{ "fma", vectorFma },
+	{ "clamp", vectorClamp },
+	{ "dot", vectorDot },
+	{ "sum", vectorSum },
+	{ "min", vectorMin },
+	{ "max", vectorMax },
+	{ 0, 0 }
+};
+
+namespace detail {;
+
+////////////////////////////////////////////////////////////////////////////////////
+// Set the vector library as the global "vector"
+void _LuaOpenVectorLib(lua_State *L)
+{
+	lua_pushlightuserdata(L, (void*)&gVectorKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	bool created = lua_istable(L, -1);
+	lua_pop(L, 1);
+	if (!created)
+	{
+		lua_pushlightuserdata(L, (void*)&gVectorKey);
+		lua_newtable(L);
+		int meta = lua_gettop(L);
+		lua_newtable(L);
+		for (const luaL_Reg *method = gVectorMethods; method->name; ++method)
+		{
+			lua_pushcfunction(L, method->func);
+			lua_setfield(L, -2, method->name);
+		}
+		lua_pushcclosure(L, vectorIndex, 1);
+		lua_setfield(L, meta, "__index");
+		lua_pushcfunction(L, vectorNewIndex);
+		lua_setfield(L, meta, "__newindex");
+		lua_pushcfunction(L, vectorLen);
+		lua_setfield(L, meta, "__len");
+		// The metamethods stay out of reach of the scripts, they could call them with any value
+		lua_pushliteral(L, "vector");
+		lua_setfield(L, meta, "__metatable");
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+
+	lua_newtable(L);
+	lua_pushcfunction(L, vectorNew);
+	lua_setfield(L, -2, "new");
+	lua_pushcfunction(L, vectorFromTable);
+	lua_setfield(L, -2, "fromTable");
+	lua_setglobal(L, "vector");
+}
+
+} // detail
+} // LuaUtils
@@ -0,0 +1,69 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUAVECTOR_H
+#define LUAVECTOR_H
+
+#include "LuaBase.h"
+
+// The kernels use AVX2 or SSE2 when the compiler targets them (ex: -mavx2 -mfma, /arch:AVX2), and
+// plain loops otherwise. Define LUAUTILS_NO_SIMD to always use the plain loops.
+#if !defined(LUAUTILS_NO_SIMD) && defined(__AVX2__)
+#define LUAUTILS_VECTOR_AVX2
+#elif !defined(LUAUTILS_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define LUAUTILS_VECTOR_SSE2
+#endif
+
+namespace LuaUtils {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Vector library for the scripts, see LuaState::openVectorLib
+//
+// A vector is a userdata holding an array of doubles, with C++ kernels for the element-wise math
+// that scripts would otherwise do in interpreted loops:
+//
+//		local v = vector.fromTable(speeds)	-- or vector.new(size [, value])
+//		v:fma(accels, dt):clamp(0, maxSpeed)
+//		speeds = v:toTable()
+//
+// - v[i], v[i] = x and #v work like an array (1 based, only within the size)
+// - In place, returning v: v:add(x), v:mul(x), v:fma(a, x) (v += a * x), v:scale(s), v:clamp(min, max)
+//   where x is a vector of the same size or a number
+// - v:dot(w), v:sum(), v:min(), v:max() (nil for an empty vector), v:copy(), v:toTable()
+// The results of dot and sum can differ from a Lua loop in the last bits, since the additions
+// aren't made in the same order.
+
+namespace detail {;
+
+// Kernels, on arrays of n doubles (a and b can be the same array)
+// a += b
+void _LuaVectorAdd(double *a, const double *b, size_t n);
+// a += s
+void _LuaVectorAddScalar(double *a, double s, size_t n);
+// a *= b
+void _LuaVectorMul(double *a, const double *b, size_t n);
+// a *= s
+void _LuaVectorScale(double *a, double s, size_t n);
+// a += b * c
+void _LuaVectorFma(double *a, const double *b, const double *c, size_t n);
+// a += b * s
+void _LuaVectorFmaScalar(double *a, const double *b, double s, size_t n);
+// a = min(max(a, low), high)
+void _LuaVectorClamp(double *a, double low, double high, size_t n);
+// Sum of a * b
+double _LuaVectorDot(const double *a, const double *b, size_t n);
+// Sum of a
+double _LuaVectorSum(const double *a, size_t n);
+// Smallest and largest of a, n must not be 0
+double _LuaVectorMin(const double *a, size_t n);
+double _LuaVectorMax(const double *a, size_t n);
+
+// Set the vector library as the global "vector"
+void _LuaOpenVectorLib(lua_State *L);
+
+} // detail
+} // LuaUtils
+
+#endif //LUAVECTOR_H
@@ -0,0 +1,162 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#include "LuaWeakRef.h"
+
+namespace LuaUtils {;
+
+// Registry key of the weak-valued table of the handles
+static const char gWeakKey = 0;
+
+//////////////////////////////////////////////////////////////////////////////
+// Push the weak table of a state, creating it if needed
+static void pushWeakTable(lua_State *L)
+{
+	lua_pushlightuserdata(L, (void*)&gWeakKey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (lua_istable(L, -1))
+		return;
+	lua_pop(L, 1);
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushliteral(L, "v");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_pushlightuserdata(L, (void*)&gWeakKey);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+namespace detail {;
+
+//////////////////////////////////////////////////////////////////////////////
+_LuaWeakRef::_LuaWeakRef(const _LuaWeakRef &other)
+:	mSet(false)
+{
+	*this = other;
+}
+//////////////////////////////////////////////////////////////////////////////
+_LuaWeakRef &_LuaWeakRef::operator=(const _LuaWeakRef &other)
+{
+	if (this == &other)
+		return *this;
+	reset();
+	if (other.mSet)
+	{
+		// A collected object stays collected in the copy
+		if (!other.push())
+			lua_pushnil(other.mL.get());
+		set(other.mL, other.mName);
+	}
+	return *this;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// The object wasn't collected
+bool	_LuaWeakRef::isAlive() const
+{
+	if (!push())
+		return false;
+	lua_pop(mL.get(), 1);
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Forget the object
+void	_LuaWeakRef::reset()
+{
+	if (!mSet)
+		return;
+	LUAUTILS_STACK_CHECK(mL.get(), mName);
+	pushWeakTable(mL.get());
+	lua_pushlightuserdata(mL.get(), (void*)this);
+	lua_pushnil(mL.get());
+	lua_rawset(mL.get(), -3);
+	lua_pop(mL.get(), 1);
+	mSet = false;
+	mName.clear();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Pop the value at the top of the stack and keep it weakly
+void	_LuaWeakRef::set(luaStatePtr vm, const std::string &name)
+{
+	mL = vm;
+	mName = name;
+	mSet = true;
+	pushWeakTable(mL.get());
+	lua_pushlightuserdata(mL.get(), (void*)this);
+	lua_pushvalue(mL.get(), -3);
+	lua_rawset(mL.get(), -3);
+	lua_pop(mL.get(), 2);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Push the object, returns false (and pushes nothing) if it was collected
+bool	_LuaWeakRef::push() const
+{
+	if (!mSet)
+		return false;
+	pushWeakTable(mL.get());
+	lua_pushlightuserdata(mL.get(), (void*)this);
+	lua_rawget(mL.get(), -2);
+	lua_remove(mL.get(), -2);
+	if (lua_isnil(mL.get(), -1))
+	{
+		lua_pop(mL.get(), 1);
+		return false;
+	}
+	return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Keep a function weakly
+void	_LuaWeakRef::setFunction(const _LuaFunctionBase &func)
+{
+	reset();
+	LUAUTILS_STACK_CHECK(func.mL.get(), func.mName);
+	if (func.push())
+		set(func.mL, func.mName);
+}
+//////////////////////////////////////////////////////////////////////////////
+// Get a strong handle to the function, returns false if it was collected
+bool	_LuaWeakRef::lockFunction(_LuaFunctionBase &res) const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), mName);
+	if (!push())
+	{
+		res.unref();
+		return false;
+	}
+	return res.initFromStack(mL, mName);
+}
+
+} // detail
+
+//////////////////////////////////////////////////////////////////////////////
+LuaWeakTable &LuaWeakTable::operator=(const LuaTable &table)
+{
+	reset();
+	LUAUTILS_STACK_CHECK(table.mL.get(), table.mName);
+	if (table.push())
+		set(table.mL, table.mName);
+	return *this;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Get a strong handle to the table
+// returns false if the table was collected (or none was given), res is then released
+bool	LuaWeakTable::lock(LuaTable &res) const
+{
+	LUAUTILS_STACK_CHECK(mL.get(), mName);
+	if (!push())
+	{
+		res.unref();
+		return false;
+	}
+	return res.init(mL, mName, false);
+}
+
+} // LuaUtils
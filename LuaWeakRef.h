@@ -0,0 +1,130 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+#ifndef LUAWEAKREF_H
+#define LUAWEAKREF_H
+
+#include "LuaTable.h"
+
+namespace LuaUtils {;
+namespace detail {;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Internal base class of the weak handles
+//
+// The objects are kept in a weak-valued table of the registry, keyed by the address of the handle,
+// so a handle never holds a registry reference and never sees the slot of another handle.
+class _LuaWeakRef : public _LuaBase
+{
+public:
+	//////////////////////////////////////////////////////////////////////////////
+	// An object was given to the handle (even if it was collected since)
+	bool	isInit() const { return mSet; }
+	//////////////////////////////////////////////////////////////////////////////
+	// The object wasn't collected
+	bool	isAlive() const;
+	//////////////////////////////////////////////////////////////////////////////
+	// Forget the object
+	void	reset();
+	//////////////////////////////////////////////////////////////////////////////
+	const std::string &getName() const { return mName; }
+
+protected:
+	//////////////////////////////////////////////////////////////////////////////
+	_LuaWeakRef()
+	:	mSet(false)
+	{
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	~_LuaWeakRef()
+	{
+		reset();
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	_LuaWeakRef(const _LuaWeakRef &other);
+	//////////////////////////////////////////////////////////////////////////////
+	_LuaWeakRef &operator=(const _LuaWeakRef &other);
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Pop the value at the top of the stack and keep it weakly
+	void	set(luaStatePtr vm, const std::string &name);
+	//////////////////////////////////////////////////////////////////////////////
+	// Push the object, returns false (and pushes nothing) if it was collected
+	bool	push() const;
+
+	//////////////////////////////////////////////////////////////////////////////
+	// Helpers of the handles, LuaFunction is a template
+	void	setFunction(const _LuaFunctionBase &func);
+	bool	lockFunction(_LuaFunctionBase &res) const;
+
+	//////////////////////////////////////////////////////////////////////////////
+	bool		mSet;
+	std::string	mName;
+};
+
+} // detail
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Handle of a table that doesn't keep it alive, for the caches of script objects
+//
+//		LuaWeakTable weak = table;
+//		...
+//		LuaTable strong;
+//		if (weak.lock(strong))
+//			strong.getValue("health", health);
+//		else
+//			// the table was collected, drop the cache entry
+//
+// LuaTable holds a registry reference, so a cache of LuaTable keeps every table alive.
+// A strong handle from lock keeps the table alive as long as it exists, like any LuaTable.
+class LuaWeakTable : public detail::_LuaWeakRef
+{
+public:
+	//////////////////////////////////////////////////////////////////////////////
+	LuaWeakTable() { }
+	//////////////////////////////////////////////////////////////////////////////
+	LuaWeakTable(const LuaTable &table)
+	{
+		*this = table;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	LuaWeakTable &operator=(const LuaTable &table);
+	//////////////////////////////////////////////////////////////////////////////
+	// Get a strong handle to the table
+	// returns false if the table was collected (or none was given), res is then released
+	bool	lock(LuaTable &res) const;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Handle of a function that doesn't keep it alive, see LuaWeakTable
+template <typename Ret, typename CallPolicy = LuaCallProtected>
+class LuaWeakFunction : public detail::_LuaWeakRef
+{
+public:
+	//////////////////////////////////////////////////////////////////////////////
+	LuaWeakFunction() { }
+	//////////////////////////////////////////////////////////////////////////////
+	LuaWeakFunction(const LuaFunction<Ret, CallPolicy> &func)
+	{
+		setFunction(func);
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	LuaWeakFunction &operator=(const LuaFunction<Ret, CallPolicy> &func)
+	{
+		setFunction(func);
+		return *this;
+	}
+	//////////////////////////////////////////////////////////////////////////////
+	// Get a strong handle to the function
+	// returns false if the function was collected (or none was given), res is then released
+	bool	lock(LuaFunction<Ret, CallPolicy> &res) const
+	{
+		return lockFunction(res);
+	}
+};
+
+} // LuaUtils
+
+#endif //LUAWEAKREF_H
@@ -0,0 +1,157 @@
+// Author: Guillaume.Stordeur@gmail.com
+// License: none, no restrictions, use at your own risk
+// Date: 07/13/12
+// Version 1.1
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// luaembed: compile Lua scripts to bytecode, and write a C++ source file that embeds them into the
+// executable (see LuaEmbedded.h)
+//
+//		luaembed [-s] [-r rootDir] -o output.cpp script.lua...
+//
+//		-s			strip the debug information (Lua 5.3 and up), smaller but errors lose their line numbers
+//		-r rootDir	removed from the start of the script paths to name the chunks
+//
+// Build it against the same Lua as the program, bytecode isn't portable between Lua versions.
+
+#include "../LuaCompat.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////////////
+// lua_dump writer appending to a string
+static int writeChunk(lua_State *L, const void *p, size_t size, void *ud)
+{
+	((std::string*)ud)->append((const char*)p, size);
+	return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Path with forward slashes
+static std::string normalizePath(const char *path)
+{
+	std::string name = path;
+	for (size_t i = 0; i < name.size(); ++i)
+	{
+		if (name[i] == '\\')
+			name[i] = '/';
+	}
+	return name;
+}
+//////////////////////////////////////////////////////////////////////////////
+// Name of a chunk: its path, with forward slashes and without the root
+// (only a whole directory is removed: the root "scripts" doesn't match "scripts2/main.lua")
+static std::string chunkName(const char *path, const std::string &root)
+{
+	std::string name = normalizePath(path);
+	if (!root.empty() && name.size() > root.size() && name.compare(0, root.size(), root) == 0
+		&& name[root.size()] == '/')
+		name.erase(0, root.size());
+	while (!name.empty() && name[0] == '/')
+		name.erase(0, 1);
+	return name;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Write a string literal, escaping what needs to be
+static void writeString(FILE *out, const std::string &s)
+{
+	fputc('"', out);
+	for (size_t i = 0; i < s.size(); ++i)
+	{
+		if (s[i] == '"' || s[i] == '\\')
+			fputc('\\', out);
+		fputc(s[i], out);
+	}
+	fputc('"', out);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+static int usage()
+{
+	fprintf(stderr, "usage: luaembed [-s] [-r rootDir] -o output.cpp script.lua...\n");
+	return 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+int main(int argc, char **argv)
+{
+	bool strip = false;
+	std::string root;
+	const char *output = 0;
+	std::vector<const char*> scripts;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (!strcmp(argv[i], "-s"))
+			strip = true;
+		else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+		{
+			root = normalizePath(argv[++i]);
+			while (!root.empty() && root[root.size() - 1] == '/')
+				root.erase(root.size() - 1);
+		}
+		else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+			output = argv[++i];
+		else if (argv[i][0] == '-')
+			return usage();
+		else
+			scripts.push_back(argv[i]);
+	}
+	if (!output || scripts.empty())
+		return usage();
+
+	// Compile everything first, so that a syntax error doesn't leave a partial output
+	lua_State *L = luaL_newstate();
+	std::vector<std::string> names, chunks;
+	for (size_t i = 0; i < scripts.size(); ++i)
+	{
+		if (luaL_loadfile(L, scripts[i]))
+		{
+			fprintf(stderr, "luaembed: %s\n", lua_tostring(L, -1));
+			lua_close(L);
+			return 1;
+		}
+		std::string chunk;
+		LuaUtils::detail::_LuaDump(L, writeChunk, &chunk, strip);
+		lua_pop(L, 1);
+		names.push_back(chunkName(scripts[i], root));
+		chunks.push_back(chunk);
+	}
+	lua_close(L);
+
+	FILE *out = fopen(output, "w");
+	if (!out)
+	{
+		fprintf(stderr, "luaembed: can't open %s\n", output);
+		return 1;
+	}
+	fprintf(out, "// Generated by luaembed, don't edit\n\n#include \"LuaEmbedded.h\"\n\n");
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		fprintf(out, "// ");
+		writeString(out, names[i]);
+		fprintf(out, "\nstatic const unsigned char chunk%u[] =\n{", (unsigned int)i);
+		for (size_t j = 0; j < chunks[i].size(); ++j)
+			fprintf(out, "%s0x%02x,", j % 16 ? " " : "\n\t", (unsigned char)chunks[i][j]);
+		fprintf(out, "\n};\n\n");
+	}
+	fprintf(out, "static const LuaUtils::LuaEmbeddedChunk chunks[] =\n{\n");
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		fprintf(out, "\t{ ");
+		writeString(out, names[i]);
+		fprintf(out, ", chunk%u, sizeof(chunk%u) },\n", (unsigned int)i, (unsigned int)i);
+	}
+	fprintf(out, "};\n\nstatic LuaUtils::LuaEmbeddedRegistrar registrar(chunks, sizeof(chunks) / sizeof(chunks[0]));\n");
+	bool ok = !ferror(out);
+	if (fclose(out) != 0)
+		ok = false;
+	if (!ok)
+	{
+		fprintf(stderr, "luaembed: error writing %s\n", output);
+		return 1;
+	}
+	return 0;
+}